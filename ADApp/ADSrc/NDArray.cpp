@@ -26,27 +26,35 @@
 NDArray::NDArray()
   : referenceCount(0), pNDArrayPool(0), pDriver(0),
     uniqueId(0), timeStamp(0.0), ndims(0), dataType(NDInt8),
-    dataSize(0),  pData(0)
+    dataSize(0),  pData(0), pViewParent(0), sharesData(false)
 {
   this->epicsTS.secPastEpoch = 0;
   this->epicsTS.nsec = 0;
+  this->freeTime.secPastEpoch = 0;
+  this->freeTime.nsec = 0;
+  this->pThreadCache = 0;
   memset(this->dims, 0, sizeof(this->dims));
+  memset(this->strides, 0, sizeof(this->strides));
   memset(&this->node, 0, sizeof(this->node));
-  this->pAttributeList = new NDAttributeList();
+  this->pAttributeList = new NDAttributeList(true);
 }
 
 NDArray::NDArray(int nDims, size_t *dims, NDDataType_t dataType, size_t dataSize, void *pData)
   : referenceCount(0), pNDArrayPool(0), pDriver(0),
     uniqueId(0), timeStamp(0.0), ndims(nDims), dataType(dataType),
-    dataSize(dataSize),  pData(0)
+    dataSize(dataSize),  pData(0), pViewParent(0), sharesData(false)
 {
   static const char *functionName = "NDArray::NDArray";
   this->epicsTS.secPastEpoch = 0;
   this->epicsTS.nsec = 0;
-  this->pAttributeList = new NDAttributeList();
+  this->freeTime.secPastEpoch = 0;
+  this->freeTime.nsec = 0;
+  this->pThreadCache = 0;
+  this->pAttributeList = new NDAttributeList(true);
   this->referenceCount = 1;
 
   memset(this->dims, 0, sizeof(this->dims));
+  memset(this->strides, 0, sizeof(this->strides));
   for (int i=0; i<ndims && i<ND_ARRAY_MAX_DIMS; i++) {
     this->dims[i].size = dims[i];
     this->dims[i].offset = 0;
@@ -73,7 +81,8 @@ NDArray::NDArray(int nDims, size_t *dims, NDDataType_t dataType, size_t dataSize
   * Frees the data array, deletes all attributes, frees the attribute list and destroys the mutex. */
 NDArray::~NDArray()
 {
-  if (this->pData) {
+  // Views and shared arrays do not own their data
+  if (this->pData && !this->pViewParent) {
       if (this->pNDArrayPool)
         this->pNDArrayPool->frameFree(this->pData);
       else
@@ -202,6 +211,24 @@ int NDArray::getInfo(NDArrayInfo_t *pInfo)
   return(ND_SUCCESS);
 }
 
+/** Returns the number of elements between successive values of each dimension.
+  * For a view these are the strides of the view, which can be negative, otherwise dimension 0
+  * has a stride of 1 and each higher dimension the product of the sizes of the lower ones.
+  \param[out] pStrides Array of at least ndims values, must have been allocated by caller. */
+int NDArray::getStrides(ptrdiff_t *pStrides)
+{
+  int i;
+
+  for (i=0; i<this->ndims; i++) {
+    if (this->pViewParent) {
+      pStrides[i] = this->strides[i];
+    } else {
+      pStrides[i] = (i == 0) ? 1 : pStrides[i-1] * (ptrdiff_t)this->dims[i-1].size;
+    }
+  }
+  return ND_SUCCESS;
+}
+
 /** Initializes the dimension structure to size=size, binning=1, reverse=0, offset=0.
   * \param[in] pDimension Pointer to an NDDimension_t structure, must have been allocated by caller.
   * \param[in] size The size of this dimension. */
@@ -256,7 +283,14 @@ int NDArray::report(FILE *fp, int details)
         this->dataType, (int)this->dataSize, this->pData);
   fprintf(fp, "  uniqueId=%d, timeStamp=%f, epicsTS.secPastEpoch=%d, epicsTS.nsec=%d\n",
         this->uniqueId, this->timeStamp, this->epicsTS.secPastEpoch, this->epicsTS.nsec);
-  fprintf(fp, "  referenceCount=%d\n", this->referenceCount);
+  fprintf(fp, "  referenceCount=%d\n", this->getReferenceCount());
+  if (this->sharesData) {
+    fprintf(fp, "  shares data of array=%p\n", this->pViewParent);
+  } else if (this->pViewParent) {
+    fprintf(fp, "  view of array=%p, strides=[", this->pViewParent);
+    for (dim=0; dim<this->ndims; dim++) fprintf(fp, "%ld ", (long)this->strides[dim]);
+    fprintf(fp, "]\n");
+  }
   fprintf(fp, "  number of attributes=%d\n", this->pAttributeList->count());
   if (details > 5) {
     this->pAttributeList->report(fp, details);
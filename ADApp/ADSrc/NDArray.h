@@ -12,9 +12,13 @@
 #ifndef NDArray_H
 #define NDArray_H
 
+#include <stddef.h>
 #include <set>
+#include <vector>
 
 #include <epicsMutex.h>
+#include <epicsAtomic.h>
+#include <epicsThread.h>
 #include <epicsTime.h>
 #include <ellLib.h>
 
@@ -25,10 +29,25 @@
 /** The maximum number of dimensions in an NDArray */
 #define ND_ARRAY_MAX_DIMS 10
 
+/** Enumeration of free list implementations for NDArrayPool */
+typedef enum
+{
+    NDArrayPoolModeSorted,      /**< Single std::multiset sorted by dataSize, protected by a mutex (default) */
+    NDArrayPoolModeSizeClass    /**< Lock-free free lists, one per size class */
+} NDArrayPoolMode_t;
+
 typedef void *(*MallocFunc_t)(size_t size);
 typedef void (*FreeFunc_t)(void *ptr);
 extern MallocFunc_t defaultFrameMalloc;
 extern FreeFunc_t defaultFrameFree;
+extern volatile int NDArrayPoolMode;
+extern volatile int NDArrayPoolClassesPerOctave;
+extern volatile int NDArrayPoolThreadCacheSize;
+extern volatile int NDArrayPoolNumaNode;
+extern volatile int NDArrayPoolTrimHighWater;
+extern volatile int NDArrayPoolTrimLowWater;
+extern volatile double NDArrayPoolTrimAge;
+extern volatile double NDArrayPoolTrimPeriod;
 
 /** Enumeration of color modes for NDArray attribute "colorMode" */
 typedef enum
@@ -107,13 +126,19 @@ public:
     int          getInfo         (NDArrayInfo_t *pInfo);
     int          reserve();
     int          release();
-    int          getReferenceCount() const {return referenceCount;}
+    int          getReferenceCount() const {return epicsAtomicGetIntT(&referenceCount);}
+    bool         isView() const {return (pViewParent != 0) && !sharesData;}
+    int          getStrides      (ptrdiff_t *pStrides);
     int          report(FILE *fp, int details);
     friend class NDArrayPool;
 
 private:
     ELLNODE      node;              /**< This must come first because ELLNODE must have the same address as NDArray object */
-    int          referenceCount;    /**< Reference count for this NDArray=number of clients who are using it */
+    int          referenceCount;    /**< Reference count for this NDArray=number of clients who are using it.
+                                       Only accessed with epicsAtomic functions. */
+    epicsTimeStamp freeTime;        /**< Time the reference count last reached 0, used by NDArrayPool::trim() */
+    class NDArrayThreadCache *pThreadCache; /**< Thread cache of the thread that allocated the array, used by
+                                       NDArrayPool::release() */
 
 public:
     class NDArrayPool *pNDArrayPool;  /**< The NDArrayPool object that created this array */
@@ -134,6 +159,14 @@ public:
     NDAttributeList *pAttributeList;  /**< Linked list of attributes */
     NDCodec_t codec;            /**< Definition of codec used to compress the data. */
     size_t compressedSize;      /**< Size of the compressed data. Should be equal to dataSize if pData is uncompressed. */
+    NDArray *pViewParent;       /**< If not NULL this array is a view created by NDArrayPool::createView() or a shared array
+                                  * created by NDArrayPool::share().
+                                  * It does not own any memory: pData points to its first element in the data of pViewParent,
+                                  * which the array holds a reference on.  The elements of a view are not contiguous. */
+    bool sharesData;            /**< true for a shared array, which has the contiguous data of pViewParent
+                                  * and its own attributes. isView() is false for shared arrays. */
+    ptrdiff_t strides[ND_ARRAY_MAX_DIMS]; /**< For views, the number of elements between successive values of each
+                                  * dimension; negative for a reversed dimension. Use getStrides() for any array. */
 };
 
 // This class defines the object that is contained in the std::multilist for sorting NDArrays in the freeList_.
@@ -167,10 +200,16 @@ class freeListElement {
   */
 class ADCORE_API NDArrayPool {
 public:
-    NDArrayPool  (class asynNDArrayDriver *pDriver, size_t maxMemory);
-    virtual ~NDArrayPool() {}
+    NDArrayPool  (class asynNDArrayDriver *pDriver, size_t maxMemory,
+                  NDArrayPoolMode_t mode=NDArrayPoolModeSorted, int classesPerOctave=4,
+                  int threadCacheSize=0);
+    virtual ~NDArrayPool();
     NDArray*     alloc(int ndims, size_t *dims, NDDataType_t dataType, size_t dataSize, void *pData);
     NDArray*     copy(NDArray *pIn, NDArray *pOut, bool copyData, bool copyDimensions=true, bool copyDataType=true);
+    NDArray*     createView(NDArray *pIn, NDDimension_t *dimsOut);
+    NDArray*     share(NDArray *pIn);
+    NDArray*     materialize(NDArray *pArray);
+    int          preAllocate(int numBuffers, size_t dataSize, int prefault=0);
 
     int          reserve(NDArray *pArray);
     int          release(NDArray *pArray);
@@ -186,6 +225,16 @@ public:
     size_t       getMaxMemory();
     size_t       getMemorySize();
     int          getNumFree();
+    NDArrayPoolMode_t getMode();
+    int          getThreadCacheSize();
+    void         setNumaNode(int numaNode);
+    int          getNumaNode();
+    void         setTrimming(int highWater, int lowWater, double maxAge);
+    int          trim();
+    size_t       getCacheHits();
+    size_t       getCacheMisses();
+    double       getConvertTime();
+    int          getConvertThreads();
     void         emptyFreeList();
     static void  setDefaultFrameMemoryFunctions(MallocFunc_t newMalloc,
                                                 FreeFunc_t newFree);
@@ -202,12 +251,55 @@ protected:
     virtual void onReleaseArray(NDArray *pArray);
 
 private:
+    void         initArray(NDArray *pArray, int ndims, size_t *dims, NDDataType_t dataType);
+    NDArray*     allocSizeClass(int ndims, size_t *dims, NDDataType_t dataType, size_t dataSize, void *pData);
+    int          sizeClassIndex(size_t size, bool roundUp);
+    size_t       sizeClassSize(int index);
+    class NDArrayFreeRing* sizeClassList(int index, bool create);
+    NDArray*     popFreeArray(int firstIndex, int lastIndex);
+    void         pushFreeArray(NDArray *pArray);
+    bool         reserveMemory(size_t size);
+    void         deleteArray(NDArray *pArray);
+    size_t       maxReuseSize(size_t dataSize);
+    class NDArrayThreadCache* threadCache(bool create);
+    NDArray*     allocFromThreadCache(size_t dataSize);
+    void         releaseToThreadCache(NDArray *pArray);
+    static void  threadCacheExit(void *arg);
+    void         retireThreadCache(class NDArrayThreadCache *pCache);
+    void         returnToFreeList(NDArray **pArrays, int numArrays);
+    void         flushThreadCaches();
+    void         wakeTrimTask();
+    bool         isActiveSize(size_t dataSize);
+    void         trimThreadCaches(epicsTimeStamp *pNow, std::vector<NDArray *>& victims);
+    void         releaseView(NDArray *pView);
+
     std::multiset<freeListElement> freeList_;
     epicsMutexId listLock_;      /**< Mutex to protect the free list */
     int          numBuffers_;
     size_t       maxMemory_;     /**< Maximum bytes of memory this object is allowed to allocate; -1=unlimited */
     size_t       memorySize_;    /**< Number of bytes of memory this object has currently allocated */
     class asynNDArrayDriver *pDriver_; /**< The asynNDArrayDriver that created this object */
+    NDArrayPoolMode_t mode_;     /**< Free list implementation selected in the constructor */
+    int          classesPerOctave_; /**< Number of size classes per power of 2 in NDArrayPoolModeSizeClass */
+    int          numSizeClasses_;   /**< Number of entries in sizeClassLists_ */
+    class NDArrayFreeRing **sizeClassLists_; /**< Lock-free free lists, created on first use */
+    int          numFree_;       /**< Number of NDArrays in the size class free lists */
+    int          threadCacheSize_;  /**< Maximum number of NDArrays in each per-thread cache; 0=disabled */
+    epicsThreadPrivateId threadCacheId_; /**< Per-thread pointer to the NDArrayThreadCache for this pool */
+    std::vector<class NDArrayThreadCache*> threadCaches_; /**< Caches of running threads, protected by listLock_ */
+    std::vector<class NDArrayThreadCache*> spareCaches_;  /**< Caches of threads that exited, protected by listLock_ */
+    int          numCached_;     /**< Number of NDArrays in all thread caches */
+    size_t       cacheHits_;     /**< Number of alloc() calls satisfied from a thread cache, epicsAtomic */
+    size_t       cacheMisses_;   /**< Number of alloc() calls that missed the thread cache, epicsAtomic */
+    int          numaNode_;      /**< Preferred NUMA node for frame buffers from NDFrameMemoryAlloc; -1=none */
+    bool         trimming_;      /**< True if this pool is trimmed by the NDArrayPoolTrim thread */
+    size_t       trimHighWaterBytes_; /**< Memory above which trim() deletes free arrays; 0=disabled */
+    size_t       trimLowWaterBytes_;  /**< Memory at which trim() stops deleting free arrays */
+    double       trimMaxAge_;    /**< Free arrays not used for this many seconds are deleted by trim(); 0=disabled */
+    size_t       activeSize_;    /**< dataSize of the most recent alloc() request, trim() keeps arrays of this size */
+    size_t       convertTimeUs_; /**< Microseconds that the most recent convert() took, epicsAtomic */
+    int          convertThreads_; /**< Number of threads that the most recent convert() used */
+    std::vector<NDArray *> freeViews_; /**< NDArray objects of released views, protected by listLock_ */
 };
 
 #endif
@@ -8,11 +8,16 @@
 
 #include <string.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <dbDefs.h>
 #include <stdint.h>
+#include <algorithm>
 
 #include <epicsMutex.h>
+#include <epicsAtomic.h>
 #include <epicsThread.h>
+#include <epicsEvent.h>
+#include <epicsExit.h>
 #include <epicsTime.h>
 #include <ellLib.h>
 #include <cantProceed.h>
@@ -23,10 +28,22 @@
 
 #include "asynNDArrayDriver.h"
 #include "NDArray.h"
+#include "NDFrameMemory.h"
+#include "NDConvert.h"
 
 // How much larger an NDArray must be than the required size before it is considered "too large"
 #define THRESHOLD_SIZE_RATIO 1.5
 
+// Smallest size class in NDArrayPoolModeSizeClass is 2^MIN_SIZE_CLASS_SHIFT bytes
+#define MIN_SIZE_CLASS_SHIFT 6
+// Maximum number of size classes per power of 2 in NDArrayPoolModeSizeClass
+#define MAX_CLASSES_PER_OCTAVE 16
+// Number of NDArrays each size class free list can hold; must be a power of 2
+#define SIZE_CLASS_LIST_DEPTH 1024
+// Number of times a size class free list retries a cell that is being filled by another thread
+// before it starts yielding the CPU
+#define MAX_POP_SPINS 100
+
 static const char *driverName = "NDArrayPool";
 
 // This provides a way of overriding the default memory functions for frame
@@ -46,15 +63,307 @@ FreeFunc_t defaultFrameFree = free;
 volatile int eraseNDAttributes=0;
 extern "C" {epicsExportAddress(int, eraseNDAttributes);}
 
+/** NDArrayPoolMode is a global flag that selects the free list implementation (NDArrayPoolMode_t)
+  * used by the NDArrayPool that each asynNDArrayDriver creates in its constructor.
+  * The default value is 0 (NDArrayPoolModeSorted). It can be changed with the iocsh "var" command
+  * before the driver or plugin is configured, so different drivers in an IOC can use different modes.
+  * NDArrayPoolClassesPerOctave is the number of size classes per power of 2 in NDArrayPoolModeSizeClass.
+  * 1 gives pure power of 2 size classes, larger values waste less memory per buffer.
+  */
+volatile int NDArrayPoolMode=NDArrayPoolModeSorted;
+volatile int NDArrayPoolClassesPerOctave=4;
+extern "C" {epicsExportAddress(int, NDArrayPoolMode);}
+extern "C" {epicsExportAddress(int, NDArrayPoolClassesPerOctave);}
+
+/** NDArrayPoolThreadCacheSize is the maximum number of free NDArrays that each thread keeps in a private cache
+  * in front of the shared free list of each NDArrayPool that asynNDArrayDriver creates.
+  * The default value is 0, which disables the caches.  When an array is released for the last time it goes in the
+  * cache of the releasing thread, and alloc() looks in the cache of the calling thread before the shared free list.
+  * When a cache is full the oldest half of it is returned to the shared free list in one batch.
+  * Like NDArrayPoolMode it must be set with the iocsh "var" command before the driver or plugin is configured.
+  */
+volatile int NDArrayPoolThreadCacheSize=0;
+extern "C" {epicsExportAddress(int, NDArrayPoolThreadCacheSize);}
+
+/** NDArrayPoolNumaNode is the preferred NUMA node for the frame buffers of the NDArrayPool that
+  * asynNDArrayDriver creates.  The default value is -1, meaning no preference.  It is only used by the
+  * mmap backend selected with NDFrameMemoryConfig.  Set it with the iocsh "var" command before each driver
+  * or plugin is configured to place each driver's buffers on the node where its threads run.
+  */
+volatile int NDArrayPoolNumaNode=-1;
+extern "C" {epicsExportAddress(int, NDArrayPoolNumaNode);}
+
+/** NDArrayPoolTrimHighWater, NDArrayPoolTrimLowWater and NDArrayPoolTrimAge control background trimming
+  * of the free list of the NDArrayPool that asynNDArrayDriver creates.  They are read when the driver is created.
+  * When the memory used by a pool exceeds NDArrayPoolTrimHighWater percent of its maxMemory the "NDArrayPoolTrim"
+  * thread deletes free arrays, least recently released first, until it is below NDArrayPoolTrimLowWater percent.
+  * Free arrays that have not been used for NDArrayPoolTrimAge seconds are also deleted.
+  * Arrays that can hold the size that is currently being allocated are only deleted after all others,
+  * and are never deleted because of their age.  0 disables each of these.
+  * NDArrayPoolTrimPeriod is the interval in seconds at which the thread checks the pools.
+  */
+volatile int NDArrayPoolTrimHighWater=0;
+volatile int NDArrayPoolTrimLowWater=0;
+volatile double NDArrayPoolTrimAge=0.;
+volatile double NDArrayPoolTrimPeriod=1.0;
+extern "C" {epicsExportAddress(int, NDArrayPoolTrimHighWater);}
+extern "C" {epicsExportAddress(int, NDArrayPoolTrimLowWater);}
+extern "C" {epicsExportAddress(double, NDArrayPoolTrimAge);}
+extern "C" {epicsExportAddress(double, NDArrayPoolTrimPeriod);}
+
+// One thread trims all of the pools that have trimming enabled
+static epicsThreadOnceId trimOnceId = EPICS_THREAD_ONCE_INIT;
+static epicsMutexId trimPoolsLock;
+static epicsEventId trimEvent;
+static std::vector<NDArrayPool *> *pTrimPools;
+
+static void trimTask(void *drvPvt)
+{
+  while (1) {
+    double period = NDArrayPoolTrimPeriod;
+    if (period <= 0.) period = 1.0;
+    epicsEventWaitWithTimeout(trimEvent, period);
+    // The pools can't be deleted while this lock is held
+    epicsMutexLock(trimPoolsLock);
+    for (size_t i=0; i<pTrimPools->size(); i++) {
+      (*pTrimPools)[i]->trim();
+    }
+    epicsMutexUnlock(trimPoolsLock);
+  }
+}
+
+static void trimInit(void *drvPvt)
+{
+  trimPoolsLock = epicsMutexMustCreate();
+  trimEvent = epicsEventMustCreate(epicsEventEmpty);
+  pTrimPools = new std::vector<NDArrayPool *>;
+  epicsThreadMustCreate("NDArrayPoolTrim", epicsThreadPriorityLow,
+                        epicsThreadGetStackSize(epicsThreadStackMedium),
+                        trimTask, NULL);
+}
+
+// Orders free arrays for trim(): arrays that are not the active size first, then least recently released first
+struct trimCandidate {
+  std::multiset<freeListElement>::iterator it;
+  bool active;
+  double age;
+  bool operator<(const trimCandidate& rhs) const {
+    if (active != rhs.active) return !active;
+    return age > rhs.age;
+  }
+};
+
+/** Bounded lock-free multi-producer multi-consumer ring of NDArray pointers.
+  * NDArrayPoolModeSizeClass uses one of these for each size class of its free list.
+  * This is the algorithm of Dmitry Vyukov: each cell carries a sequence number, so producers
+  * and consumers only contend on a single compare-and-swap of the enqueue or dequeue position,
+  * and there is no ABA problem.
+  */
+class NDArrayFreeRing {
+public:
+  NDArrayFreeRing(size_t depth)
+    : mask_(depth-1), enqueuePos_(0), dequeuePos_(0)
+  {
+    cells_ = new cell[depth];
+    for (size_t i=0; i<depth; i++) {
+      cells_[i].sequence = i;
+      cells_[i].pArray = NULL;
+    }
+  }
+  ~NDArrayFreeRing() {delete [] cells_;}
+
+  /** Adds an array that was released at freeTime to the ring; returns false if the ring is full */
+  bool push(NDArray *pArray, const epicsTimeStamp& freeTime)
+  {
+    cell *pCell;
+    size_t pos = epicsAtomicGetSizeT(&enqueuePos_);
+    while (1) {
+      pCell = &cells_[pos & mask_];
+      size_t seq = epicsAtomicGetSizeT(&pCell->sequence);
+      ptrdiff_t dif = (ptrdiff_t)(seq - pos);
+      if (dif == 0) {
+        if (epicsAtomicCmpAndSwapSizeT(&enqueuePos_, pos, pos+1) == pos) break;
+      } else if (dif < 0) {
+        return false;
+      }
+      pos = epicsAtomicGetSizeT(&enqueuePos_);
+    }
+    pCell->pArray = pArray;
+    pCell->freeTime = freeTime;
+    pCell->dataSize = pArray->dataSize;
+    epicsAtomicWriteMemoryBarrier();
+    epicsAtomicSetSizeT(&pCell->sequence, pos+1);
+    return true;
+  }
+
+  /** Gets the release time and size of the array at the head of the ring without removing it.
+    * The copies in the cell are read, because another thread can remove and delete the array at any time.
+    * Returns false if the ring is empty or the head changed while it was read. */
+  bool peek(epicsTimeStamp *pFreeTime, size_t *pDataSize)
+  {
+    size_t pos = epicsAtomicGetSizeT(&dequeuePos_);
+    cell *pCell = &cells_[pos & mask_];
+    if (epicsAtomicGetSizeT(&pCell->sequence) != pos+1) return false;
+    epicsAtomicReadMemoryBarrier();
+    *pFreeTime = pCell->freeTime;
+    *pDataSize = pCell->dataSize;
+    epicsAtomicReadMemoryBarrier();
+    return (epicsAtomicGetSizeT(&pCell->sequence) == pos+1);
+  }
+
+  /** Removes an array from the ring; returns NULL if the ring is empty */
+  NDArray *pop()
+  {
+    cell *pCell;
+    NDArray *pArray;
+    int spins = 0;
+    size_t pos = epicsAtomicGetSizeT(&dequeuePos_);
+    while (1) {
+      pCell = &cells_[pos & mask_];
+      size_t seq = epicsAtomicGetSizeT(&pCell->sequence);
+      ptrdiff_t dif = (ptrdiff_t)(seq - (pos+1));
+      if (dif == 0) {
+        if (epicsAtomicCmpAndSwapSizeT(&dequeuePos_, pos, pos+1) == pos) break;
+      } else if (dif < 0) {
+        // The ring is empty, or a push has claimed this cell but not yet stored the array.
+        // In the second case every later pop would also fail, so wait for the push to finish,
+        // yielding the CPU in case the pushing thread was preempted.
+        if (epicsAtomicGetSizeT(&enqueuePos_) == pos) return NULL;
+        if (++spins > MAX_POP_SPINS) epicsThreadSleep(0.);
+      }
+      pos = epicsAtomicGetSizeT(&dequeuePos_);
+    }
+    epicsAtomicReadMemoryBarrier();
+    pArray = pCell->pArray;
+    epicsAtomicWriteMemoryBarrier();
+    epicsAtomicSetSizeT(&pCell->sequence, pos+mask_+1);
+    return pArray;
+  }
+
+  /** Returns the number of arrays in the ring; only exact when no other thread is using it */
+  size_t size()
+  {
+    return epicsAtomicGetSizeT(&enqueuePos_) - epicsAtomicGetSizeT(&dequeuePos_);
+  }
+
+private:
+  struct cell {
+    size_t sequence;
+    NDArray *pArray;
+    epicsTimeStamp freeTime;  /**< pArray->freeTime when it was pushed, for peek() */
+    size_t dataSize;          /**< pArray->dataSize when it was pushed, for peek() */
+  };
+  cell *cells_;
+  size_t mask_;
+  // The padding keeps producers and consumers from sharing a cache line
+  char pad0_[64];
+  size_t enqueuePos_;
+  char pad1_[64];
+  size_t dequeuePos_;
+  char pad2_[64];
+};
+
+/** Cache of free NDArrays that belongs to one thread and one NDArrayPool.
+  * The owning thread allocates from it in alloc().  release() puts an array in the cache of the thread that
+  * allocated it, so a driver thread gets back the arrays that its plugins release.
+  * When the thread exits the arrays are returned to the shared free list and the cache is kept as a spare
+  * for the next thread, because released arrays can still point to it.
+  */
+class NDArrayThreadCache {
+public:
+  NDArrayThreadCache(NDArrayPool *pPool) : pPool(pPool), active(true) {lock = epicsMutexMustCreate();}
+  ~NDArrayThreadCache() {epicsMutexDestroy(lock);}
+  epicsMutexId lock;
+  std::vector<NDArray *> arrays; /**< Free arrays, most recently released last */
+  NDArrayPool *pPool;            /**< The pool; NULL after the pool was deleted.  Protected by threadCacheLock */
+  bool active;                   /**< false while the cache is a spare.  Protected by lock */
+};
+
+// Serializes the thread exit hooks of the thread caches with the deletion of the pools
+static epicsThreadOnceId threadCacheOnceId = EPICS_THREAD_ONCE_INIT;
+static epicsMutexId threadCacheLock;
+
+static void threadCacheInit(void *drvPvt)
+{
+  threadCacheLock = epicsMutexMustCreate();
+}
+
 /** NDArrayPool constructor
   * \param[in] pDriver Pointer to the asynNDArrayDriver that created this object.
   * \param[in] maxMemory Maxiumum number of bytes of memory the the pool is allowed to use, summed over
   * all of the NDArray objects; 0=unlimited.
+  * \param[in] mode The free list implementation; NDArrayPoolModeSorted (default) or NDArrayPoolModeSizeClass.
+  * \param[in] classesPerOctave Number of size classes per power of 2 in NDArrayPoolModeSizeClass.
+  * Buffers are allocated with the size of their size class, so fewer classes means more reuse
+  * but more wasted memory.  Default=4, i.e. size classes are at most 25% apart.
+  * \param[in] threadCacheSize Maximum number of free NDArrays cached per thread in front of the free list;
+  * 0 (default) disables the thread caches.
   */
-NDArrayPool::NDArrayPool(class asynNDArrayDriver *pDriver, size_t maxMemory)
-  : numBuffers_(0), maxMemory_(maxMemory), memorySize_(0), pDriver_(pDriver)
+NDArrayPool::NDArrayPool(class asynNDArrayDriver *pDriver, size_t maxMemory,
+                         NDArrayPoolMode_t mode, int classesPerOctave, int threadCacheSize)
+  : numBuffers_(0), maxMemory_(maxMemory), memorySize_(0), pDriver_(pDriver),
+    mode_(mode), classesPerOctave_(classesPerOctave), numSizeClasses_(0),
+    sizeClassLists_(NULL), numFree_(0), threadCacheSize_(threadCacheSize),
+    threadCacheId_(NULL), numCached_(0), cacheHits_(0), cacheMisses_(0), numaNode_(-1),
+    trimming_(false), trimHighWaterBytes_(0), trimLowWaterBytes_(0), trimMaxAge_(0.), activeSize_(0),
+    convertTimeUs_(0), convertThreads_(0)
 {
   listLock_ = epicsMutexCreate();
+  if (threadCacheSize_ < 0) threadCacheSize_ = 0;
+  if (threadCacheSize_ > 0) {
+    epicsThreadOnce(&threadCacheOnceId, threadCacheInit, NULL);
+    threadCacheId_ = epicsThreadPrivateCreate();
+  }
+  if (mode_ == NDArrayPoolModeSizeClass) {
+    if (classesPerOctave_ < 1) classesPerOctave_ = 1;
+    if (classesPerOctave_ > MAX_CLASSES_PER_OCTAVE) classesPerOctave_ = MAX_CLASSES_PER_OCTAVE;
+    numSizeClasses_ = (int)(sizeof(size_t)*8 - MIN_SIZE_CLASS_SHIFT) * classesPerOctave_;
+    sizeClassLists_ = (NDArrayFreeRing **)calloc(numSizeClasses_, sizeof(NDArrayFreeRing *));
+  }
+}
+
+/** NDArrayPool destructor
+  * In NDArrayPoolModeSizeClass this deletes the NDArrays in the free lists and the lists themselves.
+  * The thread caches are returned to the free list.  The spare caches are deleted, the caches of
+  * running threads are deleted when the threads exit.
+  */
+NDArrayPool::~NDArrayPool()
+{
+  if (trimming_) {
+    epicsMutexLock(trimPoolsLock);
+    for (size_t i=0; i<pTrimPools->size(); i++) {
+      if ((*pTrimPools)[i] == this) {
+        pTrimPools->erase(pTrimPools->begin() + i);
+        break;
+      }
+    }
+    epicsMutexUnlock(trimPoolsLock);
+  }
+  if (threadCacheId_) {
+    epicsMutexLock(threadCacheLock);
+    flushThreadCaches();
+    for (size_t i=0; i<threadCaches_.size(); i++) {
+      threadCaches_[i]->pPool = NULL;
+    }
+    threadCaches_.clear();
+    for (size_t i=0; i<spareCaches_.size(); i++) {
+      delete spareCaches_[i];
+    }
+    spareCaches_.clear();
+    epicsMutexUnlock(threadCacheLock);
+    epicsThreadPrivateDelete(threadCacheId_);
+    threadCacheId_ = NULL;
+  }
+  if (mode_ == NDArrayPoolModeSizeClass) {
+    emptyFreeList();
+    for (int i=0; i<numSizeClasses_; i++) {
+      delete sizeClassLists_[i];
+    }
+    free(sizeClassLists_);
+  }
+  for (size_t i=0; i<freeViews_.size(); i++) {
+    delete freeViews_[i];
+  }
 }
 
 /** Set default frame buffer allocation and deallocation functions
@@ -80,9 +389,26 @@ void NDArrayPool::setDefaultFrameMemoryFunctions(
  */
 void* NDArrayPool::frameMalloc(size_t size)
 {
+    if ((numaNode_ >= 0) && (defaultFrameMalloc == NDFrameMemoryAlloc))
+        return NDFrameMemoryAllocOnNode(size, numaNode_);
     return defaultFrameMalloc(size);
 }
 
+/** Sets the preferred NUMA node for frame buffers.
+  * This is only used when the frame memory backend selected with NDFrameMemoryConfig() is mmap.
+  * \param[in] numaNode The NUMA node, -1 for no preference.
+ */
+void NDArrayPool::setNumaNode(int numaNode)
+{
+    numaNode_ = numaNode;
+}
+
+/** Returns the preferred NUMA node for frame buffers; -1 if there is no preference */
+int NDArrayPool::getNumaNode()
+{
+    return numaNode_;
+}
+
 /** Used to free a frame buffer
  * This method can be overriden in subclasses to use custom memory deallocation
   * \param[in] ptr Pointer to memory that will be deallocated
@@ -110,7 +436,7 @@ void NDArrayPool::onAllocateArray(NDArray *pArray)
 }
 
 /** Hook for pool classes that manage objects derived from NDArray class.
-  * This hook is called after array has been reserved.
+  * This hook is called after array has been reserved.  It is called without the pool mutex held.
   * \param[in] pArray Pointer to the reserved NDArray object
   */
 void NDArrayPool::onReserveArray(NDArray *pArray)
@@ -118,7 +444,8 @@ void NDArrayPool::onReserveArray(NDArray *pArray)
 }
 
 /** Hook for pool classes that manage objects derived from NDArray class.
-  * This hook is called after array has been released.
+  * This hook is called after array has been released.  It is only called with the pool mutex held
+  * when the reference count reached 0 in NDArrayPoolModeSorted.
   * \param[in] pArray Pointer to the released NDArray object
   */
 void NDArrayPool::onReleaseArray(NDArray *pArray)
@@ -148,16 +475,38 @@ NDArray* NDArrayPool::alloc(int ndims, size_t *dims, NDDataType_t dataType, size
 {
   NDArray *pArray=NULL;
   NDArrayInfo_t arrayInfo;
+  std::vector<NDArray *> evicted;
+  void *pOldData = NULL;
+  size_t allocSize = 0;
   const char* functionName = "NDArrayPool::alloc:";
 
-  epicsMutexLock(listLock_);
-
   // Compute the required NDArray size
   NDArray::computeArrayInfo(ndims, dims, dataType, &arrayInfo);
   if (dataSize == 0) {
     dataSize = arrayInfo.totalBytes;
   }
 
+  if (trimming_ && (epicsAtomicGetSizeT(&activeSize_) != dataSize)) {
+    // Remember the size that is being allocated now, trim() keeps free arrays of this size
+    epicsAtomicSetSizeT(&activeSize_, dataSize);
+  }
+
+  if (threadCacheId_ && !pData) {
+    // Look in the cache of this thread first, that does not need listLock_
+    pArray = allocFromThreadCache(dataSize);
+    if (pArray) {
+      initArray(pArray, ndims, dims, dataType);
+      onAllocateArray(pArray);
+      return pArray;
+    }
+  }
+
+  if (mode_ == NDArrayPoolModeSizeClass) {
+    return allocSizeClass(ndims, dims, dataType, dataSize, pData);
+  }
+
+  epicsMutexLock(listLock_);
+
   std::multiset<freeListElement>::iterator pListElement;
 
   if (!pData) {
@@ -177,17 +526,100 @@ NDArray* NDArrayPool::alloc(int ndims, size_t *dims, NDDataType_t dataType, size
     pArray = pListElement->pArray_;
     if (pData || (pListElement->dataSize_ > (dataSize * THRESHOLD_SIZE_RATIO))) {
       // We found an array but it is too large.  Set the size to 0 so it will be allocated below.
+      // The old buffer is freed after listLock_ is released.
       memorySize_ -= pArray->dataSize;
-      frameFree(pArray->pData);
+      pOldData = pArray->pData;
       pArray->pData = NULL;
     }
     freeList_.erase(pListElement);
   }
 
-  /* Initialize fields */
+  initArray(pArray, ndims, dims, dataType);
+
+  /* At this point pArray exists, but pArray->pData may be NULL */
+  /* If the caller passed a valid buffer use that */
+  if (pData) {
+    pArray->pData = pData;
+    pArray->dataSize = dataSize;
+    memorySize_ += dataSize;
+  } else if (pArray->pData == NULL) {
+    if ((maxMemory_ > 0) && ((memorySize_ + dataSize) > maxMemory_)) {
+      // We don't have enough memory to allocate the array
+      // See if we can get memory by deleting arrays
+      // Delete the largest arrays first, i.e. work from the end of freeList_
+      // If that is not enough return the arrays in the thread caches to the free list and try again
+      // The arrays are deleted after listLock_ is released.
+      NDArray *freeArray;
+      std::multiset<freeListElement>::iterator it;
+      for (int pass=0; pass<2 && ((memorySize_ + dataSize) > maxMemory_); pass++) {
+        if (pass == 1) {
+          if (epicsAtomicGetIntT(&numCached_) == 0) break;
+          flushThreadCaches();
+        }
+        while (!freeList_.empty() && ((memorySize_ + dataSize) > maxMemory_)) {
+          it = freeList_.end();
+          it--;
+          freeArray = it->pArray_;
+          freeList_.erase(it);
+          memorySize_ -= freeArray->dataSize;
+          numBuffers_--;
+          evicted.push_back(freeArray);
+        }
+      }
+    }
+    if ((maxMemory_ > 0) && ((memorySize_ + dataSize) > maxMemory_)) {
+      asynPrint(pDriver_->pasynUserSelf, ASYN_TRACE_ERROR,
+             "%s: error: reached limit of %ld memory (%d buffers)\n",
+             functionName, (long)maxMemory_, numBuffers_);
+    } else {
+      // Reserve the memory now, the buffer is allocated after listLock_ is released
+      memorySize_ += dataSize;
+      allocSize = dataSize;
+    }
+  }
+  if (trimHighWaterBytes_ && (memorySize_ > trimHighWaterBytes_)) wakeTrimTask();
+  epicsMutexUnlock(listLock_);
+
+  // Freeing and allocating large buffers can take a long time, so it is done without holding listLock_
+  if (pOldData) frameFree(pOldData);
+  for (size_t i=0; i<evicted.size(); i++) {
+    delete evicted[i];
+  }
+  if (allocSize) {
+    pArray->pData = frameMalloc(allocSize);
+    if (pArray->pData) {
+      pArray->dataSize = allocSize;
+      pArray->compressedSize = allocSize;
+    } else {
+      epicsMutexLock(listLock_);
+      memorySize_ -= allocSize;
+      epicsMutexUnlock(listLock_);
+    }
+  }
+  // If we don't have a valid memory buffer see pArray to NULL to indicate error
+  if (pArray && (pArray->pData == NULL)) {
+    delete pArray;
+    epicsMutexLock(listLock_);
+    numBuffers_--;
+    epicsMutexUnlock(listLock_);
+    pArray = NULL;
+  }
+
+  // Call allocation hook (for pools that manage objects derived from NDArray class)
+  onAllocateArray(pArray);
+  return (pArray);
+}
+
+/** Initializes the fields of an NDArray that alloc() has taken from the free list or created.
+  * The data buffer is not touched.
+  */
+void NDArrayPool::initArray(NDArray *pArray, int ndims, size_t *dims, NDDataType_t dataType)
+{
   pArray->pNDArrayPool = this;
   pArray->referenceCount = 1;
   pArray->pDriver = pDriver_;
+  // release() returns the array to the cache of the thread that allocated it
+  pArray->pThreadCache = threadCacheId_ ? threadCache(false) : NULL;
   pArray->dataType = dataType;
   pArray->ndims = ndims;
   memset(pArray->dims, 0, sizeof(pArray->dims));
@@ -203,56 +635,610 @@ NDArray* NDArrayPool::alloc(int ndims, size_t *dims, NDDataType_t dataType, size
 
   /* Clear codec */
   pArray->codec.clear();
+}
+
+/** Returns the size class for a number of bytes in NDArrayPoolModeSizeClass.
+  * \param[in] size Number of bytes.
+  * \param[in] roundUp If true returns the smallest class that can hold size bytes,
+  * which is used when allocating.  If false returns the largest class that is not larger than size,
+  * which is used when returning an array to the free list. Returns -1 if size is smaller than the smallest class
+  * and roundUp is false.
+  */
+int NDArrayPool::sizeClassIndex(size_t size, bool roundUp)
+{
+  int octave = 0;
+  int subClass;
+  size_t base;
+
+  if (size < ((size_t)1 << MIN_SIZE_CLASS_SHIFT)) return roundUp ? 0 : -1;
+  while ((size >> (octave + MIN_SIZE_CLASS_SHIFT + 1)) != 0) octave++;
+  base = (size_t)1 << (octave + MIN_SIZE_CLASS_SHIFT);
+  subClass = (int)((size - base) / (base / classesPerOctave_));
+  if (subClass >= classesPerOctave_) subClass = classesPerOctave_ - 1;
+  int index = octave * classesPerOctave_ + subClass;
+  if (roundUp && (sizeClassSize(index) < size)) index++;
+  if (index >= numSizeClasses_) index = numSizeClasses_ - 1;
+  return index;
+}
+
+/** Returns the number of bytes that buffers in a size class are allocated with */
+size_t NDArrayPool::sizeClassSize(int index)
+{
+  int octave = index / classesPerOctave_;
+  int subClass = index % classesPerOctave_;
+  size_t base = (size_t)1 << (octave + MIN_SIZE_CLASS_SHIFT);
+  return base + subClass * (base / classesPerOctave_);
+}
+
+/** Returns the free list for a size class.
+  * \param[in] index The size class.
+  * \param[in] create If true the list is created if it does not yet exist, otherwise NULL is returned.
+  */
+NDArrayFreeRing* NDArrayPool::sizeClassList(int index, bool create)
+{
+  EpicsAtomicPtrT *ppList = (EpicsAtomicPtrT *)&sizeClassLists_[index];
+  NDArrayFreeRing *pList = (NDArrayFreeRing *)epicsAtomicGetPtrT(ppList);
+
+  if (pList || !create) return pList;
+  // Another thread may be creating the same list; the first one to publish its list wins
+  NDArrayFreeRing *pNew = new NDArrayFreeRing(SIZE_CLASS_LIST_DEPTH);
+  pList = (NDArrayFreeRing *)epicsAtomicCmpAndSwapPtrT(ppList, NULL, pNew);
+  if (pList) {
+    delete pNew;
+    return pList;
+  }
+  return pNew;
+}
+
+/** Removes an NDArray from the first non-empty size class free list between firstIndex and lastIndex.
+  * Returns NULL if all of those lists are empty.
+  */
+NDArray* NDArrayPool::popFreeArray(int firstIndex, int lastIndex)
+{
+  NDArrayFreeRing *pList;
+  NDArray *pArray;
+
+  for (int i=firstIndex; i<=lastIndex && i<numSizeClasses_; i++) {
+    pList = sizeClassList(i, false);
+    if (!pList) continue;
+    pArray = pList->pop();
+    if (pArray) {
+      epicsAtomicDecrIntT(&numFree_);
+      return pArray;
+    }
+  }
+  return NULL;
+}
+
+/** Puts an NDArray whose reference count has reached 0 on the size class free list.
+  * The array goes in the largest class that is not larger than its dataSize, so every array in a list
+  * can hold any request for that class. If the list is full the array is deleted.
+  */
+void NDArrayPool::pushFreeArray(NDArray *pArray)
+{
+  int index = sizeClassIndex(pArray->dataSize, false);
+
+  if (index < 0) {
+    // Smaller than the smallest class, which can only happen with a caller-supplied buffer.
+    // Free the buffer, alloc() will allocate a new one when this array is reused.
+    if (pArray->pData) {
+      epicsAtomicSubSizeT(&memorySize_, pArray->dataSize);
+      frameFree(pArray->pData);
+      pArray->pData = NULL;
+    }
+    pArray->dataSize = 0;
+    index = 0;
+  }
+  if (sizeClassList(index, true)->push(pArray, pArray->freeTime)) {
+    epicsAtomicIncrIntT(&numFree_);
+  } else {
+    deleteArray(pArray);
+  }
+}
+
+/** Deletes an NDArray that is not on any free list and updates the memory and buffer counts */
+void NDArrayPool::deleteArray(NDArray *pArray)
+{
+  epicsAtomicSubSizeT(&memorySize_, pArray->dataSize);
+  epicsAtomicDecrIntT(&numBuffers_);
+  delete pArray;
+}
+
+/** Adds size bytes to memorySize_ if that does not exceed maxMemory_.
+  * If it would, the largest arrays in the free lists are deleted until it does not.
+  * Returns false if there is still not enough memory when the free lists are empty.
+  */
+bool NDArrayPool::reserveMemory(size_t size)
+{
+  size_t current;
+  NDArray *pArray;
+
+  while (1) {
+    current = epicsAtomicGetSizeT(&memorySize_);
+    if ((maxMemory_ > 0) && ((current + size) > maxMemory_)) {
+      // Delete the largest arrays first
+      pArray = NULL;
+      for (int i=numSizeClasses_-1; i>=0 && !pArray; i--) {
+        pArray = popFreeArray(i, i);
+      }
+      if (!pArray) {
+        // Return the arrays in the thread caches to the free lists and try again
+        if (epicsAtomicGetIntT(&numCached_) == 0) return false;
+        flushThreadCaches();
+        continue;
+      }
+      deleteArray(pArray);
+      continue;
+    }
+    if (epicsAtomicCmpAndSwapSizeT(&memorySize_, current, current + size) == current) {
+      if (trimHighWaterBytes_ && ((current + size) > trimHighWaterBytes_)) wakeTrimTask();
+      return true;
+    }
+  }
+}
+
+/** Returns the largest dataSize of a free NDArray that alloc() will reuse for a request of dataSize bytes */
+size_t NDArrayPool::maxReuseSize(size_t dataSize)
+{
+  if (mode_ == NDArrayPoolModeSizeClass) {
+    dataSize = sizeClassSize(sizeClassIndex(dataSize, true));
+  }
+  return (size_t)(dataSize * THRESHOLD_SIZE_RATIO);
+}
+
+/** Returns the thread cache of the calling thread.
+  * A spare cache is reused if there is one.  threadCacheExit() is registered to run when the thread exits.
+  * \param[in] create If true the cache is created if this thread does not have one yet, otherwise NULL is returned.
+  */
+NDArrayThreadCache* NDArrayPool::threadCache(bool create)
+{
+  NDArrayThreadCache *pCache = (NDArrayThreadCache *)epicsThreadPrivateGet(threadCacheId_);
+
+  if (pCache || !create) return pCache;
+  epicsMutexLock(listLock_);
+  if (spareCaches_.empty()) {
+    pCache = new NDArrayThreadCache(this);
+    pCache->arrays.reserve(threadCacheSize_ + 1);
+  } else {
+    pCache = spareCaches_.back();
+    spareCaches_.pop_back();
+    epicsMutexLock(pCache->lock);
+    pCache->active = true;
+    epicsMutexUnlock(pCache->lock);
+  }
+  threadCaches_.push_back(pCache);
+  epicsMutexUnlock(listLock_);
+  epicsThreadPrivateSet(threadCacheId_, pCache);
+  epicsAtThreadExit(threadCacheExit, pCache);
+  return pCache;
+}
+
+/** Called when a thread that has a thread cache exits.
+  * If the pool still exists the cache is returned with retireThreadCache(), otherwise it is deleted.
+  * \param[in] arg Pointer to the NDArrayThreadCache of the thread.
+  */
+void NDArrayPool::threadCacheExit(void *arg)
+{
+  NDArrayThreadCache *pCache = (NDArrayThreadCache *)arg;
+
+  epicsMutexLock(threadCacheLock);
+  if (pCache->pPool) {
+    pCache->pPool->retireThreadCache(pCache);
+  } else {
+    delete pCache;
+  }
+  epicsMutexUnlock(threadCacheLock);
+}
+
+/** Returns the arrays in the cache of a thread that exited to the shared free list,
+  * and moves the cache from threadCaches_ to spareCaches_.
+  * Arrays that are released later and point to the cache go to the shared free list until it is reused.
+  */
+void NDArrayPool::retireThreadCache(NDArrayThreadCache *pCache)
+{
+  std::vector<NDArray *> arrays;
+
+  epicsMutexLock(listLock_);
+  epicsMutexLock(pCache->lock);
+  arrays.swap(pCache->arrays);
+  pCache->active = false;
+  epicsMutexUnlock(pCache->lock);
+  threadCaches_.erase(std::remove(threadCaches_.begin(), threadCaches_.end(), pCache), threadCaches_.end());
+  spareCaches_.push_back(pCache);
+  if (!arrays.empty()) {
+    epicsAtomicAddIntT(&numCached_, -(int)arrays.size());
+    returnToFreeList(&arrays[0], (int)arrays.size());
+  }
+  epicsMutexUnlock(listLock_);
+}
+
+/** Removes the smallest NDArray that can hold dataSize bytes from the cache of the calling thread.
+  * Returns NULL if there is none, in which case alloc() uses the shared free list.
+  */
+NDArray* NDArrayPool::allocFromThreadCache(size_t dataSize)
+{
+  NDArrayThreadCache *pCache = threadCache(true);
+  NDArray *pArray = NULL;
+  size_t maxSize = maxReuseSize(dataSize);
+  int best = -1;
+
+  epicsMutexLock(pCache->lock);
+  for (int i=(int)pCache->arrays.size()-1; i>=0; i--) {
+    size_t size = pCache->arrays[i]->dataSize;
+    if ((size < dataSize) || (size > maxSize) || !pCache->arrays[i]->pData) continue;
+    if ((best < 0) || (size < pCache->arrays[best]->dataSize)) best = i;
+    // Nearly every request is the same size as the last one, stop at an exact match
+    if (size == dataSize) break;
+  }
+  if (best >= 0) {
+    pArray = pCache->arrays[best];
+    pCache->arrays.erase(pCache->arrays.begin() + best);
+    epicsAtomicDecrIntT(&numCached_);
+  }
+  epicsMutexUnlock(pCache->lock);
+  // The statistics are only approximate, they do not need to be ordered with the cache
+  epicsAtomicIncrSizeT(pArray ? &cacheHits_ : &cacheMisses_);
+  return pArray;
+}
+
+/** Puts an NDArray whose reference count has reached 0 in the cache of the thread that allocated it,
+  * or of the calling thread if it was not allocated from a thread cache.
+  * If the cache is then full the oldest half of it is returned to the shared free list with returnToFreeList().
+  */
+void NDArrayPool::releaseToThreadCache(NDArray *pArray)
+{
+  NDArrayThreadCache *pCache = pArray->pThreadCache ? pArray->pThreadCache : threadCache(true);
+  std::vector<NDArray *> spill;
+
+  epicsMutexLock(pCache->lock);
+  if (!pCache->active) {
+    // The thread that allocated the array has exited
+    epicsMutexUnlock(pCache->lock);
+    returnToFreeList(&pArray, 1);
+    return;
+  }
+  pCache->arrays.push_back(pArray);
+  epicsAtomicIncrIntT(&numCached_);
+  if ((int)pCache->arrays.size() > threadCacheSize_) {
+    int numSpill = (int)pCache->arrays.size() - threadCacheSize_/2;
+    spill.assign(pCache->arrays.begin(), pCache->arrays.begin() + numSpill);
+    pCache->arrays.erase(pCache->arrays.begin(), pCache->arrays.begin() + numSpill);
+  }
+  epicsMutexUnlock(pCache->lock);
+
+  // The cache lock must not be held here, flushThreadCaches() takes the cache locks with listLock_ held
+  if (!spill.empty()) {
+    epicsAtomicAddIntT(&numCached_, -(int)spill.size());
+    returnToFreeList(&spill[0], (int)spill.size());
+  }
+}
+
+/** Puts NDArrays whose reference counts have reached 0 on the shared free list.
+  * In NDArrayPoolModeSorted listLock_ is only taken once for all of the arrays.
+  */
+void NDArrayPool::returnToFreeList(NDArray **pArrays, int numArrays)
+{
+  int i;
+
+  if (mode_ == NDArrayPoolModeSizeClass) {
+    for (i=0; i<numArrays; i++) {
+      pushFreeArray(pArrays[i]);
+    }
+    return;
+  }
+  epicsMutexLock(listLock_);
+  for (i=0; i<numArrays; i++) {
+    freeListElement listElement(pArrays[i], pArrays[i]->dataSize);
+    freeList_.insert(listElement);
+  }
+  epicsMutexUnlock(listLock_);
+}
+
+/** Returns the NDArrays in all thread caches to the shared free list.
+  * This is called by emptyFreeList() and when the pool needs memory, from any thread.
+  */
+void NDArrayPool::flushThreadCaches()
+{
+  std::vector<NDArray *> arrays;
+  NDArrayThreadCache *pCache;
+
+  if (!threadCacheId_) return;
+  epicsMutexLock(listLock_);
+  for (size_t i=0; i<threadCaches_.size(); i++) {
+    pCache = threadCaches_[i];
+    epicsMutexLock(pCache->lock);
+    arrays.insert(arrays.end(), pCache->arrays.begin(), pCache->arrays.end());
+    pCache->arrays.clear();
+    epicsMutexUnlock(pCache->lock);
+  }
+  if (!arrays.empty()) {
+    epicsAtomicAddIntT(&numCached_, -(int)arrays.size());
+    returnToFreeList(&arrays[0], (int)arrays.size());
+  }
+  epicsMutexUnlock(listLock_);
+}
+
+/** Implementation of alloc() for NDArrayPoolModeSizeClass.
+  * This does not take listLock_. Buffers are allocated with the size of their size class.
+  */
+NDArray* NDArrayPool::allocSizeClass(int ndims, size_t *dims, NDDataType_t dataType, size_t dataSize, void *pData)
+{
+  NDArray *pArray;
+  NDArrayInfo_t arrayInfo;
+  size_t allocSize = 0;
+  const char* functionName = "NDArrayPool::alloc:";
+
+  // Compute the required NDArray size
+  NDArray::computeArrayInfo(ndims, dims, dataType, &arrayInfo);
+  if (dataSize == 0) {
+    dataSize = arrayInfo.totalBytes;
+  }
+
+  if (!pData) {
+    // Look in the size class for dataSize, and in larger classes that are within the threshold
+    int index = sizeClassIndex(dataSize, true);
+    allocSize = sizeClassSize(index);
+    int lastIndex = sizeClassIndex((size_t)(allocSize * THRESHOLD_SIZE_RATIO), false);
+    if (lastIndex < index) lastIndex = index;
+    pArray = popFreeArray(index, lastIndex);
+  } else {
+    // dataSize doesn't matter, pData will get replaced. Pick smallest one.
+    pArray = popFreeArray(0, numSizeClasses_-1);
+  }
+
+  if (!pArray) {
+    /* We did not find a free image that is large enough, allocate a new one */
+    epicsAtomicIncrIntT(&numBuffers_);
+    pArray = this->createArray();
+  } else if (pArray->pData && (pData || (pArray->dataSize > (allocSize * THRESHOLD_SIZE_RATIO)))) {
+    // We found an array but it is too large.  Free the buffer so it will be allocated below.
+    epicsAtomicSubSizeT(&memorySize_, pArray->dataSize);
+    frameFree(pArray->pData);
+    pArray->pData = NULL;
+  }
+
+  initArray(pArray, ndims, dims, dataType);
 
   /* At this point pArray exists, but pArray->pData may be NULL */
   /* If the caller passed a valid buffer use that */
   if (pData) {
     pArray->pData = pData;
     pArray->dataSize = dataSize;
-    memorySize_ += dataSize;
+    epicsAtomicAddSizeT(&memorySize_, dataSize);
   } else if (pArray->pData == NULL) {
-    if ((maxMemory_ > 0) && ((memorySize_ + dataSize) > maxMemory_)) {
-      // We don't have enough memory to allocate the array
-      // See if we can get memory by deleting arrays
-      // Delete the largest arrays first, i.e. work from the end of freeList_
-      NDArray *freeArray;
-      std::multiset<freeListElement>::iterator it;
-      while (!freeList_.empty() && ((memorySize_ + dataSize) > maxMemory_)) {
-        it = freeList_.end();
-        it--;
-        freeArray = it->pArray_;
-        freeList_.erase(it);
-        memorySize_ -= freeArray->dataSize;
-        numBuffers_--;
-        delete freeArray;
-      }
-    }
-    if ((maxMemory_ > 0) && ((memorySize_ + dataSize) > maxMemory_)) {
+    pArray->dataSize = 0;
+    // If rounding up to the size class would exceed maxMemory_ fall back to the exact size
+    if (!reserveMemory(allocSize)) allocSize = reserveMemory(dataSize) ? dataSize : 0;
+    if (allocSize == 0) {
       asynPrint(pDriver_->pasynUserSelf, ASYN_TRACE_ERROR,
              "%s: error: reached limit of %ld memory (%d buffers)\n",
-             functionName, (long)maxMemory_, numBuffers_);
+             functionName, (long)maxMemory_, epicsAtomicGetIntT(&numBuffers_));
     } else {
-      pArray->pData = frameMalloc(dataSize);
+      pArray->pData = frameMalloc(allocSize);
       if (pArray->pData) {
-        pArray->dataSize = dataSize;
-        pArray->compressedSize = dataSize;
-        memorySize_ += dataSize;
+        pArray->dataSize = allocSize;
+        pArray->compressedSize = allocSize;
+      } else {
+        epicsAtomicSubSizeT(&memorySize_, allocSize);
       }
     }
   }
   // If we don't have a valid memory buffer see pArray to NULL to indicate error
-  if (pArray && (pArray->pData == NULL)) {
-    delete pArray;
-    numBuffers_--;
+  if (pArray->pData == NULL) {
+    deleteArray(pArray);
     pArray = NULL;
   }
 
   // Call allocation hook (for pools that manage objects derived from NDArray class)
   onAllocateArray(pArray);
-  epicsMutexUnlock(listLock_);
   return (pArray);
 }
 
+template <typename epicsType>
+static void copyViewRow(const void *pIn, void *pOut, size_t size, ptrdiff_t stride)
+{
+  const epicsType *pDataIn = (const epicsType *)pIn;
+  epicsType *pDataOut = (epicsType *)pOut;
+  size_t i;
+
+  for (i=0; i<size; i++, pDataIn+=stride) {
+    pDataOut[i] = *pDataIn;
+  }
+}
+
+/** Copies the elements of a view to a contiguous buffer of maxBytes bytes, one row along dimension 0 at a time */
+static void copyViewData(NDArray *pView, void *pOut, size_t maxBytes)
+{
+  NDArrayInfo_t arrayInfo;
+  size_t index[ND_ARRAY_MAX_DIMS];
+  size_t rowSize, rowBytes, numRows, row;
+  ptrdiff_t offset;
+  const char *pRowIn;
+  char *pRowOut = (char *)pOut;
+  int dim;
+
+  if (pView->ndims < 1) return;
+  pView->getInfo(&arrayInfo);
+  rowSize = pView->dims[0].size;
+  rowBytes = rowSize * arrayInfo.bytesPerElement;
+  numRows = arrayInfo.nElements / rowSize;
+  if (numRows > maxBytes / rowBytes) numRows = maxBytes / rowBytes;
+  memset(index, 0, sizeof(index));
+  for (row=0; row<numRows; row++, pRowOut+=rowBytes) {
+    offset = 0;
+    for (dim=1; dim<pView->ndims; dim++) offset += (ptrdiff_t)index[dim] * pView->strides[dim];
+    pRowIn = (const char *)pView->pData + offset*arrayInfo.bytesPerElement;
+    if (pView->strides[0] == 1) {
+      memcpy(pRowOut, pRowIn, rowBytes);
+    } else {
+      switch (arrayInfo.bytesPerElement) {
+        case 1: copyViewRow<epicsUInt8>(pRowIn, pRowOut, rowSize, pView->strides[0]); break;
+        case 2: copyViewRow<epicsUInt16>(pRowIn, pRowOut, rowSize, pView->strides[0]); break;
+        case 4: copyViewRow<epicsUInt32>(pRowIn, pRowOut, rowSize, pView->strides[0]); break;
+        case 8: copyViewRow<epicsUInt64>(pRowIn, pRowOut, rowSize, pView->strides[0]); break;
+      }
+    }
+    for (dim=1; dim<pView->ndims; dim++) {
+      if (++index[dim] < pView->dims[dim].size) break;
+      index[dim] = 0;
+    }
+  }
+}
+
+/** Creates a view of a region of an NDArray, which refers to the data of the input array rather than copying it.
+  * \param[in] pIn The input array, which can itself be a view.
+  * \param[in] dimsOut The size, offset and reverse of the region in each dimension; binning must be 1.
+  * \return Returns the view, or NULL if the region cannot be a view, e.g. because of binning or compression.
+  *
+  * The view holds a reference on the array that owns the data until the view is released.
+  * Its dims, timeStamp, uniqueId and attributes are set as convert() sets them.
+  * Plugins that are not view aware receive a contiguous copy made by materialize().
+  */
+NDArray* NDArrayPool::createView(NDArray *pIn, NDDimension_t *dimsOut)
+{
+  NDArray *pView = NULL;
+  NDArray *pParent;
+  NDArrayInfo_t arrayInfo;
+  ptrdiff_t inStrides[ND_ARRAY_MAX_DIMS];
+  size_t dimSizeOut[ND_ARRAY_MAX_DIMS];
+  ptrdiff_t offset = 0;
+  size_t first;
+  int i;
+  const char *functionName = "createView";
+
+  if (!pIn->codec.empty() || (pIn->ndims < 1)) return NULL;
+  for (i=0; i<pIn->ndims; i++) {
+    if (dimsOut[i].binning != 1) return NULL;
+    if ((dimsOut[i].size < 1) || (dimsOut[i].offset + dimsOut[i].size > pIn->dims[i].size)) {
+      asynPrint(pDriver_->pasynUserSelf, ASYN_TRACE_ERROR,
+        "%s:%s: ERROR, invalid view dimension %d, size=%d, offset=%d\n",
+        driverName, functionName, i, (int)dimsOut[i].size, (int)dimsOut[i].offset);
+      return NULL;
+    }
+    dimSizeOut[i] = dimsOut[i].size;
+  }
+
+  epicsMutexLock(listLock_);
+  if (!freeViews_.empty()) {
+    pView = freeViews_.back();
+    freeViews_.pop_back();
+  }
+  epicsMutexUnlock(listLock_);
+  if (!pView) pView = this->createArray();
+  initArray(pView, pIn->ndims, dimSizeOut, pIn->dataType);
+
+  pIn->getStrides(inStrides);
+  for (i=0; i<pIn->ndims; i++) {
+    first = dimsOut[i].offset;
+    if (dimsOut[i].reverse) first += dimsOut[i].size - 1;
+    offset += (ptrdiff_t)first * inStrides[i];
+    pView->strides[i] = dimsOut[i].reverse ? -inStrides[i] : inStrides[i];
+    pView->dims[i].offset = pIn->dims[i].offset + dimsOut[i].offset;
+    pView->dims[i].binning = pIn->dims[i].binning;
+    pView->dims[i].reverse = pIn->dims[i].reverse ? !dimsOut[i].reverse : dimsOut[i].reverse;
+  }
+  pIn->getInfo(&arrayInfo);
+  pView->pData = (char *)pIn->pData + offset*arrayInfo.bytesPerElement;
+  pView->dataSize = 0;
+  pView->getInfo(&arrayInfo);
+  pView->compressedSize = arrayInfo.totalBytes;
+
+  /* A view of a view refers directly to the array that owns the data */
+  pParent = pIn->pViewParent ? pIn->pViewParent : pIn;
+  pParent->reserve();
+  pView->pViewParent = pParent;
+
+  pView->timeStamp = pIn->timeStamp;
+  pView->epicsTS = pIn->epicsTS;
+  pView->uniqueId = pIn->uniqueId;
+  pView->pAttributeList->clear();
+  pIn->pAttributeList->copy(pView->pAttributeList);
+
+  onAllocateArray(pView);
+  return pView;
+}
+
+/** Creates an array that shares the data of an NDArray rather than copying it, but has its own attributes.
+  * \param[in] pIn The input array, which can be a view.
+  * \return Returns the shared array, which is a view if pIn is a view.
+  *
+  * Like a view, the shared array holds a reference on the array that owns the data until it is released.
+  * Its dims, dataType, codec, timeStamp, uniqueId and attributes are copied from pIn, so a plugin that outputs
+  * its input array unchanged can add attributes to the shared array without copying the data or changing
+  * the attributes of pIn, which other plugins may be using.
+  */
+NDArray* NDArrayPool::share(NDArray *pIn)
+{
+  NDArray *pOut = NULL;
+  NDArray *pParent;
+  size_t dimSizeOut[ND_ARRAY_MAX_DIMS];
+  int i;
+
+  for (i=0; i<pIn->ndims; i++) dimSizeOut[i] = pIn->dims[i].size;
+  epicsMutexLock(listLock_);
+  if (!freeViews_.empty()) {
+    pOut = freeViews_.back();
+    freeViews_.pop_back();
+  }
+  epicsMutexUnlock(listLock_);
+  if (!pOut) pOut = this->createArray();
+  initArray(pOut, pIn->ndims, dimSizeOut, pIn->dataType);
+
+  memcpy(pOut->dims, pIn->dims, sizeof(pIn->dims));
+  pIn->getStrides(pOut->strides);
+  pOut->sharesData = !pIn->isView();
+  pOut->pData = pIn->pData;
+  pOut->dataSize = pIn->dataSize;
+  pOut->codec.name = pIn->codec.name;
+  pOut->compressedSize = pIn->compressedSize;
+
+  /* The shared array refers directly to the array that owns the data */
+  pParent = pIn->pViewParent ? pIn->pViewParent : pIn;
+  pParent->reserve();
+  pOut->pViewParent = pParent;
+
+  pOut->timeStamp = pIn->timeStamp;
+  pOut->epicsTS = pIn->epicsTS;
+  pOut->uniqueId = pIn->uniqueId;
+  pOut->pAttributeList->clear();
+  pIn->pAttributeList->copy(pOut->pAttributeList);
+
+  onAllocateArray(pOut);
+  return pOut;
+}
+
+/** Returns an array with contiguous data for plugins that cannot handle views.
+  * \param[in] pArray The input array.
+  * \return If pArray is a view a contiguous copy of it, otherwise pArray itself, or NULL if the copy
+  * cannot be allocated.  In both cases the caller owns a reference to the returned array and must release it.
+  */
+NDArray* NDArrayPool::materialize(NDArray *pArray)
+{
+  if (!pArray->isView()) {
+    pArray->reserve();
+    return pArray;
+  }
+  return copy(pArray, NULL, true);
+}
+
+/** Called by release() when the reference count of a view or a shared array reaches 0.
+  * The NDArray object is kept for the next createView() or share() and the reference on the parent array is released.
+  */
+void NDArrayPool::releaseView(NDArray *pView)
+{
+  NDArray *pParent = pView->pViewParent;
+
+  onReleaseArray(pView);
+  pView->pViewParent = NULL;
+  pView->sharesData = false;
+  pView->pData = NULL;
+  pView->dataSize = 0;
+  epicsMutexLock(listLock_);
+  freeViews_.push_back(pView);
+  epicsMutexUnlock(listLock_);
+  pParent->release();
+}
+
 /** This method makes a copy of an NDArray object.
   * \param[in] pIn The input array to be copied.
   * \param[in] pOut The output array that will be copied to; can be NULL or a pointer to an existing NDArray.
@@ -264,7 +1250,7 @@ NDArray* NDArrayPool::alloc(int ndims, size_t *dims, NDDataType_t dataType, size
   *
   * If pOut is NULL then it is first allocated. If the output array
   * object already exists (pOut!=NULL) then it must have sufficient memory allocated to
-  * it to hold the data.
+  * it to hold the data.  If pIn is a view the output data is contiguous.
   */
 NDArray* NDArrayPool::copy(NDArray *pIn, NDArray *pOut, bool copyData, bool copyDimensions, bool copyDataType)
 {
@@ -291,7 +1277,12 @@ NDArray* NDArrayPool::copy(NDArray *pIn, NDArray *pOut, bool copyData, bool copy
     pOut->dataType = pIn->dataType;
   }
   pOut->codec.name = pIn->codec.name;
-  if (copyData) {
+  if (copyData && pIn->isView()) {
+    /* The output is contiguous */
+    pIn->getInfo(&arrayInfo);
+    pOut->compressedSize = arrayInfo.totalBytes;
+    copyViewData(pIn, pOut->pData, pOut->dataSize);
+  } else if (copyData) {
     pIn->getInfo(&arrayInfo);
     numCopy = pIn->codec.empty() ? arrayInfo.totalBytes : pIn->compressedSize;
     pOut->compressedSize = pIn->compressedSize;
@@ -303,11 +1294,54 @@ NDArray* NDArrayPool::copy(NDArray *pIn, NDArray *pOut, bool copyData, bool copy
   return(pOut);
 }
 
+/** Makes sure that the free list contains at least numBuffers arrays with dataSize bytes,
+  * so that the first frames do not have to wait for malloc() and page faults.
+  * \param[in] numBuffers Number of free buffers that are required.
+  * \param[in] dataSize Size of each buffer in bytes.
+  * \param[in] prefault NDFrameMemoryPrefault_t; 1 faults in the pages of each buffer, 2 also locks them in memory.
+  * \return Returns ND_SUCCESS, or ND_ERROR if maxMemory does not allow that many buffers;
+  * the buffers that were allocated are kept in the free list.
+  *
+  * The buffers are put directly on the shared free list, not in the cache of the calling thread.
+  */
+int NDArrayPool::preAllocate(int numBuffers, size_t dataSize, int prefault)
+{
+  const char *functionName = "preAllocate";
+  std::vector<NDArray *> arrays;
+  NDArray *pArray;
+  size_t dims = dataSize;
+  int status = ND_SUCCESS;
+  int i;
+
+  if ((numBuffers <= 0) || (dataSize == 0)) return ND_SUCCESS;
+  for (i=0; i<numBuffers; i++) {
+    pArray = this->alloc(1, &dims, NDInt8, dataSize, NULL);
+    if (!pArray) {
+      asynPrint(pDriver_->pasynUserSelf, ASYN_TRACE_ERROR,
+        "%s::%s: ERROR, could only allocate %d of %d buffers of %lu bytes\n",
+        driverName, functionName, i, numBuffers, (unsigned long)dataSize);
+      status = ND_ERROR;
+      break;
+    }
+    NDFrameMemoryPrefault(pArray->pData, pArray->dataSize, prefault);
+    arrays.push_back(pArray);
+  }
+  if (arrays.empty()) return status;
+  for (i=0; i<(int)arrays.size(); i++) {
+    pArray = arrays[i];
+    epicsAtomicSetIntT(&pArray->referenceCount, 0);
+    if (trimming_) epicsTimeGetCurrent(&pArray->freeTime);
+    onReleaseArray(pArray);
+  }
+  returnToFreeList(&arrays[0], (int)arrays.size());
+  return status;
+}
+
 /** This method increases the reference count for the NDArray object.
   * \param[in] pArray The array on which to increase the reference count.
   *
   * Plugins must call reserve() when an NDArray is placed on a queue for later
-  * processing.
+  * processing.  The reference count is changed atomically; this does not lock the pool.
   */
 int NDArrayPool::reserve(NDArray *pArray)
 {
@@ -321,18 +1355,17 @@ int NDArrayPool::reserve(NDArray *pArray)
     return(ND_ERROR);
   }
   //asynPrint(pDriver_->pasynUserSelf, ASYN_TRACE_FLOW,
-  //  "NDArrayPool::reserve pArray=%p, count=%d\n", pArray, pArray->referenceCount);
-  epicsMutexLock(listLock_);
-  // If the reference count is less than 1 then something is wrong, this NDArray has been released.
-  if (pArray->referenceCount < 1) {
+  //  "NDArrayPool::reserve pArray=%p, count=%d\n", pArray, pArray->getReferenceCount());
+  // The caller owns a reference, so the array cannot be on the free list and no lock is needed.
+  int referenceCount = epicsAtomicIncrIntT(&pArray->referenceCount);
+  // If the reference count was less than 1 then something is wrong, this NDArray has been released.
+  if (referenceCount < 2) {
     cantProceed("%s:reserve ERROR, reference count = %d, should be >= 1, pArray=%p\n",
-           driverName, pArray->referenceCount, pArray);
+           driverName, referenceCount-1, pArray);
   }
-  pArray->referenceCount++;
 
   // Call reservation hook (for pools that manage objects derived from NDArray class)
   onReserveArray(pArray);
-  epicsMutexUnlock(listLock_);
   return ND_SUCCESS;
 }
 
@@ -342,7 +1375,8 @@ int NDArrayPool::reserve(NDArray *pArray)
   * When the reference count reaches 0 the NDArray is placed back in the free list.
   * Plugins must call release() when an NDArray is removed from the queue and
   * processing on it is complete. Drivers must call release() after calling all
-  * plugins.
+  * plugins.  The reference count is changed atomically; only the release that takes it to 0
+  * accesses the free list.
   */
 int NDArrayPool::release(NDArray *pArray)
 {
@@ -356,155 +1390,195 @@ int NDArrayPool::release(NDArray *pArray)
     return(ND_ERROR);
   }
   //asynPrint(pDriver_->pasynUserSelf, ASYN_TRACE_FLOW,
-  //  "NDArrayPool::release pArray=%p, count=%d\n", pArray, pArray->referenceCount);
-  epicsMutexLock(listLock_);
-  pArray->referenceCount--;
-  if (pArray->referenceCount == 0) {
-    /* The last user has released this image, add it back to the free list */
-    freeListElement listElement(pArray, pArray->dataSize);
-    freeList_.insert(listElement);
-  }
-  if (pArray->referenceCount < 0) {
+  //  "NDArrayPool::release pArray=%p, count=%d\n", pArray, pArray->getReferenceCount());
+  int referenceCount = epicsAtomicDecrIntT(&pArray->referenceCount);
+  if (referenceCount < 0) {
     cantProceed("%s:release ERROR, reference count < 0 pArray=%p\n",
            driverName, pArray);
   }
+  if (referenceCount > 0) {
+    // Other clients still hold references, the free list is not touched.
+    // Call release hook (for pools that manage objects derived from NDArray class)
+    onReleaseArray(pArray);
+    return ND_SUCCESS;
+  }
 
-  // Call release hook (for pools that manage objects derived from NDArray class)
+  /* Views and shared arrays do not have a buffer, they go back on their own list */
+  if (pArray->pViewParent) {
+    releaseView(pArray);
+    return ND_SUCCESS;
+  }
+
+  /* The last user has released this image, add it back to the free list */
+  if (trimming_) epicsTimeGetCurrent(&pArray->freeTime);
+  if (threadCacheId_) {
+    // Put it in the cache of this thread, this only locks the free list when the cache spills.
+    // The hook must be called first, after that the array can be allocated again.
+    onReleaseArray(pArray);
+    releaseToThreadCache(pArray);
+    return ND_SUCCESS;
+  }
+  if (mode_ == NDArrayPoolModeSizeClass) {
+    // The size class free lists are lock-free.
+    // The hook must be called before the array is pushed, after that another thread can allocate it.
+    onReleaseArray(pArray);
+    pushFreeArray(pArray);
+    return ND_SUCCESS;
+  }
+  epicsMutexLock(listLock_);
+  freeListElement listElement(pArray, pArray->dataSize);
+  freeList_.insert(listElement);
   onReleaseArray(pArray);
   epicsMutexUnlock(listLock_);
   return ND_SUCCESS;
 }
 
-template <typename dataTypeIn, typename dataTypeOut> void convertType(NDArray *pIn, NDArray *pOut)
+/** Converts one output row, i.e. the output elements along dimension 0, from one input row.
+  * If first is true the output is set, otherwise the input is added to it, as each output element is the
+  * sum of the binning*binning*... input elements.  BIN is the binning of dimension 0, or 0 for any binning.
+  * Each element is added with the same cast and in the same order as the element by element algorithm.
+  * dir is the number of input elements between successive elements of the row, normally 1 or -1.
+  */
+template <typename dataTypeIn, typename dataTypeOut, int BIN>
+static void convertRow(const dataTypeIn *pIn, dataTypeOut *pOut, size_t size, int binning, ptrdiff_t dir, bool first)
 {
   size_t i;
-  dataTypeIn *pDataIn = (dataTypeIn *)pIn->pData;
-  dataTypeOut *pDataOut = (dataTypeOut *)pOut->pData;
-  NDArrayInfo_t arrayInfo;
-
-  pOut->getInfo(&arrayInfo);
-  for (i=0; i<arrayInfo.nElements; i++) {
-    *pDataOut++ = (dataTypeOut)(*pDataIn++);
+  int bin;
+  const int nBin = BIN ? BIN : binning;
+  const ptrdiff_t step = nBin * dir;
+
+  if (first) {
+    for (i=0; i<size; i++, pIn+=step) {
+      dataTypeOut value = (dataTypeOut)pIn[0];
+      for (bin=1; bin<nBin; bin++) value += (dataTypeOut)pIn[bin*dir];
+      pOut[i] = value;
+    }
+  } else {
+    for (i=0; i<size; i++, pIn+=step) {
+      dataTypeOut value = pOut[i];
+      for (bin=0; bin<nBin; bin++) value += (dataTypeOut)pIn[bin*dir];
+      pOut[i] = value;
+    }
   }
 }
 
-template <typename dataTypeOut> int convertTypeSwitch (NDArray *pIn, NDArray *pOut)
+/** Returns the index in the input array of output element out and bin number bin along one dimension */
+static inline size_t inputIndex(const NDDimension_t *pOutDim, size_t out, int bin)
 {
-  int status = ND_SUCCESS;
-
-  switch(pIn->dataType) {
-    case NDInt8:
-      convertType<epicsInt8, dataTypeOut> (pIn, pOut);
-      break;
-    case NDUInt8:
-      convertType<epicsUInt8, dataTypeOut> (pIn, pOut);
-      break;
-    case NDInt16:
-      convertType<epicsInt16, dataTypeOut> (pIn, pOut);
-      break;
-    case NDUInt16:
-      convertType<epicsUInt16, dataTypeOut> (pIn, pOut);
-      break;
-    case NDInt32:
-      convertType<epicsInt32, dataTypeOut> (pIn, pOut);
-      break;
-    case NDUInt32:
-      convertType<epicsUInt32, dataTypeOut> (pIn, pOut);
-      break;
-    case NDInt64:
-      convertType<epicsInt64, dataTypeOut> (pIn, pOut);
-      break;
-    case NDUInt64:
-      convertType<epicsUInt64, dataTypeOut> (pIn, pOut);
-      break;
-    case NDFloat32:
-      convertType<epicsFloat32, dataTypeOut> (pIn, pOut);
-      break;
-    case NDFloat64:
-      convertType<epicsFloat64, dataTypeOut> (pIn, pOut);
-      break;
-    default:
-      status = ND_ERROR;
-      break;
-  }
-  return(status);
+  size_t in = out*pOutDim->binning + bin;
+  if (pOutDim->reverse) return pOutDim->offset + pOutDim->size*pOutDim->binning - 1 - in;
+  return pOutDim->offset + in;
 }
 
-
-template <typename dataTypeIn, typename dataTypeOut> void convertDim(NDArray *pIn, NDArray *pOut,
-                                                     void *pDataIn, void *pDataOut, int dim)
-{
-  dataTypeOut *pDOut = (dataTypeOut *)pDataOut;
-  dataTypeIn *pDIn = (dataTypeIn *)pDataIn;
-  NDDimension_t *pOutDims = pOut->dims;
-  NDDimension_t *pInDims = pIn->dims;
-  size_t inStep, outStep, inOffset;
-  int inDir;
-  int i, bin;
-  size_t inc, in, out;
-
-  inStep = 1;
-  outStep = 1;
-  inDir = 1;
-  inOffset = pOutDims[dim].offset;
-  for (i=0; i<dim; i++) {
-    inStep  *= pInDims[i].size;
-    outStep *= pOutDims[i].size;
-  }
-  if (pOutDims[dim].reverse) {
-    inOffset += pOutDims[dim].size * pOutDims[dim].binning - 1;
-    inDir = -1;
-  }
-  inc = inDir * inStep;
-  pDIn += inOffset*inStep;
-  for (in=0, out=0; out<pOutDims[dim].size; out++, in++) {
-    for (bin=0; bin<pOutDims[dim].binning; bin++) {
-      if (dim > 0) {
-        convertDim <dataTypeIn, dataTypeOut> (pIn, pOut, pDIn, pDOut, dim-1);
+/** Extracts a region and/or bins or reverses the input array into the output array,
+  * converting the data type.  This works on whole rows along dimension 0 with no recursion.
+  * The rows from firstRow to firstRow+numRows-1 of the output array are computed,
+  * where the row number is the index of the row in the output array seen as a 2-D array of
+  * pOut->dims[0].size columns, so the output can be computed in independent parts.
+  * pOut->dims must contain the size, offset, binning and reverse relative to the input array.
+  */
+template <typename dataTypeIn, typename dataTypeOut>
+static void convertDim(NDArray *pIn, NDArray *pOut, size_t firstRow, size_t numRows)
+{
+  const NDDimension_t *pOutDims = pOut->dims;
+  const dataTypeIn *pDataIn = (const dataTypeIn *)pIn->pData;
+  dataTypeOut *pRowOut;
+  int ndims = pIn->ndims;
+  ptrdiff_t inStride[ND_ARRAY_MAX_DIMS];
+  size_t outIndex[ND_ARRAY_MAX_DIMS];
+  int binIndex[ND_ARRAY_MAX_DIMS];
+  size_t rowSize, row, rowIndex;
+  ptrdiff_t inRow;
+  int binning, dim;
+  ptrdiff_t dir;
+  bool first;
+  NDConvertFunc_t convertFunc = NDConvertGetFunction(pIn->dataType, pOut->dataType);
+
+  if (ndims < 1) return;
+  // The input can be a view, so its elements are not necessarily contiguous
+  pIn->getStrides(inStride);
+  rowSize = pOutDims[0].size;
+  binning = pOutDims[0].binning;
+  dir = pOutDims[0].reverse ? -inStride[0] : inStride[0];
+  // Output indices of the first row in dimensions 1 and above
+  rowIndex = firstRow;
+  for (dim=1; dim<ndims; dim++) {
+    outIndex[dim] = rowIndex % pOutDims[dim].size;
+    rowIndex /= pOutDims[dim].size;
+  }
+  pRowOut = (dataTypeOut *)pOut->pData + firstRow*rowSize;
+
+  for (row=0; row<numRows; row++, pRowOut+=rowSize) {
+    // Add the input rows of all of the bins in dimensions 1 and above, the highest dimension changes slowest
+    for (dim=1; dim<ndims; dim++) binIndex[dim] = 0;
+    first = true;
+    do {
+      inRow = (ptrdiff_t)inputIndex(&pOutDims[0], 0, 0) * inStride[0];
+      for (dim=1; dim<ndims; dim++) {
+        inRow += (ptrdiff_t)inputIndex(&pOutDims[dim], outIndex[dim], binIndex[dim]) * inStride[dim];
+      }
+      const dataTypeIn *pRowIn = pDataIn + inRow;
+      if (first && (binning == 1) && (dir == 1) && convertFunc) {
+        // Copy or convert a contiguous row
+        convertFunc(pRowIn, pRowOut, rowSize);
+      } else if (binning == 1) {
+        convertRow<dataTypeIn, dataTypeOut, 1>(pRowIn, pRowOut, rowSize, binning, dir, first);
+      } else if (binning == 2) {
+        convertRow<dataTypeIn, dataTypeOut, 2>(pRowIn, pRowOut, rowSize, binning, dir, first);
+      } else if (binning == 4) {
+        convertRow<dataTypeIn, dataTypeOut, 4>(pRowIn, pRowOut, rowSize, binning, dir, first);
       } else {
-        *pDOut += (dataTypeOut)*pDIn;
+        convertRow<dataTypeIn, dataTypeOut, 0>(pRowIn, pRowOut, rowSize, binning, dir, first);
+      }
+      first = false;
+      for (dim=1; dim<ndims; dim++) {
+        if (++binIndex[dim] < pOutDims[dim].binning) break;
+        binIndex[dim] = 0;
       }
-      pDIn += inc;
+    } while (dim < ndims);
+    // Next output row
+    for (dim=1; dim<ndims; dim++) {
+      if (++outIndex[dim] < pOutDims[dim].size) break;
+      outIndex[dim] = 0;
     }
-    pDOut += outStep;
   }
 }
 
 template <typename dataTypeOut> int convertDimensionSwitch(NDArray *pIn, NDArray *pOut,
-                                                           void *pDataIn, void *pDataOut, int dim)
+                                                           size_t firstRow, size_t numRows)
 {
   int status = ND_SUCCESS;
 
   switch(pIn->dataType) {
     case NDInt8:
-      convertDim <epicsInt8, dataTypeOut> (pIn, pOut, pDataIn, pDataOut, dim);
+      convertDim <epicsInt8, dataTypeOut> (pIn, pOut, firstRow, numRows);
       break;
     case NDUInt8:
-      convertDim <epicsUInt8, dataTypeOut> (pIn, pOut, pDataIn, pDataOut, dim);
+      convertDim <epicsUInt8, dataTypeOut> (pIn, pOut, firstRow, numRows);
       break;
     case NDInt16:
-      convertDim <epicsInt16, dataTypeOut> (pIn, pOut, pDataIn, pDataOut, dim);
+      convertDim <epicsInt16, dataTypeOut> (pIn, pOut, firstRow, numRows);
       break;
     case NDUInt16:
-      convertDim <epicsUInt16, dataTypeOut> (pIn, pOut, pDataIn, pDataOut, dim);
+      convertDim <epicsUInt16, dataTypeOut> (pIn, pOut, firstRow, numRows);
       break;
     case NDInt32:
-      convertDim <epicsInt32, dataTypeOut> (pIn, pOut, pDataIn, pDataOut, dim);
+      convertDim <epicsInt32, dataTypeOut> (pIn, pOut, firstRow, numRows);
       break;
     case NDUInt32:
-      convertDim <epicsUInt32, dataTypeOut> (pIn, pOut, pDataIn, pDataOut, dim);
+      convertDim <epicsUInt32, dataTypeOut> (pIn, pOut, firstRow, numRows);
       break;
     case NDInt64:
-      convertDim <epicsInt64, dataTypeOut> (pIn, pOut, pDataIn, pDataOut, dim);
+      convertDim <epicsInt64, dataTypeOut> (pIn, pOut, firstRow, numRows);
       break;
     case NDUInt64:
-      convertDim <epicsUInt64, dataTypeOut> (pIn, pOut, pDataIn, pDataOut, dim);
+      convertDim <epicsUInt64, dataTypeOut> (pIn, pOut, firstRow, numRows);
       break;
     case NDFloat32:
-      convertDim <epicsFloat32, dataTypeOut> (pIn, pOut, pDataIn, pDataOut, dim);
+      convertDim <epicsFloat32, dataTypeOut> (pIn, pOut, firstRow, numRows);
       break;
     case NDFloat64:
-      convertDim <epicsFloat64, dataTypeOut> (pIn, pOut, pDataIn, pDataOut, dim);
+      convertDim <epicsFloat64, dataTypeOut> (pIn, pOut, firstRow, numRows);
       break;
     default:
       status = ND_ERROR;
@@ -513,48 +1587,45 @@ template <typename dataTypeOut> int convertDimensionSwitch(NDArray *pIn, NDArray
   return(status);
 }
 
+/** Computes rows firstRow to firstRow+numRows-1 of the output array of a convert() that
+  * changes the dimensions.  See convertDim(). */
 static int convertDimension(NDArray *pIn,
                             NDArray *pOut,
-                            void *pDataIn,
-                            void *pDataOut,
-                            int dim)
+                            size_t firstRow,
+                            size_t numRows)
 {
   int status = ND_SUCCESS;
-  /* This routine is passed:
-   * A pointer to the start of the input data
-   * A pointer to the start of the output data
-   * An array of dimensions
-   * A dimension index */
+
   switch(pOut->dataType) {
     case NDInt8:
-      convertDimensionSwitch <epicsInt8>(pIn, pOut, pDataIn, pDataOut, dim);
+      convertDimensionSwitch <epicsInt8> (pIn, pOut, firstRow, numRows);
       break;
     case NDUInt8:
-      convertDimensionSwitch <epicsUInt8> (pIn, pOut, pDataIn, pDataOut, dim);
+      convertDimensionSwitch <epicsUInt8> (pIn, pOut, firstRow, numRows);
       break;
     case NDInt16:
-      convertDimensionSwitch <epicsInt16> (pIn, pOut, pDataIn, pDataOut, dim);
+      convertDimensionSwitch <epicsInt16> (pIn, pOut, firstRow, numRows);
       break;
     case NDUInt16:
-      convertDimensionSwitch <epicsUInt16> (pIn, pOut, pDataIn, pDataOut, dim);
+      convertDimensionSwitch <epicsUInt16> (pIn, pOut, firstRow, numRows);
       break;
     case NDInt32:
-      convertDimensionSwitch <epicsInt32> (pIn, pOut, pDataIn, pDataOut, dim);
+      convertDimensionSwitch <epicsInt32> (pIn, pOut, firstRow, numRows);
       break;
     case NDUInt32:
-      convertDimensionSwitch <epicsUInt32> (pIn, pOut, pDataIn, pDataOut, dim);
+      convertDimensionSwitch <epicsUInt32> (pIn, pOut, firstRow, numRows);
       break;
     case NDInt64:
-      convertDimensionSwitch <epicsInt64> (pIn, pOut, pDataIn, pDataOut, dim);
+      convertDimensionSwitch <epicsInt64> (pIn, pOut, firstRow, numRows);
       break;
     case NDUInt64:
-      convertDimensionSwitch <epicsUInt64> (pIn, pOut, pDataIn, pDataOut, dim);
+      convertDimensionSwitch <epicsUInt64> (pIn, pOut, firstRow, numRows);
       break;
     case NDFloat32:
-      convertDimensionSwitch <epicsFloat32> (pIn, pOut, pDataIn, pDataOut, dim);
+      convertDimensionSwitch <epicsFloat32> (pIn, pOut, firstRow, numRows);
       break;
     case NDFloat64:
-      convertDimensionSwitch <epicsFloat64> (pIn, pOut, pDataIn, pDataOut, dim);
+      convertDimensionSwitch <epicsFloat64> (pIn, pOut, firstRow, numRows);
       break;
     default:
       status = ND_ERROR;
@@ -563,6 +1634,34 @@ static int convertDimension(NDArray *pIn,
   return(status);
 }
 
+/** Arguments of the band functions that NDConvertRunBands() calls for convert() */
+typedef struct {
+  NDArray *pIn;
+  NDArray *pOut;
+  NDConvertFunc_t convertFunc;  /**< Conversion kernel, NULL to copy */
+  size_t bytesIn;               /**< Bytes per element in pIn */
+  size_t bytesOut;              /**< Bytes per element in pOut */
+} convertBandArgs_t;
+
+/** Converts or copies count elements starting at element first when the dimensions are unchanged */
+static void convertElementsBand(void *pvt, size_t first, size_t count)
+{
+  convertBandArgs_t *pArgs = (convertBandArgs_t *)pvt;
+  const char *pDataIn = (const char *)pArgs->pIn->pData + first*pArgs->bytesIn;
+  char *pDataOut = (char *)pArgs->pOut->pData + first*pArgs->bytesOut;
+
+  if (pArgs->convertFunc) pArgs->convertFunc(pDataIn, pDataOut, count);
+  else memcpy(pDataOut, pDataIn, count*pArgs->bytesOut);
+}
+
+/** Computes count output rows starting at row first when extracting a region, binning or reversing */
+static void convertRowsBand(void *pvt, size_t first, size_t count)
+{
+  convertBandArgs_t *pArgs = (convertBandArgs_t *)pvt;
+
+  convertDimension(pArgs->pIn, pArgs->pOut, first, count);
+}
+
 /** Creates a new output NDArray from an input NDArray, performing
   * conversion operations.
   * This form of the function is for changing the data type only, not the dimensions,
@@ -609,9 +1708,13 @@ int NDArrayPool::convert(NDArray *pIn,
   NDDimension_t dimsOutCopy[ND_ARRAY_MAX_DIMS];
   int i;
   NDArray *pOut;
-  NDArrayInfo_t arrayInfo;
+  NDArrayInfo_t arrayInfo, arrayInfoIn;
   NDAttribute *pAttribute;
   int colorMode, colorModeMono = NDColorModeMono;
+  convertBandArgs_t bandArgs;
+  int numThreads;
+  epicsTimeStamp tStart, tEnd;
+  double convertTime;
   const char *functionName = "convert";
 
   /* Initialize failure */
@@ -643,6 +1746,8 @@ int NDArrayPool::convert(NDArray *pIn,
       (dimsOutCopy[i].binning != 1) ||
       (dimsOutCopy[i].reverse != 0)) dimsUnchanged = 0;
   }
+  /* The data of a view is not contiguous, so it is always copied row by row */
+  if (pIn->isView()) dimsUnchanged = 0;
 
   /* We now know the datatype and dimensions of the output array.
    * Allocate it */
@@ -663,58 +1768,44 @@ int NDArrayPool::convert(NDArray *pIn,
   pIn->pAttributeList->copy(pOut->pAttributeList);
 
   pOut->getInfo(&arrayInfo);
-
+  pIn->getInfo(&arrayInfoIn);
+
+  /* Large arrays are split into bands that are done in parallel if NDConvertNumThreads > 1 */
+  epicsTimeGetCurrent(&tStart);
+  numThreads = NDConvertGetNumThreads(arrayInfoIn.totalBytes);
+  bandArgs.pIn = pIn;
+  bandArgs.pOut = pOut;
+  bandArgs.convertFunc = NULL;
+  bandArgs.bytesIn = arrayInfoIn.bytesPerElement;
+  bandArgs.bytesOut = arrayInfo.bytesPerElement;
   if (dimsUnchanged) {
     if (pIn->dataType == pOut->dataType) {
       /* The dimensions are the same and the data type is the same,
        * then just copy the input image to the output image */
-      memcpy(pOut->pData, pIn->pData, arrayInfo.totalBytes);
-      return ND_SUCCESS;
+      NDConvertRunBands(convertElementsBand, &bandArgs, arrayInfo.nElements, numThreads);
     } else {
-      /* We need to convert data types */
-      switch(pOut->dataType) {
-        case NDInt8:
-          convertTypeSwitch <epicsInt8> (pIn, pOut);
-          break;
-        case NDUInt8:
-          convertTypeSwitch <epicsUInt8> (pIn, pOut);
-          break;
-        case NDInt16:
-          convertTypeSwitch <epicsInt16> (pIn, pOut);
-          break;
-        case NDUInt16:
-          convertTypeSwitch <epicsUInt16> (pIn, pOut);
-          break;
-        case NDInt32:
-          convertTypeSwitch <epicsInt32> (pIn, pOut);
-          break;
-        case NDUInt32:
-          convertTypeSwitch <epicsUInt32> (pIn, pOut);
-          break;
-        case NDInt64:
-          convertTypeSwitch <epicsInt64> (pIn, pOut);
-          break;
-        case NDUInt64:
-          convertTypeSwitch <epicsUInt64> (pIn, pOut);
-          break;
-        case NDFloat32:
-          convertTypeSwitch <epicsFloat32> (pIn, pOut);
-          break;
-        case NDFloat64:
-          convertTypeSwitch <epicsFloat64> (pIn, pOut);
-          break;
-        default:
-          //status = ND_ERROR;
-          break;
+      /* We need to convert data types, this uses SIMD instructions for the common type pairs */
+      bandArgs.convertFunc = NDConvertGetFunction(pIn->dataType, pOut->dataType);
+      if (bandArgs.convertFunc) {
+        NDConvertRunBands(convertElementsBand, &bandArgs, arrayInfo.nElements, numThreads);
       }
     }
   } else {
     /* The input and output dimensions are not the same, so we are extracting a region
-     * and/or binning */
-    /* Clear entire output array */
-    memset(pOut->pData, 0, arrayInfo.totalBytes);
-    convertDimension(pIn, pOut, pIn->pData, pOut->pData, pIn->ndims-1);
+     * and/or binning.  Each output row is written directly, so the output does not need to be cleared. */
+    NDConvertRunBands(convertRowsBand, &bandArgs, arrayInfo.nElements/pOut->dims[0].size, numThreads);
   }
+  epicsTimeGetCurrent(&tEnd);
+  convertTime = epicsTimeDiffInSeconds(&tEnd, &tStart);
+  epicsAtomicSetIntT(&convertThreads_, numThreads);
+  // Stored in microseconds, so that it can be set atomically without taking listLock_
+  epicsAtomicSetSizeT(&convertTimeUs_, (size_t)(convertTime * 1e6 + 0.5));
+  if (pDriver_) {
+    asynPrint(pDriver_->pasynUserSelf, ASYN_TRACEIO_DRIVER,
+      "%s:%s: converted %lu bytes in %.3f ms with %d threads\n",
+      driverName, functionName, (unsigned long)arrayInfoIn.totalBytes, convertTime*1000., numThreads);
+  }
+  if (dimsUnchanged && (pIn->dataType == pOut->dataType)) return ND_SUCCESS;
 
   /* Set fields in the output array */
   for (i=0; i<pIn->ndims; i++) {
@@ -739,7 +1830,7 @@ int NDArrayPool::convert(NDArray *pIn,
 /** Returns number of buffers this object has currently allocated */
 int NDArrayPool::getNumBuffers()
 {
-  return numBuffers_;
+  return epicsAtomicGetIntT(&numBuffers_);
 }
 
 /** Returns maximum bytes of memory this object is allowed to allocate; 0=unlimited */
@@ -751,16 +1842,223 @@ size_t NDArrayPool::getMaxMemory()
 /** Returns mumber of bytes of memory this object has currently allocated */
 size_t NDArrayPool::getMemorySize()
 {
-  return memorySize_;
+  return epicsAtomicGetSizeT(&memorySize_);
+}
+
+/** Returns the free list implementation this object was created with */
+NDArrayPoolMode_t NDArrayPool::getMode()
+{
+  return mode_;
 }
 
 /** Returns number of NDArray objects in the free list */
 int NDArrayPool::getNumFree()
 {
+  int numCached = epicsAtomicGetIntT(&numCached_);
+  if (mode_ == NDArrayPoolModeSizeClass) {
+    return epicsAtomicGetIntT(&numFree_) + numCached;
+  }
   epicsMutexLock(listLock_);
   int size = (int)freeList_.size();
   epicsMutexUnlock(listLock_);
-  return size;
+  return size + numCached;
+}
+
+/** Returns the maximum number of NDArrays in each thread cache; 0 if the caches are disabled */
+int NDArrayPool::getThreadCacheSize()
+{
+  return threadCacheSize_;
+}
+
+/** Returns the number of alloc() calls that were satisfied from a thread cache */
+size_t NDArrayPool::getCacheHits()
+{
+  return epicsAtomicGetSizeT(&cacheHits_);
+}
+
+/** Returns the number of alloc() calls that did not find an array in the thread cache
+  * and used the shared free list */
+size_t NDArrayPool::getCacheMisses()
+{
+  return epicsAtomicGetSizeT(&cacheMisses_);
+}
+
+/** Returns the time in seconds that the most recent convert() took to copy or convert the data */
+double NDArrayPool::getConvertTime()
+{
+  return epicsAtomicGetSizeT(&convertTimeUs_) * 1e-6;
+}
+
+/** Returns the number of threads that the most recent convert() used, see NDConvertNumThreads */
+int NDArrayPool::getConvertThreads()
+{
+  return epicsAtomicGetIntT(&convertThreads_);
+}
+
+/** Enables trimming of the free list by the "NDArrayPoolTrim" thread.
+  * This should be called once, before the pool is used.
+  * \param[in] highWater Percent of maxMemory above which free arrays are deleted; 0 disables this.
+  * Ignored if maxMemory is 0.
+  * \param[in] lowWater Percent of maxMemory that trimming stops at; if 0 or larger than highWater
+  * 90% of highWater is used.
+  * \param[in] maxAge Free arrays that have not been used for this many seconds are deleted; 0 disables this.
+  */
+void NDArrayPool::setTrimming(int highWater, int lowWater, double maxAge)
+{
+  if ((highWater <= 0) || (maxMemory_ == 0)) highWater = 0;
+  if ((lowWater <= 0) || (lowWater > highWater)) lowWater = highWater * 9 / 10;
+  if (maxAge < 0.) maxAge = 0.;
+  if (trimming_ || ((highWater == 0) && (maxAge == 0.))) return;
+  trimHighWaterBytes_ = (size_t)((double)maxMemory_ * highWater / 100.);
+  trimLowWaterBytes_ = (size_t)((double)maxMemory_ * lowWater / 100.);
+  trimMaxAge_ = maxAge;
+  trimming_ = true;
+  epicsThreadOnce(&trimOnceId, trimInit, NULL);
+  epicsMutexLock(trimPoolsLock);
+  pTrimPools->push_back(this);
+  epicsMutexUnlock(trimPoolsLock);
+}
+
+/** Removes arrays that are older than the maximum age and not of the active size from the thread caches.
+  * The memory and buffer counts are updated, the caller must delete the arrays.  listLock_ must be held.
+  */
+void NDArrayPool::trimThreadCaches(epicsTimeStamp *pNow, std::vector<NDArray *>& victims)
+{
+  NDArrayThreadCache *pCache;
+  NDArray *pArray;
+
+  if ((trimMaxAge_ <= 0.) || !threadCacheId_) return;
+  for (size_t i=0; i<threadCaches_.size(); i++) {
+    pCache = threadCaches_[i];
+    epicsMutexLock(pCache->lock);
+    for (size_t j=0; j<pCache->arrays.size(); ) {
+      pArray = pCache->arrays[j];
+      if (isActiveSize(pArray->dataSize) || (epicsTimeDiffInSeconds(pNow, &pArray->freeTime) <= trimMaxAge_)) {
+        j++;
+        continue;
+      }
+      pCache->arrays.erase(pCache->arrays.begin() + j);
+      epicsAtomicDecrIntT(&numCached_);
+      epicsAtomicSubSizeT(&memorySize_, pArray->dataSize);
+      epicsAtomicDecrIntT(&numBuffers_);
+      victims.push_back(pArray);
+    }
+    epicsMutexUnlock(pCache->lock);
+  }
+}
+
+/** Wakes up the "NDArrayPoolTrim" thread because the pool is above its high watermark */
+void NDArrayPool::wakeTrimTask()
+{
+  epicsEventSignal(trimEvent);
+}
+
+/** Returns true if alloc() would reuse a free array of dataSize bytes for the size that is currently being allocated */
+bool NDArrayPool::isActiveSize(size_t dataSize)
+{
+  size_t activeSize = epicsAtomicGetSizeT(&activeSize_);
+  return (activeSize > 0) && (dataSize >= activeSize) && (dataSize <= maxReuseSize(activeSize));
+}
+
+/** Deletes free arrays that are older than the maximum age, and least recently released free arrays
+  * while the pool uses more memory than the high watermark, until it is below the low watermark.
+  * Arrays of the active size are deleted last.  Old arrays in the thread caches are also deleted.
+  * This is called periodically by the "NDArrayPoolTrim" thread,
+  * and the arrays are deleted without holding the free list lock.
+  * Returns the number of arrays deleted.
+  */
+int NDArrayPool::trim()
+{
+  std::vector<NDArray *> victims;
+  epicsTimeStamp now;
+  NDArray *pArray;
+  int numDeleted = 0;
+  bool overHighWater;
+  size_t i;
+
+  if (!trimming_) return 0;
+  epicsTimeGetCurrent(&now);
+  overHighWater = trimHighWaterBytes_ && (getMemorySize() > trimHighWaterBytes_);
+
+  if (mode_ == NDArrayPoolModeSizeClass) {
+    // Each size class list is in the order the arrays were released, so the oldest is at the head.
+    // Larger classes are trimmed first because they free the most memory.
+    for (int pass=0; pass<2; pass++) {
+      for (int index=numSizeClasses_-1; index>=0; index--) {
+        NDArrayFreeRing *pList = sizeClassList(index, false);
+        if (!pList) continue;
+        for (size_t n=pList->size(); n>0; n--) {
+          // Look at the oldest array without removing it, pushing it back would move it to the tail
+          epicsTimeStamp freeTime;
+          size_t dataSize;
+          if (!pList->peek(&freeTime, &dataSize)) break;
+          bool active = isActiveSize(dataSize);
+          bool expired = (trimMaxAge_ > 0.) && !active &&
+                         (epicsTimeDiffInSeconds(&now, &freeTime) > trimMaxAge_);
+          bool needMemory = overHighWater && (getMemorySize() > trimLowWaterBytes_) &&
+                            (!active || (pass == 1));
+          // This one stays, and the rest of the list was released more recently
+          if (!expired && !needMemory) break;
+          pArray = popFreeArray(index, index);
+          if (!pArray) break;
+          if ((pArray->dataSize != dataSize) || !epicsTimeEqual(&pArray->freeTime, &freeTime)) {
+            // Another thread allocated the array that was looked at, and this one was released later.
+            // This is rare, it is left for the next trim().
+            pushFreeArray(pArray);
+            break;
+          }
+          deleteArray(pArray);
+          numDeleted++;
+        }
+      }
+      if (!overHighWater || (getMemorySize() <= trimLowWaterBytes_)) break;
+    }
+    if (overHighWater && (getMemorySize() > trimLowWaterBytes_) && epicsAtomicGetIntT(&numCached_)) {
+      // Trim the thread caches on the next pass
+      flushThreadCaches();
+    }
+    epicsMutexLock(listLock_);
+    trimThreadCaches(&now, victims);
+    epicsMutexUnlock(listLock_);
+    for (i=0; i<victims.size(); i++) {
+      delete victims[i];
+    }
+    return numDeleted + (int)victims.size();
+  }
+
+  epicsMutexLock(listLock_);
+  trimThreadCaches(&now, victims);
+  for (int pass=0; pass<2; pass++) {
+    std::vector<trimCandidate> candidates;
+    std::multiset<freeListElement>::iterator it;
+    for (it=freeList_.begin(); it!=freeList_.end(); ++it) {
+      trimCandidate candidate;
+      candidate.it = it;
+      candidate.active = isActiveSize(it->pArray_->dataSize);
+      candidate.age = epicsTimeDiffInSeconds(&now, &it->pArray_->freeTime);
+      candidates.push_back(candidate);
+    }
+    std::sort(candidates.begin(), candidates.end());
+    for (i=0; i<candidates.size(); i++) {
+      bool expired = (trimMaxAge_ > 0.) && !candidates[i].active && (candidates[i].age > trimMaxAge_);
+      bool needMemory = overHighWater && (memorySize_ > trimLowWaterBytes_);
+      if (!expired && !needMemory) continue;
+      pArray = candidates[i].it->pArray_;
+      freeList_.erase(candidates[i].it);
+      memorySize_ -= pArray->dataSize;
+      numBuffers_--;
+      victims.push_back(pArray);
+    }
+    // If that was not enough return the arrays in the thread caches to the free list and try again
+    if (!overHighWater || (memorySize_ <= trimLowWaterBytes_) || (epicsAtomicGetIntT(&numCached_) == 0)) break;
+    flushThreadCaches();
+  }
+  epicsMutexUnlock(listLock_);
+
+  for (i=0; i<victims.size(); i++) {
+    delete victims[i];
+  }
+  return (int)victims.size();
 }
 
 /** Deletes all of the NDArrays in the free list */
@@ -768,6 +2066,13 @@ void NDArrayPool::emptyFreeList()
 {
   NDArray *freeArray;
   std::multiset<freeListElement>::iterator it;
+  flushThreadCaches();
+  if (mode_ == NDArrayPoolModeSizeClass) {
+    while ((freeArray = popFreeArray(0, numSizeClasses_-1)) != NULL) {
+      deleteArray(freeArray);
+    }
+    return;
+  }
   epicsMutexLock(listLock_);
   while (!freeList_.empty()) {
     it = freeList_.begin();
@@ -790,9 +2095,38 @@ int NDArrayPool::report(FILE *fp, int details)
   fprintf(fp, "\n");
   fprintf(fp, "NDArrayPool:\n");
   fprintf(fp, "  numBuffers=%d, numFree=%d\n",
-         numBuffers_, this->getNumFree());
+         this->getNumBuffers(), this->getNumFree());
   fprintf(fp, "  memorySize=%ld, maxMemory=%ld\n",
-        (long)memorySize_, (long)maxMemory_);
+        (long)this->getMemorySize(), (long)maxMemory_);
+  if (numaNode_ >= 0) {
+    fprintf(fp, "  numaNode=%d\n", numaNode_);
+  }
+  if (trimming_) {
+    fprintf(fp, "  trimHighWater=%ld, trimLowWater=%ld, trimMaxAge=%g, activeSize=%ld\n",
+          (long)trimHighWaterBytes_, (long)trimLowWaterBytes_, trimMaxAge_,
+          (long)epicsAtomicGetSizeT(&activeSize_));
+  }
+  if (threadCacheId_) {
+    fprintf(fp, "  threadCacheSize=%d, threadCaches=%d, numCached=%d, cacheHits=%lu, cacheMisses=%lu\n",
+          threadCacheSize_, (int)threadCaches_.size(), epicsAtomicGetIntT(&numCached_),
+          (unsigned long)getCacheHits(), (unsigned long)getCacheMisses());
+  }
+  if (getConvertThreads() > 0) {
+    fprintf(fp, "  last convert: %.3f ms with %d threads\n", getConvertTime()*1000., getConvertThreads());
+  }
+  if (mode_ == NDArrayPoolModeSizeClass) {
+    fprintf(fp, "  mode=sizeClass, classesPerOctave=%d\n", classesPerOctave_);
+    if (details > 5) {
+      NDArrayFreeRing *pList;
+      fprintf(fp, "  sizeClasses: (index, classSize, numFree)\n");
+      for (int i=0; i<numSizeClasses_; i++) {
+        pList = sizeClassList(i, false);
+        if (!pList) continue;
+        fprintf(fp, "    %d %ld %d\n", i, (long)sizeClassSize(i), (int)pList->size());
+      }
+    }
+    return ND_SUCCESS;
+  }
   if (details > 5) {
     int i;
     std::multiset<freeListElement>::iterator it;
@@ -72,6 +72,8 @@ const char *NDAttribute::attrSourceString(NDAttrSource_t type)
     this->setValue(pValue);
   }
   this->listNode_.pNDAttribute = this;
+  this->pHashNext_ = 0;
+  this->nameHash_ = 0;
 }
 
 /** NDAttribute copy constructor
@@ -91,6 +93,8 @@ NDAttribute::NDAttribute(NDAttribute& attribute)
   else pValue = &attribute.value_;
   this->setValue(pValue);
   this->listNode_.pNDAttribute = this;
+  this->pHashNext_ = 0;
+  this->nameHash_ = 0;
 }
 
 
@@ -130,6 +130,8 @@ private:
     NDAttrSource_t sourceType_;     /**< Source type */
     std::string sourceTypeString_;  /**< Source type string */
     NDAttributeListNode listNode_;  /**< Used for NDAttributeList */
+    NDAttribute *pHashNext_;        /**< Next attribute in the same bucket of the NDAttributeList name index */
+    size_t nameHash_;               /**< Hash of name_, set by NDAttributeList */
 };
 
 #endif
@@ -11,10 +11,18 @@
 #include "NDAttributeList.h"
 
 /** NDAttributeList constructor
+  * \param[in] keepSpares If true clear() keeps the attributes that it removes, and copy() reuses them
+  * for attributes with the same name, so that a list that is cleared and copied again for each NDArray
+  * does not allocate attributes.  This is used for the attribute lists of NDArrays, whose attributes are
+  * copies that hold no resources, and must not be used for lists of PVAttributes, which would stay connected.
   */
-NDAttributeList::NDAttributeList()
+NDAttributeList::NDAttributeList(bool keepSpares)
+  : keepSpares_(keepSpares)
 {
   ellInit(&this->list_);
+  ellInit(&this->spares_);
+  this->index_.count = 0;
+  this->spareIndex_.count = 0;
   this->lock_ = epicsMutexCreate();
 }
 
@@ -23,10 +31,93 @@ NDAttributeList::NDAttributeList()
 NDAttributeList::~NDAttributeList()
 {
   this->clear();
+  this->deleteSpares();
   ellFree(&this->list_);
   epicsMutexDestroy(this->lock_);
 }
 
+/** Returns the FNV-1a hash of an attribute name */
+size_t NDAttributeList::hashName(const char *pName)
+{
+  epicsUInt32 hash = 2166136261u;
+
+  for (const unsigned char *p = (const unsigned char *)pName; *p; p++) {
+    hash ^= *p;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+/** Finds an attribute in a hash index.
+  * \param[in] pIndex The index.
+  * \param[in] pName The name of the attribute.
+  * \param[in] hash The hash of pName from hashName().
+  * \return Returns a pointer to the attribute if found, NULL if not found. */
+NDAttribute* NDAttributeList::indexFind(NDAttributeIndex_t *pIndex, const char *pName, size_t hash)
+{
+  NDAttribute *pAttribute;
+
+  if (pIndex->buckets.empty()) return NULL;
+  pAttribute = pIndex->buckets[hash & (pIndex->buckets.size() - 1)];
+  while (pAttribute) {
+    if ((pAttribute->nameHash_ == hash) && (pAttribute->name_ == pName)) return pAttribute;
+    pAttribute = pAttribute->pHashNext_;
+  }
+  return NULL;
+}
+
+/** Adds an attribute to a hash index, which doubles the number of buckets when it has as many attributes
+  * as buckets.  There must not be an attribute with the same name in the index. */
+void NDAttributeList::indexAdd(NDAttributeIndex_t *pIndex, NDAttribute *pAttribute)
+{
+  size_t i, bucket, numBuckets = pIndex->buckets.size();
+  NDAttribute *pNext;
+
+  if ((size_t)pIndex->count >= numBuckets) {
+    /* Rehash the chains into twice as many buckets */
+    std::vector<NDAttribute *> buckets(numBuckets ? 2*numBuckets : 16, (NDAttribute *)NULL);
+    for (i=0; i<numBuckets; i++) {
+      for (NDAttribute *pAttr = pIndex->buckets[i]; pAttr; pAttr = pNext) {
+        pNext = pAttr->pHashNext_;
+        bucket = pAttr->nameHash_ & (buckets.size() - 1);
+        pAttr->pHashNext_ = buckets[bucket];
+        buckets[bucket] = pAttr;
+      }
+    }
+    pIndex->buckets.swap(buckets);
+  }
+  pAttribute->nameHash_ = hashName(pAttribute->name_.c_str());
+  bucket = pAttribute->nameHash_ & (pIndex->buckets.size() - 1);
+  pAttribute->pHashNext_ = pIndex->buckets[bucket];
+  pIndex->buckets[bucket] = pAttribute;
+  pIndex->count++;
+}
+
+/** Removes an attribute from a hash index */
+void NDAttributeList::indexRemove(NDAttributeIndex_t *pIndex, NDAttribute *pAttribute)
+{
+  NDAttribute **ppAttr;
+
+  if (pIndex->buckets.empty()) return;
+  ppAttr = &pIndex->buckets[pAttribute->nameHash_ & (pIndex->buckets.size() - 1)];
+  while (*ppAttr) {
+    if (*ppAttr == pAttribute) {
+      *ppAttr = pAttribute->pHashNext_;
+      pAttribute->pHashNext_ = NULL;
+      pIndex->count--;
+      return;
+    }
+    ppAttr = &(*ppAttr)->pHashNext_;
+  }
+}
+
+/** Removes all attributes from a hash index; the buckets are kept */
+void NDAttributeList::indexClear(NDAttributeIndex_t *pIndex)
+{
+  for (size_t i=0; i<pIndex->buckets.size(); i++) pIndex->buckets[i] = NULL;
+  pIndex->count = 0;
+}
+
 /** Adds an attribute to the list.
   * If an attribute of the same name already exists then
   * the existing attribute is deleted and replaced with the new one.
@@ -40,6 +131,7 @@ int NDAttributeList::add(NDAttribute *pAttribute)
   /* Remove any existing attribute with this name */
   this->remove(pAttribute->name_.c_str());
   ellAdd(&this->list_, &pAttribute->listNode_.node);
+  indexAdd(&this->index_, pAttribute);
   epicsMutexUnlock(this->lock_);
   return(ND_SUCCESS);
 }
@@ -72,6 +164,7 @@ NDAttribute* NDAttributeList::add(const char *pName, const char *pDescription, N
   } else {
     pAttribute = new NDAttribute(pName, pDescription, NDAttrSourceDriver, "Driver", dataType, pValue);
     ellAdd(&this->list_, &pAttribute->listNode_.node);
+    indexAdd(&this->index_, pAttribute);
   }
   epicsMutexUnlock(this->lock_);
   return(pAttribute);
@@ -80,25 +173,17 @@ NDAttribute* NDAttributeList::add(const char *pName, const char *pDescription, N
 
 
 /** Finds an attribute by name; the search is now case sensitive (R1-10)
+  * It uses the hash index, so the time does not depend on the number of attributes.
   * \param[in] pName The name of the attribute to be found.
   * \return Returns a pointer to the attribute if found, NULL if not found.
   */
 NDAttribute* NDAttributeList::find(const char *pName)
 {
   NDAttribute *pAttribute;
-  NDAttributeListNode *pListNode;
   //const char *functionName = "NDAttributeList::find";
 
   epicsMutexLock(this->lock_);
-  pListNode = (NDAttributeListNode *)ellFirst(&this->list_);
-  while (pListNode) {
-    pAttribute = pListNode->pNDAttribute;
-    if (pAttribute->name_ == pName) goto done;
-    pListNode = (NDAttributeListNode *)ellNext(&pListNode->node);
-  }
-  pAttribute = NULL;
-
-  done:
+  pAttribute = indexFind(&this->index_, pName, hashName(pName));
   epicsMutexUnlock(this->lock_);
   return(pAttribute);
 }
@@ -149,6 +234,7 @@ int NDAttributeList::remove(const char *pName)
   pAttribute = this->find(pName);
   if (!pAttribute) goto done;
   ellDelete(&this->list_, &pAttribute->listNode_.node);
+  indexRemove(&this->index_, pAttribute);
   delete pAttribute;
   status = ND_SUCCESS;
 
@@ -157,7 +243,9 @@ int NDAttributeList::remove(const char *pName)
   return(status);
 }
 
-/** Deletes all attributes from the list. */
+/** Deletes all attributes from the list.
+  * If the list was created with keepSpares=true the attributes are kept as spares for the next copy() instead,
+  * and the spares that the last copy() did not reuse are deleted. */
 int NDAttributeList::clear()
 {
   NDAttribute *pAttribute;
@@ -165,6 +253,16 @@ int NDAttributeList::clear()
   //const char *functionName = "NDAttributeList::clear";
 
   epicsMutexLock(this->lock_);
+  if (this->keepSpares_) {
+    this->deleteSpares();
+    /* The spare index is empty, so swapping the indexes does not allocate */
+    this->index_.buckets.swap(this->spareIndex_.buckets);
+    this->spareIndex_.count = this->index_.count;
+    this->index_.count = 0;
+    ellConcat(&this->spares_, &this->list_);
+    epicsMutexUnlock(this->lock_);
+    return(ND_SUCCESS);
+  }
   pListNode = (NDAttributeListNode *)ellFirst(&this->list_);
   while (pListNode) {
     pAttribute = pListNode->pNDAttribute;
@@ -172,13 +270,54 @@ int NDAttributeList::clear()
     delete pAttribute;
     pListNode = (NDAttributeListNode *)ellFirst(&this->list_);
   }
+  indexClear(&this->index_);
   epicsMutexUnlock(this->lock_);
   return(ND_SUCCESS);
 }
 
+/** Deletes the spare attributes kept by clear().  This is called with the lock held. */
+void NDAttributeList::deleteSpares()
+{
+  NDAttributeListNode *pListNode;
+
+  while ((pListNode = (NDAttributeListNode *)ellFirst(&this->spares_))) {
+    ellDelete(&this->spares_, &pListNode->node);
+    delete pListNode->pNDAttribute;
+  }
+  indexClear(&this->spareIndex_);
+}
+
+/** Removes the spare attribute with the name and data type of an attribute from the spares.
+  * A spare with the same name but another data type is deleted, because NDAttribute::copy() does not change
+  * the data type of an existing attribute.  NDAttribute::copy() only copies the value to an existing attribute,
+  * so the description and source of the spare are set here.  This is called with the lock held.
+  * \param[in] pAttribute The attribute that will be copied.
+  * \return Returns the spare attribute, or NULL if there is none. */
+NDAttribute* NDAttributeList::takeSpare(NDAttribute *pAttribute)
+{
+  NDAttribute *pSpare;
+
+  if (this->spareIndex_.count == 0) return NULL;
+  pSpare = indexFind(&this->spareIndex_, pAttribute->name_.c_str(), pAttribute->nameHash_);
+  if (!pSpare) return NULL;
+  ellDelete(&this->spares_, &pSpare->listNode_.node);
+  indexRemove(&this->spareIndex_, pSpare);
+  if (pSpare->dataType_ != pAttribute->dataType_) {
+    delete pSpare;
+    return NULL;
+  }
+  pSpare->description_ = pAttribute->description_;
+  pSpare->source_ = pAttribute->source_;
+  pSpare->sourceType_ = pAttribute->sourceType_;
+  pSpare->sourceTypeString_ = pAttribute->sourceTypeString_;
+  return pSpare;
+}
+
 /** Copies all attributes from one attribute list to another.
   * It is efficient so that if the attribute already exists in the output
   * list it just copies the properties, and memory allocation is minimized.
+  * If the output list is empty the attributes are copied into its spares, if it has any,
+  * without looking them up in the output list.
   * The attributes are added to any existing attributes already present in the output list.
   * \param[out] pListOut A pointer to the output attribute list to copy to.
   */
@@ -186,20 +325,38 @@ int NDAttributeList::copy(NDAttributeList *pListOut)
 {
   NDAttribute *pAttrIn, *pAttrOut, *pFound;
   NDAttributeListNode *pListNode;
+  bool outEmpty;
   //const char *functionName = "NDAttributeList::copy";
 
-  epicsMutexLock(this->lock_);
+  /* Lock the lists in order of address, so that copies in both directions cannot deadlock */
+  if (this < pListOut) {
+    epicsMutexLock(this->lock_);
+    epicsMutexLock(pListOut->lock_);
+  } else {
+    epicsMutexLock(pListOut->lock_);
+    epicsMutexLock(this->lock_);
+  }
+  outEmpty = (ellCount(&pListOut->list_) == 0);
   pListNode = (NDAttributeListNode *)ellFirst(&this->list_);
   while (pListNode) {
     pAttrIn = pListNode->pNDAttribute;
-    /* See if there is already an attribute of this name in the output list */
-    pFound = pListOut->find(pAttrIn->name_.c_str());
+    if (outEmpty) {
+      /* The names in this list are unique, so the attribute cannot be in the output list yet */
+      pFound = pListOut->takeSpare(pAttrIn);
+    } else {
+      /* See if there is already an attribute of this name in the output list */
+      pFound = indexFind(&pListOut->index_, pAttrIn->name_.c_str(), pAttrIn->nameHash_);
+    }
     /* The copy function will copy the properties, and will create the attribute if pFound is NULL */
     pAttrOut = pAttrIn->copy(pFound);
-    /* If pFound is NULL, then a copy created a new attribute, need to add it to the list */
-    if (!pFound) pListOut->add(pAttrOut);
+    /* If the attribute is not in the output list add it */
+    if (outEmpty || !pFound) {
+      ellAdd(&pListOut->list_, &pAttrOut->listNode_.node);
+      indexAdd(&pListOut->index_, pAttrOut);
+    }
     pListNode = (NDAttributeListNode *)ellNext(&pListNode->node);
   }
+  epicsMutexUnlock(pListOut->lock_);
   epicsMutexUnlock(this->lock_);
   return(ND_SUCCESS);
 }
@@ -10,17 +10,24 @@
 #define NDAttributeList_H
 
 #include <stdio.h>
+#include <vector>
 #include <ellLib.h>
 #include <epicsMutex.h>
 
 #include "NDAttribute.h"
 
 
-/** NDAttributeList class; this is a linked list of attributes.
+/** Hash index of attributes by name; the attributes in a bucket are chained through NDAttribute::pHashNext_ */
+typedef struct NDAttributeIndex {
+    std::vector<NDAttribute *> buckets;  /**< Number of buckets is 0 or a power of 2 */
+    int count;                           /**< Number of attributes in the index */
+} NDAttributeIndex_t;
+
+/** NDAttributeList class; this is a linked list of attributes, with a hash index for finding them by name.
   */
 class ADCORE_API NDAttributeList {
 public:
-    NDAttributeList();
+    NDAttributeList(bool keepSpares=false);
     ~NDAttributeList();
     int          add(NDAttribute *pAttribute);
     NDAttribute* add(const char *pName, const char *pDescription="",
@@ -35,8 +42,20 @@ public:
     int          report(FILE *fp, int details);
 
 private:
+    NDAttribute* takeSpare(NDAttribute *pAttribute);
+    void         deleteSpares();
+    static size_t       hashName(const char *pName);
+    static NDAttribute* indexFind(NDAttributeIndex_t *pIndex, const char *pName, size_t hash);
+    static void         indexAdd(NDAttributeIndex_t *pIndex, NDAttribute *pAttribute);
+    static void         indexRemove(NDAttributeIndex_t *pIndex, NDAttribute *pAttribute);
+    static void         indexClear(NDAttributeIndex_t *pIndex);
+
     ELLLIST      list_;   /**< The EPICS ELLLIST  */
     epicsMutexId lock_;  /**< Mutex to protect the ELLLIST */
+    NDAttributeIndex_t index_;       /**< Index of the attributes in list_ */
+    bool         keepSpares_;        /**< If true clear() keeps the attributes in spares_ for copy() */
+    ELLLIST      spares_;            /**< Attributes removed by the last clear() */
+    NDAttributeIndex_t spareIndex_;  /**< Index of the attributes in spares_ */
 };
 
 #endif
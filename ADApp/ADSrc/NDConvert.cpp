@@ -0,0 +1,719 @@
+/** NDConvert.cpp
+ *
+ * Data type conversion kernels for NDArrayPool::convert().
+ *
+ * Every pair of data types has a scalar kernel.  The pairs that plugins use most on large frames
+ * (UInt16 to Float64, UInt16 to UInt8, Float64 to UInt16, etc.) also have SSE4.1, AVX2 and AVX-512 kernels.
+ * They are compiled with GCC/Clang target attributes, so the rest of ADCore does not need any special
+ * compiler flags, and the best kernel that the CPU supports is selected at run time.
+ * The vector kernels give exactly the same results as the scalar casts: integer conversions keep the low bits
+ * and floating point to integer conversions truncate toward zero.  Like the scalar cast, the result of converting
+ * a floating point value that is outside the range of the output type is not defined.
+ *
+ */
+
+#include <string.h>
+
+#include <epicsTypes.h>
+#include <epicsThread.h>
+#include <epicsMutex.h>
+#include <epicsEvent.h>
+#include <epicsAtomic.h>
+#include <epicsMessageQueue.h>
+#include <epicsStdio.h>
+
+#include <epicsExport.h>
+
+#include "NDConvert.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    ((defined(__GNUC__) && (__GNUC__ >= 5)) || defined(__clang__))
+#define ND_CONVERT_HAVE_X86
+#include <immintrin.h>
+#define TARGET_SSE41  __attribute__((target("sse4.1")))
+#define TARGET_AVX2   __attribute__((target("avx2")))
+#define TARGET_AVX512 __attribute__((target("avx512f,avx512bw")))
+#endif
+
+#define ND_NUM_DATA_TYPES (NDFloat64+1)
+
+/** NDConvertMaxSIMD limits the instruction set that the conversion kernels use,
+  * e.g. 0 to use only the scalar kernels.  The default of -1 uses the best that the CPU supports.
+  */
+volatile int NDConvertMaxSIMD=-1;
+extern "C" {epicsExportAddress(int, NDConvertMaxSIMD);}
+
+/** NDConvertNumThreads is the number of threads, including the calling thread, that NDArrayPool::convert()
+  * uses for arrays of at least NDConvertParallelMinBytes bytes of input data.
+  * The default of 1 does all conversions in the calling thread.  The other threads are shared by all pools
+  * and are created when they are first needed.
+  */
+volatile int NDConvertNumThreads=1;
+volatile int NDConvertParallelMinBytes=32*1024*1024;
+extern "C" {epicsExportAddress(int, NDConvertNumThreads);}
+extern "C" {epicsExportAddress(int, NDConvertParallelMinBytes);}
+
+// Maximum number of threads that NDConvertRunBands() uses
+#define MAX_CONVERT_THREADS 64
+// Number of bands per thread, more than 1 balances the load when threads are also busy with other arrays
+#define BANDS_PER_THREAD 4
+// Maximum number of jobs waiting for the worker threads
+#define CONVERT_QUEUE_SIZE 256
+
+static NDConvertFunc_t convertFunctions[ND_CONVERT_NUM_SIMD][ND_NUM_DATA_TYPES][ND_NUM_DATA_TYPES];
+static NDConvertSIMD_t supportedSIMD = NDConvertScalar;
+static epicsThreadOnceId convertOnceId = EPICS_THREAD_ONCE_INIT;
+
+template <typename dataTypeIn, typename dataTypeOut>
+static void convertScalar(const void *pIn, void *pOut, size_t nElements)
+{
+  const dataTypeIn *pDataIn = (const dataTypeIn *)pIn;
+  dataTypeOut *pDataOut = (dataTypeOut *)pOut;
+  size_t i;
+
+  for (i=0; i<nElements; i++) {
+    pDataOut[i] = (dataTypeOut)pDataIn[i];
+  }
+}
+
+template <typename dataTypeIn>
+static void setScalarFunctions(NDDataType_t typeIn)
+{
+  NDConvertFunc_t *pFuncs = convertFunctions[NDConvertScalar][typeIn];
+  pFuncs[NDInt8]    = convertScalar<dataTypeIn, epicsInt8>;
+  pFuncs[NDUInt8]   = convertScalar<dataTypeIn, epicsUInt8>;
+  pFuncs[NDInt16]   = convertScalar<dataTypeIn, epicsInt16>;
+  pFuncs[NDUInt16]  = convertScalar<dataTypeIn, epicsUInt16>;
+  pFuncs[NDInt32]   = convertScalar<dataTypeIn, epicsInt32>;
+  pFuncs[NDUInt32]  = convertScalar<dataTypeIn, epicsUInt32>;
+  pFuncs[NDInt64]   = convertScalar<dataTypeIn, epicsInt64>;
+  pFuncs[NDUInt64]  = convertScalar<dataTypeIn, epicsUInt64>;
+  pFuncs[NDFloat32] = convertScalar<dataTypeIn, epicsFloat32>;
+  pFuncs[NDFloat64] = convertScalar<dataTypeIn, epicsFloat64>;
+}
+
+#ifdef ND_CONVERT_HAVE_X86
+
+/* SSE4.1 kernels.  Each loop converts a full vector, the remaining elements use the scalar cast. */
+
+TARGET_SSE41 static void convertUInt8ToUInt16SSE41(const void *pIn, void *pOut, size_t n)
+{
+  const epicsUInt8 *in = (const epicsUInt8 *)pIn;
+  epicsUInt16 *out = (epicsUInt16 *)pOut;
+  size_t i = 0;
+  for (; i+8<=n; i+=8) {
+    __m128i v = _mm_loadl_epi64((const __m128i *)(in+i));
+    _mm_storeu_si128((__m128i *)(out+i), _mm_cvtepu8_epi16(v));
+  }
+  convertScalar<epicsUInt8, epicsUInt16>(in+i, out+i, n-i);
+}
+
+TARGET_SSE41 static void convertUInt8ToFloat32SSE41(const void *pIn, void *pOut, size_t n)
+{
+  const epicsUInt8 *in = (const epicsUInt8 *)pIn;
+  epicsFloat32 *out = (epicsFloat32 *)pOut;
+  size_t i = 0;
+  for (; i+8<=n; i+=8) {
+    __m128i v = _mm_loadl_epi64((const __m128i *)(in+i));
+    _mm_storeu_ps(out+i,   _mm_cvtepi32_ps(_mm_cvtepu8_epi32(v)));
+    _mm_storeu_ps(out+i+4, _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_srli_si128(v, 4))));
+  }
+  convertScalar<epicsUInt8, epicsFloat32>(in+i, out+i, n-i);
+}
+
+TARGET_SSE41 static void convertUInt16ToUInt8SSE41(const void *pIn, void *pOut, size_t n)
+{
+  const epicsUInt16 *in = (const epicsUInt16 *)pIn;
+  epicsUInt8 *out = (epicsUInt8 *)pOut;
+  const __m128i mask = _mm_set1_epi16(0xFF);
+  size_t i = 0;
+  for (; i+16<=n; i+=16) {
+    __m128i a = _mm_and_si128(_mm_loadu_si128((const __m128i *)(in+i)), mask);
+    __m128i b = _mm_and_si128(_mm_loadu_si128((const __m128i *)(in+i+8)), mask);
+    _mm_storeu_si128((__m128i *)(out+i), _mm_packus_epi16(a, b));
+  }
+  convertScalar<epicsUInt16, epicsUInt8>(in+i, out+i, n-i);
+}
+
+TARGET_SSE41 static void convertUInt16ToInt32SSE41(const void *pIn, void *pOut, size_t n)
+{
+  const epicsUInt16 *in = (const epicsUInt16 *)pIn;
+  epicsInt32 *out = (epicsInt32 *)pOut;
+  size_t i = 0;
+  for (; i+8<=n; i+=8) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(in+i));
+    _mm_storeu_si128((__m128i *)(out+i),   _mm_cvtepu16_epi32(v));
+    _mm_storeu_si128((__m128i *)(out+i+4), _mm_cvtepu16_epi32(_mm_srli_si128(v, 8)));
+  }
+  convertScalar<epicsUInt16, epicsInt32>(in+i, out+i, n-i);
+}
+
+TARGET_SSE41 static void convertUInt16ToFloat32SSE41(const void *pIn, void *pOut, size_t n)
+{
+  const epicsUInt16 *in = (const epicsUInt16 *)pIn;
+  epicsFloat32 *out = (epicsFloat32 *)pOut;
+  size_t i = 0;
+  for (; i+8<=n; i+=8) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(in+i));
+    _mm_storeu_ps(out+i,   _mm_cvtepi32_ps(_mm_cvtepu16_epi32(v)));
+    _mm_storeu_ps(out+i+4, _mm_cvtepi32_ps(_mm_cvtepu16_epi32(_mm_srli_si128(v, 8))));
+  }
+  convertScalar<epicsUInt16, epicsFloat32>(in+i, out+i, n-i);
+}
+
+TARGET_SSE41 static void convertUInt16ToFloat64SSE41(const void *pIn, void *pOut, size_t n)
+{
+  const epicsUInt16 *in = (const epicsUInt16 *)pIn;
+  epicsFloat64 *out = (epicsFloat64 *)pOut;
+  size_t i = 0;
+  for (; i+4<=n; i+=4) {
+    __m128i v = _mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i *)(in+i)));
+    _mm_storeu_pd(out+i,   _mm_cvtepi32_pd(v));
+    _mm_storeu_pd(out+i+2, _mm_cvtepi32_pd(_mm_srli_si128(v, 8)));
+  }
+  convertScalar<epicsUInt16, epicsFloat64>(in+i, out+i, n-i);
+}
+
+TARGET_SSE41 static void convertInt16ToFloat32SSE41(const void *pIn, void *pOut, size_t n)
+{
+  const epicsInt16 *in = (const epicsInt16 *)pIn;
+  epicsFloat32 *out = (epicsFloat32 *)pOut;
+  size_t i = 0;
+  for (; i+8<=n; i+=8) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(in+i));
+    _mm_storeu_ps(out+i,   _mm_cvtepi32_ps(_mm_cvtepi16_epi32(v)));
+    _mm_storeu_ps(out+i+4, _mm_cvtepi32_ps(_mm_cvtepi16_epi32(_mm_srli_si128(v, 8))));
+  }
+  convertScalar<epicsInt16, epicsFloat32>(in+i, out+i, n-i);
+}
+
+TARGET_SSE41 static void convertInt16ToFloat64SSE41(const void *pIn, void *pOut, size_t n)
+{
+  const epicsInt16 *in = (const epicsInt16 *)pIn;
+  epicsFloat64 *out = (epicsFloat64 *)pOut;
+  size_t i = 0;
+  for (; i+4<=n; i+=4) {
+    __m128i v = _mm_cvtepi16_epi32(_mm_loadl_epi64((const __m128i *)(in+i)));
+    _mm_storeu_pd(out+i,   _mm_cvtepi32_pd(v));
+    _mm_storeu_pd(out+i+2, _mm_cvtepi32_pd(_mm_srli_si128(v, 8)));
+  }
+  convertScalar<epicsInt16, epicsFloat64>(in+i, out+i, n-i);
+}
+
+TARGET_SSE41 static void convertFloat32ToUInt16SSE41(const void *pIn, void *pOut, size_t n)
+{
+  const epicsFloat32 *in = (const epicsFloat32 *)pIn;
+  epicsUInt16 *out = (epicsUInt16 *)pOut;
+  const __m128i mask = _mm_set1_epi32(0xFFFF);
+  size_t i = 0;
+  for (; i+8<=n; i+=8) {
+    __m128i a = _mm_and_si128(_mm_cvttps_epi32(_mm_loadu_ps(in+i)), mask);
+    __m128i b = _mm_and_si128(_mm_cvttps_epi32(_mm_loadu_ps(in+i+4)), mask);
+    _mm_storeu_si128((__m128i *)(out+i), _mm_packus_epi32(a, b));
+  }
+  convertScalar<epicsFloat32, epicsUInt16>(in+i, out+i, n-i);
+}
+
+TARGET_SSE41 static void convertFloat64ToUInt16SSE41(const void *pIn, void *pOut, size_t n)
+{
+  const epicsFloat64 *in = (const epicsFloat64 *)pIn;
+  epicsUInt16 *out = (epicsUInt16 *)pOut;
+  const __m128i mask = _mm_set1_epi32(0xFFFF);
+  size_t i = 0;
+  for (; i+8<=n; i+=8) {
+    __m128i a = _mm_unpacklo_epi64(_mm_cvttpd_epi32(_mm_loadu_pd(in+i)),   _mm_cvttpd_epi32(_mm_loadu_pd(in+i+2)));
+    __m128i b = _mm_unpacklo_epi64(_mm_cvttpd_epi32(_mm_loadu_pd(in+i+4)), _mm_cvttpd_epi32(_mm_loadu_pd(in+i+6)));
+    _mm_storeu_si128((__m128i *)(out+i), _mm_packus_epi32(_mm_and_si128(a, mask), _mm_and_si128(b, mask)));
+  }
+  convertScalar<epicsFloat64, epicsUInt16>(in+i, out+i, n-i);
+}
+
+TARGET_SSE41 static void convertFloat32ToFloat64SSE41(const void *pIn, void *pOut, size_t n)
+{
+  const epicsFloat32 *in = (const epicsFloat32 *)pIn;
+  epicsFloat64 *out = (epicsFloat64 *)pOut;
+  size_t i = 0;
+  for (; i+4<=n; i+=4) {
+    __m128 v = _mm_loadu_ps(in+i);
+    _mm_storeu_pd(out+i,   _mm_cvtps_pd(v));
+    _mm_storeu_pd(out+i+2, _mm_cvtps_pd(_mm_movehl_ps(v, v)));
+  }
+  convertScalar<epicsFloat32, epicsFloat64>(in+i, out+i, n-i);
+}
+
+TARGET_SSE41 static void convertFloat64ToFloat32SSE41(const void *pIn, void *pOut, size_t n)
+{
+  const epicsFloat64 *in = (const epicsFloat64 *)pIn;
+  epicsFloat32 *out = (epicsFloat32 *)pOut;
+  size_t i = 0;
+  for (; i+4<=n; i+=4) {
+    __m128 a = _mm_cvtpd_ps(_mm_loadu_pd(in+i));
+    __m128 b = _mm_cvtpd_ps(_mm_loadu_pd(in+i+2));
+    _mm_storeu_ps(out+i, _mm_movelh_ps(a, b));
+  }
+  convertScalar<epicsFloat64, epicsFloat32>(in+i, out+i, n-i);
+}
+
+/* AVX2 kernels */
+
+TARGET_AVX2 static void convertUInt8ToUInt16AVX2(const void *pIn, void *pOut, size_t n)
+{
+  const epicsUInt8 *in = (const epicsUInt8 *)pIn;
+  epicsUInt16 *out = (epicsUInt16 *)pOut;
+  size_t i = 0;
+  for (; i+16<=n; i+=16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(in+i));
+    _mm256_storeu_si256((__m256i *)(out+i), _mm256_cvtepu8_epi16(v));
+  }
+  convertScalar<epicsUInt8, epicsUInt16>(in+i, out+i, n-i);
+}
+
+TARGET_AVX2 static void convertUInt8ToFloat32AVX2(const void *pIn, void *pOut, size_t n)
+{
+  const epicsUInt8 *in = (const epicsUInt8 *)pIn;
+  epicsFloat32 *out = (epicsFloat32 *)pOut;
+  size_t i = 0;
+  for (; i+8<=n; i+=8) {
+    __m128i v = _mm_loadl_epi64((const __m128i *)(in+i));
+    _mm256_storeu_ps(out+i, _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(v)));
+  }
+  convertScalar<epicsUInt8, epicsFloat32>(in+i, out+i, n-i);
+}
+
+TARGET_AVX2 static void convertUInt16ToUInt8AVX2(const void *pIn, void *pOut, size_t n)
+{
+  const epicsUInt16 *in = (const epicsUInt16 *)pIn;
+  epicsUInt8 *out = (epicsUInt8 *)pOut;
+  const __m256i mask = _mm256_set1_epi16(0xFF);
+  size_t i = 0;
+  for (; i+32<=n; i+=32) {
+    __m256i a = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(in+i)), mask);
+    __m256i b = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(in+i+16)), mask);
+    // packus works within 128 bit lanes, the permute puts the 64 bit blocks back in order
+    _mm256_storeu_si256((__m256i *)(out+i), _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xD8));
+  }
+  convertScalar<epicsUInt16, epicsUInt8>(in+i, out+i, n-i);
+}
+
+TARGET_AVX2 static void convertUInt16ToInt32AVX2(const void *pIn, void *pOut, size_t n)
+{
+  const epicsUInt16 *in = (const epicsUInt16 *)pIn;
+  epicsInt32 *out = (epicsInt32 *)pOut;
+  size_t i = 0;
+  for (; i+8<=n; i+=8) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(in+i));
+    _mm256_storeu_si256((__m256i *)(out+i), _mm256_cvtepu16_epi32(v));
+  }
+  convertScalar<epicsUInt16, epicsInt32>(in+i, out+i, n-i);
+}
+
+TARGET_AVX2 static void convertUInt16ToFloat32AVX2(const void *pIn, void *pOut, size_t n)
+{
+  const epicsUInt16 *in = (const epicsUInt16 *)pIn;
+  epicsFloat32 *out = (epicsFloat32 *)pOut;
+  size_t i = 0;
+  for (; i+8<=n; i+=8) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(in+i));
+    _mm256_storeu_ps(out+i, _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(v)));
+  }
+  convertScalar<epicsUInt16, epicsFloat32>(in+i, out+i, n-i);
+}
+
+TARGET_AVX2 static void convertUInt16ToFloat64AVX2(const void *pIn, void *pOut, size_t n)
+{
+  const epicsUInt16 *in = (const epicsUInt16 *)pIn;
+  epicsFloat64 *out = (epicsFloat64 *)pOut;
+  size_t i = 0;
+  for (; i+8<=n; i+=8) {
+    __m256i v = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(in+i)));
+    _mm256_storeu_pd(out+i,   _mm256_cvtepi32_pd(_mm256_castsi256_si128(v)));
+    _mm256_storeu_pd(out+i+4, _mm256_cvtepi32_pd(_mm256_extracti128_si256(v, 1)));
+  }
+  convertScalar<epicsUInt16, epicsFloat64>(in+i, out+i, n-i);
+}
+
+TARGET_AVX2 static void convertInt16ToFloat32AVX2(const void *pIn, void *pOut, size_t n)
+{
+  const epicsInt16 *in = (const epicsInt16 *)pIn;
+  epicsFloat32 *out = (epicsFloat32 *)pOut;
+  size_t i = 0;
+  for (; i+8<=n; i+=8) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(in+i));
+    _mm256_storeu_ps(out+i, _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(v)));
+  }
+  convertScalar<epicsInt16, epicsFloat32>(in+i, out+i, n-i);
+}
+
+TARGET_AVX2 static void convertInt16ToFloat64AVX2(const void *pIn, void *pOut, size_t n)
+{
+  const epicsInt16 *in = (const epicsInt16 *)pIn;
+  epicsFloat64 *out = (epicsFloat64 *)pOut;
+  size_t i = 0;
+  for (; i+8<=n; i+=8) {
+    __m256i v = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(in+i)));
+    _mm256_storeu_pd(out+i,   _mm256_cvtepi32_pd(_mm256_castsi256_si128(v)));
+    _mm256_storeu_pd(out+i+4, _mm256_cvtepi32_pd(_mm256_extracti128_si256(v, 1)));
+  }
+  convertScalar<epicsInt16, epicsFloat64>(in+i, out+i, n-i);
+}
+
+TARGET_AVX2 static void convertFloat32ToUInt16AVX2(const void *pIn, void *pOut, size_t n)
+{
+  const epicsFloat32 *in = (const epicsFloat32 *)pIn;
+  epicsUInt16 *out = (epicsUInt16 *)pOut;
+  const __m256i mask = _mm256_set1_epi32(0xFFFF);
+  size_t i = 0;
+  for (; i+16<=n; i+=16) {
+    __m256i a = _mm256_and_si256(_mm256_cvttps_epi32(_mm256_loadu_ps(in+i)), mask);
+    __m256i b = _mm256_and_si256(_mm256_cvttps_epi32(_mm256_loadu_ps(in+i+8)), mask);
+    _mm256_storeu_si256((__m256i *)(out+i), _mm256_permute4x64_epi64(_mm256_packus_epi32(a, b), 0xD8));
+  }
+  convertScalar<epicsFloat32, epicsUInt16>(in+i, out+i, n-i);
+}
+
+TARGET_AVX2 static void convertFloat64ToUInt16AVX2(const void *pIn, void *pOut, size_t n)
+{
+  const epicsFloat64 *in = (const epicsFloat64 *)pIn;
+  epicsUInt16 *out = (epicsUInt16 *)pOut;
+  const __m128i mask = _mm_set1_epi32(0xFFFF);
+  size_t i = 0;
+  for (; i+8<=n; i+=8) {
+    __m128i a = _mm_and_si128(_mm256_cvttpd_epi32(_mm256_loadu_pd(in+i)), mask);
+    __m128i b = _mm_and_si128(_mm256_cvttpd_epi32(_mm256_loadu_pd(in+i+4)), mask);
+    _mm_storeu_si128((__m128i *)(out+i), _mm_packus_epi32(a, b));
+  }
+  convertScalar<epicsFloat64, epicsUInt16>(in+i, out+i, n-i);
+}
+
+TARGET_AVX2 static void convertFloat32ToFloat64AVX2(const void *pIn, void *pOut, size_t n)
+{
+  const epicsFloat32 *in = (const epicsFloat32 *)pIn;
+  epicsFloat64 *out = (epicsFloat64 *)pOut;
+  size_t i = 0;
+  for (; i+8<=n; i+=8) {
+    __m256 v = _mm256_loadu_ps(in+i);
+    _mm256_storeu_pd(out+i,   _mm256_cvtps_pd(_mm256_castps256_ps128(v)));
+    _mm256_storeu_pd(out+i+4, _mm256_cvtps_pd(_mm256_extractf128_ps(v, 1)));
+  }
+  convertScalar<epicsFloat32, epicsFloat64>(in+i, out+i, n-i);
+}
+
+TARGET_AVX2 static void convertFloat64ToFloat32AVX2(const void *pIn, void *pOut, size_t n)
+{
+  const epicsFloat64 *in = (const epicsFloat64 *)pIn;
+  epicsFloat32 *out = (epicsFloat32 *)pOut;
+  size_t i = 0;
+  for (; i+8<=n; i+=8) {
+    _mm_storeu_ps(out+i,   _mm256_cvtpd_ps(_mm256_loadu_pd(in+i)));
+    _mm_storeu_ps(out+i+4, _mm256_cvtpd_ps(_mm256_loadu_pd(in+i+4)));
+  }
+  convertScalar<epicsFloat64, epicsFloat32>(in+i, out+i, n-i);
+}
+
+/* AVX-512 kernels for the conversions to and from UInt16.  vpmovwb and vpmovdw truncate, like the scalar cast. */
+
+TARGET_AVX512 static void convertUInt8ToUInt16AVX512(const void *pIn, void *pOut, size_t n)
+{
+  const epicsUInt8 *in = (const epicsUInt8 *)pIn;
+  epicsUInt16 *out = (epicsUInt16 *)pOut;
+  size_t i = 0;
+  for (; i+32<=n; i+=32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(in+i));
+    _mm512_storeu_si512((void *)(out+i), _mm512_cvtepu8_epi16(v));
+  }
+  convertScalar<epicsUInt8, epicsUInt16>(in+i, out+i, n-i);
+}
+
+TARGET_AVX512 static void convertUInt16ToUInt8AVX512(const void *pIn, void *pOut, size_t n)
+{
+  const epicsUInt16 *in = (const epicsUInt16 *)pIn;
+  epicsUInt8 *out = (epicsUInt8 *)pOut;
+  size_t i = 0;
+  for (; i+32<=n; i+=32) {
+    __m512i v = _mm512_loadu_si512((const void *)(in+i));
+    _mm256_storeu_si256((__m256i *)(out+i), _mm512_cvtepi16_epi8(v));
+  }
+  convertScalar<epicsUInt16, epicsUInt8>(in+i, out+i, n-i);
+}
+
+TARGET_AVX512 static void convertUInt16ToFloat32AVX512(const void *pIn, void *pOut, size_t n)
+{
+  const epicsUInt16 *in = (const epicsUInt16 *)pIn;
+  epicsFloat32 *out = (epicsFloat32 *)pOut;
+  size_t i = 0;
+  for (; i+16<=n; i+=16) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(in+i));
+    _mm512_storeu_ps(out+i, _mm512_cvtepi32_ps(_mm512_cvtepu16_epi32(v)));
+  }
+  convertScalar<epicsUInt16, epicsFloat32>(in+i, out+i, n-i);
+}
+
+TARGET_AVX512 static void convertUInt16ToFloat64AVX512(const void *pIn, void *pOut, size_t n)
+{
+  const epicsUInt16 *in = (const epicsUInt16 *)pIn;
+  epicsFloat64 *out = (epicsFloat64 *)pOut;
+  size_t i = 0;
+  for (; i+16<=n; i+=16) {
+    __m512i v = _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i *)(in+i)));
+    _mm512_storeu_pd(out+i,   _mm512_cvtepi32_pd(_mm512_castsi512_si256(v)));
+    _mm512_storeu_pd(out+i+8, _mm512_cvtepi32_pd(_mm512_extracti64x4_epi64(v, 1)));
+  }
+  convertScalar<epicsUInt16, epicsFloat64>(in+i, out+i, n-i);
+}
+
+TARGET_AVX512 static void convertFloat32ToUInt16AVX512(const void *pIn, void *pOut, size_t n)
+{
+  const epicsFloat32 *in = (const epicsFloat32 *)pIn;
+  epicsUInt16 *out = (epicsUInt16 *)pOut;
+  size_t i = 0;
+  for (; i+16<=n; i+=16) {
+    __m512i v = _mm512_cvttps_epi32(_mm512_loadu_ps(in+i));
+    _mm256_storeu_si256((__m256i *)(out+i), _mm512_cvtepi32_epi16(v));
+  }
+  convertScalar<epicsFloat32, epicsUInt16>(in+i, out+i, n-i);
+}
+
+TARGET_AVX512 static void convertFloat64ToUInt16AVX512(const void *pIn, void *pOut, size_t n)
+{
+  const epicsFloat64 *in = (const epicsFloat64 *)pIn;
+  epicsUInt16 *out = (epicsUInt16 *)pOut;
+  size_t i = 0;
+  for (; i+16<=n; i+=16) {
+    __m256i a = _mm512_cvttpd_epi32(_mm512_loadu_pd(in+i));
+    __m256i b = _mm512_cvttpd_epi32(_mm512_loadu_pd(in+i+8));
+    __m512i v = _mm512_inserti64x4(_mm512_castsi256_si512(a), b, 1);
+    _mm256_storeu_si256((__m256i *)(out+i), _mm512_cvtepi32_epi16(v));
+  }
+  convertScalar<epicsFloat64, epicsUInt16>(in+i, out+i, n-i);
+}
+
+static void setX86Functions()
+{
+  NDConvertFunc_t (*pFuncs)[ND_NUM_DATA_TYPES];
+
+  __builtin_cpu_init();
+  if (!__builtin_cpu_supports("sse4.1")) return;
+  supportedSIMD = NDConvertSSE41;
+  pFuncs = convertFunctions[NDConvertSSE41];
+  pFuncs[NDUInt8][NDUInt16]    = convertUInt8ToUInt16SSE41;
+  pFuncs[NDUInt8][NDFloat32]   = convertUInt8ToFloat32SSE41;
+  pFuncs[NDUInt16][NDUInt8]    = convertUInt16ToUInt8SSE41;
+  pFuncs[NDUInt16][NDInt32]    = convertUInt16ToInt32SSE41;
+  pFuncs[NDUInt16][NDUInt32]   = convertUInt16ToInt32SSE41;
+  pFuncs[NDUInt16][NDFloat32]  = convertUInt16ToFloat32SSE41;
+  pFuncs[NDUInt16][NDFloat64]  = convertUInt16ToFloat64SSE41;
+  pFuncs[NDInt16][NDFloat32]   = convertInt16ToFloat32SSE41;
+  pFuncs[NDInt16][NDFloat64]   = convertInt16ToFloat64SSE41;
+  pFuncs[NDFloat32][NDUInt16]  = convertFloat32ToUInt16SSE41;
+  pFuncs[NDFloat64][NDUInt16]  = convertFloat64ToUInt16SSE41;
+  pFuncs[NDFloat32][NDFloat64] = convertFloat32ToFloat64SSE41;
+  pFuncs[NDFloat64][NDFloat32] = convertFloat64ToFloat32SSE41;
+
+  if (!__builtin_cpu_supports("avx2")) return;
+  supportedSIMD = NDConvertAVX2;
+  pFuncs = convertFunctions[NDConvertAVX2];
+  pFuncs[NDUInt8][NDUInt16]    = convertUInt8ToUInt16AVX2;
+  pFuncs[NDUInt8][NDFloat32]   = convertUInt8ToFloat32AVX2;
+  pFuncs[NDUInt16][NDUInt8]    = convertUInt16ToUInt8AVX2;
+  pFuncs[NDUInt16][NDInt32]    = convertUInt16ToInt32AVX2;
+  pFuncs[NDUInt16][NDUInt32]   = convertUInt16ToInt32AVX2;
+  pFuncs[NDUInt16][NDFloat32]  = convertUInt16ToFloat32AVX2;
+  pFuncs[NDUInt16][NDFloat64]  = convertUInt16ToFloat64AVX2;
+  pFuncs[NDInt16][NDFloat32]   = convertInt16ToFloat32AVX2;
+  pFuncs[NDInt16][NDFloat64]   = convertInt16ToFloat64AVX2;
+  pFuncs[NDFloat32][NDUInt16]  = convertFloat32ToUInt16AVX2;
+  pFuncs[NDFloat64][NDUInt16]  = convertFloat64ToUInt16AVX2;
+  pFuncs[NDFloat32][NDFloat64] = convertFloat32ToFloat64AVX2;
+  pFuncs[NDFloat64][NDFloat32] = convertFloat64ToFloat32AVX2;
+
+  if (!__builtin_cpu_supports("avx512f") || !__builtin_cpu_supports("avx512bw")) return;
+  supportedSIMD = NDConvertAVX512;
+  pFuncs = convertFunctions[NDConvertAVX512];
+  pFuncs[NDUInt8][NDUInt16]    = convertUInt8ToUInt16AVX512;
+  pFuncs[NDUInt16][NDUInt8]    = convertUInt16ToUInt8AVX512;
+  pFuncs[NDUInt16][NDFloat32]  = convertUInt16ToFloat32AVX512;
+  pFuncs[NDUInt16][NDFloat64]  = convertUInt16ToFloat64AVX512;
+  pFuncs[NDFloat32][NDUInt16]  = convertFloat32ToUInt16AVX512;
+  pFuncs[NDFloat64][NDUInt16]  = convertFloat64ToUInt16AVX512;
+}
+#endif
+
+static void convertInit(void *)
+{
+  memset(convertFunctions, 0, sizeof(convertFunctions));
+  setScalarFunctions<epicsInt8>(NDInt8);
+  setScalarFunctions<epicsUInt8>(NDUInt8);
+  setScalarFunctions<epicsInt16>(NDInt16);
+  setScalarFunctions<epicsUInt16>(NDUInt16);
+  setScalarFunctions<epicsInt32>(NDInt32);
+  setScalarFunctions<epicsUInt32>(NDUInt32);
+  setScalarFunctions<epicsInt64>(NDInt64);
+  setScalarFunctions<epicsUInt64>(NDUInt64);
+  setScalarFunctions<epicsFloat32>(NDFloat32);
+  setScalarFunctions<epicsFloat64>(NDFloat64);
+#ifdef ND_CONVERT_HAVE_X86
+  setX86Functions();
+#endif
+}
+
+/** Returns the best instruction set that the CPU supports and ADCore was compiled for */
+NDConvertSIMD_t NDConvertGetSupportedSIMD()
+{
+  epicsThreadOnce(&convertOnceId, convertInit, NULL);
+  return supportedSIMD;
+}
+
+/** Returns the name of an NDConvertSIMD_t value */
+const char* NDConvertGetSIMDName(int simd)
+{
+  switch (simd) {
+    case NDConvertScalar: return "scalar";
+    case NDConvertSSE41:  return "SSE4.1";
+    case NDConvertAVX2:   return "AVX2";
+    case NDConvertAVX512: return "AVX-512";
+    default:              return "unknown";
+  }
+}
+
+/** Returns the instruction set of the kernel that NDConvertGetFunction() returns.
+  * \param[in] dataTypeIn Data type of the input array
+  * \param[in] dataTypeOut Data type of the output array
+  * \param[in] maxSIMD Best NDConvertSIMD_t to use, -1 for the best the CPU supports.
+  * The NDConvertMaxSIMD variable also limits this.
+  */
+NDConvertSIMD_t NDConvertGetFunctionSIMD(NDDataType_t dataTypeIn, NDDataType_t dataTypeOut, int maxSIMD)
+{
+  int simd = NDConvertGetSupportedSIMD();
+
+  if ((maxSIMD >= 0) && (maxSIMD < simd)) simd = maxSIMD;
+  if ((NDConvertMaxSIMD >= 0) && (NDConvertMaxSIMD < simd)) simd = NDConvertMaxSIMD;
+  if ((dataTypeIn < NDInt8) || (dataTypeIn > NDFloat64) ||
+      (dataTypeOut < NDInt8) || (dataTypeOut > NDFloat64)) return NDConvertScalar;
+  for (; simd > NDConvertScalar; simd--) {
+    if (convertFunctions[simd][dataTypeIn][dataTypeOut]) break;
+  }
+  return (NDConvertSIMD_t)simd;
+}
+
+/** Returns the fastest function that converts contiguous elements from dataTypeIn to dataTypeOut.
+  * \param[in] dataTypeIn Data type of the input array
+  * \param[in] dataTypeOut Data type of the output array
+  * \param[in] maxSIMD Best NDConvertSIMD_t to use, -1 for the best the CPU supports.
+  * \return The conversion function, NULL if a data type is invalid.
+  */
+NDConvertFunc_t NDConvertGetFunction(NDDataType_t dataTypeIn, NDDataType_t dataTypeOut, int maxSIMD)
+{
+  if ((dataTypeIn < NDInt8) || (dataTypeIn > NDFloat64) ||
+      (dataTypeOut < NDInt8) || (dataTypeOut > NDFloat64)) return NULL;
+  return convertFunctions[NDConvertGetFunctionSIMD(dataTypeIn, dataTypeOut, maxSIMD)][dataTypeIn][dataTypeOut];
+}
+
+/** One call to NDConvertRunBands(), shared by the calling thread and the worker threads */
+typedef struct {
+  NDConvertBandFunc_t func;
+  void *pvt;
+  size_t numItems;
+  int numBands;
+  int nextBand;     /**< Next band to process */
+  int pending;      /**< Number of threads that have not finished with the job */
+  epicsEventId doneEvent;
+} convertJob_t;
+
+static epicsThreadOnceId workersOnceId = EPICS_THREAD_ONCE_INIT;
+static epicsMutexId workersLock;
+static epicsMessageQueue *pWorkerQueue;
+static epicsThreadPrivateId doneEventId;
+static int numWorkers;
+
+static void runBands(convertJob_t *pJob)
+{
+  int band;
+  size_t first, last;
+
+  while ((band = epicsAtomicIncrIntT(&pJob->nextBand) - 1) < pJob->numBands) {
+    first = pJob->numItems * band / pJob->numBands;
+    last = pJob->numItems * (band + 1) / pJob->numBands;
+    if (last > first) pJob->func(pJob->pvt, first, last - first);
+  }
+}
+
+static void workerTask(void *)
+{
+  convertJob_t *pJob;
+
+  while (1) {
+    if (pWorkerQueue->receive(&pJob, sizeof(pJob)) != sizeof(pJob)) continue;
+    runBands(pJob);
+    // The calling thread can return as soon as pending is 0, so pJob must not be used after this
+    if (epicsAtomicDecrIntT(&pJob->pending) == 0) epicsEventSignal(pJob->doneEvent);
+  }
+}
+
+static void workersInit(void *)
+{
+  workersLock = epicsMutexMustCreate();
+  pWorkerQueue = new epicsMessageQueue(CONVERT_QUEUE_SIZE, sizeof(convertJob_t *));
+  doneEventId = epicsThreadPrivateCreate();
+}
+
+/** Returns the number of threads to use for an array with nBytes bytes of input data,
+  * from NDConvertNumThreads and NDConvertParallelMinBytes */
+int NDConvertGetNumThreads(size_t nBytes)
+{
+  int numThreads = NDConvertNumThreads;
+
+  if ((numThreads <= 1) || (nBytes < (size_t)NDConvertParallelMinBytes)) return 1;
+  if (numThreads > MAX_CONVERT_THREADS) numThreads = MAX_CONVERT_THREADS;
+  return numThreads;
+}
+
+/** Calls func for bands of items 0 to numItems-1 using numThreads threads.
+  * The calling thread processes bands too, and this returns when all of the bands are done.
+  * The worker threads are shared, so if they are busy with other jobs the calling thread does more of the bands.
+  * \param[in] func Function that processes count items starting at first
+  * \param[in] pvt Passed to func
+  * \param[in] numItems Number of items, e.g. rows or elements
+  * \param[in] numThreads Number of threads including the calling thread, see NDConvertGetNumThreads()
+  */
+void NDConvertRunBands(NDConvertBandFunc_t func, void *pvt, size_t numItems, int numThreads)
+{
+  convertJob_t job;
+  convertJob_t *pJob = &job;
+  int i;
+
+  if (numThreads > MAX_CONVERT_THREADS) numThreads = MAX_CONVERT_THREADS;
+  if ((size_t)numThreads > numItems) numThreads = (int)numItems;
+  if (numThreads <= 1) {
+    if (numItems > 0) func(pvt, 0, numItems);
+    return;
+  }
+  epicsThreadOnce(&workersOnceId, workersInit, NULL);
+  if (numWorkers < numThreads-1) {
+    epicsMutexLock(workersLock);
+    for (; numWorkers < numThreads-1; numWorkers++) {
+      char name[20];
+      epicsSnprintf(name, sizeof(name), "NDConvert-%d", numWorkers);
+      epicsThreadMustCreate(name, epicsThreadPriorityMedium,
+                            epicsThreadGetStackSize(epicsThreadStackMedium),
+                            workerTask, NULL);
+    }
+    epicsMutexUnlock(workersLock);
+  }
+  job.doneEvent = (epicsEventId)epicsThreadPrivateGet(doneEventId);
+  if (!job.doneEvent) {
+    job.doneEvent = epicsEventMustCreate(epicsEventEmpty);
+    epicsThreadPrivateSet(doneEventId, job.doneEvent);
+  }
+  job.func = func;
+  job.pvt = pvt;
+  job.numItems = numItems;
+  job.numBands = numThreads * BANDS_PER_THREAD;
+  if ((size_t)job.numBands > numItems) job.numBands = (int)numItems;
+  job.nextBand = 0;
+  job.pending = numThreads;
+  for (i=1; i<numThreads; i++) {
+    if (pWorkerQueue->trySend(&pJob, sizeof(pJob)) != 0) epicsAtomicDecrIntT(&job.pending);
+  }
+  runBands(&job);
+  if (epicsAtomicDecrIntT(&job.pending) != 0) epicsEventMustWait(job.doneEvent);
+}
@@ -0,0 +1,40 @@
+/** NDConvert.h
+ *
+ * Data type conversion kernels for NDArrayPool::convert().
+ *
+ */
+
+#ifndef NDConvert_H
+#define NDConvert_H
+
+#include <stddef.h>
+
+#include "ADCoreAPI.h"
+#include "NDAttribute.h"
+
+/** Enumeration of the instruction sets that the conversion kernels can use */
+typedef enum
+{
+    NDConvertScalar,    /**< Element by element C++ cast, available for all type pairs */
+    NDConvertSSE41,     /**< x86 SSE4.1, 128 bit vectors */
+    NDConvertAVX2,      /**< x86 AVX2, 256 bit vectors */
+    NDConvertAVX512     /**< x86 AVX-512F and AVX-512BW, 512 bit vectors */
+} NDConvertSIMD_t;
+
+#define ND_CONVERT_NUM_SIMD (NDConvertAVX512+1)
+
+/** Function that converts nElements contiguous elements from pIn to pOut.
+  * The vector kernels give exactly the same results as the scalar cast. */
+typedef void (*NDConvertFunc_t)(const void *pIn, void *pOut, size_t nElements);
+
+/** Function that processes count items, e.g. rows of an array, starting at item first */
+typedef void (*NDConvertBandFunc_t)(void *pvt, size_t first, size_t count);
+
+ADCORE_API NDConvertSIMD_t NDConvertGetSupportedSIMD();
+ADCORE_API const char* NDConvertGetSIMDName(int simd);
+ADCORE_API NDConvertFunc_t NDConvertGetFunction(NDDataType_t dataTypeIn, NDDataType_t dataTypeOut, int maxSIMD=-1);
+ADCORE_API NDConvertSIMD_t NDConvertGetFunctionSIMD(NDDataType_t dataTypeIn, NDDataType_t dataTypeOut, int maxSIMD=-1);
+ADCORE_API int NDConvertGetNumThreads(size_t nBytes);
+ADCORE_API void NDConvertRunBands(NDConvertBandFunc_t func, void *pvt, size_t numItems, int numThreads);
+
+#endif
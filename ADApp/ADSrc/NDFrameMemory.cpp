@@ -0,0 +1,344 @@
+/** NDFrameMemory.cpp
+ *
+ * Frame buffer memory backends for NDArrayPool.
+ * NDFrameMemoryConfig() installs NDFrameMemoryAlloc() and NDFrameMemoryFree() with
+ * NDArrayPool::setDefaultFrameMemoryFunctions().
+ *
+ * The mmap backend maps each large frame buffer separately, so it can use huge pages,
+ * fault in and lock the pages before the detector writes to them, and place them on the
+ * NUMA node of the thread that will process them.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <map>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#include <epicsMutex.h>
+#include <epicsString.h>
+#ifndef EPICS_LIBCOM_ONLY
+#include <iocsh.h>
+#endif
+
+#include <epicsExport.h>
+
+#include "NDArray.h"
+#include "NDFrameMemory.h"
+
+#ifdef __linux__
+#define ND_FRAME_MEMORY_HAVE_MMAP
+#endif
+
+// Buffers smaller than this are allocated with the aligned allocator by the mmap backend
+#define MMAP_MIN_SIZE 65536
+// Size of huge pages for MAP_HUGETLB, used to round up the length of the mapping
+#define HUGE_PAGE_SIZE (2*1024*1024)
+// Not all C libraries define the mbind() policies without numaif.h
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+#define MAX_NUMA_NODES 1024
+
+static const char *driverName = "NDFrameMemory";
+
+static NDFrameMemoryBackend_t backend_ = NDFrameMemoryMalloc;
+static int hugePages_ = NDFrameMemoryHugePagesNone;
+static int prefault_ = NDFrameMemoryPrefaultNone;
+static size_t alignment_ = 64;
+
+// Length of each buffer allocated with mmap(), which munmap() needs
+static epicsMutexId mappingLock_ = NULL;
+static std::map<void *, size_t> *pMappings_ = NULL;
+
+static void *alignedAlloc(size_t size)
+{
+#if defined(_WIN32)
+  return _aligned_malloc(size, alignment_);
+#elif defined(vxWorks)
+  return memalign(alignment_, size);
+#else
+  void *ptr;
+  if (posix_memalign(&ptr, alignment_, size) != 0) return NULL;
+  return ptr;
+#endif
+}
+
+static void alignedFree(void *ptr)
+{
+#if defined(_WIN32)
+  _aligned_free(ptr);
+#else
+  free(ptr);
+#endif
+}
+
+#ifdef ND_FRAME_MEMORY_HAVE_MMAP
+/** Sets the preferred NUMA node of a mapping before its pages are faulted in.
+  * This calls the mbind system call directly so ADCore does not depend on libnuma.
+  */
+static void bindToNode(void *ptr, size_t length, int numaNode)
+{
+  static const char *functionName = "bindToNode";
+  static bool warned = false;
+  unsigned long nodeMask[MAX_NUMA_NODES/(8*sizeof(unsigned long))];
+  const size_t bitsPerLong = 8*sizeof(unsigned long);
+
+  if (numaNode >= MAX_NUMA_NODES) return;
+  memset(nodeMask, 0, sizeof(nodeMask));
+  nodeMask[numaNode/bitsPerLong] |= 1UL << (numaNode % bitsPerLong);
+#ifdef SYS_mbind
+  if (syscall(SYS_mbind, ptr, length, MPOL_PREFERRED, nodeMask, (unsigned long)MAX_NUMA_NODES, 0) == 0) return;
+#endif
+  if (!warned) {
+    printf("%s::%s: WARNING, cannot bind frame memory to NUMA node %d\n", driverName, functionName, numaNode);
+    warned = true;
+  }
+}
+
+static void *mmapAlloc(size_t size, int numaNode)
+{
+  static const char *functionName = "mmapAlloc";
+  static bool warnedHugeTLB = false;
+  static bool warnedLock = false;
+  size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+  size_t length = (size + pageSize - 1) / pageSize * pageSize;
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+  void *ptr = MAP_FAILED;
+  bool populated = false;
+
+#ifdef MAP_HUGETLB
+  if (hugePages_ == NDFrameMemoryHugePagesHugeTLB) {
+    size_t hugeLength = (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+    ptr = mmap(NULL, hugeLength, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB, -1, 0);
+    if (ptr != MAP_FAILED) {
+      length = hugeLength;
+    } else if (!warnedHugeTLB) {
+      printf("%s::%s: WARNING, no huge pages available, using normal pages\n", driverName, functionName);
+      warnedHugeTLB = true;
+    }
+  }
+#endif
+  if (ptr == MAP_FAILED) {
+    // MAP_POPULATE would fault the pages in before mbind() or madvise() could take effect
+    if ((prefault_ == NDFrameMemoryPrefaultPopulate) && (numaNode < 0) &&
+        (hugePages_ != NDFrameMemoryHugePagesTHP)) {
+      flags |= MAP_POPULATE;
+      populated = true;
+    }
+    ptr = mmap(NULL, length, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (ptr == MAP_FAILED) return NULL;
+#ifdef MADV_HUGEPAGE
+    if (hugePages_ == NDFrameMemoryHugePagesTHP) madvise(ptr, length, MADV_HUGEPAGE);
+#endif
+  }
+  if (numaNode >= 0) bindToNode(ptr, length, numaNode);
+
+  if ((prefault_ == NDFrameMemoryPrefaultPopulate) && !populated) {
+    // Touch each page so it is faulted in now, on the node selected above
+    for (size_t offset=0; offset<length; offset+=pageSize) {
+      ((volatile char *)ptr)[offset] = 0;
+    }
+  } else if (prefault_ == NDFrameMemoryPrefaultLock) {
+    if ((mlock(ptr, length) != 0) && !warnedLock) {
+      printf("%s::%s: WARNING, mlock failed, check RLIMIT_MEMLOCK\n", driverName, functionName);
+      warnedLock = true;
+    }
+  }
+
+  epicsMutexLock(mappingLock_);
+  (*pMappings_)[ptr] = length;
+  epicsMutexUnlock(mappingLock_);
+  return ptr;
+}
+#endif
+
+/** Allocates a frame buffer with the backend selected by NDFrameMemoryConfig(), with no NUMA node preference.
+  * This function can be passed to NDArrayPool::setDefaultFrameMemoryFunctions().
+  * \param[in] size Required buffer size
+  */
+void* NDFrameMemoryAlloc(size_t size)
+{
+  return NDFrameMemoryAllocOnNode(size, -1);
+}
+
+/** Allocates a frame buffer with the backend selected by NDFrameMemoryConfig().
+  * \param[in] size Required buffer size
+  * \param[in] numaNode Preferred NUMA node for the memory, -1 for no preference.
+  * Only the mmap backend uses this.
+  */
+void* NDFrameMemoryAllocOnNode(size_t size, int numaNode)
+{
+  switch (backend_) {
+    case NDFrameMemoryAligned:
+      return alignedAlloc(size);
+#ifdef ND_FRAME_MEMORY_HAVE_MMAP
+    case NDFrameMemoryMmap:
+      if (size < MMAP_MIN_SIZE) return alignedAlloc(size);
+      return mmapAlloc(size, numaNode);
+#endif
+    default:
+      return malloc(size);
+  }
+}
+
+/** Frees a frame buffer allocated with NDFrameMemoryAlloc() or NDFrameMemoryAllocOnNode().
+  * This function can be passed to NDArrayPool::setDefaultFrameMemoryFunctions().
+  * \param[in] ptr Pointer to memory that will be deallocated
+  */
+void NDFrameMemoryFree(void *ptr)
+{
+  if (!ptr) return;
+#ifdef ND_FRAME_MEMORY_HAVE_MMAP
+  if (pMappings_) {
+    size_t length = 0;
+    std::map<void *, size_t>::iterator it;
+    epicsMutexLock(mappingLock_);
+    it = pMappings_->find(ptr);
+    if (it != pMappings_->end()) {
+      length = it->second;
+      pMappings_->erase(it);
+    }
+    epicsMutexUnlock(mappingLock_);
+    if (length) {
+      munmap(ptr, length);
+      return;
+    }
+  }
+#endif
+  if (backend_ == NDFrameMemoryMalloc) {
+    free(ptr);
+  } else {
+    alignedFree(ptr);
+  }
+}
+
+/** Faults in the pages of a frame buffer so that the first frame written to it does not page fault.
+  * This works for buffers from any backend.  The contents of the buffer are overwritten.
+  * \param[in] ptr Pointer to the buffer
+  * \param[in] size Size of the buffer in bytes
+  * \param[in] prefault NDFrameMemoryPrefault_t; NDFrameMemoryPrefaultLock also locks the pages
+  * in memory with mlock(), which is only supported on Linux.
+  */
+void NDFrameMemoryPrefault(void *ptr, size_t size, int prefault)
+{
+  static const char *functionName = "NDFrameMemoryPrefault";
+  static bool warnedLock = false;
+  volatile char *pData = (volatile char *)ptr;
+  size_t pageSize = 4096;
+  size_t i;
+
+  if (!ptr || (size == 0) || (prefault == NDFrameMemoryPrefaultNone)) return;
+#ifdef ND_FRAME_MEMORY_HAVE_MMAP
+  pageSize = (size_t)sysconf(_SC_PAGESIZE);
+#endif
+  // Reading a page of anonymous memory maps the shared zero page, so each page must be written
+  for (i=0; i<size; i+=pageSize) {
+    pData[i] = 0;
+  }
+  pData[size-1] = 0;
+  if (prefault != NDFrameMemoryPrefaultLock) return;
+#ifdef ND_FRAME_MEMORY_HAVE_MMAP
+  if (mlock(ptr, size) == 0) return;
+#endif
+  if (!warnedLock) {
+    printf("%s::%s: WARNING, cannot lock frame memory, check RLIMIT_MEMLOCK\n", driverName, functionName);
+    warnedLock = true;
+  }
+}
+
+/** Returns the frame memory backend selected by NDFrameMemoryConfig() */
+NDFrameMemoryBackend_t NDFrameMemoryGetBackend()
+{
+  return backend_;
+}
+
+/** Selects the memory backend that NDArrayPool uses for frame buffers.
+  * This must be called before any driver or plugin allocates NDArrays, because buffers must be
+  * freed by the backend that allocated them.
+  * \param[in] backend "malloc" (default), "aligned" or "mmap".  "mmap" is only available on Linux.
+  * \param[in] hugePages NDFrameMemoryHugePages_t; mmap backend only.
+  * \param[in] prefault NDFrameMemoryPrefault_t; mmap backend only.
+  * \param[in] alignment Alignment in bytes for the aligned backend and for small buffers in the mmap backend;
+  * must be a power of 2, 0 selects the default of 64.  Buffers from the mmap backend are page aligned.
+  * The NUMA node is selected per driver with the NDArrayPoolNumaNode variable.
+  */
+int NDFrameMemoryConfig(const char *backend, int hugePages, int prefault, int alignment)
+{
+  static const char *functionName = "NDFrameMemoryConfig";
+  NDFrameMemoryBackend_t newBackend;
+
+  if (!backend || (strlen(backend) == 0) || (epicsStrCaseCmp(backend, "malloc") == 0)) {
+    newBackend = NDFrameMemoryMalloc;
+  } else if (epicsStrCaseCmp(backend, "aligned") == 0) {
+    newBackend = NDFrameMemoryAligned;
+  } else if (epicsStrCaseCmp(backend, "mmap") == 0) {
+#ifdef ND_FRAME_MEMORY_HAVE_MMAP
+    newBackend = NDFrameMemoryMmap;
+#else
+    printf("%s: ERROR, the mmap backend is only available on Linux\n", functionName);
+    return -1;
+#endif
+  } else {
+    printf("%s: ERROR, unknown backend %s, must be malloc, aligned or mmap\n", functionName, backend);
+    return -1;
+  }
+  if (alignment == 0) alignment = 64;
+  if ((alignment < (int)sizeof(void *)) || ((alignment & (alignment - 1)) != 0)) {
+    printf("%s: ERROR, alignment %d must be a power of 2 and at least %d\n",
+           functionName, alignment, (int)sizeof(void *));
+    return -1;
+  }
+  if ((hugePages < NDFrameMemoryHugePagesNone) || (hugePages > NDFrameMemoryHugePagesHugeTLB) ||
+      (prefault < NDFrameMemoryPrefaultNone) || (prefault > NDFrameMemoryPrefaultLock)) {
+    printf("%s: ERROR, hugePages must be 0-2 and prefault must be 0-2\n", functionName);
+    return -1;
+  }
+
+  if ((newBackend == NDFrameMemoryMmap) && !pMappings_) {
+    mappingLock_ = epicsMutexMustCreate();
+    pMappings_ = new std::map<void *, size_t>;
+  }
+  backend_ = newBackend;
+  hugePages_ = hugePages;
+  prefault_ = prefault;
+  alignment_ = (size_t)alignment;
+  if (backend_ == NDFrameMemoryMalloc) {
+    NDArrayPool::setDefaultFrameMemoryFunctions(malloc, free);
+  } else {
+    NDArrayPool::setDefaultFrameMemoryFunctions(NDFrameMemoryAlloc, NDFrameMemoryFree);
+  }
+  return 0;
+}
+
+#ifndef EPICS_LIBCOM_ONLY
+/* EPICS iocsh shell commands */
+static const iocshArg configArg0 = { "backend (malloc, aligned, mmap)", iocshArgString};
+static const iocshArg configArg1 = { "hugePages (0=none, 1=THP, 2=HugeTLB)", iocshArgInt};
+static const iocshArg configArg2 = { "prefault (0=none, 1=populate, 2=lock)", iocshArgInt};
+static const iocshArg configArg3 = { "alignment", iocshArgInt};
+static const iocshArg * const configArgs[] = {&configArg0,
+                                              &configArg1,
+                                              &configArg2,
+                                              &configArg3};
+static const iocshFuncDef configFuncDef = {"NDFrameMemoryConfig", 4, configArgs};
+static void configCallFunc(const iocshArgBuf *args)
+{
+  NDFrameMemoryConfig(args[0].sval, args[1].ival, args[2].ival, args[3].ival);
+}
+
+extern "C" void NDFrameMemoryRegister(void)
+{
+  iocshRegister(&configFuncDef, configCallFunc);
+}
+
+extern "C" {
+epicsExportRegistrar(NDFrameMemoryRegister);
+}
+#endif
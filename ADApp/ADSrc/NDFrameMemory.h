@@ -0,0 +1,45 @@
+/** NDFrameMemory.h
+ *
+ * Frame buffer memory backends for NDArrayPool.
+ *
+ */
+
+#ifndef NDFrameMemory_H
+#define NDFrameMemory_H
+
+#include <stddef.h>
+
+#include "ADCoreAPI.h"
+
+/** Enumeration of frame memory backends that NDFrameMemoryConfig() can select */
+typedef enum
+{
+    NDFrameMemoryMalloc,        /**< malloc() and free(), the default */
+    NDFrameMemoryAligned,       /**< malloc() with the configured alignment, default 64 bytes */
+    NDFrameMemoryMmap           /**< Anonymous mmap() on Linux, page aligned, with optional huge pages, pre-faulting and NUMA node */
+} NDFrameMemoryBackend_t;
+
+/** Enumeration of huge page options for NDFrameMemoryMmap */
+typedef enum
+{
+    NDFrameMemoryHugePagesNone,     /**< Normal pages */
+    NDFrameMemoryHugePagesTHP,      /**< madvise(MADV_HUGEPAGE), transparent huge pages */
+    NDFrameMemoryHugePagesHugeTLB   /**< MAP_HUGETLB from the reserved huge page pool, falls back to normal pages */
+} NDFrameMemoryHugePages_t;
+
+/** Enumeration of pre-fault options for NDFrameMemoryMmap */
+typedef enum
+{
+    NDFrameMemoryPrefaultNone,      /**< Pages are faulted in when they are first touched */
+    NDFrameMemoryPrefaultPopulate,  /**< Pages are faulted in when the buffer is allocated (MAP_POPULATE) */
+    NDFrameMemoryPrefaultLock       /**< Pages are faulted in and locked in memory with mlock() */
+} NDFrameMemoryPrefault_t;
+
+ADCORE_API int   NDFrameMemoryConfig(const char *backend, int hugePages, int prefault, int alignment);
+ADCORE_API NDFrameMemoryBackend_t NDFrameMemoryGetBackend();
+ADCORE_API void* NDFrameMemoryAlloc(size_t size);
+ADCORE_API void* NDFrameMemoryAllocOnNode(size_t size, int numaNode);
+ADCORE_API void  NDFrameMemoryFree(void *ptr);
+ADCORE_API void  NDFrameMemoryPrefault(void *ptr, size_t size, int prefault);
+
+#endif
@@ -23,12 +23,15 @@
 #include <epicsThread.h>
 #include <macLib.h>
 #include <cantProceed.h>
+#include <iocsh.h>
 
 #include "PVAttribute.h"
 #include "paramAttribute.h"
 #include "functAttribute.h"
 #include "asynNDArrayDriver.h"
 
+#include <epicsExport.h>
+
 #define MAX_PATH_PARTS 32
 
 #if defined(_WIN32)              // Windows
@@ -583,10 +586,11 @@ asynStatus asynNDArrayDriver::readGenericPointer(asynUser *pasynUser, void *gene
                     driverName, functionName, pArray->pData);
         status = asynError;
     } else {
-        this->pNDArrayPool->copy(myArray, pArray, 0);
+        /* A view is copied element by element, other arrays with memcpy */
+        this->pNDArrayPool->copy(myArray, pArray, myArray->isView());
         myArray->getInfo(&arrayInfo);
         if (arrayInfo.totalBytes > pArray->dataSize) arrayInfo.totalBytes = pArray->dataSize;
-        memcpy(pArray->pData, myArray->pData, arrayInfo.totalBytes);
+        if (!myArray->isView()) memcpy(pArray->pData, myArray->pData, arrayInfo.totalBytes);
         pasynUser->timestamp = myArray->epicsTS;
     }
     if (!status)
@@ -691,6 +695,11 @@ asynStatus asynNDArrayDriver::writeInt32(asynUser *pasynUser, epicsInt32 value)
         setDoubleParam(NDPoolUsedMemory, this->pNDArrayPool->getMemorySize() / MEGABYTE_DBL);
         setIntegerParam(NDPoolAllocBuffers, this->pNDArrayPool->getNumBuffers());
         setIntegerParam(NDPoolFreeBuffers, this->pNDArrayPool->getNumFree());
+        // The counters can exceed the range of an Int32, a Float64 holds them exactly up to 2^53
+        setDoubleParam(NDPoolCacheHits, (double)this->pNDArrayPool->getCacheHits());
+        setDoubleParam(NDPoolCacheMisses, (double)this->pNDArrayPool->getCacheMisses());
+        setDoubleParam(NDPoolConvertTime, this->pNDArrayPool->getConvertTime() * 1000.);
+        setIntegerParam(NDPoolConvertThreads, this->pNDArrayPool->getConvertThreads());
     }
 
     /* Do callbacks so higher layers see any changes */
@@ -707,40 +716,65 @@ asynStatus asynNDArrayDriver::writeInt32(asynUser *pasynUser, epicsInt32 value)
     return status;
 }
 
+/** Pre-allocates NumPreAllocBuffers buffers in the NDArrayPool when PreAllocBuffers is written.
+  * If PreAllocSizeX is non-zero the buffer size is computed from PreAllocSizeX, PreAllocSizeY, PreAllocSizeZ
+  * and PreAllocDataType, so no array needs to have been collected.  Otherwise the buffers are the size of pArrays[0].
+  */
 asynStatus asynNDArrayDriver::preAllocateBuffers()
 {
     int numBuffers;
-    NDArray *pArray;
+    int sizeX, sizeY, sizeZ, dataType, prefault;
+    size_t dims[3];
+    int ndims = 0;
+    NDArrayInfo arrayInfo;
     static const char *functionName = "preAllocateBuffers";
 
-    /* Make sure there is a valid array */
-    if (!this->pArrays[0]) {
-        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
-            "%s::%s: ERROR, must collect an array to get dimensions first\n",
-            driverName, functionName);
-        return asynError;
-    }
-    std::vector<NDArray*> buffVector;
     getIntegerParam(NDPoolNumPreAllocBuffers, &numBuffers);
-    for (int i=0; i<numBuffers; i++) {
-        pArray = this->pNDArrayPool->copy(this->pArrays[0], NULL, true);
-        if (!pArray) {
+    getIntegerParam(NDPoolPreAllocSizeX, &sizeX);
+    getIntegerParam(NDPoolPreAllocSizeY, &sizeY);
+    getIntegerParam(NDPoolPreAllocSizeZ, &sizeZ);
+    getIntegerParam(NDPoolPreAllocDataType, &dataType);
+    getIntegerParam(NDPoolPreAllocPrefault, &prefault);
+    if (sizeX > 0) {
+        dims[ndims++] = sizeX;
+        if (sizeY > 0) dims[ndims++] = sizeY;
+        if (sizeZ > 0) dims[ndims++] = sizeZ;
+        if (NDArray::computeArrayInfo(ndims, dims, (NDDataType_t)dataType, &arrayInfo) != ND_SUCCESS) {
             asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
-                "%s::%s: ERROR, could not allocate array %d\n",
-                driverName, functionName, i);
+                "%s::%s: ERROR, invalid data type %d\n",
+                driverName, functionName, dataType);
             return asynError;
         }
-        buffVector.push_back(pArray);
-        setIntegerParam(NDPoolAllocBuffers, this->pNDArrayPool->getNumBuffers());
-        setIntegerParam(NDPoolFreeBuffers, this->pNDArrayPool->getNumFree());
-        setDoubleParam(NDPoolUsedMemory, this->pNDArrayPool->getMemorySize() / MEGABYTE_DBL);
-        callParamCallbacks();
+    } else if (this->pArrays[0]) {
+        this->pArrays[0]->getInfo(&arrayInfo);
+    } else {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+            "%s::%s: ERROR, must set PreAllocSizeX or collect an array to get dimensions first\n",
+            driverName, functionName);
+        return asynError;
     }
-    // Now release these NDArrays to put them on the free list
-    for (int i=0; i<numBuffers; i++) {
-        buffVector[i]->release();
+    return preAllocateBuffers(numBuffers, arrayInfo.totalBytes, prefault);
+}
+
+/** Pre-allocates buffers in the NDArrayPool so that the first frames do not wait for malloc() and page faults.
+  * This is called by the NDPoolPreAllocate and NDPoolPreAllocateSizes iocsh commands at startup and
+  * when PreAllocBuffers is written.  The caller must hold the driver lock.
+  * \param[in] numBuffers Number of free buffers that the pool should contain.
+  * \param[in] dataSize Size of each buffer in bytes.
+  * \param[in] prefault NDFrameMemoryPrefault_t; 1 faults in the pages of each buffer, 2 also locks them in memory.
+  */
+asynStatus asynNDArrayDriver::preAllocateBuffers(int numBuffers, size_t dataSize, int prefault)
+{
+    asynStatus status = asynSuccess;
+
+    if (this->pNDArrayPool->preAllocate(numBuffers, dataSize, prefault) != ND_SUCCESS) {
+        status = asynError;
     }
-    return asynSuccess;
+    setIntegerParam(NDPoolAllocBuffers, this->pNDArrayPool->getNumBuffers());
+    setIntegerParam(NDPoolFreeBuffers, this->pNDArrayPool->getNumFree());
+    setDoubleParam(NDPoolUsedMemory, this->pNDArrayPool->getMemorySize() / MEGABYTE_DBL);
+    callParamCallbacks();
+    return status;
 }
 
 
@@ -790,6 +824,7 @@ void asynNDArrayDriver::updateQueuedArrayCount()
 
         lock();
         setIntegerParam(NDNumQueuedArrays, getQueuedArrayCount());
+        setIntegerParam(NDBackPressure, backPressure() ? 1 : 0);
         callParamCallbacks();
         unlock();
     }
@@ -813,22 +848,64 @@ asynStatus asynNDArrayDriver::incrementQueuedArrayCount()
     return asynSuccess;
 }
 
-asynStatus asynNDArrayDriver::decrementQueuedArrayCount()
+/** Decrements the number of arrays that plugins have queued.
+  * \param[in] count Number of arrays that a plugin has finished with. */
+asynStatus asynNDArrayDriver::decrementQueuedArrayCount(int count)
 {
     static const char *functionName = "decrementQueuedArrayCount";
 
     queuedArrayCountMutex_->lock();
-    if (queuedArrayCount_ <= 0) {
+    if (queuedArrayCount_ < count) {
         asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
-            "%s::%s error, numQueuedArrays already 0 or less (%d)\n",
-            driverName, functionName, queuedArrayCount_);
+            "%s::%s error, numQueuedArrays less than %d (%d)\n",
+            driverName, functionName, count, queuedArrayCount_);
     }
-    queuedArrayCount_--;
+    queuedArrayCount_ -= count;
     queuedArrayCountMutex_->unlock();
     epicsEventSignal(queuedArrayEvent_);
     return asynSuccess;
 }
 
+/** Called by plugins that use credit based flow control to tell the driver that allocated their arrays
+  * how many more arrays they can queue.  This can be called with the plugin's lock held; it does not
+  * take the driver's lock.
+  * \param[in] pConsumer Identifies the plugin, normally its this pointer.
+  * \param[in] credits Number of free slots in the plugin's queue, or -1 to stop using flow control. */
+void asynNDArrayDriver::setDownstreamCredits(const void *pConsumer, int credits)
+{
+    queuedArrayCountMutex_->lock();
+    if (credits < 0) {
+        downstreamCredits_.erase(pConsumer);
+    } else {
+        downstreamCredits_[pConsumer] = credits;
+    }
+    queuedArrayCountMutex_->unlock();
+    epicsEventSignal(queuedArrayEvent_);
+}
+
+/** Returns the number of arrays that the driver can output before a plugin that uses flow control
+  * would drop one, i.e. the smallest number of free queue slots of those plugins, or -1 if no plugin
+  * uses flow control. */
+int asynNDArrayDriver::getDownstreamCredits()
+{
+    std::map<const void *, int>::const_iterator it;
+    int credits = -1;
+
+    queuedArrayCountMutex_->lock();
+    for (it=downstreamCredits_.begin(); it!=downstreamCredits_.end(); ++it) {
+        if ((credits < 0) || (it->second < credits)) credits = it->second;
+    }
+    queuedArrayCountMutex_->unlock();
+    return credits;
+}
+
+/** Returns true if a plugin that uses flow control has no free queue slots, so the next array that
+  * the driver outputs would be dropped.  Drivers can call this to skip reading out a frame. */
+bool asynNDArrayDriver::backPressure()
+{
+    return getDownstreamCredits() == 0;
+}
+
 void asynNDArrayDriver::updateTimeStamps(NDArray *pArray)
 {
     updateTimeStamp(&pArray->epicsTS);
@@ -842,6 +919,10 @@ void asynNDArrayDriver::updateTimeStamps(NDArray *pArray)
   * are simply passed to asynPortDriver::asynPortDriver.
   * asynNDArrayDriver creates an NDArrayPool object to allocate NDArray
   * objects. maxBuffers and maxMemory are passed to NDArrayPool::NDArrayPool.
+  * The free list implementation of the pool is selected by the global variables NDArrayPoolMode,
+  * NDArrayPoolClassesPerOctave and NDArrayPoolThreadCacheSize at the time this constructor runs,
+  * the NUMA node for its frame buffers by NDArrayPoolNumaNode, and background trimming of its free list by
+  * NDArrayPoolTrimHighWater, NDArrayPoolTrimLowWater and NDArrayPoolTrimAge.
   * \param[in] portName The name of the asyn port driver to be created.
   * \param[in] maxAddr The maximum  number of asyn addr addresses this driver supports. 1 is minimum.
   * \param[in] maxBuffers The maximum number of NDArray buffers that the NDArrayPool for this driver is
@@ -878,7 +959,10 @@ asynNDArrayDriver::asynNDArrayDriver(const char *portName, int maxAddr, int maxB
     if (priority <= 0) priority = epicsThreadPriorityMedium;
     threadPriority_ = priority;
 
-    this->pNDArrayPoolPvt_ = new NDArrayPool(this, maxMemory);
+    this->pNDArrayPoolPvt_ = new NDArrayPool(this, maxMemory, (NDArrayPoolMode_t)NDArrayPoolMode,
+                                             NDArrayPoolClassesPerOctave, NDArrayPoolThreadCacheSize);
+    this->pNDArrayPoolPvt_->setNumaNode(NDArrayPoolNumaNode);
+    this->pNDArrayPoolPvt_->setTrimming(NDArrayPoolTrimHighWater, NDArrayPoolTrimLowWater, NDArrayPoolTrimAge);
     this->pNDArrayPool = this->pNDArrayPoolPvt_;
     this->queuedArrayCountMutex_ = new epicsMutex();
 
@@ -944,12 +1028,22 @@ asynNDArrayDriver::asynNDArrayDriver(const char *portName, int maxAddr, int maxB
     createParam(NDPoolAllocBuffersString,     asynParamInt32,           &NDPoolAllocBuffers);
     createParam(NDPoolPreAllocBuffersString,  asynParamInt32,           &NDPoolPreAllocBuffers);
     createParam(NDPoolNumPreAllocBuffersString, asynParamInt32,         &NDPoolNumPreAllocBuffers);
+    createParam(NDPoolPreAllocSizeXString,    asynParamInt32,           &NDPoolPreAllocSizeX);
+    createParam(NDPoolPreAllocSizeYString,    asynParamInt32,           &NDPoolPreAllocSizeY);
+    createParam(NDPoolPreAllocSizeZString,    asynParamInt32,           &NDPoolPreAllocSizeZ);
+    createParam(NDPoolPreAllocDataTypeString, asynParamInt32,           &NDPoolPreAllocDataType);
+    createParam(NDPoolPreAllocPrefaultString, asynParamInt32,           &NDPoolPreAllocPrefault);
     createParam(NDPoolFreeBuffersString,      asynParamInt32,           &NDPoolFreeBuffers);
     createParam(NDPoolMaxMemoryString,        asynParamFloat64,         &NDPoolMaxMemory);
     createParam(NDPoolUsedMemoryString,       asynParamFloat64,         &NDPoolUsedMemory);
     createParam(NDPoolEmptyFreeListString,    asynParamInt32,           &NDPoolEmptyFreeList);
     createParam(NDPoolPollStatsString,        asynParamInt32,           &NDPoolPollStats);
+    createParam(NDPoolCacheHitsString,        asynParamFloat64,         &NDPoolCacheHits);
+    createParam(NDPoolCacheMissesString,      asynParamFloat64,         &NDPoolCacheMisses);
+    createParam(NDPoolConvertTimeString,      asynParamFloat64,         &NDPoolConvertTime);
+    createParam(NDPoolConvertThreadsString,   asynParamInt32,           &NDPoolConvertThreads);
     createParam(NDNumQueuedArraysString,      asynParamInt32,           &NDNumQueuedArrays);
+    createParam(NDBackPressureString,         asynParamInt32,           &NDBackPressure);
 
     /* Here we set the values of read-only parameters and of read/write parameters that cannot
      * or should not get their values from the database.  Note that values set here will override
@@ -996,6 +1090,11 @@ asynNDArrayDriver::asynNDArrayDriver(const char *portName, int maxAddr, int maxB
     setStringParam (NDAttributesFile, "");
     setIntegerParam(NDAttributesStatus, NDAttributesFileNotFound);
     setStringParam (NDAttributesMacros, "");
+    setIntegerParam(NDPoolPreAllocSizeX, 0);
+    setIntegerParam(NDPoolPreAllocSizeY, 0);
+    setIntegerParam(NDPoolPreAllocSizeZ, 0);
+    setIntegerParam(NDPoolPreAllocDataType, NDUInt8);
+    setIntegerParam(NDPoolPreAllocPrefault, 0);
 
     setIntegerParam(NDPoolAllocBuffers, this->pNDArrayPool->getNumBuffers());
     setIntegerParam(NDPoolFreeBuffers, this->pNDArrayPool->getNumFree());
@@ -1003,6 +1102,7 @@ asynNDArrayDriver::asynNDArrayDriver(const char *portName, int maxAddr, int maxB
     setDoubleParam(NDPoolUsedMemory, 0);
 
     setIntegerParam(NDNumQueuedArrays, 0);
+    setIntegerParam(NDBackPressure, 0);
 
     queuedArrayEvent_ = epicsEventCreate(epicsEventEmpty);
     queuedArrayUpdateDone_ = epicsEventCreate(epicsEventEmpty);
@@ -1052,3 +1152,143 @@ asynNDArrayDriver::~asynNDArrayDriver()
     delete this->queuedArrayCountMutex_;
 }
 
+
+/** Finds the asynNDArrayDriver for an iocsh command */
+static asynNDArrayDriver *findNDArrayDriver(const char *functionName, const char *portName)
+{
+    asynNDArrayDriver *pDriver = NULL;
+
+    if (portName) {
+        pDriver = dynamic_cast<asynNDArrayDriver *>(findAsynPortDriver(portName));
+    }
+    if (!pDriver) {
+        printf("%s: ERROR, %s is not an areaDetector driver or plugin\n", functionName, portName ? portName : "");
+    }
+    return pDriver;
+}
+
+/** Parses a list of sizes separated by commas, spaces or 'x', e.g. "2048x2048" or "1048576,4194304".
+  * Returns the number of sizes, or -1 if the list is invalid.
+  */
+static int parseSizeList(const char *list, size_t *sizes, int maxSizes)
+{
+    const char *p = list;
+    char *end;
+    int n = 0;
+
+    if (!list) return 0;
+    while (*p) {
+        if ((*p == ',') || (*p == ' ') || (*p == 'x') || (*p == 'X')) {
+            p++;
+            continue;
+        }
+        if (n >= maxSizes) return -1;
+        double size = strtod(p, &end);
+        if ((end == p) || (size < 1)) return -1;
+        sizes[n++] = (size_t)size;
+        p = end;
+    }
+    return n;
+}
+
+/** Pre-allocates buffers for the arrays of a driver or plugin, e.g. at IOC startup before the first frame.
+  * \param[in] portName The asyn port name of the driver or plugin.
+  * \param[in] numBuffers Number of buffers.
+  * \param[in] dims Array dimensions separated by commas or 'x', e.g. "2048x2048" or "3,1024,1024".
+  * \param[in] dataType NDDataType_t of the arrays.
+  * \param[in] prefault NDFrameMemoryPrefault_t; 1 faults in the pages of each buffer, 2 also locks them in memory.
+  */
+extern "C" int NDPoolPreAllocate(const char *portName, int numBuffers, const char *dims, int dataType, int prefault)
+{
+    static const char *functionName = "NDPoolPreAllocate";
+    size_t dimSizes[ND_ARRAY_MAX_DIMS];
+    NDArrayInfo arrayInfo;
+    int ndims;
+    asynStatus status;
+
+    asynNDArrayDriver *pDriver = findNDArrayDriver(functionName, portName);
+    if (!pDriver) return asynError;
+    ndims = parseSizeList(dims, dimSizes, ND_ARRAY_MAX_DIMS);
+    if (ndims <= 0) {
+        printf("%s: ERROR, invalid dimensions \"%s\"\n", functionName, dims ? dims : "");
+        return asynError;
+    }
+    if (NDArray::computeArrayInfo(ndims, dimSizes, (NDDataType_t)dataType, &arrayInfo) != ND_SUCCESS) {
+        printf("%s: ERROR, invalid data type %d\n", functionName, dataType);
+        return asynError;
+    }
+    pDriver->lock();
+    status = pDriver->preAllocateBuffers(numBuffers, arrayInfo.totalBytes, prefault);
+    pDriver->unlock();
+    return status;
+}
+
+/** Pre-allocates buffers of one or more sizes in bytes for a driver or plugin.
+  * \param[in] portName The asyn port name of the driver or plugin.
+  * \param[in] numBuffers Number of buffers of each size.
+  * \param[in] sizes Buffer sizes in bytes separated by commas, e.g. "1048576,4194304".
+  * \param[in] prefault NDFrameMemoryPrefault_t; 1 faults in the pages of each buffer, 2 also locks them in memory.
+  */
+extern "C" int NDPoolPreAllocateSizes(const char *portName, int numBuffers, const char *sizes, int prefault)
+{
+    static const char *functionName = "NDPoolPreAllocateSizes";
+    size_t dataSizes[ND_ARRAY_MAX_DIMS];
+    int numSizes;
+    asynStatus status = asynSuccess;
+
+    asynNDArrayDriver *pDriver = findNDArrayDriver(functionName, portName);
+    if (!pDriver) return asynError;
+    numSizes = parseSizeList(sizes, dataSizes, ND_ARRAY_MAX_DIMS);
+    if (numSizes <= 0) {
+        printf("%s: ERROR, invalid sizes \"%s\", at most %d sizes separated by commas\n",
+               functionName, sizes ? sizes : "", ND_ARRAY_MAX_DIMS);
+        return asynError;
+    }
+    pDriver->lock();
+    for (int i=0; i<numSizes; i++) {
+        if (pDriver->preAllocateBuffers(numBuffers, dataSizes[i], prefault) != asynSuccess) status = asynError;
+    }
+    pDriver->unlock();
+    return status;
+}
+
+/* EPICS iocsh shell commands */
+static const iocshArg preAllocArg0 = { "portName", iocshArgString};
+static const iocshArg preAllocArg1 = { "numBuffers", iocshArgInt};
+static const iocshArg preAllocArg2 = { "dims (e.g. 2048x2048)", iocshArgString};
+static const iocshArg preAllocArg3 = { "dataType", iocshArgInt};
+static const iocshArg preAllocArg4 = { "prefault (0=none, 1=fault in, 2=lock)", iocshArgInt};
+static const iocshArg * const preAllocArgs[] = {&preAllocArg0,
+                                                &preAllocArg1,
+                                                &preAllocArg2,
+                                                &preAllocArg3,
+                                                &preAllocArg4};
+static const iocshFuncDef preAllocFuncDef = {"NDPoolPreAllocate", 5, preAllocArgs};
+static void preAllocCallFunc(const iocshArgBuf *args)
+{
+    NDPoolPreAllocate(args[0].sval, args[1].ival, args[2].sval, args[3].ival, args[4].ival);
+}
+
+static const iocshArg preAllocSizesArg0 = { "portName", iocshArgString};
+static const iocshArg preAllocSizesArg1 = { "numBuffers", iocshArgInt};
+static const iocshArg preAllocSizesArg2 = { "sizes in bytes (e.g. 1048576,4194304)", iocshArgString};
+static const iocshArg preAllocSizesArg3 = { "prefault (0=none, 1=fault in, 2=lock)", iocshArgInt};
+static const iocshArg * const preAllocSizesArgs[] = {&preAllocSizesArg0,
+                                                     &preAllocSizesArg1,
+                                                     &preAllocSizesArg2,
+                                                     &preAllocSizesArg3};
+static const iocshFuncDef preAllocSizesFuncDef = {"NDPoolPreAllocateSizes", 4, preAllocSizesArgs};
+static void preAllocSizesCallFunc(const iocshArgBuf *args)
+{
+    NDPoolPreAllocateSizes(args[0].sval, args[1].ival, args[2].sval, args[3].ival);
+}
+
+extern "C" void asynNDArrayDriverRegister(void)
+{
+    iocshRegister(&preAllocFuncDef, preAllocCallFunc);
+    iocshRegister(&preAllocSizesFuncDef, preAllocSizesCallFunc);
+}
+
+extern "C" {
+epicsExportRegistrar(asynNDArrayDriverRegister);
+}
@@ -1,6 +1,8 @@
 #ifndef asynNDArrayDriver_H
 #define asynNDArrayDriver_H
 
+#include <map>
+
 #include <epicsMutex.h>
 #include <epicsEvent.h>
 
@@ -119,14 +121,24 @@ typedef enum {
 #define NDPoolAllocBuffersString        "POOL_ALLOC_BUFFERS"
 #define NDPoolPreAllocBuffersString     "POOL_PRE_ALLOC_BUFFERS"
 #define NDPoolNumPreAllocBuffersString  "POOL_NUM_PRE_ALLOC_BUFFERS"
+#define NDPoolPreAllocSizeXString       "POOL_PRE_ALLOC_SIZE_X"
+#define NDPoolPreAllocSizeYString       "POOL_PRE_ALLOC_SIZE_Y"
+#define NDPoolPreAllocSizeZString       "POOL_PRE_ALLOC_SIZE_Z"
+#define NDPoolPreAllocDataTypeString    "POOL_PRE_ALLOC_DATA_TYPE"
+#define NDPoolPreAllocPrefaultString    "POOL_PRE_ALLOC_PREFAULT"
 #define NDPoolFreeBuffersString         "POOL_FREE_BUFFERS"
 #define NDPoolMaxMemoryString           "POOL_MAX_MEMORY"
 #define NDPoolUsedMemoryString          "POOL_USED_MEMORY"
 #define NDPoolEmptyFreeListString       "POOL_EMPTY_FREELIST"
 #define NDPoolPollStatsString           "POOL_POLL_STATS"
+#define NDPoolCacheHitsString           "POOL_CACHE_HITS"
+#define NDPoolCacheMissesString         "POOL_CACHE_MISSES"
+#define NDPoolConvertTimeString         "POOL_CONVERT_TIME"
+#define NDPoolConvertThreadsString      "POOL_CONVERT_THREADS"
 
 /* Queued arrays */
 #define NDNumQueuedArraysString     "NUM_QUEUED_ARRAYS"
+#define NDBackPressureString        "BACK_PRESSURE"
 
 /** This is the class from which NDArray drivers are derived; implements the asynGenericPointer functions
   * for NDArray objects.
@@ -161,9 +173,13 @@ public:
     virtual void updateTimeStamps(NDArray *pArray);
 
     asynStatus incrementQueuedArrayCount();
-    asynStatus decrementQueuedArrayCount();
+    asynStatus decrementQueuedArrayCount(int count=1);
     int getQueuedArrayCount();
     void updateQueuedArrayCount();
+    void setDownstreamCredits(const void *pConsumer, int credits);
+    int getDownstreamCredits();
+    bool backPressure();
+    asynStatus preAllocateBuffers(int numBuffers, size_t dataSize, int prefault);
 
     class NDArrayPool *pNDArrayPool;     /**< An NDArrayPool pointer that is initialized to pNDArrayPoolPvt_ in the constructor.
                                      * Plugins change this pointer to the one passed in NDArray::pNDArrayPool */
@@ -228,12 +244,22 @@ protected:
     int NDPoolAllocBuffers;
     int NDPoolPreAllocBuffers;
     int NDPoolNumPreAllocBuffers;
+    int NDPoolPreAllocSizeX;
+    int NDPoolPreAllocSizeY;
+    int NDPoolPreAllocSizeZ;
+    int NDPoolPreAllocDataType;
+    int NDPoolPreAllocPrefault;
     int NDPoolFreeBuffers;
     int NDPoolMaxMemory;
     int NDPoolUsedMemory;
     int NDPoolEmptyFreeList;
     int NDPoolPollStats;
+    int NDPoolCacheHits;
+    int NDPoolCacheMisses;
+    int NDPoolConvertTime;
+    int NDPoolConvertThreads;
     int NDNumQueuedArrays;
+    int NDBackPressure;
 
     class NDArray **pArrays;             /**< An array of NDArray pointers used to store data in the driver */
     class NDAttributeList *pAttributeList;  /**< An NDAttributeList object used to obtain the current values of a set of attributes */
@@ -246,6 +272,8 @@ private:
     epicsMutex *queuedArrayCountMutex_;
     epicsEventId queuedArrayEvent_;
     int queuedArrayCount_;
+    std::map<const void *, int> downstreamCredits_;  /**< Free queue slots of each flow controlled plugin,
+                                                       *   protected by queuedArrayCountMutex_ */
 
     bool queuedArrayUpdateRun_;
     epicsEventId queuedArrayUpdateDone_;
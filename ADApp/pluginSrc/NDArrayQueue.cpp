@@ -0,0 +1,231 @@
+/*
+ * NDArrayQueue.cpp
+ *
+ * Bounded queue of NDArray pointers for the input of NDPluginDriver.
+ *
+ * The lock-free implementation is a bounded multi-producer multi-consumer ring in which each cell
+ * has a sequence number, the same algorithm as the NDArrayPool free lists.
+ * Sending never blocks.  A receiver that finds the ring empty polls it NDPluginQueueSpins more times
+ * before it waits on an epicsEvent, which a sender only triggers when a receiver is waiting.
+ */
+
+#include <stdio.h>
+
+#include <epicsAtomic.h>
+#include <epicsThread.h>
+#include <cantProceed.h>
+
+#include "NDArrayQueue.h"
+
+#include <epicsExport.h>
+
+/** Selects the input queue of plugins that are created after it is set, see NDArrayQueueMode_t.
+  * 0 (the default) is epicsMessageQueue, 1 is the lock-free ring. */
+volatile int NDPluginQueueMode = NDArrayQueueMessageQueue;
+/** Number of times a receiver polls an empty lock-free queue before it waits for an array */
+volatile int NDPluginQueueSpins = 1000;
+extern "C" {epicsExportAddress(int, NDPluginQueueMode);}
+extern "C" {epicsExportAddress(int, NDPluginQueueSpins);}
+
+/* Maximum number of times pop() retries a cell that a sender has claimed but not yet written before yielding */
+#define MAX_POP_SPINS 100
+
+/** Constructor.
+  * \param[in] capacity Maximum number of arrays in the queue.
+  * \param[in] mode NDArrayQueueMode_t implementation to use.
+  * \param[in] spins Number of times receive() polls an empty queue before it waits, for NDArrayQueueLockFree.
+  *            It is ignored on computers with a single CPU.
+  */
+NDArrayQueue::NDArrayQueue(int capacity, NDArrayQueueMode_t mode, int spins)
+    : mode_(mode), capacity_(capacity), spins_(spins), pMsgQ_(NULL), cells_(NULL),
+      enqueuePos_(0), dequeuePos_(0), waiters_(0), notEmpty_(epicsEventEmpty)
+{
+    if (capacity_ < 1) capacity_ = 1;
+    /* Spinning only helps if the sender can run at the same time */
+    if ((spins_ < 0) || (epicsThreadGetCPUs() < 2)) spins_ = 0;
+    if (mode_ == NDArrayQueueLockFree) {
+        cells_ = new cell[capacity_];
+        for (int i=0; i<capacity_; i++) {
+            cells_[i].sequence = i;
+            cells_[i].msg.pArray = NULL;
+        }
+    } else {
+        mode_ = NDArrayQueueMessageQueue;
+        pMsgQ_ = new epicsMessageQueue(capacity_, sizeof(message));
+        if (!pMsgQ_) {
+            cantProceed("NDArrayQueue::NDArrayQueue epicsMessageQueueCreate failure\n");
+        }
+    }
+}
+
+NDArrayQueue::~NDArrayQueue()
+{
+    delete pMsgQ_;
+    delete [] cells_;
+}
+
+/** Adds a message to the lock-free ring; returns false if the ring is full */
+bool NDArrayQueue::push(const message *pMsg)
+{
+    cell *pCell;
+    size_t pos = epicsAtomicGetSizeT(&enqueuePos_);
+    while (1) {
+        pCell = &cells_[pos % capacity_];
+        size_t seq = epicsAtomicGetSizeT(&pCell->sequence);
+        ptrdiff_t dif = (ptrdiff_t)(seq - pos);
+        if (dif == 0) {
+            if (epicsAtomicCmpAndSwapSizeT(&enqueuePos_, pos, pos+1) == pos) break;
+        } else if (dif < 0) {
+            return false;
+        }
+        pos = epicsAtomicGetSizeT(&enqueuePos_);
+    }
+    pCell->msg = *pMsg;
+    epicsAtomicWriteMemoryBarrier();
+    epicsAtomicSetSizeT(&pCell->sequence, pos+1);
+    return true;
+}
+
+/** Removes a message from the lock-free ring; returns false if the ring is empty */
+bool NDArrayQueue::pop(message *pMsg)
+{
+    cell *pCell;
+    int spins = 0;
+    size_t pos = epicsAtomicGetSizeT(&dequeuePos_);
+    while (1) {
+        pCell = &cells_[pos % capacity_];
+        size_t seq = epicsAtomicGetSizeT(&pCell->sequence);
+        ptrdiff_t dif = (ptrdiff_t)(seq - (pos+1));
+        if (dif == 0) {
+            if (epicsAtomicCmpAndSwapSizeT(&dequeuePos_, pos, pos+1) == pos) break;
+        } else if (dif < 0) {
+            // The ring is empty, or a sender has claimed this cell but not yet stored the array.
+            if (epicsAtomicGetSizeT(&enqueuePos_) == pos) return false;
+            if (++spins > MAX_POP_SPINS) epicsThreadSleep(0.);
+        }
+        pos = epicsAtomicGetSizeT(&dequeuePos_);
+    }
+    epicsAtomicReadMemoryBarrier();
+    *pMsg = pCell->msg;
+    epicsAtomicWriteMemoryBarrier();
+    epicsAtomicSetSizeT(&pCell->sequence, pos+capacity_);
+    return true;
+}
+
+/** Adds a message to the queue without waiting; returns false if the queue is full */
+bool NDArrayQueue::trySendMessage(const message *pMsg)
+{
+    if (pMsgQ_) return (pMsgQ_->trySend((void *)pMsg, sizeof(*pMsg)) == 0);
+
+    if (!push(pMsg)) return false;
+    /* The atomic add is a full barrier, so either the waiting receiver sees the array
+     * or we see that it is waiting */
+    if (epicsAtomicAddIntT(&waiters_, 0) > 0) notEmpty_.trigger();
+    return true;
+}
+
+/** Adds an array to the queue without waiting.
+  * \param[in] pArray The array.
+  * \param[in] pTime Time stamp that is received with the array, or NULL for none.
+  * \return Returns true if the array was added, false if the queue is full. */
+bool NDArrayQueue::trySend(NDArray *pArray, const epicsTimeStamp *pTime)
+{
+    message msg;
+
+    msg.pArray = pArray;
+    if (pTime) {
+        msg.time = *pTime;
+    } else {
+        msg.time.secPastEpoch = 0;
+        msg.time.nsec = 0;
+    }
+    return trySendMessage(&msg);
+}
+
+/** Adds an array to the queue, waiting until there is room for it.
+  * \param[in] pArray The array.
+  * \param[in] pTime Time stamp that is received with the array, or NULL for none. */
+void NDArrayQueue::send(NDArray *pArray, const epicsTimeStamp *pTime)
+{
+    message msg;
+
+    msg.pArray = pArray;
+    if (pTime) {
+        msg.time = *pTime;
+    } else {
+        msg.time.secPastEpoch = 0;
+        msg.time.nsec = 0;
+    }
+    if (pMsgQ_) {
+        pMsgQ_->send(&msg, sizeof(msg));
+        return;
+    }
+    while (!trySendMessage(&msg)) {
+        epicsThreadSleep(0.001);
+    }
+}
+
+/** Removes an array from the queue without waiting.
+  * \param[out] ppArray The array.
+  * \param[out] pTime If not NULL, the time stamp that was sent with the array.
+  * \return Returns true if an array was removed, false if the queue is empty. */
+bool NDArrayQueue::tryReceive(NDArray **ppArray, epicsTimeStamp *pTime)
+{
+    message msg;
+
+    if (pMsgQ_) {
+        if (pMsgQ_->tryReceive(&msg, sizeof(msg)) != sizeof(msg)) return false;
+    } else {
+        if (!pop(&msg)) return false;
+    }
+    *ppArray = msg.pArray;
+    if (pTime) *pTime = msg.time;
+    return true;
+}
+
+/** Removes an array from the queue, waiting until there is one.
+  * \param[out] pTime If not NULL, the time stamp that was sent with the array.
+  * \return The array. */
+NDArray* NDArrayQueue::receive(epicsTimeStamp *pTime)
+{
+    message msg;
+    int i;
+
+    msg.pArray = NULL;
+    msg.time.secPastEpoch = 0;
+    msg.time.nsec = 0;
+    if (pMsgQ_) {
+        pMsgQ_->receive(&msg, sizeof(msg));
+    } else {
+        while (1) {
+            for (i=0; i<=spins_; i++) {
+                if (pop(&msg)) goto done;
+            }
+            epicsAtomicIncrIntT(&waiters_);
+            if (pop(&msg)) {
+                epicsAtomicDecrIntT(&waiters_);
+                goto done;
+            }
+            notEmpty_.wait();
+            epicsAtomicDecrIntT(&waiters_);
+            /* The event is binary, so several arrays sent while more than one receiver was waiting
+             * may have woken only this one.  Pass the wakeup on if there are more arrays. */
+            if (pending() > 1 && epicsAtomicGetIntT(&waiters_) > 0) notEmpty_.trigger();
+        }
+    }
+done:
+    if (pTime) *pTime = msg.time;
+    return msg.pArray;
+}
+
+/** Returns the number of arrays in the queue. */
+int NDArrayQueue::pending()
+{
+    if (pMsgQ_) return pMsgQ_->pending();
+
+    size_t dequeuePos = epicsAtomicGetSizeT(&dequeuePos_);
+    ptrdiff_t count = (ptrdiff_t)(epicsAtomicGetSizeT(&enqueuePos_) - dequeuePos);
+    if (count < 0) count = 0;
+    if (count > capacity_) count = capacity_;
+    return (int)count;
+}
@@ -0,0 +1,61 @@
+#ifndef NDArrayQueue_H
+#define NDArrayQueue_H
+
+#include <stddef.h>
+#include <epicsEvent.h>
+#include <epicsTime.h>
+#include <epicsMessageQueue.h>
+
+#include <NDPluginAPI.h>
+
+#include "NDArray.h"
+
+/** Implementations of the NDArrayQueue */
+typedef enum {
+    NDArrayQueueMessageQueue,   /**< epicsMessageQueue, a mutex and condition variable for each operation */
+    NDArrayQueueLockFree        /**< Bounded lock-free ring, receivers spin and then wait on an event */
+} NDArrayQueueMode_t;
+
+/** Bounded queue of NDArray pointers from any number of sending threads to any number of receiving threads.
+  * This is the input queue of NDPluginDriver when BlockingCallbacks=0.  The queue does not change the
+  * reference count of the arrays.  A NULL pointer is a valid message; NDPluginDriver uses it to stop its threads.
+  * Each array can carry a time stamp, which NDPluginDriver uses for the time that arrays wait in the queue.
+  */
+class NDPLUGIN_API NDArrayQueue {
+public:
+    NDArrayQueue(int capacity, NDArrayQueueMode_t mode, int spins=0);
+    ~NDArrayQueue();
+    bool trySend(NDArray *pArray, const epicsTimeStamp *pTime=0);
+    void send(NDArray *pArray, const epicsTimeStamp *pTime=0);
+    NDArray* receive(epicsTimeStamp *pTime=0);
+    bool tryReceive(NDArray **ppArray, epicsTimeStamp *pTime=0);
+    int pending();
+    int capacity() const {return capacity_;}
+    NDArrayQueueMode_t mode() const {return mode_;}
+
+private:
+    struct message {
+        NDArray *pArray;
+        epicsTimeStamp time;
+    };
+    struct cell {
+        size_t sequence;
+        message msg;
+    };
+
+    bool push(const message *pMsg);
+    bool pop(message *pMsg);
+    bool trySendMessage(const message *pMsg);
+
+    NDArrayQueueMode_t mode_;
+    int capacity_;
+    int spins_;
+    epicsMessageQueue *pMsgQ_;  /**< Used in NDArrayQueueMessageQueue mode */
+    cell *cells_;               /**< Used in NDArrayQueueLockFree mode */
+    size_t enqueuePos_;
+    size_t dequeuePos_;
+    int waiters_;               /**< Number of receivers waiting on notEmpty_ */
+    epicsEvent notEmpty_;
+};
+
+#endif
@@ -0,0 +1,131 @@
+/*
+ * NDArrayReorderBuffer.cpp
+ *
+ * Buffer of output NDArrays indexed by uniqueId, used by NDPluginDriver to output arrays in order.
+ *
+ * The entries are allocated when the capacity is set, so adding and removing arrays never allocates memory.
+ * Each slot of the ring holds a list of the entries with one uniqueId, and the unused entries are kept in
+ * a free list.
+ */
+
+#include "NDArrayReorderBuffer.h"
+
+/** Constructor.
+  * \param[in] capacity Maximum number of arrays in the buffer; it is also the maximum difference between
+  *            the uniqueIds in the buffer plus 1. */
+NDArrayReorderBuffer::NDArrayReorderBuffer(int capacity)
+    : freeEntry_(-1), size_(0), lowId_(0), highId_(0), newCapacity_(-1)
+{
+    allocate(capacity);
+}
+
+void NDArrayReorderBuffer::allocate(int capacity)
+{
+    int i;
+
+    if (capacity < 0) capacity = 0;
+    entries_.resize(capacity);
+    slots_.resize(capacity);
+    for (i=0; i<capacity; i++) {
+        entries_[i].pArray = NULL;
+        entries_[i].next = (i < capacity-1) ? i+1 : -1;
+        slots_[i].head = -1;
+        slots_[i].tail = -1;
+    }
+    freeEntry_ = (capacity > 0) ? 0 : -1;
+    newCapacity_ = -1;
+}
+
+/** Changes the capacity of the buffer.  If the buffer is not empty the change is made when it next becomes empty.
+  * \param[in] capacity Maximum number of arrays in the buffer. */
+void NDArrayReorderBuffer::setCapacity(int capacity)
+{
+    if (capacity == this->capacity()) {
+        newCapacity_ = -1;
+    } else if (size_ == 0) {
+        allocate(capacity);
+    } else {
+        newCapacity_ = capacity;
+    }
+}
+
+/** Adds an array to the buffer.
+  * \param[in] pArray The array.
+  * \param[in] pTime The time the array was added, returned by first().
+  * \return Returns false if the buffer is full or if the uniqueId of pArray is capacity() or more
+  *         from another uniqueId in the buffer. */
+bool NDArrayReorderBuffer::add(NDArray *pArray, const epicsTimeStamp *pTime)
+{
+    int uniqueId = pArray->uniqueId;
+    int capacity = this->capacity();
+    int index;
+    slot *pSlot;
+
+    if (freeEntry_ < 0) return false;
+    if (size_ > 0) {
+        int lowId  = (uniqueId < lowId_)  ? uniqueId : lowId_;
+        int highId = (uniqueId > highId_) ? uniqueId : highId_;
+        if (highId - lowId >= capacity) return false;
+        lowId_ = lowId;
+        highId_ = highId;
+    } else {
+        lowId_ = highId_ = uniqueId;
+    }
+    index = freeEntry_;
+    freeEntry_ = entries_[index].next;
+    entries_[index].pArray = pArray;
+    entries_[index].time = *pTime;
+    entries_[index].next = -1;
+    pSlot = &slots_[((uniqueId % capacity) + capacity) % capacity];
+    if (pSlot->head < 0) {
+        pSlot->head = index;
+    } else {
+        entries_[pSlot->tail].next = index;
+    }
+    pSlot->tail = index;
+    size_++;
+    return true;
+}
+
+/** Returns the array with the lowest uniqueId, or NULL if the buffer is empty.
+  * \param[out] pTime If not NULL, the time passed to add() for the array. */
+NDArray* NDArrayReorderBuffer::first(epicsTimeStamp *pTime)
+{
+    int capacity = this->capacity();
+    entry *pEntry;
+
+    if (size_ == 0) return NULL;
+    pEntry = &entries_[slots_[((lowId_ % capacity) + capacity) % capacity].head];
+    if (pTime) *pTime = pEntry->time;
+    return pEntry->pArray;
+}
+
+/** Removes the array with the lowest uniqueId from the buffer.
+  * \return The array, or NULL if the buffer is empty. */
+NDArray* NDArrayReorderBuffer::removeFirst()
+{
+    int capacity = this->capacity();
+    int index;
+    NDArray *pArray;
+    slot *pSlot;
+
+    if (size_ == 0) return NULL;
+    pSlot = &slots_[((lowId_ % capacity) + capacity) % capacity];
+    index = pSlot->head;
+    pArray = entries_[index].pArray;
+    pSlot->head = entries_[index].next;
+    if (pSlot->head < 0) pSlot->tail = -1;
+    entries_[index].pArray = NULL;
+    entries_[index].next = freeEntry_;
+    freeEntry_ = index;
+    size_--;
+    if (size_ == 0) {
+        if (newCapacity_ >= 0) allocate(newCapacity_);
+    } else if (pSlot->head < 0) {
+        /* Move on to the next uniqueId in the buffer, which is at most highId_ */
+        do {
+            lowId_++;
+        } while (slots_[((lowId_ % capacity) + capacity) % capacity].head < 0);
+    }
+    return pArray;
+}
@@ -0,0 +1,53 @@
+#ifndef NDArrayReorderBuffer_H
+#define NDArrayReorderBuffer_H
+
+#include <vector>
+#include <epicsTime.h>
+
+#include <NDPluginAPI.h>
+
+#include "NDArray.h"
+
+/** Buffer of output NDArrays that NDPluginDriver holds back when SortMode=Sorted until the arrays
+  * with lower uniqueIds have been output.  The arrays are kept in a ring that is indexed by uniqueId,
+  * so adding an array and removing the one with the lowest uniqueId do not search or allocate memory.
+  * Arrays with the same uniqueId are kept in the order they were added.
+  * The uniqueIds in the buffer must be less than capacity() apart.
+  * The buffer does not change the reference count of the arrays and it is not thread safe;
+  * NDPluginDriver calls it with its lock held.
+  */
+class NDPLUGIN_API NDArrayReorderBuffer {
+public:
+    NDArrayReorderBuffer(int capacity=0);
+    void setCapacity(int capacity);
+    bool add(NDArray *pArray, const epicsTimeStamp *pTime);
+    NDArray* first(epicsTimeStamp *pTime=0);
+    NDArray* removeFirst();
+    /** Returns the number of arrays in the buffer */
+    int size() const {return size_;}
+    /** Returns the maximum number of arrays in the buffer */
+    int capacity() const {return (int)entries_.size();}
+
+private:
+    void allocate(int capacity);
+
+    struct entry {
+        NDArray *pArray;
+        epicsTimeStamp time;
+        int next;           /**< Next entry with the same uniqueId, or in the free list; -1 for none */
+    };
+    struct slot {
+        int head;           /**< First entry for this uniqueId, -1 if the slot is empty */
+        int tail;
+    };
+
+    std::vector<entry> entries_;
+    std::vector<slot> slots_;       /**< Slot uniqueId % capacity() */
+    int freeEntry_;                 /**< First entry of the free list */
+    int size_;
+    int lowId_;                     /**< Lowest and highest uniqueId in the buffer if it is not empty */
+    int highId_;
+    int newCapacity_;               /**< Capacity to change to when the buffer is next empty */
+};
+
+#endif
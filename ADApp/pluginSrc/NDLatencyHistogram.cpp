@@ -0,0 +1,98 @@
+/*
+ * NDLatencyHistogram.cpp
+ *
+ * Histogram of times with logarithmic bins, used by NDPluginDriver for the latency of each stage of a plugin.
+ */
+
+#include <string.h>
+#include <math.h>
+
+#include "NDLatencyHistogram.h"
+
+/* 2^(1/4), 2^(2/4) and 2^(3/4), the bin edges within an octave */
+static const double subBinEdges[ND_LATENCY_BINS_PER_OCTAVE-1] = {1.189207115002721, 1.414213562373095, 1.681792830507429};
+
+NDLatencyHistogram::NDLatencyHistogram()
+{
+    reset();
+}
+
+/** Clears the histogram. */
+void NDLatencyHistogram::reset()
+{
+    memset(counts_, 0, sizeof(counts_));
+    count_ = 0;
+    max_ = 0.;
+}
+
+/** Records a time.
+  * \param[in] seconds The time in seconds.
+  * \param[in] count The number of times to record it, e.g. the number of arrays in a batch. */
+void NDLatencyHistogram::record(double seconds, int count)
+{
+    double micros = seconds * 1e6;
+    double mantissa;
+    int exponent, bin, i;
+
+    if (count <= 0) return;
+    if (seconds > max_) max_ = seconds;
+    if (!(micros >= 1.)) {
+        bin = 0;
+    } else {
+        /* micros = mantissa * 2^exponent with mantissa in [0.5, 1), so it is in octave exponent-1 */
+        mantissa = 2. * frexp(micros, &exponent);
+        if (exponent > ND_LATENCY_OCTAVES) {
+            bin = ND_LATENCY_NUM_BINS - 1;
+        } else {
+            bin = 1 + (exponent-1) * ND_LATENCY_BINS_PER_OCTAVE;
+            for (i=0; i<ND_LATENCY_BINS_PER_OCTAVE-1; i++) {
+                if (mantissa >= subBinEdges[i]) bin++;
+            }
+        }
+    }
+    counts_[bin] += count;
+    count_ += count;
+}
+
+/** Returns the upper edge of a bin in seconds, or 0 for the last bin which has no upper edge.
+  * \param[in] bin The bin number, from 0 to ND_LATENCY_NUM_BINS-1. */
+double NDLatencyHistogram::binUpperEdge(int bin)
+{
+    if ((bin < 0) || (bin >= ND_LATENCY_NUM_BINS-1)) return 0.;
+    return pow(2., (double)bin/ND_LATENCY_BINS_PER_OCTAVE) * 1e-6;
+}
+
+/** Returns a percentile of the times in seconds.
+  * This is the upper edge of the bin that contains it, or the maximum time if that is smaller.
+  * \param[in] fraction The percentile as a fraction, e.g. 0.99 for the 99th percentile.
+  * \return The time, or 0 if no times have been recorded. */
+double NDLatencyHistogram::percentile(double fraction) const
+{
+    size_t target, sum = 0;
+    double edge;
+    int bin;
+
+    if (count_ == 0) return 0.;
+    target = (size_t)ceil(fraction * count_);
+    if (target < 1) target = 1;
+    for (bin=0; bin<ND_LATENCY_NUM_BINS-1; bin++) {
+        sum += counts_[bin];
+        if (sum >= target) break;
+    }
+    edge = binUpperEdge(bin);
+    if ((edge == 0.) || (edge > max_)) edge = max_;
+    return edge;
+}
+
+/** Copies the counts of the bins, limited to the largest value of an epicsInt32.
+  * \param[out] pCounts Array for the counts.
+  * \param[in] nElements Size of pCounts; at most ND_LATENCY_NUM_BINS counts are copied. */
+void NDLatencyHistogram::getCounts(epicsInt32 *pCounts, size_t nElements) const
+{
+    size_t i;
+
+    if (nElements > ND_LATENCY_NUM_BINS) nElements = ND_LATENCY_NUM_BINS;
+    for (i=0; i<nElements; i++) {
+        pCounts[i] = (counts_[i] > 0x7fffffff) ? 0x7fffffff : (epicsInt32)counts_[i];
+    }
+}
@@ -0,0 +1,41 @@
+#ifndef NDLatencyHistogram_H
+#define NDLatencyHistogram_H
+
+#include <stddef.h>
+#include <epicsTypes.h>
+
+#include <NDPluginAPI.h>
+
+/** Number of bins per factor of 2 in time */
+#define ND_LATENCY_BINS_PER_OCTAVE 4
+/** Number of factors of 2 above 1 microsecond that the bins cover */
+#define ND_LATENCY_OCTAVES 30
+/** Number of bins: below 1 microsecond, ND_LATENCY_BINS_PER_OCTAVE bins for each octave, and the rest */
+#define ND_LATENCY_NUM_BINS (ND_LATENCY_BINS_PER_OCTAVE*ND_LATENCY_OCTAVES + 2)
+
+/** Histogram of times with logarithmic bins, from which NDPluginDriver computes the percentiles of the
+  * time that arrays spend in each stage of a plugin.  Bin 0 counts times below 1 microsecond, bin i from 1 to
+  * ND_LATENCY_NUM_BINS-2 counts times from 2^((i-1)/4) up to 2^(i/4) microseconds, and the last bin counts
+  * longer times, so percentiles are within 19% of the true value.  Recording a time does not allocate memory
+  * or compute a logarithm.  The histogram is not thread safe; NDPluginDriver uses it with its lock held.
+  */
+class NDPLUGIN_API NDLatencyHistogram {
+public:
+    NDLatencyHistogram();
+    void reset();
+    void record(double seconds, int count=1);
+    double percentile(double fraction) const;
+    /** Returns the longest time recorded in seconds */
+    double maximum() const {return max_;}
+    /** Returns the number of times recorded */
+    size_t count() const {return count_;}
+    void getCounts(epicsInt32 *pCounts, size_t nElements) const;
+    static double binUpperEdge(int bin);
+
+private:
+    size_t counts_[ND_LATENCY_NUM_BINS];
+    size_t count_;
+    double max_;
+};
+
+#endif
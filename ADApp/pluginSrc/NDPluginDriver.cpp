@@ -12,24 +12,73 @@
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
+#include <vector>
 
 #include <epicsMessageQueue.h>
+#include <epicsAtomic.h>
 #include <cantProceed.h>
 
 #include "NDPluginDriver.h"
+#include "NDArrayQueue.h"
+#include "NDArrayReorderBuffer.h"
+#include "NDConvert.h"
+#include "NDPluginExecutor.h"
+#include "NDTraceSink.h"
 #include "throttler.h"
 
+#include <iocsh.h>
 #include <epicsExport.h>
 
-typedef enum {
-    ToThreadMessageData,
-    ToThreadMessageExit
-} ToThreadMessageType_t;
+extern volatile int NDPluginQueueMode;
+extern volatile int NDPluginQueueSpins;
+
+/** If non-zero, plugins that are created while it is set process their queues with the IOC-wide
+  * NDPluginExecutor threads instead of creating their own threads */
+volatile int NDPluginUseExecutor = 0;
+extern "C" {epicsExportAddress(int, NDPluginUseExecutor);}
+
+/* Maximum number of arrays that an executor task processes before it lets other plugins run */
+#define EXECUTOR_BATCH_SIZE 8
+
+/* wakeProcessTask() queues this instead of an array, the plugin thread then calls processWakeup() */
+static char wakeupTag;
+#define WAKEUP_MESSAGE ((NDArray *)&wakeupTag)
+
+/* Minimum time in seconds between updates of the latency percentile parameters */
+#define LATENCY_UPDATE_PERIOD 1.0
 
+static const char *latencyStageNames[NDPluginLatencyNumStages] = {"QUEUE", "PROCESS", "COPY", "OUTPUT"};
+
+/** Arrays smaller than this many bytes are processed in one thread even if ParallelThreads > 1,
+  * because starting the other threads would take longer than the processing */
+volatile int NDPluginParallelMinBytes = 1024*1024;
+extern "C" {epicsExportAddress(int, NDPluginParallelMinBytes);}
+
+/* Number of bands per thread in parallelFor(), more than 1 balances the load when some threads are busy */
+#define PARALLEL_BANDS_PER_THREAD 4
+
+/** One call to parallelFor() */
 typedef struct {
-    ToThreadMessageType_t messageType;
-    NDArray *pArray;
-} ToThreadMessage_t;
+    NDPluginBandFunc_t func;
+    void *pvt;
+    size_t numItems;
+    int numBands;
+} parallelForArgs_t;
+
+/* Band function for NDConvertRunBands() that runs bands first to first+count-1 of a parallelFor() */
+static void parallelForBands(void *pvt, size_t first, size_t count)
+{
+    parallelForArgs_t *pArgs = (parallelForArgs_t *)pvt;
+    size_t band, firstItem, lastItem;
+
+    for (band=first; band<first+count; band++) {
+        firstItem = pArgs->numItems * band / pArgs->numBands;
+        lastItem = pArgs->numItems * (band + 1) / pArgs->numBands;
+        if (lastItem > firstItem) pArgs->func(pArgs->pvt, (int)band, firstItem, lastItem - firstItem);
+    }
+}
+
+/* The input queue carries NDArray pointers, a NULL pointer tells a plugin thread to exit */
 
 typedef enum {
     FromThreadMessageEnter,
@@ -43,9 +92,6 @@ typedef struct {
 
 static const char *driverName="NDPluginDriver";
 
-sortedListElement::sortedListElement(NDArray *pArray, epicsTimeStamp time)
-    : pArray_(pArray), insertionTime_(time) {}
-
 static void sortingTaskC(void *drvPvt)
 {
     NDPluginDriver *pPvt = (NDPluginDriver *)drvPvt;
@@ -53,6 +99,29 @@ static void sortingTaskC(void *drvPvt)
     pPvt->sortingTask();
 }
 
+static void executorTaskC(void *drvPvt)
+{
+    NDPluginDriver *pPvt = (NDPluginDriver *)drvPvt;
+
+    pPvt->executorTask();
+}
+
+static void paramTimerCallbackC(void *drvPvt)
+{
+    NDPluginDriver *pPvt = (NDPluginDriver *)drvPvt;
+
+    pPvt->paramTimerCallback();
+}
+
+/* The plugin whose arrays the calling thread is processing, see beginArrayProcessing() */
+static epicsThreadOnceId processingPluginOnce = EPICS_THREAD_ONCE_INIT;
+static epicsThreadPrivateId processingPluginId;
+
+static void processingPluginInit(void *arg)
+{
+    processingPluginId = epicsThreadPrivateCreate();
+}
+
 /** Constructor for NDPluginDriver; most parameters are simply passed to asynNDArrayDriver::asynNDArrayDriver.
   * After calling the base class constructor this method creates a thread to execute the NDArray callbacks,
   * and sets reasonable default values for all of the parameters defined in NDPluginDriver.h.
@@ -80,12 +149,14 @@ static void sortingTaskC(void *drvPvt)
   *            This value should also be used for any other threads this object creates.
   * \param[in] maxThreads The maximum number of threads this plugin is allowed to use.
   * \param[in] compressionAware true if the plugin can handle compressed input arrays, false if not.
+  * \param[in] viewAware true if the plugin can handle input arrays that are views (NDArray::isView()),
+  *            false if it must receive a contiguous copy of them.
   */
 NDPluginDriver::NDPluginDriver(const char *portName, int queueSize, int blockingCallbacks,
                                const char *NDArrayPort, int NDArrayAddr, int maxAddr,
                                int maxBuffers, size_t maxMemory, int interfaceMask, int interruptMask,
                                int asynFlags, int autoConnect, int priority, int stackSize, int maxThreads,
-                               bool compressionAware)
+                               bool compressionAware, bool viewAware)
 
     : asynNDArrayDriver(portName, maxAddr, maxBuffers, maxMemory,
           interfaceMask | asynInt32Mask | asynFloat64Mask | asynOctetMask | asynInt32ArrayMask | asynDrvUserMask,
@@ -96,9 +167,20 @@ NDPluginDriver::NDPluginDriver(const char *portName, int queueSize, int blocking
     firstOutputArray_(true),
     pToThreadMsgQ_(NULL),
     pFromThreadMsgQ_(NULL),
+    pSortBuffer_(new NDArrayReorderBuffer()),
     prevUniqueId_(-1000),
     sortingThreadId_(0),
+    sortingEvent_(epicsEventMustCreate(epicsEventEmpty)),
+    sortingExitEvent_(epicsEventMustCreate(epicsEventEmpty)),
+    sortingThreadExit_(false),
     compressionAware_(compressionAware),
+    viewAware_(viewAware),
+    pExecutor_(NULL),
+    executorTasks_(0),
+    pCreditDriver_(NULL),
+    queueFree_(queueSize),
+    fusedInput_(false),
+    fusedOutput_(false),
     throttler_(new Throttler())
 {
     asynUser *pasynUser;
@@ -115,6 +197,16 @@ NDPluginDriver::NDPluginDriver(const char *portName, int queueSize, int blocking
     this->connectedToArrayPort_ = false;
 
     if (maxThreads < 1) maxThreads = 1;
+    if (NDPluginUseExecutor) pExecutor_ = NDPluginExecutor::getInstance();
+
+    /* Timer for the parameter callbacks that MaxParamRate delays */
+    epicsThreadOnce(&processingPluginOnce, processingPluginInit, NULL);
+    paramTimerQueue_ = epicsTimerQueueAllocate(1, epicsThreadPriorityScanLow);
+    paramTimer_ = epicsTimerQueueCreateTimer(paramTimerQueue_, paramTimerCallbackC, this);
+    paramTimerActive_ = false;
+    paramCallbackTimes_.resize(this->maxAddr);
+    memset(&paramCallbackTimes_[0], 0, this->maxAddr*sizeof(epicsTimeStamp));
+    pendingParamAddr_.assign(this->maxAddr, -1);
 
     /* Create asynUser for communicating with NDArray port */
     pasynUser = pasynManager->createAsynUser(0, 0);
@@ -142,6 +234,29 @@ NDPluginDriver::NDPluginDriver(const char *portName, int queueSize, int blocking
     createParam(NDPluginDriverExecutionTimeString,     asynParamFloat64, &NDPluginDriverExecutionTime);
     createParam(NDPluginDriverMinCallbackTimeString,   asynParamFloat64, &NDPluginDriverMinCallbackTime);
     createParam(NDPluginDriverMaxByteRateString,       asynParamFloat64, &NDPluginDriverMaxByteRate);
+    createParam(NDPluginDriverParallelThreadsString,   asynParamInt32, &NDPluginDriverParallelThreads);
+    createParam(NDPluginDriverBatchSizeString,         asynParamInt32, &NDPluginDriverBatchSize);
+    createParam(NDPluginDriverMaxParamRateString,      asynParamFloat64, &NDPluginDriverMaxParamRate);
+    createParam(NDPluginDriverFlowControlString,       asynParamInt32, &NDPluginDriverFlowControl);
+    createParam(NDPluginDriverQueuePolicyString,       asynParamInt32, &NDPluginDriverQueuePolicy);
+    createParam(NDPluginDriverDroppedOldestString,     asynParamInt32, &NDPluginDriverDroppedOldest);
+    createParam(NDPluginDriverDroppedStaleString,      asynParamInt32, &NDPluginDriverDroppedStale);
+    createParam(NDPluginDriverFusedString,             asynParamInt32, &NDPluginDriverFused);
+    createParam(NDPluginDriverZeroCopyString,          asynParamInt32, &NDPluginDriverZeroCopy);
+    createParam(NDPluginDriverLatencyResetString,      asynParamInt32, &NDPluginDriverLatencyReset);
+    for (int i=0; i<NDPluginLatencyNumStages; i++) {
+        char paramName[64];
+        epicsSnprintf(paramName, sizeof(paramName), "LATENCY_%s_P50", latencyStageNames[i]);
+        createParam(paramName, asynParamFloat64, &NDPluginDriverLatencyP50[i]);
+        epicsSnprintf(paramName, sizeof(paramName), "LATENCY_%s_P90", latencyStageNames[i]);
+        createParam(paramName, asynParamFloat64, &NDPluginDriverLatencyP90[i]);
+        epicsSnprintf(paramName, sizeof(paramName), "LATENCY_%s_P99", latencyStageNames[i]);
+        createParam(paramName, asynParamFloat64, &NDPluginDriverLatencyP99[i]);
+        epicsSnprintf(paramName, sizeof(paramName), "LATENCY_%s_MAX", latencyStageNames[i]);
+        createParam(paramName, asynParamFloat64, &NDPluginDriverLatencyMax[i]);
+        epicsSnprintf(paramName, sizeof(paramName), "LATENCY_%s_HIST", latencyStageNames[i]);
+        createParam(paramName, asynParamInt32Array, &NDPluginDriverLatencyHist[i]);
+    }
 
     /* Here we set the values of read-only parameters and of read/write parameters that cannot
      * or should not get their values from the database.  Note that values set here will override
@@ -157,6 +272,18 @@ NDPluginDriver::NDPluginDriver(const char *portName, int queueSize, int blocking
     setIntegerParam(NDPluginDriverQueueFree, queueSize);
     setIntegerParam(NDPluginDriverMaxThreads, maxThreads);
     setIntegerParam(NDPluginDriverNumThreads, 1);
+    setIntegerParam(NDPluginDriverParallelThreads, 1);
+    setIntegerParam(NDPluginDriverBatchSize, 1);
+    setDoubleParam(NDPluginDriverMaxParamRate, 0.);
+    setIntegerParam(NDPluginDriverFlowControl, 0);
+    setIntegerParam(NDPluginDriverQueuePolicy, NDPluginQueueDropNewest);
+    setIntegerParam(NDPluginDriverDroppedOldest, 0);
+    setIntegerParam(NDPluginDriverDroppedStale, 0);
+    setIntegerParam(NDPluginDriverFused, NDPluginFusedNone);
+    setIntegerParam(NDPluginDriverZeroCopy, 0);
+    setIntegerParam(NDPluginDriverLatencyReset, 0);
+    epicsTimeGetCurrent(&latencyUpdateTime_);
+    updateLatencyParams(&latencyUpdateTime_, true);
     setIntegerParam(NDPluginDriverBlockingCallbacks, blockingCallbacks);
 
     /* Create the callback threads, unless blocking callbacks are disabled with
@@ -180,12 +307,45 @@ void NDPluginDriver::shutdownPortDriver() {
     // unlocked it because the mutex is deleted in the asynPortDriver destructor and the
     // mutex must be unlocked before deleting it.
     this->lock();
+    updateCredits(NULL, 0);
     deleteCallbackThreads();
+    if (sortingThreadId_) {
+        sortingThreadExit_ = true;
+        epicsEventSignal(sortingEvent_);
+        this->unlock();
+        epicsEventMustWait(sortingExitEvent_);
+        this->lock();
+        sortingThreadId_ = 0;
+    }
+    /* Release the arrays that are waiting to be sorted */
+    NDArray *pArray;
+    while ((pArray = pSortBuffer_->removeFirst())) {
+        pArray->release();
+    }
     this->unlock();
 
+    destroyParamTimer();
+
     asynNDArrayDriver::shutdownPortDriver();
 }
 
+/** Destroys the MaxParamRate timer and releases its timer queue; it does nothing if this was already done.
+  * This waits for the timer callback if it is running, so it must be called with the mutex unlocked. */
+void NDPluginDriver::destroyParamTimer()
+{
+    epicsTimerId timer;
+
+    this->lock();
+    timer = paramTimer_;
+    paramTimer_ = 0;
+    this->unlock();
+    if (timer) {
+        epicsTimerQueueDestroyTimer(paramTimerQueue_, timer);
+        epicsTimerQueueRelease(paramTimerQueue_);
+        paramTimerQueue_ = 0;
+    }
+}
+
 NDPluginDriver::~NDPluginDriver()
 {
     // If the driver subclass is not destructible, or asyn is old, or we are not
@@ -194,8 +354,13 @@ NDPluginDriver::~NDPluginDriver()
     // shutdown has already been done, be we don't want to rely on that.
     if (pToThreadMsgQ_)
         shutdownPortDriver();
+    // Plugins without a queue skip the shutdown above, but the timer is always created
+    destroyParamTimer();
 
     delete throttler_;
+    delete pSortBuffer_;
+    epicsEventDestroy(sortingEvent_);
+    epicsEventDestroy(sortingExitEvent_);
 }
 
 /** Method that is normally called at the beginning of the processCallbacks
@@ -255,11 +420,13 @@ void NDPluginDriver::beginProcessCallbacks(NDArray *pArray)
   * method in derived classes.
   * \param[in] pArray  The NDArray from the callback.
   * \param[in] copyArray This flag should be true if pArray is the original array passed to processCallbacks().
-  *            It must be false if the derived class if pArray is a new NDArray that processCallbacks() created
+  *            It must be false if the derived class if pArray is a new NDArray that processCallbacks() created.
+  *            If it is true the output array is made by passThroughArray()
   * \param[in] readAttributes This flag must be true if the derived class has not yet called readAttributes() for pArray.
   *
-  * This method does NDArray callbacks to downstream plugins if NDArrayCallbacks is true and SortMode is Unsorted.
-  * If SortMode is sorted it inserts the NDArray into the std::multilist for callbacks in SortThread().
+  * This method does NDArray callbacks to downstream plugins if NDArrayCallbacks is true.
+  * If SortMode is Sorted and arrays with lower uniqueIds may still arrive it adds the NDArray to the sort buffer,
+  * from which it is output as soon as they have been output, or after SortTime by sortingTask().
   * It keeps track of DisorderedArrays and DroppedOutputArrays.
   * It caches the most recent NDArray in pArrays[0]. */
 asynStatus NDPluginDriver::endProcessCallbacks(NDArray *pArray, bool copyArray, bool readAttributes)
@@ -283,7 +450,7 @@ asynStatus NDPluginDriver::endProcessCallbacks(NDArray *pArray, bool copyArray,
     getIntegerParam(NDPluginDriverSortMode, &callbacksSorted);
     getIntegerParam(NDPluginDriverDroppedOutputArrays, &droppedOutputArrays);
     if (copyArray) {
-        pArrayOut = this->pNDArrayPool->copy(pArray, NULL, 1);
+        pArrayOut = passThroughArray(pArray, &readAttributes);
     }
     if (NULL != pArrayOut) {
         if (readAttributes) {
@@ -310,41 +477,133 @@ asynStatus NDPluginDriver::endProcessCallbacks(NDArray *pArray, bool copyArray,
     }
     bool orderOK = (pArrayOut->uniqueId == prevUniqueId_)   ||
                    (pArrayOut->uniqueId == prevUniqueId_+1);
-    if (callbacksSorted && !orderOK) {
+    /* An array with a lower uniqueId than the last one output is already too late to sort */
+    bool late = !firstOutputArray_ && (pArrayOut->uniqueId < prevUniqueId_);
+    if (callbacksSorted && !orderOK && !late) {
         int sortSize;
-        int listSize = (int)sortedNDArrayList_.size();
+        epicsTimeStamp now;
         getIntegerParam(NDPluginDriverSortSize, &sortSize);
-        setIntegerParam(NDPluginDriverSortFree, sortSize-listSize);
-        if (listSize >= sortSize) {
+        pSortBuffer_->setCapacity(sortSize);
+        epicsTimeGetCurrent(&now);
+        if (pSortBuffer_->add(pArrayOut, &now)) {
+            pArrayOut->reserve();
+            /* The sorting thread waits without a timeout while the buffer is empty */
+            if (pSortBuffer_->size() == 1) epicsEventSignal(sortingEvent_);
+        } else {
             asynPrint(pasynUserSelf, ASYN_TRACE_WARNING,
-                "%s::%s std::multilist size exceeded, dropped array uniqueId=%d\n",
+                "%s::%s sort buffer full, dropped array uniqueId=%d\n",
                 driverName, functionName, pArrayOut->uniqueId);
             droppedOutputArrays++;
             setIntegerParam(NDPluginDriverDroppedOutputArrays, droppedOutputArrays);
-        } else {
-            epicsTimeStamp now;
-            epicsTimeGetCurrent(&now);
-            pArrayOut->reserve();
-            sortedListElement *pListElement = new sortedListElement(pArrayOut, now);
-            sortedNDArrayList_.insert(*pListElement);
         }
+        setIntegerParam(NDPluginDriverSortFree, sortSize - pSortBuffer_->size());
     } else {
-        doCallbacksGenericPointer(pArrayOut, NDArrayData, 0);
-        if (!firstOutputArray_ && !orderOK) {
-            int disorderedArrays;
-            getIntegerParam(NDPluginDriverDisorderedArrays, &disorderedArrays);
-            disorderedArrays++;
-            setIntegerParam(NDPluginDriverDisorderedArrays, disorderedArrays);
-            asynPrint(pasynUserSelf, ASYN_TRACE_WARNING,
-                "%s::%s disordered array found uniqueId=%d, prevUniqueId_=%d, orderOK=%d, disorderedArrays=%d\n",
-                driverName, functionName, pArrayOut->uniqueId, prevUniqueId_, orderOK, disorderedArrays);
-        }
-        firstOutputArray_ = false;
-        prevUniqueId_ = pArrayOut->uniqueId;
+        outputArray(pArrayOut);
+        /* This array may be the one that the arrays in the sort buffer are waiting for */
+        if (pSortBuffer_->size() > 0) outputSortedArrays();
     }
     return asynSuccess;
 }
 
+/** Returns the array that a plugin outputs when it passes its input array downstream unchanged.
+  * \param[in] pArray  The NDArray from the callback.
+  * \param[in,out] pReadAttributes Set to false if the plugin must not call getAttributes() for the returned array.
+  * \return The output array, which the caller owns a reference to, or NULL if it cannot be allocated.
+  *
+  * Normally this is a copy of pArray.  With ZeroCopy=1, or when the downstream plugin is fused, the data is
+  * not copied: if the plugin has no attributes to add pArray itself is returned with an additional reference,
+  * otherwise a shared array from NDArrayPool::share(), which has the data of pArray and a copy of its attributes.
+  * This is called with the lock held. */
+NDArray *NDPluginDriver::passThroughArray(NDArray *pArray, bool *pReadAttributes)
+{
+    int zeroCopy;
+    NDArray *pArrayOut;
+    epicsTimeStamp tStart, tEnd;
+
+    getIntegerParam(NDPluginDriverZeroCopy, &zeroCopy);
+    if (zeroCopy || fusedOutput_) {
+        if (this->pAttributeList->count() == 0) {
+            pArray->reserve();
+            *pReadAttributes = false;
+            return pArray;
+        }
+        return this->pNDArrayPool->share(pArray);
+    }
+    epicsTimeGetCurrent(&tStart);
+    pArrayOut = this->pNDArrayPool->copy(pArray, NULL, 1);
+    epicsTimeGetCurrent(&tEnd);
+    recordLatency(NDPluginLatencyCopy, &tStart, &tEnd);
+    return pArrayOut;
+}
+
+/** Does the NDArray callbacks to downstream plugins for an output array.
+  * It keeps track of DisorderedArrays.  This is called with the lock held.
+  * \param[in] pArray The NDArray to output. */
+void NDPluginDriver::outputArray(NDArray *pArray)
+{
+    static const char *functionName = "outputArray";
+    bool orderOK = (pArray->uniqueId == prevUniqueId_)   ||
+                   (pArray->uniqueId == prevUniqueId_+1);
+    epicsTimeStamp tStart, tEnd;
+
+    epicsTimeGetCurrent(&tStart);
+    doCallbacksGenericPointer(pArray, NDArrayData, 0);
+    epicsTimeGetCurrent(&tEnd);
+    recordLatency(NDPluginLatencyOutput, &tStart, &tEnd);
+    if (NDTraceSink::active()) NDTraceSink::record(portName, NDTraceOutput, pArray->uniqueId, &tStart, &tEnd);
+    if (!firstOutputArray_ && !orderOK) {
+        int disorderedArrays;
+        getIntegerParam(NDPluginDriverDisorderedArrays, &disorderedArrays);
+        disorderedArrays++;
+        setIntegerParam(NDPluginDriverDisorderedArrays, disorderedArrays);
+        asynPrint(pasynUserSelf, ASYN_TRACE_WARNING,
+            "%s::%s disordered array found uniqueId=%d, prevUniqueId_=%d, orderOK=%d, disorderedArrays=%d\n",
+            driverName, functionName, pArray->uniqueId, prevUniqueId_, orderOK, disorderedArrays);
+    }
+    firstOutputArray_ = false;
+    prevUniqueId_ = pArray->uniqueId;
+}
+
+/** Outputs the arrays in the sort buffer that follow the last array that was output, and the array
+  * with the lowest uniqueId if it has been in the buffer for longer than SortTime because the arrays
+  * before it have not arrived.  This is called with the lock held.
+  * \return The time in seconds until the array with the lowest uniqueId has been in the buffer
+  *         for SortTime, or -1 if the buffer is empty. */
+double NDPluginDriver::outputSortedArrays()
+{
+    double sortTime;
+    double waitTime = -1.;
+    int sortSize;
+    bool haveTime = false;
+    epicsTimeStamp now, addTime;
+    NDArray *pArray;
+    static const char *functionName = "outputSortedArrays";
+
+    getDoubleParam(NDPluginDriverSortTime, &sortTime);
+    while ((pArray = pSortBuffer_->first(&addTime))) {
+        bool orderOK = (pArray->uniqueId == prevUniqueId_)   ||
+                       (pArray->uniqueId == prevUniqueId_+1);
+        if (firstOutputArray_ || !orderOK) {
+            if (!haveTime) {
+                epicsTimeGetCurrent(&now);
+                haveTime = true;
+            }
+            waitTime = sortTime - epicsTimeDiffInSeconds(&now, &addTime);
+            asynPrint(pasynUserSelf, ASYN_TRACEIO_DRIVER,
+                "%s::%s, waitTime=%f, buffer size=%d, uniqueId=%d\n",
+                driverName, functionName, waitTime, pSortBuffer_->size(), pArray->uniqueId);
+            if (waitTime > 0.) break;
+        }
+        pSortBuffer_->removeFirst();
+        outputArray(pArray);
+        pArray->release();
+        waitTime = -1.;
+    }
+    getIntegerParam(NDPluginDriverSortSize, &sortSize);
+    setIntegerParam(NDPluginDriverSortFree, sortSize - pSortBuffer_->size());
+    return waitTime;
+}
+
 
 extern "C" {static void driverCallback(void *drvPvt, asynUser *pasynUser, void *genericPointer)
 {
@@ -373,6 +632,53 @@ bool NDPluginDriver::throttled(NDArray *pArray)
     return !throttler_->tryTake(needed);
 }
 
+/** Returns the number of bands that parallelFor() should split an array into.
+  * This is 1, i.e. the calling thread does all of the work, if ParallelThreads is 1 or the array
+  * is smaller than NDPluginParallelMinBytes.  This is called with the lock held.
+  * \param[in] pArray The array to be processed.
+  * \param[in] numItems The number of items, e.g. rows or elements, that are split into bands.
+  * \return The number of bands, between 1 and numItems. */
+int NDPluginDriver::getNumBands(NDArray *pArray, size_t numItems)
+{
+    int numThreads;
+    size_t numBands;
+    NDArrayInfo arrayInfo;
+
+    getIntegerParam(NDPluginDriverParallelThreads, &numThreads);
+    if ((numThreads <= 1) || (numItems <= 1)) return 1;
+    pArray->getInfo(&arrayInfo);
+    if (arrayInfo.totalBytes < (size_t)NDPluginParallelMinBytes) return 1;
+    numBands = (size_t)numThreads * PARALLEL_BANDS_PER_THREAD;
+    if (numBands > numItems) numBands = numItems;
+    return (int)numBands;
+}
+
+/** Calls func for numBands bands of items 0 to numItems-1 with the shared NDConvert worker threads.
+  * The calling thread processes bands too, and this returns when all of the bands are done.
+  * The bands are the same for the same numItems and numBands however many threads are free,
+  * so results that are combined from the bands do not depend on the timing.
+  * This must be called with the lock released.
+  * \param[in] func Function that processes one band.
+  * \param[in] pvt Passed to func.
+  * \param[in] numItems Number of items, e.g. rows or elements.
+  * \param[in] numBands Number of bands from getNumBands(). */
+void NDPluginDriver::parallelFor(NDPluginBandFunc_t func, void *pvt, size_t numItems, int numBands)
+{
+    parallelForArgs_t args;
+
+    if ((size_t)numBands > numItems) numBands = (int)numItems;
+    if (numBands <= 1) {
+        if (numItems > 0) func(pvt, 0, 0, numItems);
+        return;
+    }
+    args.func = func;
+    args.pvt = pvt;
+    args.numItems = numItems;
+    args.numBands = numBands;
+    NDConvertRunBands(parallelForBands, &args, numBands,
+                      (numBands + PARALLEL_BANDS_PER_THREAD - 1) / PARALLEL_BANDS_PER_THREAD);
+}
+
 /** Method that is called from the driver with a new NDArray.
   * It calls the processCallbacks function, which typically is implemented in the
   * derived class.
@@ -390,11 +696,17 @@ void NDPluginDriver::driverCallback(asynUser *pasynUser, void *genericPointer)
     double minCallbackTime, deltaTime;
     int status=0;
     int blockingCallbacks;
-    int droppedArrays, queueSize, queueFree;
+    int droppedArrays, queueSize, queueFree, queuePolicy;
     bool ignoreQueueFull = false;
+    void *pPrevious;
     static const char *functionName = "driverCallback";
 
+    if (NDTraceSink::active()) {
+        epicsTimeGetCurrent(&tNow);
+        NDTraceSink::record(portName, NDTraceCallback, pArray->uniqueId, &tNow);
+    }
     this->lock();
+    pPrevious = beginArrayProcessing();
 
     if (!compressionAware_ && !pArray->codec.empty()) {
         getIntegerParam(NDPluginDriverDroppedArrays, &droppedArrays);
@@ -405,6 +717,7 @@ void NDPluginDriver::driverCallback(asynUser *pasynUser, void *genericPointer)
         setIntegerParam(NDPluginDriverDroppedArrays, droppedArrays);
 
         callParamCallbacks();
+        endArrayProcessing(pPrevious);
         this->unlock();
         return;
     }
@@ -432,20 +745,33 @@ void NDPluginDriver::driverCallback(asynUser *pasynUser, void *genericPointer)
         /* Update the time we last posted an array */
         epicsTimeGetCurrent(&tNow);
         memcpy(&this->lastProcessTime_, &tNow, sizeof(tNow));
-        if (blockingCallbacks) {
-            processCallbacks(pArray);
+        if (blockingCallbacks || fusedInput_) {
+            processArrays(&pArray, 1);
             epicsTimeGetCurrent(&tEnd);
             setDoubleParam(NDPluginDriverExecutionTime, epicsTimeDiffInSeconds(&tEnd, &tNow)*1e3);
         } else {
             /* Increase the reference count again on this array
              * It will be released in the background task when processing is done */
             pArray->reserve();
+            getIntegerParam(NDPluginDriverQueuePolicy, &queuePolicy);
+            /* With KeepLatest the arrays that are waiting are stale now, so only this one will be processed next */
+            if (queuePolicy == NDPluginQueueKeepLatest) {
+                dropQueuedArrays(0, NDPluginDriverDroppedStale);
+            }
             /* Try to put this array on the message queue.  If there is no room then return
-             * immediately. */
-            ToThreadMessage_t msg = {ToThreadMessageData, pArray};
-            status = pToThreadMsgQ_->trySend(&msg, sizeof(msg));
+             * immediately, or with DropOldest make room by dropping the oldest array. */
+            status = pToThreadMsgQ_->trySend(pArray, &tNow) ? asynSuccess : asynError;
+            if (status && (queuePolicy != NDPluginQueueDropNewest)) {
+                for (int retry=0; status && (retry<10); retry++) {
+                    dropQueuedArrays(pToThreadMsgQ_->capacity()-1, (queuePolicy == NDPluginQueueDropOldest) ?
+                                     NDPluginDriverDroppedOldest : NDPluginDriverDroppedStale);
+                    status = pToThreadMsgQ_->trySend(pArray, &tNow) ? asynSuccess : asynError;
+                }
+            }
             queueFree = queueSize - pToThreadMsgQ_->pending();
             setIntegerParam(NDPluginDriverQueueFree, queueFree);
+            epicsAtomicSetIntT(&queueFree_, queueFree);
+            updateCredits(pArray->pDriver, queueFree);
             if (status) {
                 pasynUser->auxStatus = asynOverflow;
                 if (!ignoreQueueFull) {
@@ -455,15 +781,18 @@ void NDPluginDriver::driverCallback(asynUser *pasynUser, void *genericPointer)
                         driverName, functionName, pArray->uniqueId);
                     droppedArrays++;
                     status |= setIntegerParam(NDPluginDriverDroppedArrays, droppedArrays);
+                    if (NDTraceSink::active()) NDTraceSink::record(portName, NDTraceDropped, pArray->uniqueId, &tNow);
                 }
                 /* This buffer needs to be released */
                 pArray->release();
             } else {
                 pArray->pDriver->incrementQueuedArrayCount();
+                if (pExecutor_) scheduleExecutorTask(false);
             }
         }
     }
     callParamCallbacks();
+    endArrayProcessing(pPrevious);
     this->unlock();
 }
 
@@ -475,12 +804,12 @@ void NDPluginDriver::driverCallback(asynUser *pasynUser, void *genericPointer)
 void NDPluginDriver::processTask()
 {
     /* This thread processes a new array when it arrives */
-    int queueSize, queueFree;
-    epicsTimeStamp tStart, tEnd;
-    int numBytes;
     int status;
+    int batchSize, numArrays;
+    bool wakeup;
     NDArray *pArray=0;
-    ToThreadMessage_t toMsg;
+    std::vector<NDArray *> batch;
+    std::vector<epicsTimeStamp> queuedTimes;
     FromThreadMessage_t fromMsg = {FromThreadMessageEnter, epicsThreadGetIdSelf()};
     static const char *functionName = "processTask";
 
@@ -494,51 +823,450 @@ void NDPluginDriver::processTask()
     this->lock();
     /* Loop forever */
     while (1) {
+        getIntegerParam(NDPluginDriverBatchSize, &batchSize);
+        if (batchSize < 1) batchSize = 1;
+        if ((int)batch.size() < batchSize) {
+            batch.resize(batchSize);
+            queuedTimes.resize(batchSize);
+        }
 
-        /* Wait for an array to arrive from the queue. Release the lock while  waiting. */
+        /* Wait for an array to arrive from the queue. Release the lock while  waiting.
+         * Then take up to BatchSize-1 more arrays that are already in the queue. */
         this->unlock();
-        numBytes = pToThreadMsgQ_->receive(&toMsg, sizeof(toMsg));
-        if (numBytes != sizeof(toMsg)) {
-            asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
-                "%s::%s error reading message queue, expected size=%d, actual=%d\n",
-                driverName, functionName, (int)sizeof(toMsg), numBytes);
+        numArrays = 0;
+        wakeup = false;
+        pArray = pToThreadMsgQ_->receive(&queuedTimes[0]);
+        while (pArray) {
+            if (pArray == WAKEUP_MESSAGE) {
+                wakeup = true;
+            } else {
+                batch[numArrays++] = pArray;
+                if (numArrays == batchSize) break;
+            }
+            if (!pToThreadMsgQ_->tryReceive(&pArray, &queuedTimes[numArrays])) break;
         }
-        switch (toMsg.messageType) {
-            case ToThreadMessageExit:
-                asynPrint(pasynUserSelf, ASYN_TRACE_FLOW,
-                    "%s::%s received exit message, thread=%s\n",
-                    driverName, functionName, epicsThreadGetNameSelf());
-                fromMsg.messageType = FromThreadMessageExit;
-                pFromThreadMsgQ_->send(&fromMsg, sizeof(fromMsg));
-                return; // shutdown thread if special message
-                break;
-            case ToThreadMessageData:
-                pArray = toMsg.pArray;
-                break;
-            default:
-                asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
-                    "%s::%s unknown message type = %d\n",
-                    driverName, functionName, toMsg.messageType);
+        if (wakeup || (numArrays > 0)) {
+            this->lock();
+            if (wakeup) processQueuedWakeup();
+            if (numArrays > 0) processQueuedArrays(&batch[0], &queuedTimes[0], numArrays);
+        }
+        if (!pArray) {
+            if (wakeup || (numArrays > 0)) this->unlock();
+            asynPrint(pasynUserSelf, ASYN_TRACE_FLOW,
+                "%s::%s received exit message, thread=%s\n",
+                driverName, functionName, epicsThreadGetNameSelf());
+            fromMsg.messageType = FromThreadMessageExit;
+            pFromThreadMsgQ_->send(&fromMsg, sizeof(fromMsg));
+            return; // shutdown thread if special message
         }
+    }
+}
 
-        // Note: the lock must not be taken until after the thread exit logic above
-        this->lock();
-        epicsTimeGetCurrent(&tStart);
-        getIntegerParam(NDPluginDriverQueueSize, &queueSize);
-        queueFree = queueSize - pToThreadMsgQ_->pending();
-        setIntegerParam(NDPluginDriverQueueFree, queueFree);
+/** Processes arrays taken from the input queue and releases them.  This is called with the lock held.
+  * The queue statistics, ExecutionTime and the parameter callbacks are updated once for the batch;
+  * ExecutionTime is the average time per array.
+  * \param[in] pArrays The NDArrays from the queue, in the order they were queued.
+  * \param[in] queuedTimes The times at which the arrays were queued.
+  * \param[in] numArrays Number of arrays. */
+void NDPluginDriver::processQueuedArrays(NDArray *pArrays[], epicsTimeStamp queuedTimes[], int numArrays)
+{
+    int queueSize, queueFree;
+    int i, first;
+    epicsTimeStamp tStart, tEnd;
+    void *pPrevious = beginArrayProcessing();
+
+    epicsTimeGetCurrent(&tStart);
+    for (i=0; i<numArrays; i++) {
+        recordLatency(NDPluginLatencyQueue, &queuedTimes[i], &tStart);
+        if (NDTraceSink::active()) {
+            NDTraceSink::record(portName, NDTraceQueue, pArrays[i]->uniqueId, &queuedTimes[i], &tStart);
+        }
+    }
+    getIntegerParam(NDPluginDriverQueueSize, &queueSize);
+    queueFree = queueSize - pToThreadMsgQ_->pending();
+    setIntegerParam(NDPluginDriverQueueFree, queueFree);
+    epicsAtomicSetIntT(&queueFree_, queueFree);
+    updateCredits(pArrays[numArrays-1]->pDriver, queueFree);
+
+    /* Call the function that does the business of this callback.
+     * This function should release the lock during time-consuming operations,
+     * but of course it must not access any class data when the lock is released. */
+    processArrays(pArrays, numArrays);
+
+    epicsTimeGetCurrent(&tEnd);
+    setDoubleParam(NDPluginDriverExecutionTime, epicsTimeDiffInSeconds(&tEnd, &tStart)*1e3/numArrays);
+    /* Arrays that come from the same driver are counted down together */
+    for (first=0, i=1; i<=numArrays; i++) {
+        if ((i == numArrays) || (pArrays[i]->pDriver != pArrays[first]->pDriver)) {
+            pArrays[first]->pDriver->decrementQueuedArrayCount(i - first);
+            first = i;
+        }
+    }
+    callParamCallbacks();
+    endArrayProcessing(pPrevious);
+    /* We are done with these array buffers */
+    for (i=0; i<numArrays; i++) {
+        pArrays[i]->release();
+    }
+}
 
-        /* Call the function that does the business of this callback.
-         * This function should release the lock during time-consuming operations,
-         * but of course it must not access any class data when the lock is released. */
-        processCallbacks(pArray);
+/** Calls processWakeup() for a wake-up message from the input queue.  This is called with the lock held. */
+void NDPluginDriver::processQueuedWakeup()
+{
+    void *pPrevious = beginArrayProcessing();
 
-        epicsTimeGetCurrent(&tEnd);
-        setDoubleParam(NDPluginDriverExecutionTime, epicsTimeDiffInSeconds(&tEnd, &tStart)*1e3);
+    processWakeup();
+    callParamCallbacks();
+    endArrayProcessing(pPrevious);
+}
+
+/** Called by a plugin thread, with the lock held, after wakeProcessTask().
+  * Plugins that output arrays later than they receive them, e.g. after a timeout, override this to do it
+  * in the plugin thread rather than in a timer thread.  The default implementation does nothing. */
+void NDPluginDriver::processWakeup()
+{
+}
+
+/** Queues a message that makes a plugin thread call processWakeup().  The plugin threads also run with
+  * BlockingCallbacks=1, unless the plugin was created with BlockingCallbacks=1 and it was never set to 0.
+  * If the input queue is full no message is queued, because a plugin thread will run soon anyway.
+  * This is called with the lock held.
+  * \return false if there are no plugin threads. */
+bool NDPluginDriver::wakeProcessTask()
+{
+    if (!pToThreadMsgQ_) return false;
+    if (pToThreadMsgQ_->trySend(WAKEUP_MESSAGE) && pExecutor_) scheduleExecutorTask(false);
+    return true;
+}
+
+/** Marks the calling thread as processing arrays for this plugin, so that callParamCallbacks() is limited
+  * to MaxParamRate.  This is called with the lock held.
+  * \return The plugin that the thread was processing arrays for before, to pass to endArrayProcessing(). */
+void* NDPluginDriver::beginArrayProcessing()
+{
+    void *pPrevious = epicsThreadPrivateGet(processingPluginId);
+    epicsThreadPrivateSet(processingPluginId, this);
+    return pPrevious;
+}
+
+/** Ends the marking done by beginArrayProcessing().  Blocking callbacks to downstream plugins
+  * mark the same thread for the downstream plugin, so the previous plugin is restored.
+  * \param[in] pPrevious The value that beginArrayProcessing() returned. */
+void NDPluginDriver::endArrayProcessing(void *pPrevious)
+{
+    epicsThreadPrivateSet(processingPluginId, pPrevious);
+}
+
+/** Adds the time that arrays took in a stage to its latency histogram.  This is called with the lock held.
+  * \param[in] stage The stage.
+  * \param[in] pStart The time the stage started; a time of 0 is not recorded.
+  * \param[in] pEnd The time the stage ended.
+  * \param[in] count The number of arrays that the stage processed together, which each took the average time. */
+void NDPluginDriver::recordLatency(NDPluginLatencyStage_t stage, const epicsTimeStamp *pStart,
+                                   const epicsTimeStamp *pEnd, int count)
+{
+    double elapsed;
+
+    if ((pStart->secPastEpoch == 0) && (pStart->nsec == 0)) return;
+    elapsed = epicsTimeDiffInSeconds(pEnd, pStart);
+    if (elapsed < 0.) elapsed = 0.;
+    if (count > 1) elapsed /= count;
+    latency_[stage].record(elapsed, count);
+}
+
+/** Sends the number of free slots in the input queue to the driver that allocated the arrays when
+  * FlowControl is enabled, so that it can stop producing arrays that would be dropped.  The plugin stops
+  * sending them to a driver when FlowControl is disabled, with BlockingCallbacks=1, in a fused chain, or when
+  * the arrays come from a different driver.  This is called with the lock held.
+  * \param[in] pDriver The driver of the last array received, NULL to stop sending them.
+  * \param[in] queueFree Number of free slots in the queue. */
+void NDPluginDriver::updateCredits(asynNDArrayDriver *pDriver, int queueFree)
+{
+    int flowControl, blockingCallbacks;
+
+    getIntegerParam(NDPluginDriverFlowControl, &flowControl);
+    getIntegerParam(NDPluginDriverBlockingCallbacks, &blockingCallbacks);
+    if (!flowControl || blockingCallbacks || fusedInput_) pDriver = NULL;
+    if (pCreditDriver_ && (pCreditDriver_ != pDriver)) pCreditDriver_->setDownstreamCredits(this, -1);
+    pCreditDriver_ = pDriver;
+    if (pDriver) pDriver->setDownstreamCredits(this, queueFree);
+}
+
+/** Takes the oldest arrays off the input queue and releases them without processing them, until at most
+  * maxPending arrays are queued.  This implements the DropOldest and KeepLatest queue policies, and is called
+  * from driverCallback() with the lock held, so no other arrays are queued at the same time.
+  * \param[in] maxPending Number of arrays to leave in the queue.
+  * \param[in] droppedParam The parameter that counts the dropped arrays.
+  * \return The number of arrays dropped. */
+int NDPluginDriver::dropQueuedArrays(int maxPending, int droppedParam)
+{
+    NDArray *pArray;
+    epicsTimeStamp tNow;
+    int dropped, numDropped = 0;
+    static const char *functionName = "dropQueuedArrays";
+
+    while (pToThreadMsgQ_->pending() > maxPending) {
+        if (!pToThreadMsgQ_->tryReceive(&pArray)) break;
+        if (!pArray) {
+            /* An exit message from deleteCallbackThreads(), which must still reach a thread */
+            pToThreadMsgQ_->send(NULL);
+            break;
+        }
+        /* A wake-up is not needed, the array that is being queued wakes up the thread */
+        if (pArray == WAKEUP_MESSAGE) continue;
+        asynPrint(pasynUserSelf, ASYN_TRACE_FLOW,
+            "%s::%s dropped queued array uniqueId=%d\n",
+            driverName, functionName, pArray->uniqueId);
+        if (NDTraceSink::active()) {
+            epicsTimeGetCurrent(&tNow);
+            NDTraceSink::record(portName, NDTraceDropped, pArray->uniqueId, &tNow);
+        }
         pArray->pDriver->decrementQueuedArrayCount();
-        callParamCallbacks();
-        /* We are done with this array buffer */
         pArray->release();
+        numDropped++;
+    }
+    if (numDropped > 0) {
+        getIntegerParam(droppedParam, &dropped);
+        setIntegerParam(droppedParam, dropped + numDropped);
+    }
+    return numDropped;
+}
+
+/** Records the trace events for processing a batch of arrays, if a trace is active.  The arrays are shown
+  * one after the other, each taking the average time.
+  * \param[in] pArrays The arrays.
+  * \param[in] numArrays Number of arrays.
+  * \param[in] pStart The time processing started.
+  * \param[in] pEnd The time processing ended. */
+void NDPluginDriver::traceProcessing(NDArray *pArrays[], int numArrays, const epicsTimeStamp *pStart,
+                                     const epicsTimeStamp *pEnd)
+{
+    double elapsed;
+    epicsTimeStamp tStart, tEnd;
+    int i;
+
+    if (!NDTraceSink::active()) return;
+    elapsed = epicsTimeDiffInSeconds(pEnd, pStart) / numArrays;
+    tEnd = *pStart;
+    for (i=0; i<numArrays; i++) {
+        tStart = tEnd;
+        tEnd = *pStart;
+        epicsTimeAddSeconds(&tEnd, elapsed*(i+1));
+        NDTraceSink::record(portName, NDTraceProcess, pArrays[i]->uniqueId, &tStart, &tEnd);
+    }
+}
+
+/** Sets the latency percentile parameters from the histograms and does the callbacks for the
+  * histogram waveforms.  This is called with the lock held, after each batch of arrays is processed.
+  * \param[in] pNow The current time.
+  * \param[in] force true to update them now, false to update them only if LATENCY_UPDATE_PERIOD
+  *            has passed since the last update. */
+void NDPluginDriver::updateLatencyParams(const epicsTimeStamp *pNow, bool force)
+{
+    epicsInt32 counts[ND_LATENCY_NUM_BINS];
+    int stage;
+
+    if (!force && (epicsTimeDiffInSeconds(pNow, &latencyUpdateTime_) < LATENCY_UPDATE_PERIOD)) return;
+    latencyUpdateTime_ = *pNow;
+    for (stage=0; stage<NDPluginLatencyNumStages; stage++) {
+        NDLatencyHistogram *pHist = &latency_[stage];
+        setDoubleParam(NDPluginDriverLatencyP50[stage], pHist->percentile(0.50)*1e3);
+        setDoubleParam(NDPluginDriverLatencyP90[stage], pHist->percentile(0.90)*1e3);
+        setDoubleParam(NDPluginDriverLatencyP99[stage], pHist->percentile(0.99)*1e3);
+        setDoubleParam(NDPluginDriverLatencyMax[stage], pHist->maximum()*1e3);
+        pHist->getCounts(counts, ND_LATENCY_NUM_BINS);
+        doCallbacksInt32Array(counts, ND_LATENCY_NUM_BINS, NDPluginDriverLatencyHist[stage], 0);
+    }
+}
+
+/** Does the callbacks for the parameters in a parameter list that have changed.
+  * While the calling thread is processing arrays for this plugin and MaxParamRate is not 0,
+  * the callbacks for each list are done at most MaxParamRate times per second.  Callbacks that
+  * are delayed are done by paramTimerCallback(), so the last values are always published,
+  * at most 1/MaxParamRate seconds after the last array.  Callbacks from other threads,
+  * e.g. for the writes of clients, are never delayed.  This is called with the lock held.
+  * \param[in] list The parameter list number.
+  * \param[in] addr The asyn address to use for the callbacks. */
+asynStatus NDPluginDriver::callParamCallbacks(int list, int addr)
+{
+    double maxParamRate, minInterval, interval;
+    epicsTimeStamp now;
+
+    if ((list < 0) || (list >= (int)pendingParamAddr_.size()) ||
+        (epicsThreadPrivateGet(processingPluginId) != this)) {
+        return asynNDArrayDriver::callParamCallbacks(list, addr);
+    }
+    getDoubleParam(NDPluginDriverMaxParamRate, &maxParamRate);
+    if ((maxParamRate <= 0.) || !paramTimer_) {
+        return asynNDArrayDriver::callParamCallbacks(list, addr);
+    }
+    minInterval = 1./maxParamRate;
+    epicsTimeGetCurrent(&now);
+    interval = epicsTimeDiffInSeconds(&now, &paramCallbackTimes_[list]);
+    if ((interval >= minInterval) && (pendingParamAddr_[list] < 0)) {
+        paramCallbackTimes_[list] = now;
+        return asynNDArrayDriver::callParamCallbacks(list, addr);
+    }
+    /* The values stay in the parameter library until the timer does the callbacks */
+    pendingParamAddr_[list] = addr;
+    if (!paramTimerActive_) {
+        paramTimerActive_ = true;
+        epicsTimerStartDelay(paramTimer_, (interval < minInterval) ? minInterval - interval : 0.);
+    }
+    return asynSuccess;
+}
+
+/** Does the parameter callbacks that callParamCallbacks() delayed because of MaxParamRate.
+  * This method should really be private, but it must be called from a
+  * C-linkage callback function, so it must be public. */
+void NDPluginDriver::paramTimerCallback()
+{
+    int list, addr;
+
+    this->lock();
+    paramTimerActive_ = false;
+    for (list=0; list<(int)pendingParamAddr_.size(); list++) {
+        addr = pendingParamAddr_[list];
+        if (addr < 0) continue;
+        pendingParamAddr_[list] = -1;
+        epicsTimeGetCurrent(&paramCallbackTimes_[list]);
+        asynNDArrayDriver::callParamCallbacks(list, addr);
+    }
+    this->unlock();
+}
+
+/** Submits a task to the executor that processes the input queue, unless NumThreads tasks of this plugin
+  * are already queued or running.  This keeps the arrays of a plugin with NumThreads=1 in order.
+  * \param[in] resubmit true if an executor task is submitting itself again. */
+void NDPluginDriver::scheduleExecutorTask(bool resubmit)
+{
+    if (resubmit) {
+        pExecutor_->submit(executorTaskC, this, false);
+    } else if (epicsAtomicIncrIntT(&executorTasks_) <= numThreads_) {
+        pExecutor_->submit(executorTaskC, this);
+    } else {
+        epicsAtomicDecrIntT(&executorTasks_);
+    }
+}
+
+/** Task that the NDPluginExecutor threads run instead of processTask() when NDPluginUseExecutor was set
+  * when the plugin was created.  It processes batches of up to BatchSize arrays from the input queue until
+  * the queue is empty, or until it has processed a few arrays and then it submits itself again so other
+  * plugins can run.
+  * This method should really be private, but it must be called from a
+  * C-linkage callback function, so it must be public. */
+void NDPluginDriver::executorTask()
+{
+    NDArray *pArray;
+    int batchSize, numArrays;
+    int numProcessed = 0;
+    bool wakeup;
+
+    this->lock();
+    getIntegerParam(NDPluginDriverBatchSize, &batchSize);
+    this->unlock();
+    if (batchSize < 1) batchSize = 1;
+    std::vector<NDArray *> batch(batchSize);
+    std::vector<epicsTimeStamp> queuedTimes(batchSize);
+
+    while (numProcessed < EXECUTOR_BATCH_SIZE) {
+        wakeup = false;
+        for (numArrays=0; numArrays<batchSize; ) {
+            if (!pToThreadMsgQ_->tryReceive(&pArray, &queuedTimes[numArrays])) break;
+            if (pArray == WAKEUP_MESSAGE) {
+                wakeup = true;
+                continue;
+            }
+            batch[numArrays++] = pArray;
+        }
+        if (!wakeup && (numArrays == 0)) break;
+        this->lock();
+        if (wakeup) processQueuedWakeup();
+        if (numArrays > 0) processQueuedArrays(&batch[0], &queuedTimes[0], numArrays);
+        this->unlock();
+        numProcessed += numArrays;
+    }
+    if (numProcessed >= EXECUTOR_BATCH_SIZE) {
+        scheduleExecutorTask(true);
+        return;
+    }
+    /* An array that was queued after the queue was found empty but before the count was decremented
+     * did not start a task, so check again */
+    epicsAtomicDecrIntT(&executorTasks_);
+    if (pToThreadMsgQ_->pending() > 0) scheduleExecutorTask(false);
+}
+
+/** Processes a batch of arrays that have been queued for this plugin.
+  * The default implementation calls processCallbacks() for each array in turn.
+  * Plugins that can process several small arrays more efficiently together, e.g. by publishing
+  * their parameters once, can override it.  This is called with the lock held.
+  * numArrays is 1 with blocking callbacks and when BatchSize is 1.
+  * \param[in] pArrays The NDArrays, in the order they were received.
+  * \param[in] numArrays Number of arrays. */
+void NDPluginDriver::processCallbacksBatch(NDArray *pArrays[], int numArrays)
+{
+    for (int i=0; i<numArrays; i++) {
+        processCallbacks(pArrays[i]);
+    }
+}
+
+/** Calls processCallbacksBatch() with arrays from the driver.
+  * If an array is a view and this plugin is not view aware then it is replaced by a contiguous copy
+  * of the view, which is released afterwards.  This is called with the lock held.
+  * \param[in] pArrays The NDArrays from the driver.
+  * \param[in] numArrays Number of arrays. */
+void NDPluginDriver::processArrays(NDArray *pArrays[], int numArrays)
+{
+    NDArray *pInput;
+    int i, droppedArrays;
+    bool haveViews = false;
+    epicsTimeStamp tStart, tEnd;
+    std::vector<NDArray *> inputs, copies;
+    static const char *functionName = "processArrays";
+
+    if (!viewAware_) {
+        for (i=0; i<numArrays; i++) {
+            if (pArrays[i]->isView()) haveViews = true;
+        }
+    }
+    if (!haveViews) {
+        epicsTimeGetCurrent(&tStart);
+        processCallbacksBatch(pArrays, numArrays);
+        epicsTimeGetCurrent(&tEnd);
+        recordLatency(NDPluginLatencyProcess, &tStart, &tEnd, numArrays);
+        traceProcessing(pArrays, numArrays, &tStart, &tEnd);
+        updateLatencyParams(&tEnd, false);
+        return;
+    }
+    for (i=0; i<numArrays; i++) {
+        pInput = pArrays[i];
+        if (pInput->isView()) {
+            this->unlock();
+            pInput = pInput->pNDArrayPool->materialize(pArrays[i]);
+            this->lock();
+            if (!pInput) {
+                getIntegerParam(NDPluginDriverDroppedArrays, &droppedArrays);
+                asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+                    "%s::%s cannot copy view, dropped array uniqueId=%d\n",
+                    driverName, functionName, pArrays[i]->uniqueId);
+                droppedArrays++;
+                setIntegerParam(NDPluginDriverDroppedArrays, droppedArrays);
+                continue;
+            }
+            copies.push_back(pInput);
+        }
+        inputs.push_back(pInput);
+    }
+    if (!inputs.empty()) {
+        epicsTimeGetCurrent(&tStart);
+        processCallbacksBatch(&inputs[0], (int)inputs.size());
+        epicsTimeGetCurrent(&tEnd);
+        recordLatency(NDPluginLatencyProcess, &tStart, &tEnd, (int)inputs.size());
+        traceProcessing(&inputs[0], (int)inputs.size(), &tStart, &tEnd);
+        updateLatencyParams(&tEnd, false);
+    }
+    for (i=0; i<(int)copies.size(); i++) {
+        copies[i]->release();
     }
 }
 
@@ -628,61 +1356,34 @@ asynStatus NDPluginDriver::connectToArrayPort(void)
     return(status);
 }
 
-/** Method runs as a separate thread, periodically doing NDArray callbacks to downstream plugins.
+/** Method runs as a separate thread, doing NDArray callbacks to downstream plugins for arrays in the
+  * sort buffer when the arrays before them have not arrived within SortTime.
+  * It waits until the array with the lowest uniqueId has been in the buffer for SortTime, and waits
+  * without a timeout when the buffer is empty.  Arrays that are in order are output by endProcessCallbacks().
   * This thread is used when SortMode=1.
   * This method should really be private, but it must be called from a
   * C-linkage callback function, so it must be public. */
 void NDPluginDriver::sortingTask()
 {
-    double sortTime;
-    epicsTimeStamp now;
-    int sortSize;
-    double deltaTime;
-    int listSize;
-    std::multiset<sortedListElement>::iterator pListElement;
-    static const char *functionName = "sortingTask";
+    double waitTime;
+    void *pPrevious;
 
     lock();
-    while (1) {
-        getDoubleParam(NDPluginDriverSortTime, &sortTime);
+    while (!sortingThreadExit_) {
+        pPrevious = beginArrayProcessing();
+        waitTime = outputSortedArrays();
+        callParamCallbacks();
+        endArrayProcessing(pPrevious);
         unlock();
-        epicsThreadSleep(sortTime);
-        lock();
-        epicsTimeGetCurrent(&now);
-        getIntegerParam(NDPluginDriverSortSize, &sortSize);
-        while ((listSize=(int)sortedNDArrayList_.size()) > 0) {
-            bool orderOK;
-            pListElement = sortedNDArrayList_.begin();
-            deltaTime = epicsTimeDiffInSeconds(&now, &pListElement->insertionTime_);
-            asynPrint(pasynUserSelf, ASYN_TRACEIO_DRIVER,
-                "%s::%s, deltaTime=%f, list size=%d, uniqueId=%d\n",
-                driverName, functionName, deltaTime, listSize, pListElement->pArray_->uniqueId);
-            orderOK = (pListElement->pArray_->uniqueId == prevUniqueId_)   ||
-                      (pListElement->pArray_->uniqueId == prevUniqueId_+1);
-            if ((!firstOutputArray_ && orderOK) || (deltaTime > sortTime)) {
-                doCallbacksGenericPointer(pListElement->pArray_, NDArrayData, 0);
-                if (!firstOutputArray_ && !orderOK) {
-                    int disorderedArrays;
-                    getIntegerParam(NDPluginDriverDisorderedArrays, &disorderedArrays);
-                    disorderedArrays++;
-                    setIntegerParam(NDPluginDriverDisorderedArrays, disorderedArrays);
-                    asynPrint(pasynUserSelf, ASYN_TRACE_WARNING,
-                        "%s::%s disordered array found uniqueId=%d, prevUniqueId_=%d, orderOK=%d, disorderedArrays=%d\n",
-                        driverName, functionName, pListElement->pArray_->uniqueId, prevUniqueId_,
-                        orderOK, disorderedArrays);
-                }
-                prevUniqueId_ = pListElement->pArray_->uniqueId;
-                pListElement->pArray_->release();
-                sortedNDArrayList_.erase(pListElement);
-                firstOutputArray_ = false;
-            } else  {
-                break;
-            }
+        if (waitTime < 0.) {
+            epicsEventMustWait(sortingEvent_);
+        } else {
+            epicsEventWaitWithTimeout(sortingEvent_, waitTime);
         }
-        listSize=(int)sortedNDArrayList_.size();
-        setIntegerParam(NDPluginDriverSortFree, sortSize-listSize);
-        callParamCallbacks();
+        lock();
     }
+    unlock();
+    epicsEventSignal(sortingExitEvent_);
 }
 
 /** Called when asyn clients call pasynInt32->write().
@@ -752,6 +1453,20 @@ asynStatus NDPluginDriver::writeInt32(asynUser *pasynUser, epicsInt32 value)
                (value == 1)) {
         status = createSortingThread();
 
+    } else if ((function == NDPluginDriverFlowControl) ||
+               (function == NDPluginDriverBlockingCallbacks)) {
+        int queueFree;
+        getIntegerParam(NDPluginDriverQueueFree, &queueFree);
+        updateCredits(pCreditDriver_, queueFree);
+
+    } else if (function == NDPluginDriverLatencyReset) {
+        epicsTimeStamp now;
+        for (int stage=0; stage<NDPluginLatencyNumStages; stage++) {
+            latency_[stage].reset();
+        }
+        epicsTimeGetCurrent(&now);
+        updateLatencyParams(&now, true);
+
     } else if (function == NDPluginDriverProcessPlugin) {
         if (pPrevInputArray_) {
             driverCallback(pasynUserSelf, pPrevInputArray_);
@@ -803,6 +1518,9 @@ asynStatus NDPluginDriver::writeFloat64(asynUser *pasynUser, epicsFloat64 value)
 
     if (function == NDPluginDriverMaxByteRate) {
         throttler_->reset(value);
+    } else if (function == NDPluginDriverSortTime) {
+        /* The sorting thread may be waiting for the previous SortTime */
+        epicsEventSignal(sortingEvent_);
     }
 
 done:
@@ -857,7 +1575,7 @@ asynStatus NDPluginDriver::writeOctet(asynUser *pasynUser, const char *value,
 }
 
 /** Called when asyn clients call pasynInt32Array->read().
-  * Returns the value of the array dimensions for the last NDArray.
+  * Returns the value of the array dimensions for the last NDArray, or the counts of a latency histogram.
   * \param[in] pasynUser pasynUser structure that encodes the reason and address.
   * \param[in] value Pointer to the array to read.
   * \param[in] nElements Number of elements to read.
@@ -867,6 +1585,7 @@ asynStatus NDPluginDriver::readInt32Array(asynUser *pasynUser, epicsInt32 *value
 {
     int function;
     int addr;
+    int stage;
     const char *paramName;
     size_t ncopy;
     asynStatus status = asynSuccess;
@@ -875,11 +1594,19 @@ asynStatus NDPluginDriver::readInt32Array(asynUser *pasynUser, epicsInt32 *value
     status = parseAsynUser(pasynUser, &function, &addr, &paramName);
     if (status != asynSuccess) return(status);
 
+    for (stage=0; stage<NDPluginLatencyNumStages; stage++) {
+        if (function == NDPluginDriverLatencyHist[stage]) break;
+    }
     if (function == NDDimensions) {
             ncopy = ND_ARRAY_MAX_DIMS;
             if (nElements < ncopy) ncopy = nElements;
             memcpy(value, this->dimsPrev_, ncopy*sizeof(*this->dimsPrev_));
             *nIn = ncopy;
+    } else if (stage < NDPluginLatencyNumStages) {
+            ncopy = ND_LATENCY_NUM_BINS;
+            if (nElements < ncopy) ncopy = nElements;
+            latency_[stage].getCounts(value, ncopy);
+            *nIn = ncopy;
     } else {
         /* If this parameter belongs to a base class call its method */
         if (function < FIRST_NDPLUGIN_PARAM)
@@ -919,7 +1646,7 @@ asynStatus NDPluginDriver::startCallbackThreads(void)
     FromThreadMessage_t fromMsg;
     static const char *functionName = "startCallbackThreads";
 
-    for (i=0; i<numThreads_; i++) {
+    for (i=0; i<(int)pThreads_.size(); i++) {
         pThreads_[i]->start();
 
         // Wait for the thread to say its running
@@ -945,7 +1672,7 @@ asynStatus NDPluginDriver::startCallbackThreads(void)
     return status;
 }
 
-/** Starts the thread that receives NDArrays from the epicsMessageQueue. */
+/** Starts the thread that receives NDArrays from the input queue. */
 void NDPluginDriver::run()
 {
     this->processTask();
@@ -997,19 +1724,17 @@ asynStatus NDPluginDriver::createCallbackThreads()
 
     pThreads_.resize(numThreads);
 
-    /* Create the message queue for the input arrays */
-    pToThreadMsgQ_ = new epicsMessageQueue(queueSize, sizeof(ToThreadMessage_t));
-    if (!pToThreadMsgQ_) {
-        /* We don't handle memory errors above, so no point in handling this. */
-        cantProceed("NDPluginDriver::createCallbackThreads epicsMessageQueueCreate failure\n");
-    }
+    /* Create the queue for the input arrays, NDPluginQueueMode selects the implementation */
+    pToThreadMsgQ_ = new NDArrayQueue(queueSize, (NDArrayQueueMode_t)NDPluginQueueMode, NDPluginQueueSpins);
     pFromThreadMsgQ_ = new epicsMessageQueue(numThreads, sizeof(FromThreadMessage_t));
     if (!pFromThreadMsgQ_) {
         /* We don't handle memory errors above, so no point in handling this. */
         cantProceed("NDPluginDriver::createCallbackThreads epicsMessageQueueCreate failure\n");
     }
 
-    for (i=0; i<numThreads; i++) {
+    /* With the executor, numThreads is the number of executor tasks that can process the queue at once */
+    if (pExecutor_) pThreads_.resize(0);
+    for (i=0; i<(int)pThreads_.size(); i++) {
         /* Create the thread (but not start). */
         char taskName[256];
         epicsSnprintf(taskName, sizeof(taskName)-1, "%s_Plugin_%d", portName, i+1);
@@ -1022,6 +1747,8 @@ asynStatus NDPluginDriver::createCallbackThreads()
     }
     getIntegerParam(NDPluginDriverEnableCallbacks, &enableCallbacks);
     setIntegerParam(NDPluginDriverQueueFree, queueSize);
+    epicsAtomicSetIntT(&queueFree_, queueSize);
+    updateCredits(pCreditDriver_, queueSize);
     if (enableCallbacks) this->setArrayInterrupt(1);
     return (asynStatus) status;
 }
@@ -1030,7 +1757,6 @@ asynStatus NDPluginDriver::createCallbackThreads()
   * This method is called on shutdown and whenever QueueSize or NumThreads is changed. */
 asynStatus NDPluginDriver::deleteCallbackThreads()
 {
-    ToThreadMessage_t toMsg = {ToThreadMessageExit, 0};
     FromThreadMessage_t fromMsg;
     asynStatus status = asynSuccess;
     int i;
@@ -1048,15 +1774,14 @@ asynStatus NDPluginDriver::deleteCallbackThreads()
                 driverName, functionName, pending);
             epicsThreadSleep(0.05);
         }
+        // Wait for the executor tasks of this plugin to finish
+        while (epicsAtomicGetIntT(&executorTasks_) > 0) {
+            epicsThreadSleep(0.01);
+        }
         // Send a kill message to the threads and wait for reply.
         // Must do this with lock released else the threads may not be able to receive the message
-        for (i=0; i<numThreads_; i++) {
-            if (pToThreadMsgQ_->send(&toMsg, sizeof(toMsg)) != 0) {
-                asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
-                    "%s::%s error sending plugin thread %d exit message\n",
-                    driverName, functionName, i);
-                status = asynError;
-            }
+        for (i=0; i<(int)pThreads_.size(); i++) {
+            pToThreadMsgQ_->send(NULL);
             asynPrint(pasynUserSelf, ASYN_TRACE_FLOW,
                 "%s::%s sent exit message %d\n",
                 driverName, functionName, i);
@@ -1075,7 +1800,7 @@ asynStatus NDPluginDriver::deleteCallbackThreads()
         }
         this->lock();
         // All threads have now been stopped.  Delete them.
-        for (i=0; i<numThreads_; i++) {
+        for (i=0; i<(int)pThreads_.size(); i++) {
             delete pThreads_[i]; // The epicsThread destructor waits for the thread to return
         }
         pThreads_.resize(0);
@@ -1115,4 +1840,102 @@ asynStatus NDPluginDriver::createSortingThread()
     return asynSuccess;
 }
 
+/** Returns the number of free slots in the input queue, the value of QueueFree.  This does not take the lock,
+  * so upstream plugins such as NDPluginScatter can use it to choose where to send an array. */
+int NDPluginDriver::getQueueFree()
+{
+    return epicsAtomicGetIntT(&queueFree_);
+}
+
+/** Returns the plugin that registered an NDArray interrupt callback, or NULL if the callback is not a plugin.
+  * \param[in] pInterrupt The interrupt from the client list of the asynGenericPointer interface. */
+NDPluginDriver *NDPluginDriver::arrayClient(const asynGenericPointerInterrupt *pInterrupt)
+{
+    if (pInterrupt->callback != ::driverCallback) return NULL;
+    return (NDPluginDriver *)pInterrupt->userPvt;
+}
+
+/** Sets the position of the plugin in a fused chain.  This is called by NDPluginFuseChain.
+  * \param[in] fusedInput true to process arrays in the thread of the upstream plugin that calls
+  *            driverCallback(), without the queue, whatever BlockingCallbacks is.
+  * \param[in] fusedOutput true if the downstream plugin is fused, so that endProcessCallbacks() outputs
+  *            the input array instead of a copy when the plugin did not change it and has no attributes. */
+void NDPluginDriver::setFused(bool fusedInput, bool fusedOutput)
+{
+    this->lock();
+    fusedInput_ = fusedInput;
+    fusedOutput_ = fusedOutput;
+    if (fusedInput) updateCredits(NULL, 0);
+    setIntegerParam(NDPluginDriverFused, (fusedInput ? NDPluginFusedTail : 0) | (fusedOutput ? NDPluginFusedHead : 0));
+    callParamCallbacks();
+    this->unlock();
+}
+
+/** Fuses a linear chain of plugins, so that each array is processed by all of them in the thread of the
+  * first plugin, or of its driver if it has BlockingCallbacks=1.
+  * \param[in] ports The asyn port names of the plugins separated by commas or spaces, in order.  The
+  *            NDArrayPort of each plugin after the first must be the plugin before it.
+  * \return 0 on success, -1 on error.
+  */
+int NDPluginDriver::fuseChain(const char *ports)
+{
+    std::vector<NDPluginDriver *> plugins;
+    std::string list(ports ? ports : ""), arrayPort;
+    size_t start = 0, end;
+    int i;
+    static const char *functionName = "NDPluginDriver::fuseChain";
+
+    while ((start = list.find_first_not_of(", ", start)) != std::string::npos) {
+        end = list.find_first_of(", ", start);
+        std::string portName = list.substr(start, end - start);
+        NDPluginDriver *pPlugin = dynamic_cast<NDPluginDriver *>(findAsynPortDriver(portName.c_str()));
+        if (!pPlugin) {
+            printf("%s: ERROR, %s is not an areaDetector plugin\n", functionName, portName.c_str());
+            return -1;
+        }
+        if (!plugins.empty()) {
+            pPlugin->lock();
+            pPlugin->getStringParam(pPlugin->NDPluginDriverArrayPort, arrayPort);
+            pPlugin->unlock();
+            if (arrayPort != plugins.back()->portName) {
+                printf("%s: ERROR, the NDArrayPort of %s is %s, not %s\n",
+                       functionName, portName.c_str(), arrayPort.c_str(), plugins.back()->portName);
+                return -1;
+            }
+        }
+        plugins.push_back(pPlugin);
+        start = end;
+    }
+    if (plugins.size() < 2) {
+        printf("%s: ERROR, a chain needs at least 2 plugins\n", functionName);
+        return -1;
+    }
+    for (i=0; i<(int)plugins.size(); i++) {
+        plugins[i]->setFused(i > 0, i < (int)plugins.size()-1);
+    }
+    return 0;
+}
+
+/* EPICS iocsh shell commands */
+
+extern "C" int NDPluginFuseChain(const char *ports)
+{
+    return NDPluginDriver::fuseChain(ports);
+}
+
+static const iocshArg fuseChainArg0 = { "ports (e.g. ROI1,STATS1,IMAGE1)", iocshArgString};
+static const iocshArg * const fuseChainArgs[] = {&fuseChainArg0};
+static const iocshFuncDef fuseChainFuncDef = {"NDPluginFuseChain", 1, fuseChainArgs};
+static void fuseChainCallFunc(const iocshArgBuf *args)
+{
+    NDPluginFuseChain(args[0].sval);
+}
 
+extern "C" void NDPluginDriverRegister(void)
+{
+    iocshRegister(&fuseChainFuncDef, fuseChainCallFunc);
+}
+
+extern "C" {
+epicsExportRegistrar(NDPluginDriverRegister);
+}
@@ -5,32 +5,19 @@
 #include <epicsTypes.h>
 #include <epicsMessageQueue.h>
 #include <epicsThread.h>
+#include <epicsEvent.h>
+#include <epicsTimer.h>
 #include <epicsTime.h>
 
 #include <NDPluginAPI.h>
 
 #include "asynNDArrayDriver.h"
+#include "NDLatencyHistogram.h"
 
 class Throttler;
-
-// This class defines the object that is contained in the std::multilist for sorting output NDArrays
-// It contains a pointer to the NDArray and the time that the object was added to the list
-// It defines the < operator to use the NDArray::uniqueId field as the sort key
-
-// We would like to hide this class definition in NDPluginDriver.cpp and just forward reference it here.
-// That works on Visual Studio, and on gcc if instantiating plugins as heap variables with "new", but fails on gcc
-// if instantiating plugins as automatic variables.
-//class sortedListElement;
-
-class sortedListElement {
-    public:
-        sortedListElement(NDArray *pArray, epicsTimeStamp time);
-        friend bool operator<(const sortedListElement& lhs, const sortedListElement& rhs) {
-            return (lhs.pArray_->uniqueId < rhs.pArray_->uniqueId);
-        }
-        NDArray *pArray_;
-        epicsTimeStamp insertionTime_;
-};
+class NDArrayQueue;
+class NDPluginExecutor;
+class NDArrayReorderBuffer;
 
 #define NDPluginDriverArrayPortString           "NDARRAY_PORT"          /**< (asynOctet,    r/w) The port for the NDArray interface */
 #define NDPluginDriverArrayAddrString           "NDARRAY_ADDR"          /**< (asynInt32,    r/w) The address on the port */
@@ -42,8 +29,8 @@ class sortedListElement {
 #define NDPluginDriverNumThreadsString          "NUM_THREADS"           /**< (asynInt32,    r/w) Number of threads */
 #define NDPluginDriverSortModeString            "SORT_MODE"             /**< (asynInt32,    r/w) sorted callback mode */
 #define NDPluginDriverSortTimeString            "SORT_TIME"             /**< (asynFloat64,  r/w) sorted callback time */
-#define NDPluginDriverSortSizeString            "SORT_SIZE"             /**< (asynInt32,    r/o) std::multiset maximum # elements */
-#define NDPluginDriverSortFreeString            "SORT_FREE"             /**< (asynInt32,    r/o) std::multiset free elements */
+#define NDPluginDriverSortSizeString            "SORT_SIZE"             /**< (asynInt32,    r/o) sort buffer maximum # elements */
+#define NDPluginDriverSortFreeString            "SORT_FREE"             /**< (asynInt32,    r/o) sort buffer free elements */
 #define NDPluginDriverDisorderedArraysString    "DISORDERED_ARRAYS"     /**< (asynInt32,    r/o) Number of out of order output arrays */
 #define NDPluginDriverDroppedOutputArraysString "DROPPED_OUTPUT_ARRAYS" /**< (asynInt32,    r/o) Number of dropped output arrays */
 #define NDPluginDriverEnableCallbacksString     "ENABLE_CALLBACKS"      /**< (asynInt32,    r/w) Enable callbacks from driver (1=Yes, 0=No) */
@@ -53,6 +40,51 @@ class sortedListElement {
 #define NDPluginDriverMinCallbackTimeString     "MIN_CALLBACK_TIME"     /**< (asynFloat64,  r/w) Minimum time between calling processCallbacks
                                                                          *to execute plugin code */
 #define NDPluginDriverMaxByteRateString         "MAX_BYTE_RATE"         /**< (asynFloat64,  r/w) Limit on byte rate output of plugin */
+#define NDPluginDriverParallelThreadsString     "PARALLEL_THREADS"      /**< (asynInt32,    r/w) Number of threads that process each array */
+#define NDPluginDriverBatchSizeString           "BATCH_SIZE"            /**< (asynInt32,    r/w) Maximum number of queued arrays processed together */
+#define NDPluginDriverMaxParamRateString        "MAX_PARAM_RATE"        /**< (asynFloat64,  r/w) Maximum rate of parameter callbacks
+                                                                         *while processing arrays */
+#define NDPluginDriverFlowControlString         "FLOW_CONTROL"          /**< (asynInt32,    r/w) Advertise free queue slots to the driver */
+#define NDPluginDriverQueuePolicyString         "QUEUE_POLICY"          /**< (asynInt32,    r/w) What to do when the queue is full */
+#define NDPluginDriverDroppedOldestString       "DROPPED_OLDEST"        /**< (asynInt32,    r/w) Number of queued arrays dropped by DropOldest */
+#define NDPluginDriverDroppedStaleString        "DROPPED_STALE"         /**< (asynInt32,    r/w) Number of queued arrays dropped by KeepLatest */
+#define NDPluginDriverFusedString               "FUSED"                 /**< (asynInt32,    r/o) Position in a fused chain, NDPluginFused_t */
+#define NDPluginDriverZeroCopyString            "ZERO_COPY"             /**< (asynInt32,    r/w) Output unchanged arrays without copying the data */
+#define NDPluginDriverLatencyResetString        "LATENCY_RESET"         /**< (asynInt32,    r/w) Reset the latency histograms */
+/* Each stage in NDPluginLatencyStage_t has the parameters LATENCY_<stage>_P50, _P90, _P99 and _MAX (asynFloat64, r/o),
+ * the percentiles and maximum of the time in milliseconds, and LATENCY_<stage>_HIST (asynInt32Array, r/o), the counts
+ * of the NDLatencyHistogram bins.  <stage> is QUEUE, PROCESS, COPY or OUTPUT. */
+
+/** What the driver callback does with arrays when BlockingCallbacks=0 */
+typedef enum {
+    NDPluginQueueDropNewest,    /**< Drop the new array if the queue is full */
+    NDPluginQueueDropOldest,    /**< Drop the oldest queued array if the queue is full */
+    NDPluginQueueKeepLatest     /**< Drop all queued arrays, so only the newest array waits */
+} NDPluginQueuePolicy_t;
+
+/** Position of a plugin in a chain fused by NDPluginFuseChain, the value of the FUSED parameter */
+typedef enum {
+    NDPluginFusedNone,          /**< Not in a fused chain */
+    NDPluginFusedHead,          /**< Its output goes to a fused plugin */
+    NDPluginFusedTail,          /**< It runs in the thread of its upstream plugin */
+    NDPluginFusedMiddle         /**< Both */
+} NDPluginFused_t;
+
+/** Stages of a plugin for which NDPluginDriver keeps a histogram of the time that each array takes */
+typedef enum {
+    NDPluginLatencyQueue,       /**< Time that arrays wait in the input queue */
+    NDPluginLatencyProcess,     /**< Time in processCallbacks(), including endProcessCallbacks() */
+    NDPluginLatencyCopy,        /**< Time to copy the output array in endProcessCallbacks() */
+    NDPluginLatencyOutput,      /**< Time in the NDArray callbacks to downstream plugins */
+    NDPluginLatencyNumStages
+} NDPluginLatencyStage_t;
+
+/** Function that parallelFor() calls to process items first to first+count-1 of an array, e.g. rows.
+  * band is the number of the band, from 0 to numBands-1.  Bands run at the same time in different threads,
+  * so results that are added up, e.g. sums or histograms, must be kept separately for each band and
+  * combined after parallelFor() returns. */
+typedef void (*NDPluginBandFunc_t)(void *pvt, int band, size_t first, size_t count);
+
 /** Class from which actual plugin drivers are derived; derived from asynNDArrayDriver */
 class NDPLUGIN_API NDPluginDriver : public asynNDArrayDriver, public epicsThreadRunable {
 public:
@@ -60,7 +92,7 @@ public:
                    const char *NDArrayPort, int NDArrayAddr, int maxAddr,
                    int maxBuffers, size_t maxMemory, int interfaceMask, int interruptMask,
                    int asynFlags, int autoConnect, int priority, int stackSize, int maxThreads,
-                   bool compressionAware = false);
+                   bool compressionAware = false, bool viewAware = false);
     ~NDPluginDriver();
 
     /* These are the methods that we override from asynNDArrayDriver */
@@ -71,19 +103,33 @@ public:
     virtual asynStatus readInt32Array(asynUser *pasynUser, epicsInt32 *value,
                                         size_t nElements, size_t *nIn);
     virtual void shutdownPortDriver();
+    using asynNDArrayDriver::callParamCallbacks;
+    virtual asynStatus callParamCallbacks(int list, int addr);
 
     /* These are the methods that are new to this class */
     virtual void driverCallback(asynUser *pasynUser, void *genericPointer);
     virtual void run(void);
     virtual asynStatus start(void);
     void sortingTask();
+    void executorTask();
+    void paramTimerCallback();
+    void setFused(bool fusedInput, bool fusedOutput);
+    static int fuseChain(const char *ports);
+    int getQueueFree();
+    static NDPluginDriver *arrayClient(const asynGenericPointerInterrupt *pInterrupt);
 
 protected:
     virtual void processCallbacks(NDArray *pArray) = 0;
+    virtual void processCallbacksBatch(NDArray *pArrays[], int numArrays);
     virtual void beginProcessCallbacks(NDArray *pArray);
     virtual asynStatus endProcessCallbacks(NDArray *pArray, bool copyArray=false, bool readAttributes=true);
+    NDArray *passThroughArray(NDArray *pArray, bool *pReadAttributes);
+    virtual void processWakeup();
+    bool wakeProcessTask();
     virtual asynStatus connectToArrayPort(void);
     virtual asynStatus setArrayInterrupt(int connect);
+    int getNumBands(NDArray *pArray, size_t numItems);
+    void parallelFor(NDPluginBandFunc_t func, void *pvt, size_t numItems, int numBands);
 
 protected:
     int NDPluginDriverArrayPort;
@@ -107,16 +153,46 @@ protected:
     int NDPluginDriverExecutionTime;
     int NDPluginDriverMinCallbackTime;
     int NDPluginDriverMaxByteRate;
+    int NDPluginDriverParallelThreads;
+    int NDPluginDriverBatchSize;
+    int NDPluginDriverMaxParamRate;
+    int NDPluginDriverFlowControl;
+    int NDPluginDriverQueuePolicy;
+    int NDPluginDriverDroppedOldest;
+    int NDPluginDriverDroppedStale;
+    int NDPluginDriverFused;
+    int NDPluginDriverZeroCopy;
+    int NDPluginDriverLatencyReset;
+    int NDPluginDriverLatencyP50[NDPluginLatencyNumStages];
+    int NDPluginDriverLatencyP90[NDPluginLatencyNumStages];
+    int NDPluginDriverLatencyP99[NDPluginLatencyNumStages];
+    int NDPluginDriverLatencyMax[NDPluginLatencyNumStages];
+    int NDPluginDriverLatencyHist[NDPluginLatencyNumStages];
 
     NDArray *pPrevInputArray_;
     bool throttled(NDArray *pArray);
 
 private:
     void processTask();
+    void processArrays(NDArray *pArrays[], int numArrays);
+    void processQueuedArrays(NDArray *pArrays[], epicsTimeStamp queuedTimes[], int numArrays);
+    void scheduleExecutorTask(bool resubmit);
     asynStatus createCallbackThreads();
     asynStatus startCallbackThreads();
     asynStatus deleteCallbackThreads();
     asynStatus createSortingThread();
+    void outputArray(NDArray *pArray);
+    void recordLatency(NDPluginLatencyStage_t stage, const epicsTimeStamp *pStart, const epicsTimeStamp *pEnd,
+                       int count=1);
+    void updateLatencyParams(const epicsTimeStamp *pNow, bool force);
+    void traceProcessing(NDArray *pArrays[], int numArrays, const epicsTimeStamp *pStart, const epicsTimeStamp *pEnd);
+    void updateCredits(asynNDArrayDriver *pDriver, int queueFree);
+    void processQueuedWakeup();
+    int dropQueuedArrays(int maxPending, int droppedParam);
+    void *beginArrayProcessing();
+    void endArrayProcessing(void *pPrevious);
+    double outputSortedArrays();
+    void destroyParamTimer();
 
     /* The asyn interfaces we access as a client */
     void *asynGenericPointerInterruptPvt_;
@@ -130,15 +206,32 @@ private:
     asynGenericPointer *pasynGenericPointer_;    /**< asyn interface for connecting to NDArray driver */
     bool connectedToArrayPort_;
     std::vector<epicsThread*>pThreads_;
-    epicsMessageQueue *pToThreadMsgQ_;
+    NDArrayQueue *pToThreadMsgQ_;
     epicsMessageQueue *pFromThreadMsgQ_;
-    std::multiset<sortedListElement> sortedNDArrayList_;
+    NDArrayReorderBuffer *pSortBuffer_;         /**< Output arrays waiting for lower uniqueIds when SortMode=Sorted */
     int prevUniqueId_;
     epicsThreadId sortingThreadId_;
+    epicsEventId sortingEvent_;                 /**< Wakes the sorting thread */
+    epicsEventId sortingExitEvent_;             /**< Signalled when the sorting thread exits */
+    bool sortingThreadExit_;
     epicsTimeStamp lastProcessTime_;
     int dimsPrev_[ND_ARRAY_MAX_DIMS];
     bool compressionAware_;
+    bool viewAware_;
+    NDPluginExecutor *pExecutor_;                /**< Executor that processes the queue, NULL for private threads */
+    int executorTasks_;                          /**< Number of executor tasks queued or running */
+    asynNDArrayDriver *pCreditDriver_;           /**< Driver that FlowControl sends the free queue slots to */
+    int queueFree_;                              /**< Copy of QueueFree that getQueueFree() reads without the lock */
+    bool fusedInput_;                            /**< Arrays are processed in the thread of the upstream plugin */
+    bool fusedOutput_;                           /**< The downstream plugin is fused, so output arrays need not be copied */
     Throttler *throttler_;
+    epicsTimerQueueId paramTimerQueue_;
+    epicsTimerId paramTimer_;                    /**< Does the parameter callbacks that MaxParamRate delayed */
+    bool paramTimerActive_;
+    std::vector<epicsTimeStamp> paramCallbackTimes_;  /**< Time of the last parameter callbacks for each list */
+    std::vector<int> pendingParamAddr_;          /**< Address of the delayed parameter callbacks for each list, -1 for none */
+    NDLatencyHistogram latency_[NDPluginLatencyNumStages];
+    epicsTimeStamp latencyUpdateTime_;          /**< Time the latency parameters were last updated */
 };
 
 
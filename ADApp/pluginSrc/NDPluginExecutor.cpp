@@ -0,0 +1,358 @@
+/*
+ * NDPluginExecutor.cpp
+ *
+ * IOC-wide work-stealing thread pool for plugins.
+ *
+ * Each worker thread has a double-ended queue of tasks protected by its own mutex.
+ * A worker runs the newest task on its own queue, and when that is empty it steals the oldest task
+ * from the other queues, starting with the next worker.  Workers with nothing to do wait on their own
+ * event; submit() wakes one of them.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#include <epicsStdio.h>
+#include <iocsh.h>
+
+#include "NDPluginExecutor.h"
+
+#include <epicsExport.h>
+
+static const char *driverName = "NDPluginExecutor";
+
+static NDPluginExecutor *pInstance = NULL;
+static epicsMutexId instanceLock;
+static epicsThreadOnceId instanceOnceId = EPICS_THREAD_ONCE_INIT;
+
+static void instanceInit(void *)
+{
+    instanceLock = epicsMutexMustCreate();
+}
+
+/** Parses a CPU list such as "0-3,8,10-11".  Returns 0 on success, -1 if it is invalid. */
+static int parseCpuSet(const char *cpuSet, std::vector<int>& cpus)
+{
+    const char *p = cpuSet;
+    char *pEnd;
+    long first, last;
+
+    cpus.clear();
+    if (!cpuSet) return 0;
+    while (*p) {
+        if ((*p == ',') || (*p == ' ')) {
+            p++;
+            continue;
+        }
+        first = strtol(p, &pEnd, 10);
+        if ((pEnd == p) || (first < 0)) return -1;
+        p = pEnd;
+        last = first;
+        if (*p == '-') {
+            p++;
+            last = strtol(p, &pEnd, 10);
+            if ((pEnd == p) || (last < first)) return -1;
+            p = pEnd;
+        }
+        for (long cpu=first; cpu<=last; cpu++) cpus.push_back((int)cpu);
+    }
+    return 0;
+}
+
+/** Constructor, creates and starts the threads.
+  * \param[in] numThreads Number of threads.
+  * \param[in] cpuSet CPUs that the threads may run on, e.g. "0-3,8", NULL or "" for any CPU.
+  */
+NDPluginExecutor::NDPluginExecutor(int numThreads, const char *cpuSet)
+    : numIdle_(0), nextWorker_(0)
+{
+    int i;
+
+    parseCpuSet(cpuSet, cpus_);
+    idleLock_ = epicsMutexMustCreate();
+    workerId_ = epicsThreadPrivateCreate();
+    for (i=0; i<numThreads; i++) {
+        worker *pWorker = new worker;
+        pWorker->pExecutor = this;
+        pWorker->index = i;
+        pWorker->lock = epicsMutexMustCreate();
+        pWorker->wakeEvent = epicsEventMustCreate(epicsEventEmpty);
+        pWorker->idle = false;
+        pWorker->numExecuted = 0;
+        pWorker->numStolen = 0;
+        workers_.push_back(pWorker);
+    }
+    for (i=0; i<numThreads; i++) {
+        char name[32];
+        epicsSnprintf(name, sizeof(name), "NDPluginExec-%d", i);
+        epicsThreadMustCreate(name, epicsThreadPriorityMedium,
+                              epicsThreadGetStackSize(epicsThreadStackBig),
+                              workerTaskC, workers_[i]);
+    }
+}
+
+/** Returns the executor, creating it with one thread per CPU if NDPluginExecutorConfig was not called. */
+NDPluginExecutor* NDPluginExecutor::getInstance()
+{
+    NDPluginExecutor *pExecutor;
+
+    epicsThreadOnce(&instanceOnceId, instanceInit, NULL);
+    epicsMutexLock(instanceLock);
+    if (!pInstance) {
+        int numThreads = epicsThreadGetCPUs();
+        if (numThreads < 1) numThreads = 1;
+        pInstance = new NDPluginExecutor(numThreads, NULL);
+    }
+    pExecutor = pInstance;
+    epicsMutexUnlock(instanceLock);
+    return pExecutor;
+}
+
+/** Creates the executor.  This must be called before the first plugin that uses the executor is created.
+  * \param[in] numThreads Number of threads, 0 for one per CPU.
+  * \param[in] cpuSet CPUs that the threads may run on, e.g. "0-3,8", NULL or "" for any CPU.
+  *            This is only supported on Linux.
+  * \return 0 on success, -1 on error.
+  */
+int NDPluginExecutor::configure(int numThreads, const char *cpuSet)
+{
+    std::vector<int> cpus;
+    static const char *functionName = "configure";
+
+    if (numThreads <= 0) numThreads = epicsThreadGetCPUs();
+    if (numThreads < 1) numThreads = 1;
+    if (parseCpuSet(cpuSet, cpus)) {
+        printf("%s::%s ERROR, invalid CPU set \"%s\"\n", driverName, functionName, cpuSet);
+        return -1;
+    }
+#ifndef __linux__
+    if (!cpus.empty()) {
+        printf("%s::%s WARNING, CPU affinity is not supported on this OS, ignoring CPU set\n",
+               driverName, functionName);
+    }
+#endif
+    epicsThreadOnce(&instanceOnceId, instanceInit, NULL);
+    epicsMutexLock(instanceLock);
+    if (pInstance) {
+        epicsMutexUnlock(instanceLock);
+        printf("%s::%s ERROR, the executor already exists with %d threads\n",
+               driverName, functionName, pInstance->getNumThreads());
+        return -1;
+    }
+    pInstance = new NDPluginExecutor(numThreads, cpuSet);
+    epicsMutexUnlock(instanceLock);
+    return 0;
+}
+
+/** Returns true if the calling thread is one of the executor threads */
+bool NDPluginExecutor::inWorkerThread()
+{
+    return epicsThreadPrivateGet(workerId_) != NULL;
+}
+
+/** Queues a task for one of the executor threads.
+  * \param[in] func Function to call.
+  * \param[in] pvt Argument of func.
+  * \param[in] runSoon If true and the caller is an executor thread, the task is the next one that the
+  *            thread runs.  If false it runs after the tasks already queued; tasks that resubmit themselves
+  *            use this so that they cannot starve the others.
+  */
+void NDPluginExecutor::submit(NDPluginExecutorFunc_t func, void *pvt, bool runSoon)
+{
+    worker *pWorker = (worker *)epicsThreadPrivateGet(workerId_);
+    worker *pWake = NULL;
+    task newTask = {func, pvt};
+    int i, n = (int)workers_.size();
+
+    /* Threads outside the pool spread their tasks over the queues */
+    if (!pWorker) {
+        epicsMutexLock(idleLock_);
+        pWorker = workers_[nextWorker_];
+        nextWorker_ = (nextWorker_ + 1) % n;
+        epicsMutexUnlock(idleLock_);
+    }
+    epicsMutexLock(pWorker->lock);
+    if (runSoon) {
+        pWorker->tasks.push_back(newTask);
+    } else {
+        pWorker->tasks.push_front(newTask);
+    }
+    epicsMutexUnlock(pWorker->lock);
+
+    /* Wake the owner of the queue if it is idle, otherwise any idle thread, which will steal the task */
+    epicsMutexLock(idleLock_);
+    if (numIdle_ > 0) {
+        if (pWorker->idle) {
+            pWake = pWorker;
+        } else {
+            for (i=1; i<n; i++) {
+                worker *pOther = workers_[(pWorker->index + i) % n];
+                if (pOther->idle) {
+                    pWake = pOther;
+                    break;
+                }
+            }
+        }
+        if (pWake) {
+            pWake->idle = false;
+            numIdle_--;
+        }
+    }
+    epicsMutexUnlock(idleLock_);
+    if (pWake) epicsEventSignal(pWake->wakeEvent);
+}
+
+/** Takes the newest task from the queue of pWorker, or steals the oldest task of another worker */
+bool NDPluginExecutor::findTask(worker *pWorker, task *pTask)
+{
+    int i, n = (int)workers_.size();
+    bool found = false;
+
+    epicsMutexLock(pWorker->lock);
+    if (!pWorker->tasks.empty()) {
+        *pTask = pWorker->tasks.back();
+        pWorker->tasks.pop_back();
+        found = true;
+    }
+    epicsMutexUnlock(pWorker->lock);
+    for (i=1; !found && (i<n); i++) {
+        worker *pVictim = workers_[(pWorker->index + i) % n];
+        epicsMutexLock(pVictim->lock);
+        if (!pVictim->tasks.empty()) {
+            *pTask = pVictim->tasks.front();
+            pVictim->tasks.pop_front();
+            found = true;
+            pWorker->numStolen++;
+        }
+        epicsMutexUnlock(pVictim->lock);
+    }
+    return found;
+}
+
+/** Restricts the calling thread to the CPUs in cpus_ */
+void NDPluginExecutor::setAffinity()
+{
+#ifdef __linux__
+    cpu_set_t mask;
+    size_t i;
+
+    if (cpus_.empty()) return;
+    CPU_ZERO(&mask);
+    for (i=0; i<cpus_.size(); i++) {
+        if (cpus_[i] < CPU_SETSIZE) CPU_SET(cpus_[i], &mask);
+    }
+    if (sched_setaffinity(0, sizeof(mask), &mask) != 0) {
+        printf("%s::setAffinity ERROR, sched_setaffinity failed for thread %s: %s\n",
+               driverName, epicsThreadGetNameSelf(), strerror(errno));
+    }
+#endif
+}
+
+void NDPluginExecutor::workerTaskC(void *drvPvt)
+{
+    worker *pWorker = (worker *)drvPvt;
+    pWorker->pExecutor->workerTask(pWorker);
+}
+
+void NDPluginExecutor::workerTask(worker *pWorker)
+{
+    task nextTask;
+
+    epicsThreadPrivateSet(workerId_, pWorker);
+    setAffinity();
+    while (1) {
+        if (!findTask(pWorker, &nextTask)) {
+            /* Mark this thread idle before looking again, so a task submitted in between wakes it */
+            epicsMutexLock(idleLock_);
+            pWorker->idle = true;
+            numIdle_++;
+            epicsMutexUnlock(idleLock_);
+            bool found = findTask(pWorker, &nextTask);
+            if (!found) epicsEventMustWait(pWorker->wakeEvent);
+            epicsMutexLock(idleLock_);
+            if (pWorker->idle) {
+                pWorker->idle = false;
+                numIdle_--;
+            }
+            epicsMutexUnlock(idleLock_);
+            if (!found) continue;
+        }
+        nextTask.func(nextTask.pvt);
+        pWorker->numExecuted++;
+    }
+}
+
+/** Reports the number of threads and the tasks they have run.
+  * \param[in] fp File pointer for the report output.
+  * \param[in] details Level of report details; more than 0 reports each thread. */
+void NDPluginExecutor::report(FILE *fp, int details)
+{
+    unsigned long executed = 0, stolen = 0;
+    size_t i;
+
+    for (i=0; i<workers_.size(); i++) {
+        executed += workers_[i]->numExecuted;
+        stolen += workers_[i]->numStolen;
+    }
+    fprintf(fp, "NDPluginExecutor: %d threads, %lu tasks executed, %lu stolen, CPU set:",
+            getNumThreads(), executed, stolen);
+    if (cpus_.empty()) fprintf(fp, " any");
+    for (i=0; i<cpus_.size(); i++) fprintf(fp, " %d", cpus_[i]);
+    fprintf(fp, "\n");
+    if (details > 0) {
+        for (i=0; i<workers_.size(); i++) {
+            epicsMutexLock(workers_[i]->lock);
+            fprintf(fp, "  thread %d: %lu executed, %lu stolen, %d queued\n", workers_[i]->index,
+                    workers_[i]->numExecuted, workers_[i]->numStolen, (int)workers_[i]->tasks.size());
+            epicsMutexUnlock(workers_[i]->lock);
+        }
+    }
+}
+
+/* EPICS iocsh shell commands */
+extern "C" int NDPluginExecutorConfig(int numThreads, const char *cpuSet)
+{
+    return NDPluginExecutor::configure(numThreads, cpuSet);
+}
+
+extern "C" int NDPluginExecutorReport(int details)
+{
+    if (!pInstance) {
+        printf("NDPluginExecutor has not been created\n");
+        return 0;
+    }
+    pInstance->report(stdout, details);
+    return 0;
+}
+
+static const iocshArg configArg0 = { "numThreads (0=one per CPU)", iocshArgInt};
+static const iocshArg configArg1 = { "cpuSet (e.g. 0-3,8)", iocshArgString};
+static const iocshArg * const configArgs[] = {&configArg0,
+                                              &configArg1};
+static const iocshFuncDef configFuncDef = {"NDPluginExecutorConfig", 2, configArgs};
+static void configCallFunc(const iocshArgBuf *args)
+{
+    NDPluginExecutorConfig(args[0].ival, args[1].sval);
+}
+
+static const iocshArg reportArg0 = { "details", iocshArgInt};
+static const iocshArg * const reportArgs[] = {&reportArg0};
+static const iocshFuncDef reportFuncDef = {"NDPluginExecutorReport", 1, reportArgs};
+static void reportCallFunc(const iocshArgBuf *args)
+{
+    NDPluginExecutorReport(args[0].ival);
+}
+
+extern "C" void NDPluginExecutorRegister(void)
+{
+    iocshRegister(&configFuncDef, configCallFunc);
+    iocshRegister(&reportFuncDef, reportCallFunc);
+}
+
+extern "C" {
+epicsExportRegistrar(NDPluginExecutorRegister);
+}
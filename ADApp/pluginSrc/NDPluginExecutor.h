@@ -0,0 +1,63 @@
+#ifndef NDPluginExecutor_H
+#define NDPluginExecutor_H
+
+#include <stdio.h>
+#include <deque>
+#include <vector>
+
+#include <epicsMutex.h>
+#include <epicsEvent.h>
+#include <epicsThread.h>
+
+#include <NDPluginAPI.h>
+
+/** Function that the executor runs, with the pvt pointer passed to NDPluginExecutor::submit() */
+typedef void (*NDPluginExecutorFunc_t)(void *pvt);
+
+/** IOC-wide pool of threads that plugins can use instead of their own threads.
+  * Each thread has its own queue of tasks.  Tasks submitted by a pool thread go on its own queue and
+  * are run last in first out, so a downstream plugin usually runs on the thread that produced its array.
+  * Idle threads steal the oldest tasks from the queues of the other threads.
+  * NDPluginDriver uses it when NDPluginUseExecutor is set; it limits the number of tasks of each plugin
+  * to NumThreads, so the executor itself does not know about plugins.
+  */
+class NDPLUGIN_API NDPluginExecutor {
+public:
+    static NDPluginExecutor* getInstance();
+    static int configure(int numThreads, const char *cpuSet);
+    void submit(NDPluginExecutorFunc_t func, void *pvt, bool runSoon=true);
+    int getNumThreads() const {return (int)workers_.size();}
+    bool inWorkerThread();
+    void report(FILE *fp, int details);
+
+private:
+    struct task {
+        NDPluginExecutorFunc_t func;
+        void *pvt;
+    };
+    struct worker {
+        NDPluginExecutor *pExecutor;
+        int index;
+        epicsMutexId lock;          /**< Protects tasks */
+        std::deque<task> tasks;
+        epicsEventId wakeEvent;
+        bool idle;                  /**< Protected by idleLock_ */
+        unsigned long numExecuted;
+        unsigned long numStolen;
+    };
+
+    NDPluginExecutor(int numThreads, const char *cpuSet);
+    static void workerTaskC(void *drvPvt);
+    void workerTask(worker *pWorker);
+    bool findTask(worker *pWorker, task *pTask);
+    void setAffinity();
+
+    std::vector<worker *> workers_;
+    std::vector<int> cpus_;         /**< CPUs the threads run on, empty for no affinity */
+    epicsMutexId idleLock_;
+    int numIdle_;                   /**< Protected by idleLock_ */
+    int nextWorker_;                /**< Queue for the next task submitted by a thread outside the pool */
+    epicsThreadPrivateId workerId_; /**< worker structure of the calling thread, NULL outside the pool */
+};
+
+#endif
@@ -12,6 +12,7 @@
 #include <stdio.h>
 
 #include <iocsh.h>
+#include <epicsTime.h>
 
 #include "NDPluginGather.h"
 
@@ -19,6 +20,13 @@
 
 static const char *driverName="NDPluginGather";
 
+static void orderTimerCallbackC(void *drvPvt)
+{
+    NDPluginGather *pPvt = (NDPluginGather *)drvPvt;
+
+    pPvt->orderTimerCallback();
+}
+
 /** Constructor for NDPluginGather; most parameters are simply passed to NDPluginDriver::NDPluginDriver.
   *
   * \param[in] portName The name of the asyn port driver to be created.
@@ -46,16 +54,33 @@ NDPluginGather::NDPluginGather(const char *portName, int queueSize, int blocking
                    asynInt32Mask | asynFloat64Mask | asynGenericPointerMask,
                    asynInt32Mask | asynFloat64Mask | asynGenericPointerMask,
                    ASYN_MULTIDEVICE, 1, priority, stackSize, 1),
-    maxPorts_(maxPorts)
+    maxPorts_(maxPorts),
+    nextId_(-1)
 {
     int i;
     NDGatherNDArraySource_t *pArraySrc;
     //static const char *functionName = "NDPluginGather";
 
+    createParam(NDPluginGatherOrderString,      asynParamInt32,   &NDPluginGatherOrder);
+    createParam(NDPluginGatherWindowString,     asynParamInt32,   &NDPluginGatherWindow);
+    createParam(NDPluginGatherTimeoutString,    asynParamFloat64, &NDPluginGatherTimeout);
+    createParam(NDPluginGatherPendingString,    asynParamInt32,   &NDPluginGatherPending);
+    createParam(NDPluginGatherSkippedString,    asynParamInt32,   &NDPluginGatherSkipped);
+
     /* Set the plugin type string */
     setStringParam(NDPluginDriverPluginType, "NDPluginGather");
 
+    setIntegerParam(NDPluginGatherOrder, 0);
+    setIntegerParam(NDPluginGatherWindow, 100);
+    setDoubleParam(NDPluginGatherTimeout, 1.0);
+    setIntegerParam(NDPluginGatherPending, 0);
+    setIntegerParam(NDPluginGatherSkipped, 0);
+
+    orderTimerQueue_ = epicsTimerQueueAllocate(1, epicsThreadPriorityScanLow);
+    orderTimer_ = epicsTimerQueueCreateTimer(orderTimerQueue_, orderTimerCallbackC, this);
+
     if (maxPorts_ < 1) maxPorts_ = 1;
+    watermarks_.assign(maxPorts_, -1);
     NDArraySrc_ = (NDGatherNDArraySource_t *)calloc(sizeof(NDGatherNDArraySource_t), maxPorts_);
     pArraySrc = NDArraySrc_;
     for (i=0; i<maxPorts_; i++, pArraySrc++) {
@@ -63,6 +88,9 @@ NDPluginGather::NDPluginGather(const char *portName, int queueSize, int blocking
         pArraySrc->pasynUserGenericPointer = pasynManager->createAsynUser(0, 0);
         pArraySrc->pasynUserGenericPointer->userPvt = this;
         pArraySrc->pasynUserGenericPointer->reason = NDArrayData;
+        /* The base class only sets these for address 0 */
+        setStringParam(i, NDPluginDriverArrayPort, "");
+        setIntegerParam(i, NDPluginDriverArrayAddr, 0);
     }
 }
 
@@ -82,12 +110,292 @@ void NDPluginGather::processCallbacks(NDArray *pArray)
     /* This function is called with the mutex already locked.  It unlocks it during long calculations when private
     * structures don't need to be protected.
     */
+    int order, windowSize, source;
+    int uniqueId = pArray->uniqueId;
+    epicsTimeStamp now;
     //static const char *functionName = "processCallbacks";
 
     /* Call the base class method */
     NDPluginDriver::beginProcessCallbacks(pArray);
 
-    NDPluginDriver::endProcessCallbacks(pArray, true, true);
+    source = arraySource(pArray);
+    getIntegerParam(NDPluginGatherOrder, &order);
+    if (!order) {
+        NDPluginDriver::endProcessCallbacks(pArray, true, true);
+        return;
+    }
+
+    getIntegerParam(NDPluginGatherWindow, &windowSize);
+    if (windowSize < 1) windowSize = 1;
+    window_.setCapacity(windowSize);
+    windowSize = window_.capacity();
+    epicsTimeGetCurrent(&now);
+
+    /* A uniqueId far below the window means the driver restarted its uniqueIds */
+    if ((nextId_ < 0) || (uniqueId < nextId_ - windowSize)) restartOrder(uniqueId);
+    if ((source >= 0) && (uniqueId > watermarks_[source])) watermarks_[source] = uniqueId;
+
+    if (uniqueId < nextId_) {
+        /* Too late, the uniqueIds after it have been output already.  DisorderedArrays counts these */
+        NDPluginDriver::endProcessCallbacks(pArray, true, true);
+    } else {
+        /* Make room for the array by skipping the missing uniqueIds at the front of the window */
+        if (uniqueId - nextId_ >= windowSize) skipTo(uniqueId - windowSize + 1);
+        pArray->reserve();
+        if (!window_.add(pArray, &now)) {
+            /* Only possible with many arrays with the same uniqueId */
+            NDPluginDriver::endProcessCallbacks(pArray, true, true);
+            pArray->release();
+        }
+    }
+    outputOrdered(&now, false);
+    startOrderTimer(&now);
+}
+
+/** Called by the NDArray ports with a new array.  When GatherOrder=Ordered this records the source of the
+  * array, so that processCallbacks() can update the watermark of the source, and then calls the base class.
+  * The base class may drop the array, so the records are not removed when the arrays are processed, they are
+  * limited to the number of arrays that can be waiting: QueueSize, 1 being processed, and 1 from each source
+  * waiting for the lock.
+  * \param[in] pasynUser The asynUser of the source.
+  * \param[in] genericPointer Pointer to the NDArray */
+void NDPluginGather::driverCallback(asynUser *pasynUser, void *genericPointer)
+{
+    NDArray *pArray = (NDArray *)genericPointer;
+    NDGatherArrival_t arrival;
+    int order, queueSize, i;
+
+    this->lock();
+    getIntegerParam(NDPluginGatherOrder, &order);
+    if (order) {
+        for (i=0; i<maxPorts_; i++) {
+            if (NDArraySrc_[i].pasynUserGenericPointer == pasynUser) {
+                arrival.pArray = pArray;
+                arrival.uniqueId = pArray->uniqueId;
+                arrival.source = i;
+                arrivals_.push_back(arrival);
+                break;
+            }
+        }
+        getIntegerParam(NDPluginDriverQueueSize, &queueSize);
+        while ((int)arrivals_.size() > queueSize + maxPorts_ + 1) arrivals_.pop_front();
+    }
+    this->unlock();
+    NDPluginDriver::driverCallback(pasynUser, genericPointer);
+}
+
+/** Returns the source of an array that driverCallback() recorded, and removes the record.
+  * The oldest record with the address and uniqueId of the array is used, so a record of a dropped array whose
+  * NDArray the pool has reused is not.  If there is none, e.g. because the array is a copy of a view,
+  * the oldest record with the uniqueId is used.  This is called with the lock held.
+  * \param[in] pArray The array.
+  * \return The index of the source, or -1 if it is not known. */
+int NDPluginGather::arraySource(NDArray *pArray)
+{
+    std::deque<NDGatherArrival_t>::iterator it, found = arrivals_.end();
+    int source;
+
+    for (it=arrivals_.begin(); it!=arrivals_.end(); it++) {
+        if (it->uniqueId != pArray->uniqueId) continue;
+        if (it->pArray == pArray) {
+            found = it;
+            break;
+        }
+        if (found == arrivals_.end()) found = it;
+    }
+    if (found == arrivals_.end()) return -1;
+    source = found->source;
+    arrivals_.erase(found);
+    return source;
+}
+
+/** Starts a new sequence of uniqueIds, outputting the arrays in the window in order.
+  * This is called with the lock held. */
+void NDPluginGather::restartOrder(int uniqueId)
+{
+    outputOrdered(NULL, true);
+    watermarks_.assign(maxPorts_, -1);
+    nextId_ = uniqueId;
+}
+
+/** Outputs the arrays in the window with uniqueIds below uniqueId and moves the start of the window to it,
+  * counting the missing uniqueIds in GatherSkipped.  This is called with the lock held. */
+void NDPluginGather::skipTo(int uniqueId)
+{
+    NDArray *pArray;
+    int skipped;
+
+    getIntegerParam(NDPluginGatherSkipped, &skipped);
+    while (nextId_ < uniqueId) {
+        pArray = window_.first();
+        if (pArray && (pArray->uniqueId <= nextId_)) {
+            window_.removeFirst();
+            if (pArray->uniqueId == nextId_) nextId_++;
+            NDPluginDriver::endProcessCallbacks(pArray, true, true);
+            pArray->release();
+            continue;
+        }
+        /* nextId_ is missing, skip to the next array in the window or to uniqueId */
+        int next = (pArray && (pArray->uniqueId < uniqueId)) ? pArray->uniqueId : uniqueId;
+        skipped += next - nextId_;
+        nextId_ = next;
+    }
+    setIntegerParam(NDPluginGatherSkipped, skipped);
+}
+
+/** Returns the lowest watermark of the connected sources, or -1 if a source has not sent an array */
+int NDPluginGather::lowestWatermark()
+{
+    int i, lowest = -1;
+    bool first = true;
+
+    for (i=0; i<maxPorts_; i++) {
+        if (!NDArraySrc_[i].connectedToArrayPort) continue;
+        if (watermarks_[i] < 0) return -1;
+        if (first || (watermarks_[i] < lowest)) lowest = watermarks_[i];
+        first = false;
+    }
+    return lowest;
+}
+
+/** Outputs the arrays at the front of the window that are in order.  A missing uniqueId is skipped when each
+  * source has sent a higher uniqueId, because each source outputs its arrays in order, or when the first array
+  * in the window has waited for GatherTimeout.  This is called with the lock held.
+  * \param[in] pNow The current time.
+  * \param[in] flush If true all arrays in the window are output. */
+void NDPluginGather::outputOrdered(const epicsTimeStamp *pNow, bool flush)
+{
+    NDArray *pArray;
+    epicsTimeStamp added;
+    double timeout;
+    int lowest;
+
+    getDoubleParam(NDPluginGatherTimeout, &timeout);
+    while ((pArray = window_.first(&added))) {
+        if (pArray->uniqueId > nextId_) {
+            lowest = lowestWatermark();
+            if (flush || (epicsTimeDiffInSeconds(pNow, &added) >= timeout)) {
+                skipTo(pArray->uniqueId);
+            } else if (lowest >= nextId_) {
+                /* The uniqueIds up to lowest that are not in the window will not arrive */
+                skipTo((lowest < pArray->uniqueId) ? lowest + 1 : pArray->uniqueId);
+            }
+            if (pArray->uniqueId > nextId_) break;
+        }
+        window_.removeFirst();
+        if (pArray->uniqueId == nextId_) nextId_++;
+        NDPluginDriver::endProcessCallbacks(pArray, true, true);
+        pArray->release();
+    }
+    setIntegerParam(NDPluginGatherPending, window_.size());
+}
+
+/** Starts the timer that skips the missing uniqueId in front of the first array in the window after
+  * GatherTimeout.  This is called with the lock held. */
+void NDPluginGather::startOrderTimer(const epicsTimeStamp *pNow)
+{
+    epicsTimeStamp added;
+    double timeout;
+
+    if (!orderTimer_ || !window_.first(&added)) return;
+    getDoubleParam(NDPluginGatherTimeout, &timeout);
+    timeout -= epicsTimeDiffInSeconds(pNow, &added);
+    epicsTimerStartDelay(orderTimer_, (timeout > 0.) ? timeout : 0.);
+}
+
+/** Called by the timer when the first array in the window may have waited for GatherTimeout.
+  * The timer thread is shared, so the arrays are output by the plugin thread in processWakeup().
+  * Only when the plugin was created with BlockingCallbacks=1 there is no plugin thread, and they are output
+  * here, in the same way as blocking callbacks output arrays in the thread of the source. */
+void NDPluginGather::orderTimerCallback()
+{
+    this->lock();
+    if (!wakeProcessTask()) {
+        processWakeup();
+        callParamCallbacks();
+    }
+    this->unlock();
+}
+
+/** Outputs the arrays in the window that have waited for GatherTimeout.
+  * This is called by the plugin thread after orderTimerCallback(), with the lock held. */
+void NDPluginGather::processWakeup()
+{
+    epicsTimeStamp now;
+
+    epicsTimeGetCurrent(&now);
+    outputOrdered(&now, false);
+    startOrderTimer(&now);
+}
+
+asynStatus NDPluginGather::writeInt32(asynUser *pasynUser, epicsInt32 value)
+{
+    int function = pasynUser->reason;
+    asynStatus status = asynSuccess;
+    static const char *functionName = "NDPluginGather::writeInt32";
+
+    if ((function == NDPluginGatherOrder) && !value) {
+        /* Output the arrays that are waiting, and start again when ordering is enabled */
+        outputOrdered(NULL, true);
+        arrivals_.clear();
+        nextId_ = -1;
+    }
+    if ((function == NDPluginGatherWindow) && (value < 1)) {
+        status = asynError;
+    } else {
+        /* Set the parameter in the parameter library. */
+        status = (asynStatus) setIntegerParam(function, value);
+        /* If this parameter belongs to a base class call its method */
+        if (function < FIRST_NDPLUGIN_GATHER_PARAM)
+            status = NDPluginDriver::writeInt32(pasynUser, value);
+    }
+
+    /* Do callbacks so higher layers see any changes */
+    callParamCallbacks();
+
+    if (status)
+        epicsSnprintf(pasynUser->errorMessage, pasynUser->errorMessageSize,
+                      "%s: status=%d, function=%d, value=%d",
+                      functionName, status, function, value);
+    else
+        asynPrint(pasynUser, ASYN_TRACEIO_DRIVER,
+                  "%s: function=%d, value=%d\n",
+                  functionName, function, value);
+    return status;
+}
+
+NDPluginGather::~NDPluginGather()
+{
+    // As in NDPluginDriver, shut down here if this was not done before
+    if (orderTimerQueue_)
+        shutdownPortDriver();
+}
+
+void NDPluginGather::shutdownPortDriver()
+{
+    NDArray *pArray;
+    epicsTimerId timer;
+
+    this->lock();
+    timer = orderTimer_;
+    orderTimer_ = 0;
+    this->unlock();
+    // This waits for the timer callback if it is running, so it must be done with the mutex unlocked
+    if (timer) {
+        epicsTimerQueueDestroyTimer(orderTimerQueue_, timer);
+    }
+    NDPluginDriver::shutdownPortDriver();
+
+    /* Release the arrays that are waiting in the reorder window */
+    this->lock();
+    while ((pArray = window_.removeFirst())) {
+        pArray->release();
+    }
+    this->unlock();
+    if (orderTimerQueue_) {
+        epicsTimerQueueRelease(orderTimerQueue_);
+        orderTimerQueue_ = 0;
+    }
 }
 
 /** Register or unregister to receive asynGenericPointer (NDArray) callbacks from the driver.
@@ -2,8 +2,20 @@
 #define NDPluginGather_H
 
 #include <set>
+#include <deque>
+#include <vector>
+
+#include <epicsTimer.h>
 
 #include "NDPluginDriver.h"
+#include "NDArrayReorderBuffer.h"
+
+/* Ordered merge parameters */
+#define NDPluginGatherOrderString       "GATHER_ORDER"      /* (asynInt32,   r/w) 0=Unordered, 1=Ordered by uniqueId */
+#define NDPluginGatherWindowString      "GATHER_WINDOW"     /* (asynInt32,   r/w) Size of the reorder window in uniqueIds */
+#define NDPluginGatherTimeoutString     "GATHER_TIMEOUT"    /* (asynFloat64, r/w) Time to wait for a missing uniqueId */
+#define NDPluginGatherPendingString     "GATHER_PENDING"    /* (asynInt32,   r/o) Number of arrays in the reorder window */
+#define NDPluginGatherSkippedString     "GATHER_SKIPPED"    /* (asynInt32,   r/w) Number of missing uniqueIds skipped */
 
 typedef struct {
     void *asynGenericPointerInterruptPvt;        /**< InterruptPvt for connecting to NDArray driver interupts */
@@ -13,6 +25,13 @@ typedef struct {
     bool connectedToArrayPort;
 } NDGatherNDArraySource_t;
 
+/** An array received by driverCallback() when GatherOrder=Ordered, to find its source in processCallbacks() */
+typedef struct {
+    NDArray *pArray;
+    int uniqueId;
+    int source;
+} NDGatherArrival_t;
+
 /** A plugin that subscribes to callbacks from multiple ports, not just a single port  */
 class NDPLUGIN_API NDPluginGather : public NDPluginDriver {
 public:
@@ -20,17 +39,44 @@ public:
                    int maxPorts,
                    int maxBuffers, size_t maxMemory,
                    int priority, int stackSize);
+    ~NDPluginGather();
+
+    /* These methods override the virtual methods in the base class */
+    virtual void driverCallback(asynUser *pasynUser, void *genericPointer);
+    virtual asynStatus writeInt32(asynUser *pasynUser, epicsInt32 value);
+    virtual void shutdownPortDriver();
+    void orderTimerCallback();
 
 protected:
     /* These methods override the virtual methods in the base class */
     virtual void processCallbacks(NDArray *pArray);
+    virtual void processWakeup();
     virtual asynStatus connectToArrayPort(void);
     virtual asynStatus setArrayInterrupt(int connect);
 
+    int NDPluginGatherOrder;
+    #define FIRST_NDPLUGIN_GATHER_PARAM NDPluginGatherOrder
+    int NDPluginGatherWindow;
+    int NDPluginGatherTimeout;
+    int NDPluginGatherPending;
+    int NDPluginGatherSkipped;
 
 private:
+    int arraySource(NDArray *pArray);
+    void restartOrder(int uniqueId);
+    void skipTo(int uniqueId);
+    void outputOrdered(const epicsTimeStamp *pNow, bool flush);
+    int lowestWatermark();
+    void startOrderTimer(const epicsTimeStamp *pNow);
+
     int maxPorts_;
     NDGatherNDArraySource_t *NDArraySrc_;
+    std::deque<NDGatherArrival_t> arrivals_; /**< Arrays that may be waiting in the input queue, oldest first */
+    std::vector<int> watermarks_;           /**< Highest uniqueId processed from each source, -1 for none */
+    NDArrayReorderBuffer window_;           /**< Arrays waiting for lower uniqueIds */
+    int nextId_;                            /**< Next uniqueId to output, -1 before the first array */
+    epicsTimerQueueId orderTimerQueue_;
+    epicsTimerId orderTimer_;               /**< Skips a missing uniqueId after GatherTimeout */
 };
 
 #endif
@@ -8,6 +8,8 @@
  */
 
 #include <math.h>
+#include <float.h>
+#include <vector>
 
 #include <iocsh.h>
 
@@ -17,6 +19,101 @@
 
 static const char *driverName="NDPluginProcess";
 
+/** Arguments of the band functions that processCallbacks() passes to NDPluginDriver::parallelFor() */
+typedef struct {
+    double *data;
+    double *background;
+    double *flatField;
+    double *filter;
+    double scaleFlatField;
+    int    enableOffsetScale, autoOffsetScale;
+    double offset, scale;
+    int    enableLowClip, enableHighClip;
+    double lowClipThresh, highClipThresh;
+    double lowClipValue, highClipValue;
+    double rOffset, rc1, rc2;
+    double oOffset, O1, O2;
+    double fOffset, F1, F2;
+    double *minValues;      /**< Minimum input value of each band for autoOffsetScale */
+    double *maxValues;      /**< Maximum input value of each band for autoOffsetScale */
+} processBandArgs_t;
+
+/* Background, flat field, offset and scale, and clipping */
+static void processBand(void *pvt, int band, size_t first, size_t count)
+{
+    processBandArgs_t *pArgs = (processBandArgs_t *)pvt;
+    double *data = pArgs->data;
+    double *background = pArgs->background;
+    double *flatField = pArgs->flatField;
+    double minValue, maxValue;
+    double value;
+    size_t i;
+
+    if (count == 0) {
+        /* An empty band must not change the minimum and maximum of the other bands */
+        pArgs->minValues[band] = DBL_MAX;
+        pArgs->maxValues[band] = -DBL_MAX;
+        return;
+    }
+    minValue = data[first];
+    maxValue = data[first];
+    for (i=first; i<first+count; i++) {
+        value = data[i];
+        if (pArgs->autoOffsetScale) {
+            if (data[i] < minValue) minValue = data[i];
+            if (data[i] > maxValue) maxValue = data[i];
+        }
+        if (background) value -= background[i];
+        if (flatField) {
+            if (flatField[i] != 0.) value *= pArgs->scaleFlatField / flatField[i];
+        }
+        if (pArgs->enableOffsetScale) value = (value + pArgs->offset)*pArgs->scale;
+        if (pArgs->enableHighClip && (value > pArgs->highClipThresh)) value = pArgs->highClipValue;
+        if (pArgs->enableLowClip  && (value < pArgs->lowClipThresh))  value = pArgs->lowClipValue;
+        data[i] = value;
+    }
+    pArgs->minValues[band] = minValue;
+    pArgs->maxValues[band] = maxValue;
+}
+
+/* Resets the filter */
+static void resetFilterBand(void *pvt, int band, size_t first, size_t count)
+{
+    processBandArgs_t *pArgs = (processBandArgs_t *)pvt;
+    double *data = pArgs->data;
+    double *filter = pArgs->filter;
+    double newFilter;
+    size_t i;
+
+    for (i=first; i<first+count; i++) {
+        newFilter = pArgs->rOffset;
+        if (pArgs->rc1) newFilter += pArgs->rc1*filter[i];
+        if (pArgs->rc2) newFilter += pArgs->rc2*data[i];
+        filter[i] = newFilter;
+    }
+}
+
+/* Applies the filter */
+static void filterBand(void *pvt, int band, size_t first, size_t count)
+{
+    processBandArgs_t *pArgs = (processBandArgs_t *)pvt;
+    double *data = pArgs->data;
+    double *filter = pArgs->filter;
+    double newData, newFilter;
+    size_t i;
+
+    for (i=first; i<first+count; i++) {
+        newData   = pArgs->oOffset;
+        if (pArgs->O1) newData += pArgs->O1 * filter[i];
+        if (pArgs->O2) newData += pArgs->O2 * data[i];
+        newFilter = pArgs->fOffset;
+        if (pArgs->F1) newFilter += pArgs->F1 * filter[i];
+        if (pArgs->F2) newFilter += pArgs->F2 * data[i];
+        data[i] = newData;
+        filter[i] = newFilter;
+    }
+}
+
 
 /** Callback function that is called by the NDArray driver with new NDArray data.
   * Does image processing.
@@ -28,18 +125,16 @@ void NDPluginProcess::processCallbacks(NDArray *pArray)
      * It is called with the mutex already locked.  It unlocks it during long calculations when private
      * structures don't need to be protected.
      */
-    size_t i;
     NDArray *pScratch=NULL;
-    double  *data, newData, newFilter;
+    double  *data;
     NDArrayInfo arrayInfo;
-    double  *background=NULL, *flatField=NULL, *filter=NULL;
-    double  value;
+    double  *background=NULL, *flatField=NULL;
     size_t  nElements;
     int     saveBackground, enableBackground, validBackground;
     int     saveFlatField,  enableFlatField,  validFlatField;
     double  scaleFlatField;
     int     enableOffsetScale, autoOffsetScale;
-    double  offset, scale, minValue, maxValue;
+    double  offset=0, scale=1, minValue, maxValue;
     double  lowClipThresh=0, highClipThresh=0;
     double  lowClipValue=0, highClipValue=0;
     int     enableLowClip, enableHighClip;
@@ -52,6 +147,8 @@ void NDPluginProcess::processCallbacks(NDArray *pArray)
     double  fc1, fc2, fc3, fc4;
     double  rc1, rc2;
     double  F1, F2, O1, O2;
+    int     band, numBands;
+    processBandArgs_t args;
 
     NDArray *pArrayOut = NULL;
     static const char* functionName = "processCallbacks";
@@ -137,6 +234,9 @@ void NDPluginProcess::processCallbacks(NDArray *pArray)
                    enableHighClip                       ||
                    enableLowClip                        ||
                    enableFilter);
+    numBands = getNumBands(pArray, nElements);
+    if ((size_t)numBands > nElements) numBands = (int)nElements;
+    if (numBands < 1) numBands = 1;
     this->unlock();
     /* If no processing is to be done just convert the input array and do callbacks */
     if (!anyProcess) {
@@ -155,27 +255,38 @@ void NDPluginProcess::processCallbacks(NDArray *pArray)
     }
     data = (double *)pScratch->pData;
 
-    if (nElements > 0) {
-        minValue = data[0];
-        maxValue = data[0];
-    } else {
-        minValue = 0;
-        maxValue = 1;
-    }
-    for (i=0; i<nElements; i++) {
-        value = data[i];
-        if (autoOffsetScale) {
-            if (data[i] < minValue) minValue = data[i];
-            if (data[i] > maxValue) maxValue = data[i];
-        }
-        if (background) value -= background[i];
-        if (flatField) {
-            if (flatField[i] != 0.) value *= scaleFlatField / flatField[i];
+    {
+        /* Each band finds its own minimum and maximum */
+        std::vector<double> minValues(numBands), maxValues(numBands);
+        args.data = data;
+        args.background = background;
+        args.flatField = flatField;
+        args.filter = NULL;
+        args.scaleFlatField = scaleFlatField;
+        args.enableOffsetScale = enableOffsetScale;
+        args.autoOffsetScale = autoOffsetScale;
+        args.offset = offset;
+        args.scale = scale;
+        args.enableLowClip = enableLowClip;
+        args.enableHighClip = enableHighClip;
+        args.lowClipThresh = lowClipThresh;
+        args.highClipThresh = highClipThresh;
+        args.lowClipValue = lowClipValue;
+        args.highClipValue = highClipValue;
+        args.minValues = &minValues[0];
+        args.maxValues = &maxValues[0];
+        parallelFor(processBand, &args, nElements, numBands);
+        if (nElements > 0) {
+            minValue = minValues[0];
+            maxValue = maxValues[0];
+            for (band=1; band<numBands; band++) {
+                if (minValues[band] < minValue) minValue = minValues[band];
+                if (maxValues[band] > maxValue) maxValue = maxValues[band];
+            }
+        } else {
+            minValue = 0;
+            maxValue = 1;
         }
-        if (enableOffsetScale) value = (value + offset)*scale;
-        if (enableHighClip && (value > highClipThresh)) value = highClipValue;
-        if (enableLowClip  && (value < lowClipThresh))  value = lowClipValue;
-        data[i] = value;
     }
 
     if (enableFilter) {
@@ -200,33 +311,27 @@ void NDPluginProcess::processCallbacks(NDArray *pArray)
         }
         if ((this->numFiltered >= numFilter) && autoResetFilter)
           resetFilter = 1;
+        args.filter = (double *)this->pFilter->pData;
         if (resetFilter) {
-            filter = (double *)this->pFilter->pData;
-            for (i=0; i<nElements; i++) {
-                newFilter = rOffset;
-                if (rc1) newFilter += rc1*filter[i];
-                if (rc2) newFilter += rc2*data[i];
-                filter[i] = newFilter;
-            }
+            args.rOffset = rOffset;
+            args.rc1 = rc1;
+            args.rc2 = rc2;
+            parallelFor(resetFilterBand, &args, nElements, numBands);
             this->numFiltered = 0;
         }
         /* Do the filtering */
         if (this->numFiltered < numFilter) this->numFiltered++;
-        filter = (double *)this->pFilter->pData;
         O1 = oScale * (oc1 + oc2/this->numFiltered);
         O2 = oScale * (oc3 + oc4/this->numFiltered);
         F1 = fScale * (fc1 + fc2/this->numFiltered);
         F2 = fScale * (fc3 + fc4/this->numFiltered);
-        for (i=0; i<nElements; i++) {
-            newData   = oOffset;
-            if (O1) newData += O1 * filter[i];
-            if (O2) newData += O2 * data[i];
-            newFilter = fOffset;
-            if (F1) newFilter += F1 * filter[i];
-            if (F2) newFilter += F2 * data[i];
-            data[i] = newData;
-            filter[i] = newFilter;
-        }
+        args.oOffset = oOffset;
+        args.O1 = O1;
+        args.O2 = O2;
+        args.fOffset = fOffset;
+        args.F1 = F1;
+        args.F2 = F2;
+        parallelFor(filterBand, &args, nElements, numBands);
         if ((this->numFiltered != numFilter) && filterCallbacks)
           doCallbacks = 0;
     }
@@ -49,6 +49,7 @@ void NDPluginROI::processCallbacks(NDArray *pArray)
     size_t i;
     double scale;
     int collapseDims;
+    int outputViews;
     //static const char* functionName = "processCallbacks";
 
     memset(dims, 0, sizeof(NDDimension_t) * ND_ARRAY_MAX_DIMS);
@@ -70,6 +71,7 @@ void NDPluginROI::processCallbacks(NDArray *pArray)
     getIntegerParam(NDPluginROIEnableScale,  &enableScale);
     getDoubleParam(NDPluginROIScale, &scale);
     getIntegerParam(NDPluginROICollapseDims, &collapseDims);
+    getIntegerParam(NDPluginROIOutputViews,  &outputViews);
 
     /* Call the base class method */
     NDPluginDriver::beginProcessCallbacks(pArray);
@@ -157,7 +159,21 @@ void NDPluginROI::processCallbacks(NDArray *pArray)
         dims[2] = tempDim;
     }
 
-    if (enableScale && (scale != 0) && (scale != 1)) {
+    /* If OutputViews is enabled and there is no binning, scaling or data type conversion then
+     * the output is a view into the input array rather than a copy.
+     * createView() returns NULL if it cannot make the view, and then we fall back to convert(). */
+    pOutput = NULL;
+    if (outputViews && (dataType == (int)pArray->dataType) && !(enableScale && (scale != 0) && (scale != 1))) {
+        for (dim=0; dim<pArray->ndims; dim++) {
+            if (dims[dim].binning != 1) break;
+        }
+        if (dim == pArray->ndims) pOutput = this->pNDArrayPool->createView(pArray, dims);
+    }
+
+    if (pOutput) {
+        /* The view was created */
+    }
+    else if (enableScale && (scale != 0) && (scale != 1)) {
         /* This is tricky.  We want to do the operation to avoid errors due to integer truncation.
          * For example, if an image with all pixels=1 is binned 3x3 with scale=9 (divide by 9), then
          * the output should also have all pixels=1.
@@ -206,6 +222,7 @@ void NDPluginROI::processCallbacks(NDArray *pArray)
             if (pOutput->dims[i].size == 1) {
                 for (j=i+1; j<pOutput->ndims; j++) {
                     pOutput->dims[j-1] = pOutput->dims[j];
+                    if (pOutput->isView()) pOutput->strides[j-1] = pOutput->strides[j];
                 }
                 if (pOutput->ndims > 1) pOutput->ndims--;
             } else {
@@ -312,7 +329,8 @@ NDPluginROI::NDPluginROI(const char *portName, int queueSize, int blockingCallba
                    NDArrayPort, NDArrayAddr, 1, maxBuffers, maxMemory,
                    asynInt32ArrayMask | asynFloat64ArrayMask | asynGenericPointerMask,
                    asynInt32ArrayMask | asynFloat64ArrayMask | asynGenericPointerMask,
-                   asynFlags | ASYN_MULTIDEVICE, 1, priority, stackSize, maxThreads)
+                   asynFlags | ASYN_MULTIDEVICE, 1, priority, stackSize, maxThreads,
+                   false, true)
 {
     //static const char *functionName = "NDPluginROI";
 
@@ -345,6 +363,8 @@ NDPluginROI::NDPluginROI(const char *portName, int queueSize, int blockingCallba
     createParam(NDPluginROIEnableScaleString,       asynParamInt32, &NDPluginROIEnableScale);
     createParam(NDPluginROIScaleString,             asynParamFloat64, &NDPluginROIScale);
     createParam(NDPluginROICollapseDimsString,      asynParamInt32, &NDPluginROICollapseDims);
+    createParam(NDPluginROIOutputViewsString,       asynParamInt32, &NDPluginROIOutputViews);
+    setIntegerParam(NDPluginROIOutputViews, 0);
 
     /* Set the plugin type string */
     setStringParam(NDPluginDriverPluginType, "NDPluginROI");
@@ -8,8 +8,12 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <algorithm>
 
 #include <iocsh.h>
+#include <epicsString.h>
 
 #include "NDPluginScatter.h"
 
@@ -27,6 +31,7 @@ void NDPluginScatter::processCallbacks(NDArray *pArray)
      * structures don't need to be protected.
      */
     int arrayCallbacks;
+    int method;
 
     static const char *functionName = "NDPluginScatter::processCallbacks";
 
@@ -34,12 +39,20 @@ void NDPluginScatter::processCallbacks(NDArray *pArray)
     NDPluginDriver::beginProcessCallbacks(pArray);
 
     getIntegerParam(NDArrayCallbacks, &arrayCallbacks);
+    getIntegerParam(NDPluginScatterMethod, &method);
+    if (weightsChanged_) {
+        /* The client list is only used in this thread, so rebuilding it here is safe */
+        clientWeights_ = weights_;
+        clients_.clear();
+        weightsChanged_ = false;
+    }
     if (arrayCallbacks == 1) {
-        NDArray *pArrayOut = this->pNDArrayPool->copy(pArray, NULL, 1);
+        bool readAttributes = true;
+        NDArray *pArrayOut = passThroughArray(pArray, &readAttributes);
         if (NULL != pArrayOut) {
-            this->getAttributes(pArrayOut->pAttributeList);
+            if (readAttributes) this->getAttributes(pArrayOut->pAttributeList);
             this->unlock();
-            doNDArrayCallbacks(pArrayOut, NDArrayData, 0);
+            doNDArrayCallbacks(pArrayOut, NDArrayData, 0, method);
             this->lock();
             if (this->pArrays[0]) this->pArrays[0]->release();
             this->pArrays[0] = pArrayOut;
@@ -52,43 +65,194 @@ void NDPluginScatter::processCallbacks(NDArray *pArray)
     }
 }
 
-/** Called by driver to do the callbacks to the next registered client on the asynGenericPointer interface.
-  * \param[in] pArray Pointer to the NDArray
+/** Updates clients_ from the list of clients registered for callbacks.  The list is only rebuilt when
+  * a client has registered or unregistered, so the reason and address of each client are not looked up for
+  * every NDArray.
+  * \param[in] pclientList The client list of the asynGenericPointer interface, between interruptStart()
+  *            and interruptEnd().
   * \param[in] reason A client will be called if reason matches pasynUser->reason registered for that client.
-  * \param[in] address A client will be called if address matches the address registered for that client. */
-asynStatus NDPluginScatter::doNDArrayCallbacks(NDArray *pArray, int reason, int address)
+  * \param[in] address A client will be called if address matches the address registered for that client.
+  * \return true if the list was rebuilt. */
+bool NDPluginScatter::updateClients(ELLLIST *pclientList, int reason, int address)
 {
-    ELLLIST *pclientList;
     interruptNode *pnode;
+    size_t i = 0;
     int addr;
-    int numNodes;
-    int i;
-    //static const char *functionName = "doNDArrayCallbacks";
 
-    pasynManager->interruptStart(this->asynStdInterfaces.genericPointerInterruptPvt, &pclientList);
-    numNodes = ellCount(pclientList);
-    for (i=0; i<numNodes; i++) {
-        if (nextClient_ > numNodes) nextClient_ = 1;
-        pnode = (interruptNode *)ellNth(pclientList, nextClient_);
-        nextClient_++;
+    for (pnode = (interruptNode *)ellFirst(pclientList); pnode; pnode = (interruptNode *)ellNext(&pnode->node), i++) {
+        asynGenericPointerInterrupt *pInterrupt = (asynGenericPointerInterrupt *)pnode->drvPvt;
+        if ((i >= clients_.size()) || (clients_[i].pInterrupt != pInterrupt)) break;
+    }
+    if (!pnode && (i == clients_.size())) return false;
+
+    clients_.clear();
+    for (pnode = (interruptNode *)ellFirst(pclientList); pnode; pnode = (interruptNode *)ellNext(&pnode->node)) {
         asynGenericPointerInterrupt *pInterrupt = (asynGenericPointerInterrupt *)pnode->drvPvt;
+        scatterClient client;
+        client.pInterrupt = pInterrupt;
+        client.pPlugin = NDPluginDriver::arrayClient(pInterrupt);
+        client.weight = 1;
+        client.current = 0;
         pasynManager->getAddr(pInterrupt->pasynUser, &addr);
         /* If this is not a multi-device then address is -1, change to 0 */
         if (addr == -1) addr = 0;
-        if ((pInterrupt->pasynUser->reason != reason) || (address != addr)) continue;
+        /* Clients for other reasons or addresses are kept with weight -1 so the list can be compared */
+        if ((pInterrupt->pasynUser->reason != reason) || (address != addr)) {
+            client.weight = -1;
+        } else if (client.pPlugin) {
+            std::map<std::string, int>::iterator it = clientWeights_.find(client.pPlugin->portName);
+            if (it != clientWeights_.end()) client.weight = it->second;
+        }
+        clients_.push_back(client);
+    }
+    return true;
+}
+
+/** Fills order_ with the indexes in clients_ of the clients to call for the next NDArray, in the order in which
+  * they are tried.  Every method starts from nextClient_, so that clients that are equally good take turns.
+  * \param[in] method The NDPluginScatterMethod_t.
+  * \return The sum of the weights of the clients for Weighted, else 0. */
+epicsInt64 NDPluginScatter::orderClients(int method)
+{
+    int numClients = (int)clients_.size();
+    epicsInt64 totalWeight = 0;
+    int i, j;
+
+    order_.clear();
+    for (i=0; i<numClients; i++) {
+        j = (nextClient_ + i) % numClients;
+        if (clients_[j].weight < 0) continue;
+        order_.push_back(j);
+    }
+    if (method == NDPluginScatterLeastLoaded) {
+        /* Clients that are not plugins do not report a queue, so they are tried last */
+        for (i=0; i<(int)order_.size(); i++) {
+            for (j=i; (j > 0) && (queueFree(order_[j]) > queueFree(order_[j-1])); j--) {
+                std::swap(order_[j], order_[j-1]);
+            }
+        }
+    } else if (method == NDPluginScatterWeighted) {
+        /* Smooth weighted round robin: each client gains its weight for each NDArray, and the one that
+         * accepts the NDArray loses the total, so the clients receive NDArrays in proportion to their weights,
+         * interleaved.  When the first choice is full the next highest is tried. */
+        for (i=0; i<(int)order_.size(); i++) {
+            scatterClient *pClient = &clients_[order_[i]];
+            pClient->current += pClient->weight;
+            totalWeight += pClient->weight;
+            for (j=i; (j > 0) && (pClient->current > clients_[order_[j-1]].current); j--) {
+                std::swap(order_[j], order_[j-1]);
+            }
+        }
+    }
+    return totalWeight;
+}
+
+/** Returns the free queue slots of a client for LeastLoaded, -1 if it is not a plugin */
+int NDPluginScatter::queueFree(int client)
+{
+    return clients_[client].pPlugin ? clients_[client].pPlugin->getQueueFree() : -1;
+}
+
+/** Called by driver to do the callbacks to the next registered client on the asynGenericPointer interface.
+  * \param[in] pArray Pointer to the NDArray
+  * \param[in] reason A client will be called if reason matches pasynUser->reason registered for that client.
+  * \param[in] address A client will be called if address matches the address registered for that client.
+  * \param[in] method The NDPluginScatterMethod_t that chooses the client. */
+asynStatus NDPluginScatter::doNDArrayCallbacks(NDArray *pArray, int reason, int address, int method)
+{
+    ELLLIST *pclientList;
+    int numClients;
+    epicsInt64 totalWeight;
+    int i;
+    //static const char *functionName = "doNDArrayCallbacks";
+
+    pasynManager->interruptStart(this->asynStdInterfaces.genericPointerInterruptPvt, &pclientList);
+    updateClients(pclientList, reason, address);
+    totalWeight = orderClients(method);
+    numClients = (int)order_.size();
+    for (i=0; i<numClients; i++) {
+        scatterClient *pClient = &clients_[order_[i]];
+        asynGenericPointerInterrupt *pInterrupt = pClient->pInterrupt;
+        nextClient_ = order_[i] + 1;
         /* Set pasynUser->auxStatus to asynOverflow.
          * This is a flag that means return without generating an error if the queue is full.
          * We don't set this for the last node because if the last node cannot queue the array
          * then the array will be dropped */
         pInterrupt->pasynUser->auxStatus = asynOverflow;
-        if (i == numNodes-1) pInterrupt->pasynUser->auxStatus = asynSuccess;
+        if (i == numClients-1) pInterrupt->pasynUser->auxStatus = asynSuccess;
         pInterrupt->callback(pInterrupt->userPvt, pInterrupt->pasynUser, pArray);
-        if (pInterrupt->pasynUser->auxStatus == asynSuccess) break;
+        if (pInterrupt->pasynUser->auxStatus == asynSuccess) {
+            pClient->current -= totalWeight;
+            break;
+        }
     }
     pasynManager->interruptEnd(this->asynStdInterfaces.genericPointerInterruptPvt);
     return asynSuccess;
 }
 
+/** Called when asyn clients call pasynOctet->write().
+  * This function parses SCATTER_WEIGHTS, a list of portName:weight pairs separated by commas or spaces.
+  * Clients that are not in the list have weight 1.
+  * \param[in] pasynUser pasynUser structure that encodes the reason and address.
+  * \param[in] value Address of the string to write.
+  * \param[in] nChars Number of characters to write.
+  * \param[out] nActual Number of characters actually written. */
+asynStatus NDPluginScatter::writeOctet(asynUser *pasynUser, const char *value, size_t nChars, size_t *nActual)
+{
+    int function = pasynUser->reason;
+    asynStatus status = asynSuccess;
+    const char *functionName = "writeOctet";
+
+    if (function == NDPluginScatterWeights) {
+        std::map<std::string, int> weights;
+        std::string list(value, strnlen(value, nChars));
+        size_t start = 0, end;
+        while ((start = list.find_first_not_of(", ", start)) != std::string::npos) {
+            end = list.find_first_of(", ", start);
+            std::string item = list.substr(start, end - start);
+            size_t colon = item.rfind(':');
+            const char *pWeight = (colon == std::string::npos) ? "" : item.c_str() + colon + 1;
+            char *pEnd;
+            errno = 0;
+            long weight = strtol(pWeight, &pEnd, 10);
+            /* Each entry must be port:weight, with a weight from 0 to NDPluginScatterMaxWeight and nothing after it */
+            if ((colon == std::string::npos) || (colon == 0) || (pEnd == pWeight) || (*pEnd != 0) ||
+                (errno == ERANGE) || (weight < 0) || (weight > NDPluginScatterMaxWeight)) {
+                epicsSnprintf(pasynUser->errorMessage, pasynUser->errorMessageSize,
+                              "%s:%s: invalid entry \"%s\" in ScatterWeights, must be port:weight with weight 0 to %d",
+                              driverName, functionName, item.c_str(), NDPluginScatterMaxWeight);
+                status = asynError;
+                break;
+            }
+            weights[item.substr(0, colon)] = (int)weight;
+            start = end;
+        }
+        if (status == asynSuccess) {
+            setStringParam(function, list.c_str());
+            weights_ = weights;
+            weightsChanged_ = true;
+            callParamCallbacks();
+        }
+    } else {
+        /* If this parameter belongs to a base class call its method */
+        status = NDPluginDriver::writeOctet(pasynUser, value, nChars, nActual);
+    }
+
+    if (status){
+        /* The weights parser has already written a more specific message */
+        if (function != NDPluginScatterWeights)
+            epicsSnprintf(pasynUser->errorMessage, pasynUser->errorMessageSize,
+                          "%s:%s: status=%d, function=%d, value=%s",
+                          driverName, functionName, status, function, value);
+    } else {
+        asynPrint(pasynUser, ASYN_TRACEIO_DRIVER,
+                  "%s:%s: function=%d, value=%s\n",
+                  driverName, functionName, function, value);
+    }
+    *nActual = nChars;
+    return status;
+}
+
 /** Constructor for NDPluginScatter; most parameters are simply passed to NDPluginDriver::NDPluginDriver.
   *
   * \param[in] portName The name of the asyn port driver to be created.
@@ -117,11 +281,16 @@ NDPluginScatter::NDPluginScatter(const char *portName, int queueSize, int blocki
                    asynInt32ArrayMask | asynFloat64Mask | asynFloat64ArrayMask | asynGenericPointerMask,
                    asynInt32ArrayMask | asynFloat64Mask | asynFloat64ArrayMask | asynGenericPointerMask,
                    ASYN_MULTIDEVICE, 1, priority, stackSize, 1),
-    nextClient_(1)
+    nextClient_(0),
+    weightsChanged_(false)
 {
     //static const char *functionName = "NDPluginScatter::NDPluginScatter";
 
     createParam(NDPluginScatterMethodString,         asynParamInt32,        &NDPluginScatterMethod);
+    createParam(NDPluginScatterWeightsString,        asynParamOctet,        &NDPluginScatterWeights);
+
+    setIntegerParam(NDPluginScatterMethod, NDPluginScatterRoundRobin);
+    setStringParam(NDPluginScatterWeights, "");
 
     /* Set the plugin type string */
     setStringParam(NDPluginDriverPluginType, "NDPluginScatter");
@@ -1,10 +1,25 @@
 #ifndef NDPluginScatter_H
 #define NDPluginScatter_H
 
+#include <map>
+#include <string>
+#include <vector>
+
 #include "NDPluginDriver.h"
 
 /* General parameters */
 #define NDPluginScatterMethodString          "SCATTER_METHOD"            /* (asynInt32,        r/w) Algorithm for scatter */
+#define NDPluginScatterWeightsString         "SCATTER_WEIGHTS"           /* (asynOctet,        r/w) Weights of the clients for Weighted */
+
+/** Largest weight accepted in SCATTER_WEIGHTS */
+#define NDPluginScatterMaxWeight 1000000
+
+/** Algorithms for choosing the client that receives the next NDArray, the value of SCATTER_METHOD */
+typedef enum {
+    NDPluginScatterRoundRobin,      /**< Each client in turn, skipping clients whose queue is full */
+    NDPluginScatterLeastLoaded,     /**< The client with the most free queue slots */
+    NDPluginScatterWeighted         /**< Smooth weighted round robin using SCATTER_WEIGHTS */
+} NDPluginScatterMethod_t;
 
 /** A plugin that does callbacks in round-robin fashion rather than passing every NDArray to every callback client  */
 class NDPLUGIN_API NDPluginScatter : public NDPluginDriver {
@@ -15,14 +30,30 @@ public:
                       int priority, int stackSize);
     /* These methods override the virtual methods in the base class */
     void processCallbacks(NDArray *pArray);
+    asynStatus writeOctet(asynUser *pasynUser, const char *value, size_t maxChars, size_t *nActual);
 
 protected:
     int NDPluginScatterMethod;
     #define FIRST_NDPLUGIN_SCATTER_PARAM NDPluginScatterMethod
+    int NDPluginScatterWeights;
 
 private:
+    struct scatterClient {
+        asynGenericPointerInterrupt *pInterrupt;
+        NDPluginDriver *pPlugin;    /**< NULL if the client is not a plugin */
+        int weight;
+        epicsInt64 current;         /**< Running total of the smooth weighted round robin */
+    };
     int nextClient_;
-    asynStatus doNDArrayCallbacks(NDArray *pArray, int reason, int addr);
+    std::vector<scatterClient> clients_;        /**< Cached list of the clients registered for NDArrayData */
+    std::vector<int> order_;                    /**< Order in which clients_ are tried for the current NDArray */
+    std::map<std::string, int> weights_;        /**< Weights from SCATTER_WEIGHTS by port name, protected by the lock */
+    std::map<std::string, int> clientWeights_;  /**< Copy of weights_ used by doNDArrayCallbacks() */
+    bool weightsChanged_;
+    asynStatus doNDArrayCallbacks(NDArray *pArray, int reason, int addr, int method);
+    bool updateClients(ELLLIST *pclientList, int reason, int address);
+    epicsInt64 orderClients(int method);
+    int queueFree(int client);
 };
 
 #endif
@@ -9,6 +9,8 @@
 
 #include <stdlib.h>
 #include <math.h>
+#include <float.h>
+#include <vector>
 
 #include <iocsh.h>
 
@@ -26,33 +28,98 @@
 
 static const char *driverName="NDPluginStats";
 
+/** Partial results for one band of an array, which are added up after NDPluginDriver::parallelFor() returns */
+typedef struct {
+    double min;
+    double max;
+    size_t imin;
+    size_t imax;
+    double total;
+    double sigma;
+    double M11;
+    double *profileX[MAX_PROFILE_TYPES];    /**< Sums of the columns of the rows in the band */
+    double *histogram;
+    epicsInt32 histBelow;
+    epicsInt32 histAbove;
+} NDStatsBand_t;
+
+/** Arguments of the band functions */
+typedef struct {
+    void *pData;
+    NDStats_t *pStats;
+    NDStatsBand_t *pBands;
+} NDStatsBandArgs_t;
+
+/** Returns the number of bands to split numItems items into, from pStats->numBands */
+static int statsNumBands(NDStats_t *pStats, size_t numItems)
+{
+    int numBands = pStats->numBands;
+
+    if ((size_t)numBands > numItems) numBands = (int)numItems;
+    if (numBands < 1) numBands = 1;
+    return numBands;
+}
+
 template <typename epicsType>
-asynStatus NDPluginStats::doComputeHistogramT(NDArray *pArray, NDStats_t *pStats)
+static void histogramBand(void *pvt, int band, size_t first, size_t count)
 {
-    epicsType *pData = (epicsType *)pArray->pData;
+    NDStatsBandArgs_t *pArgs = (NDStatsBandArgs_t *)pvt;
+    NDStats_t *pStats = pArgs->pStats;
+    NDStatsBand_t *pBand = &pArgs->pBands[band];
+    epicsType *pData = (epicsType *)pArgs->pData;
+    double scale = (pStats->histSize - 1) / (pStats->histMax - pStats->histMin);
+    double value;
     size_t i;
-    double scale, entropy;
     int bin;
+
+    for (i=first; i<first+count; i++) {
+        value = (double)pData[i];
+        bin = (int)(((value - pStats->histMin) * scale) + 0.5);
+        if ((bin < 0) || (value < pStats->histMin))
+            pBand->histBelow++;
+        else if ((bin > (int)pStats->histSize-1) || (value > pStats->histMax))
+            pBand->histAbove++;
+        else
+            pBand->histogram[bin]++;
+    }
+}
+
+template <typename epicsType>
+asynStatus NDPluginStats::doComputeHistogramT(NDArray *pArray, NDStats_t *pStats)
+{
+    size_t i;
+    double entropy;
     size_t nElements;
-    double value, counts;
+    double counts;
     NDArrayInfo arrayInfo;
+    NDStatsBandArgs_t args;
+    int band, numBands;
 
     pArray->getInfo(&arrayInfo);
     nElements = arrayInfo.nElements;
     if (pStats->histMax <= pStats->histMin) pStats->histMax = pStats->histMin + 1;
-    scale = (pStats->histSize - 1) / (pStats->histMax - pStats->histMin);
+
+    /* The first band counts into the output histogram, the others into their own */
+    numBands = statsNumBands(pStats, nElements);
+    std::vector<NDStatsBand_t> bands(numBands);
+    std::vector<double> histograms((numBands-1) * pStats->histSize);
+    for (band=0; band<numBands; band++) {
+        bands[band].histogram = (band == 0) ? pStats->histogram : &histograms[(band-1) * pStats->histSize];
+    }
+    args.pData = pArray->pData;
+    args.pStats = pStats;
+    args.pBands = &bands[0];
+    parallelFor(histogramBand<epicsType>, &args, nElements, numBands);
 
     pStats->histBelow = 0;
     pStats->histAbove = 0;
-    for (i=0; i<nElements; i++) {
-        value = (double)pData[i];
-        bin = (int)(((value - pStats->histMin) * scale) + 0.5);
-        if ((bin < 0) || (value < pStats->histMin))
-            pStats->histBelow++;
-        else if ((bin > (int)pStats->histSize-1) || (value > pStats->histMax))
-            pStats->histAbove++;
-        else
-            pStats->histogram[bin]++;
+    for (band=0; band<numBands; band++) {
+        pStats->histBelow += bands[band].histBelow;
+        pStats->histAbove += bands[band].histAbove;
+        if (band == 0) continue;
+        for (i=0; (int)i<pStats->histSize; i++) {
+            pStats->histogram[i] += bands[band].histogram[i];
+        }
     }
 
     entropy = 0;
@@ -109,34 +176,75 @@ asynStatus NDPluginStats::doComputeHistogram(NDArray *pArray, NDStats_t *pStats)
     return(status);
 }
 
+template <typename epicsType>
+static void statisticsBand(void *pvt, int band, size_t first, size_t count)
+{
+    NDStatsBandArgs_t *pArgs = (NDStatsBandArgs_t *)pvt;
+    NDStatsBand_t *pBand = &pArgs->pBands[band];
+    epicsType *pData = (epicsType *)pArgs->pData;
+    size_t i;
+    double value;
+
+    if (count == 0) {
+        /* An empty band must not change the minimum and maximum of the other bands */
+        pBand->min = DBL_MAX;
+        pBand->max = -DBL_MAX;
+        return;
+    }
+    pBand->min = (double) pData[first];
+    pBand->imin = first;
+    pBand->max = (double) pData[first];
+    pBand->imax = first;
+    for (i=first; i<first+count; i++) {
+        value = (double)pData[i];
+        if (value < pBand->min) {
+            pBand->min = value;
+            pBand->imin = i;
+        }
+        if (value > pBand->max) {
+            pBand->max = value;
+            pBand->imax = i;
+        }
+        pBand->total += value;
+        pBand->sigma += value * value;
+    }
+}
+
 template <typename epicsType>
 void NDPluginStats::doComputeStatisticsT(NDArray *pArray, NDStats_t *pStats)
 {
-    size_t i, imin, imax;
-    epicsType *pData = (epicsType *)pArray->pData;
+    size_t imin, imax;
     NDArrayInfo arrayInfo;
-    double value;
+    NDStatsBandArgs_t args;
+    int band, numBands;
 
     pArray->getInfo(&arrayInfo);
     pStats->nElements = arrayInfo.nElements;
-    pStats->min = (double) pData[0];
-    imin = 0;
-    pStats->max = (double) pData[0];
-    imax = 0;
+    numBands = statsNumBands(pStats, pStats->nElements);
+    std::vector<NDStatsBand_t> bands(numBands);
+    args.pData = pArray->pData;
+    args.pStats = pStats;
+    args.pBands = &bands[0];
+    parallelFor(statisticsBand<epicsType>, &args, pStats->nElements, numBands);
+
+    /* Combine the bands in order, so the minimum and maximum are the first ones in the array */
+    pStats->min = bands[0].min;
+    imin = bands[0].imin;
+    pStats->max = bands[0].max;
+    imax = bands[0].imax;
     pStats->total = 0.;
     pStats->sigma = 0.;
-    for (i=0; i<pStats->nElements; i++) {
-        value = (double)pData[i];
-        if (value < pStats->min) {
-            pStats->min = value;
-            imin = i;
+    for (band=0; band<numBands; band++) {
+        if (bands[band].min < pStats->min) {
+            pStats->min = bands[band].min;
+            imin = bands[band].imin;
         }
-        if (value > pStats->max) {
-            pStats->max = value;
-            imax = i;
+        if (bands[band].max > pStats->max) {
+            pStats->max = bands[band].max;
+            imax = bands[band].imax;
         }
-        pStats->total += value;
-        pStats->sigma += value * value;
+        pStats->total += bands[band].total;
+        pStats->sigma += bands[band].sigma;
     }
     pStats->minX = imin % arrayInfo.xSize;
     pStats->minY = imin / arrayInfo.xSize;
@@ -189,11 +297,36 @@ int NDPluginStats::doComputeStatistics(NDArray *pArray, NDStats_t *pStats)
 }
 
 template <typename epicsType>
-asynStatus NDPluginStats::doComputeCentroidT(NDArray *pArray, NDStats_t *pStats)
+static void centroidBand(void *pvt, int band, size_t first, size_t count)
 {
-    epicsType *pData = (epicsType *)pArray->pData;
-    double value, *pValue, *pThresh, varX, varY, varXY;
+    NDStatsBandArgs_t *pArgs = (NDStatsBandArgs_t *)pvt;
+    NDStats_t *pStats = pArgs->pStats;
+    NDStatsBand_t *pBand = &pArgs->pBands[band];
+    epicsType *pData = (epicsType *)pArgs->pData + first*pStats->profileSizeX;
+    double value;
     size_t ix, iy;
+
+    for (iy=first; iy<first+count; iy++) {
+        for (ix=0; ix<pStats->profileSizeX; ix++) {
+            value = (double)*pData++;
+            pBand->profileX[profAverage][ix] += value;
+            pStats->profileY[profAverage][iy] += value;
+            if (value >= pStats->centroidThreshold) {
+                pBand->profileX[profThreshold][ix] += value;
+                pStats->profileY[profThreshold][iy] += value;
+                pBand->M11 += value * ix * iy;
+            }
+        }
+    }
+}
+
+template <typename epicsType>
+asynStatus NDPluginStats::doComputeCentroidT(NDArray *pArray, NDStats_t *pStats)
+{
+    double *pValue, *pThresh, varX, varY, varXY;
+    size_t ix;
+    NDStatsBandArgs_t args;
+    int band, numBands;
     /*Raw moments */
     double M00 = 0.0;
     double M10 = 0.0, M01 = 0.0;
@@ -205,16 +338,27 @@ asynStatus NDPluginStats::doComputeCentroidT(NDArray *pArray, NDStats_t *pStats)
 
     if (pArray->ndims > 2) return(asynError);
 
-    for (iy=0; iy<pStats->profileSizeY; iy++) {
+    /* Each band of rows sums its own X profiles, the first band sums into the output profiles.
+     * The rows of the Y profiles are different in each band. */
+    numBands = statsNumBands(pStats, pStats->profileSizeY);
+    std::vector<NDStatsBand_t> bands(numBands);
+    std::vector<double> profiles((numBands-1) * 2 * pStats->profileSizeX);
+    bands[0].profileX[profAverage] = pStats->profileX[profAverage];
+    bands[0].profileX[profThreshold] = pStats->profileX[profThreshold];
+    for (band=1; band<numBands; band++) {
+        bands[band].profileX[profAverage] = &profiles[(band-1) * 2 * pStats->profileSizeX];
+        bands[band].profileX[profThreshold] = bands[band].profileX[profAverage] + pStats->profileSizeX;
+    }
+    args.pData = pArray->pData;
+    args.pStats = pStats;
+    args.pBands = &bands[0];
+    parallelFor(centroidBand<epicsType>, &args, pStats->profileSizeY, numBands);
+    for (band=0; band<numBands; band++) {
+        M11 += bands[band].M11;
+        if (band == 0) continue;
         for (ix=0; ix<pStats->profileSizeX; ix++) {
-            value = (double)*pData++;
-            pStats->profileX[profAverage][ix] += value;
-            pStats->profileY[profAverage][iy] += value;
-            if (value >= pStats->centroidThreshold) {
-                pStats->profileX[profThreshold][ix] += value;
-                pStats->profileY[profThreshold][iy] += value;
-                M11 += value * ix * iy;
-            }
+            pStats->profileX[profAverage][ix] += bands[band].profileX[profAverage][ix];
+            pStats->profileX[profThreshold][ix] += bands[band].profileX[profThreshold][ix];
         }
     }
 
@@ -232,7 +376,7 @@ asynStatus NDPluginStats::doComputeCentroidT(NDArray *pArray, NDStats_t *pStats)
     }
     pValue  = pStats->profileY[profAverage];
     pThresh = pStats->profileY[profThreshold];
-    for (iy=0; iy<pStats->profileSizeY; iy++, pValue++, pThresh++) {
+    for (size_t iy=0; iy<pStats->profileSizeY; iy++, pValue++, pThresh++) {
         M01 += *pThresh * iy;
         M02 += *pThresh * iy * iy;
         M03 += *pThresh * iy * iy * iy;
@@ -461,6 +605,7 @@ void NDPluginStats::processCallbacks(NDArray *pArray)
     getDoubleParam (NDPluginStatsHistMin,  &pStats->histMin);
     getDoubleParam (NDPluginStatsHistMax,  &pStats->histMax);
     getDoubleParam (NDPluginStatsCentroidThreshold,  &pStats->centroidThreshold);
+    pStats->numBands = getNumBands(pArray, arrayInfo.nElements);
 
     if (pArray->ndims > 0) sizeX = pArray->dims[0].size;
     if (pArray->ndims == 1) sizeY = 1;
@@ -86,6 +86,7 @@ typedef struct NDStats {
     epicsInt32 histBelow;
     epicsInt32 histAbove;
     double histEntropy;
+    int numBands;           /**< Number of bands for NDPluginDriver::parallelFor(), 0 or 1 for one thread */
 } NDStats_t;
 
 /* Statistics */
@@ -31,9 +31,32 @@ typedef enum {
   TransformRotate270Mirror,
 } NDPluginTransformType_t;
 
-/** Perform the move of the pixels to the new orientation. */
+/** Sets the dimensions of the output array, which are swapped by the rotations by 90 and 270 degrees. */
+static void transformDims(NDArray *inArray, NDArray *outArray, int transformType, NDArrayInfo_t *arrayInfo)
+{
+  outArray->dims[arrayInfo->xDim].size = inArray->dims[arrayInfo->xDim].size;
+  outArray->dims[arrayInfo->yDim].size = inArray->dims[arrayInfo->yDim].size;
+  if (inArray->ndims > 2) outArray->dims[arrayInfo->colorDim].size = inArray->dims[arrayInfo->colorDim].size;
+
+  switch (transformType)
+  {
+    case (TransformRotate90):
+    case (TransformRotate270):
+    case (TransformRotate90Mirror):
+    case (TransformRotate270Mirror):
+      outArray->dims[arrayInfo->xDim].size = inArray->dims[arrayInfo->yDim].size;
+      outArray->dims[arrayInfo->yDim].size = inArray->dims[arrayInfo->xDim].size;
+      break;
+
+    default:
+      break;
+  }
+}
+
+/** Perform the move of the pixels to the new orientation, for input rows yFirst to yLast-1. */
 template <typename epicsType>
-void transformNDArray(NDArray *inArray, NDArray *outArray, int transformType, int colorMode, NDArrayInfo_t *arrayInfo)
+void transformNDArray(NDArray *inArray, NDArray *outArray, int transformType, int colorMode, NDArrayInfo_t *arrayInfo,
+                      int yFirst, int yLast)
 {
   epicsType *inData = (epicsType *)inArray->pData;
   epicsType *outData = (epicsType *)outArray->pData;
@@ -54,11 +77,6 @@ void transformNDArray(NDArray *inArray, NDArray *outArray, int transformType, in
   colorStride = (int)arrayInfo->colorStride;
   elementSize = arrayInfo->bytesPerElement;
 
-  // Assume output array is same dimensions as input.  Handle rotation cases below.
-  outArray->dims[arrayInfo->xDim].size = inArray->dims[arrayInfo->xDim].size;
-  outArray->dims[arrayInfo->yDim].size = inArray->dims[arrayInfo->yDim].size;
-  if (inArray->ndims > 2) outArray->dims[arrayInfo->colorDim].size = inArray->dims[arrayInfo->colorDim].size;
-
   switch (transformType)
   {
     case (TransformNone):
@@ -68,14 +86,11 @@ void transformNDArray(NDArray *inArray, NDArray *outArray, int transformType, in
 
     case (TransformRotate90):
 
-      outArray->dims[arrayInfo->xDim].size = inArray->dims[arrayInfo->yDim].size;
-      outArray->dims[arrayInfo->yDim].size = inArray->dims[arrayInfo->xDim].size;
-
       if (colorMode == NDColorModeMono)
       {
         for (x = 0; x < xSize; x++)
         {
-          for (y = (ySize - 1); y >= 0; y--)
+          for (y = (yLast - 1); y >= yFirst; y--)
           {
             outData[(((ySize-1) - y) * xStride) + (x * ySize)] = inData[(y * yStride) + (x * xStride)];
           }
@@ -86,7 +101,7 @@ void transformNDArray(NDArray *inArray, NDArray *outArray, int transformType, in
       {
         for (x = 0; x < xSize; x++)
         {
-          for (y = (ySize - 1); y >= 0; y--)
+          for (y = (yLast - 1); y >= yFirst; y--)
           {
             /** Copy three values for each iteration of the inner loop.  This moves the red, green, and blue information. */
             outData[(((ySize-1) - y) * xStride) + (x * ySize)] = inData[(y * yStride) + (x * xStride)];
@@ -104,7 +119,7 @@ void transformNDArray(NDArray *inArray, NDArray *outArray, int transformType, in
         int newColorStride = ySize;
         int newYStride = newColorStride * colorSize;
 
-        for (y = (ySize - 1); y >= 0; y--)
+        for (y = (yLast - 1); y >= yFirst; y--)
         {
           for (x = (xSize - 1); x >= 0; x--)
           {
@@ -124,7 +139,7 @@ void transformNDArray(NDArray *inArray, NDArray *outArray, int transformType, in
         /** Calculate a new value for the Y stride. */
         int newStride = colorSize * ySize;
 
-        for (y = (ySize - 1); y >= 0; y--)
+        for (y = (yLast - 1); y >= yFirst; y--)
         {
           for (x = (xSize - 1); x >= 0; x--)
           {
@@ -143,7 +158,7 @@ void transformNDArray(NDArray *inArray, NDArray *outArray, int transformType, in
 
       if (colorMode == NDColorModeMono)
       {
-        for (y = (ySize - 1); y >= 0; y--)
+        for (y = (yLast - 1); y >= yFirst; y--)
         {
           for (x = (xSize - 1); x >= 0; x--)
           {
@@ -153,7 +168,7 @@ void transformNDArray(NDArray *inArray, NDArray *outArray, int transformType, in
       }
       else
       {
-        for (y = (ySize - 1); y >= 0; y--)
+        for (y = (yLast - 1); y >= yFirst; y--)
         {
           for (x = (xSize - 1); x >= 0; x--)
           {
@@ -168,14 +183,11 @@ void transformNDArray(NDArray *inArray, NDArray *outArray, int transformType, in
 
     case (TransformRotate270):
 
-      outArray->dims[arrayInfo->xDim].size = inArray->dims[arrayInfo->yDim].size;
-      outArray->dims[arrayInfo->yDim].size = inArray->dims[arrayInfo->xDim].size;
-
       if (colorMode == NDColorModeMono)
       {
         for (x = (xSize - 1); x >= 0; x--)
         {
-          for (y = 0; y < ySize; y++)
+          for (y = yFirst; y < yLast; y++)
           {
             outData[(y * xStride) + (((xSize - 1) - x) * ySize)] = inData[(y * yStride) + (x * xStride)];
           }
@@ -186,7 +198,7 @@ void transformNDArray(NDArray *inArray, NDArray *outArray, int transformType, in
       {
         for (x = (xSize - 1); x >= 0; x--)
         {
-          for (y = 0; y < ySize; y++)
+          for (y = yFirst; y < yLast; y++)
           {
             /** Copy three values for each iteration of the inner loop.  This moves the red, green, and blue information. */
             outData[(y * xStride) + (((xSize - 1) - x) * ySize)]           = inData[(y * yStride) + (x * xStride)];
@@ -204,7 +216,7 @@ void transformNDArray(NDArray *inArray, NDArray *outArray, int transformType, in
         int newColorStride = ySize;
         int newYStride = newColorStride * colorSize;
 
-        for (y = 0; y < ySize; y++)
+        for (y = yFirst; y < yLast; y++)
         {
           for (x = (xSize - 1); x >= 0; x--)
           {
@@ -224,7 +236,7 @@ void transformNDArray(NDArray *inArray, NDArray *outArray, int transformType, in
         /** Calculate a new value for the Y stride. */
         int newStride = colorSize * ySize;
 
-        for (y = 0; y < ySize; y++)
+        for (y = yFirst; y < yLast; y++)
         {
           for (x = (xSize - 1); x >= 0; x--)
           {
@@ -241,14 +253,11 @@ void transformNDArray(NDArray *inArray, NDArray *outArray, int transformType, in
 
     case (TransformRotate90Mirror):
 
-      outArray->dims[arrayInfo->xDim].size = inArray->dims[arrayInfo->yDim].size;
-      outArray->dims[arrayInfo->yDim].size = inArray->dims[arrayInfo->xDim].size;
-
       if (colorMode == NDColorModeMono)
       {
         for (x = 0; x < xSize; x++)
         {
-          for (y = 0; y < ySize; y++)
+          for (y = yFirst; y < yLast; y++)
           {
             outData[(y * xStride) + (x * ySize)] = inData[(y * yStride) + (x * xStride)];
           }
@@ -259,7 +268,7 @@ void transformNDArray(NDArray *inArray, NDArray *outArray, int transformType, in
       {
         for (x = 0; x < xSize; x++)
         {
-          for (y = 0; y < ySize; y++)
+          for (y = yFirst; y < yLast; y++)
           {
             /** Copy three values for each iteration of the inner loop.  This moves the red, green, and blue information. */
             outData[(y * xStride) + (x * ySize)] = inData[(y * yStride) + (x * xStride)];
@@ -277,7 +286,7 @@ void transformNDArray(NDArray *inArray, NDArray *outArray, int transformType, in
         int newColorStride = ySize;
         int newYStride = newColorStride * colorSize;
 
-        for (y = 0; y < ySize; y++)
+        for (y = yFirst; y < yLast; y++)
         {
           for (x = 0; x < xSize; x++)
           {
@@ -297,7 +306,7 @@ void transformNDArray(NDArray *inArray, NDArray *outArray, int transformType, in
         /** Calculate a new value for the Y stride. */
         int newStride = colorSize * ySize;
 
-        for (y = 0; y < ySize; y++)
+        for (y = yFirst; y < yLast; y++)
         {
           for (x = (xSize - 1); x >= 0; x--)
           {
@@ -314,14 +323,11 @@ void transformNDArray(NDArray *inArray, NDArray *outArray, int transformType, in
 
     case (TransformRotate270Mirror):
 
-      outArray->dims[arrayInfo->xDim].size = inArray->dims[arrayInfo->yDim].size;
-      outArray->dims[arrayInfo->yDim].size = inArray->dims[arrayInfo->xDim].size;
-
       if (colorMode == NDColorModeMono)
       {
         for (x = (xSize - 1); x >= 0; x--)
         {
-          for (y = (ySize - 1); y >= 0; y--)
+          for (y = (yLast - 1); y >= yFirst; y--)
           {
             outData[(((ySize - 1) - y) * xStride) + (((xSize - 1) - x) * ySize)] = inData[(y * yStride) + (x * xStride)];
           }
@@ -332,7 +338,7 @@ void transformNDArray(NDArray *inArray, NDArray *outArray, int transformType, in
       {
         for (x = (xSize - 1); x >= 0; x--)
         {
-          for (y = (ySize - 1); y >= 0; y--)
+          for (y = (yLast - 1); y >= yFirst; y--)
           {
             /** Copy three values for each iteration of the inner loop.  This moves the red, green, and blue information. */
             outData[(((ySize - 1) - y) * xStride) + (((xSize - 1) - x) * ySize)] = inData[(y * yStride) + (x * xStride)];
@@ -350,7 +356,7 @@ void transformNDArray(NDArray *inArray, NDArray *outArray, int transformType, in
         int newColorStride = ySize;
         int newYStride = newColorStride * colorSize;
 
-        for (y = (ySize - 1); y >= 0; y--)
+        for (y = (yLast - 1); y >= yFirst; y--)
         {
           for (x = (xSize - 1); x >= 0; x--)
           {
@@ -370,7 +376,7 @@ void transformNDArray(NDArray *inArray, NDArray *outArray, int transformType, in
         /** Calculate a new value for the Y stride. */
         int newStride = colorSize * ySize;
 
-        for (y = (ySize - 1); y >= 0; y--)
+        for (y = (yLast - 1); y >= yFirst; y--)
         {
           for (x = (xSize - 1); x >= 0; x--)
           {
@@ -389,7 +395,7 @@ void transformNDArray(NDArray *inArray, NDArray *outArray, int transformType, in
 
       if (colorMode == NDColorModeMono)
       {
-        for (y = 0; y < ySize; y++)
+        for (y = yFirst; y < yLast; y++)
         {
           for (x = (xSize - 1); x >= 0; x--)
           {
@@ -399,7 +405,7 @@ void transformNDArray(NDArray *inArray, NDArray *outArray, int transformType, in
       }
       else
       {
-        for (y = 0; y < ySize; y++)
+        for (y = yFirst; y < yLast; y++)
         {
           for (x = (xSize - 1); x >= 0; x--)
           {
@@ -424,7 +430,7 @@ void transformNDArray(NDArray *inArray, NDArray *outArray, int transformType, in
       {
         for (color = 0; color < colorSize; color++)
         {
-          for (y = 0; y < ySize; y++)
+          for (y = yFirst; y < yLast; y++)
           {
             source_offset = (y * yStride) + (color * colorStride);
             target_offset = (((ySize-1) - y) * yStride) + (color * colorStride);
@@ -439,7 +445,7 @@ void transformNDArray(NDArray *inArray, NDArray *outArray, int transformType, in
         information for each for are moved at once. */
       if (colorMode == NDColorModeRGB2)
       {
-        for (y = 0; y < ySize; y++)
+        for (y = yFirst; y < yLast; y++)
         {
           source_offset = (y * yStride);
           target_offset = (((ySize-1) - y) * yStride);
@@ -450,7 +456,7 @@ void transformNDArray(NDArray *inArray, NDArray *outArray, int transformType, in
 
       if (colorMode == NDColorModeRGB1)
       {
-        for (y = 0; y < ySize; y++)
+        for (y = yFirst; y < yLast; y++)
         {
           for (x = 0; x < xSize; x++)
           {
@@ -472,6 +478,25 @@ void transformNDArray(NDArray *inArray, NDArray *outArray, int transformType, in
   return;
 }
 
+/** Arguments of transformBand() */
+typedef struct {
+  NDArray *inArray;
+  NDArray *outArray;
+  int transformType;
+  int colorMode;
+  NDArrayInfo_t *arrayInfo;
+} transformBandArgs_t;
+
+/** Band function for NDPluginDriver::parallelFor() that transforms input rows first to first+count-1. */
+template <typename epicsType>
+static void transformBand(void *pvt, int band, size_t first, size_t count)
+{
+  transformBandArgs_t *pArgs = (transformBandArgs_t *)pvt;
+
+  transformNDArray<epicsType>(pArgs->inArray, pArgs->outArray, pArgs->transformType, pArgs->colorMode,
+                              pArgs->arrayInfo, (int)first, (int)(first + count));
+}
+
 /** Callback function that is called by the NDArray driver with new NDArray data.
   * Grabs the current NDArray and applies the selected transforms to the data.  Apply the transforms in order.
   * \param[in] pArray  The NDArray from the callback.
@@ -479,6 +504,7 @@ void transformNDArray(NDArray *inArray, NDArray *outArray, int transformType, in
 void NDPluginTransform::processCallbacks(NDArray *pArray){
   NDArray *transformedArray;
   NDArrayInfo_t arrayInfo;
+  int numBands;
   static const char* functionName = "processCallbacks";
 
   /* Call the base class method */
@@ -495,11 +521,12 @@ void NDPluginTransform::processCallbacks(NDArray *pArray){
 
   /* Copy the information from the current array */
   transformedArray = this->pNDArrayPool->copy(pArray, NULL, 1);
+  numBands = getNumBands(pArray, arrayInfo.ySize);
 
   /* Release the lock; this is computationally intensive and does not access any shared data */
   this->unlock();
   if ( pArray->ndims <=3 )
-    this->transformImage(pArray, transformedArray, &arrayInfo);
+    this->transformImage(pArray, transformedArray, &arrayInfo, numBands);
   else {
     asynPrint( this->pasynUserSelf, ASYN_TRACE_ERROR, "%s::%s, this method is meant to transform 2Dimages when the number of dimensions is <= 3\n",
           pluginName, functionName);
@@ -518,11 +545,13 @@ void NDPluginTransform::processCallbacks(NDArray *pArray){
 
 
 /** Transform the image according to the selected choice.*/
-void NDPluginTransform::transformImage(NDArray *inArray, NDArray *outArray, NDArrayInfo_t *arrayInfo)
+void NDPluginTransform::transformImage(NDArray *inArray, NDArray *outArray, NDArrayInfo_t *arrayInfo, int numBands)
 {
   //static const char *functionName = "transformNDArray";
   int colorMode;
   int transformType;
+  NDPluginBandFunc_t func = NULL;
+  transformBandArgs_t args;
 
   colorMode = NDColorModeMono;
   getIntegerParam(NDColorMode, &colorMode);
@@ -530,36 +559,46 @@ void NDPluginTransform::transformImage(NDArray *inArray, NDArray *outArray, NDAr
 
   switch (inArray->dataType) {
     case NDInt8:
-      transformNDArray<epicsInt8>(inArray, outArray, transformType, colorMode, arrayInfo);
+      func = transformBand<epicsInt8>;
       break;
     case NDUInt8:
-      transformNDArray<epicsUInt8>(inArray, outArray, transformType, colorMode, arrayInfo);
+      func = transformBand<epicsUInt8>;
       break;
     case NDInt16:
-      transformNDArray<epicsInt16>(inArray, outArray, transformType, colorMode, arrayInfo);
+      func = transformBand<epicsInt16>;
       break;
     case NDUInt16:
-      transformNDArray<epicsUInt16>(inArray, outArray, transformType, colorMode, arrayInfo);
+      func = transformBand<epicsUInt16>;
       break;
     case NDInt32:
-      transformNDArray<epicsInt32>(inArray, outArray, transformType, colorMode, arrayInfo);
+      func = transformBand<epicsInt32>;
       break;
     case NDUInt32:
-      transformNDArray<epicsUInt32>(inArray, outArray, transformType, colorMode, arrayInfo);
+      func = transformBand<epicsUInt32>;
       break;
     case NDInt64:
-      transformNDArray<epicsInt64>(inArray, outArray, transformType, colorMode, arrayInfo);
+      func = transformBand<epicsInt64>;
       break;
     case NDUInt64:
-      transformNDArray<epicsUInt64>(inArray, outArray, transformType, colorMode, arrayInfo);
+      func = transformBand<epicsUInt64>;
       break;
     case NDFloat32:
-      transformNDArray<epicsFloat32>(inArray, outArray, transformType, colorMode, arrayInfo);
+      func = transformBand<epicsFloat32>;
       break;
     case NDFloat64:
-      transformNDArray<epicsFloat64>(inArray, outArray, transformType, colorMode, arrayInfo);
+      func = transformBand<epicsFloat64>;
       break;
   }
+  if (!func) return;
+
+  /* Each band moves different rows of the input array */
+  transformDims(inArray, outArray, transformType, arrayInfo);
+  args.inArray = inArray;
+  args.outArray = outArray;
+  args.transformType = transformType;
+  args.colorMode = colorMode;
+  args.arrayInfo = arrayInfo;
+  parallelFor(func, &args, arrayInfo->ySize, numBands);
 
   return;
 }
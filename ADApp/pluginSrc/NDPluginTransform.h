@@ -25,7 +25,7 @@ protected:
 
 private:
     size_t userDims_[ND_ARRAY_MAX_DIMS];
-    void transformImage(NDArray *inArray, NDArray *outArray, NDArrayInfo_t *arrayInfo);
+    void transformImage(NDArray *inArray, NDArray *outArray, NDArrayInfo_t *arrayInfo, int numBands);
 };
 
 #endif
@@ -0,0 +1,327 @@
+/*
+ * NDTraceSink.cpp
+ *
+ * IOC-wide sink for trace events of NDArrays in the plugins, written as a Chrome trace event JSON file.
+ *
+ * The events are kept in a vector that is allocated when the trace starts and written to the file
+ * when it stops, so recording an event does not do any I/O.
+ */
+
+#include <string.h>
+
+#include <epicsMutex.h>
+#include <epicsStdio.h>
+#include <iocsh.h>
+
+#include "NDTraceSink.h"
+
+#include <epicsExport.h>
+
+static const char *driverName = "NDTraceSink";
+
+/* Names of the events of each stage */
+static const char *stageNames[NDTraceNumStages] = {"callback", "queue", "process", "output", "dropped"};
+
+/* Default number of events for each frame if maxEvents is 0 */
+#define DEFAULT_EVENTS_PER_FRAME 64
+
+int NDTraceSink::active_ = 0;
+std::string NDTraceSink::fileName_;
+int NDTraceSink::numFrames_ = 0;
+size_t NDTraceSink::maxEvents_ = 0;
+int NDTraceSink::firstUniqueId_ = -1;
+bool NDTraceSink::full_ = false;
+std::vector<NDTraceSink::event> NDTraceSink::events_;
+std::vector<std::string> NDTraceSink::portNames_;
+std::vector<epicsThreadId> NDTraceSink::threadIds_;
+std::vector<std::string> NDTraceSink::threadNames_;
+
+/* Protects all of the static members except active_ */
+static epicsMutexId traceLock;
+static epicsThreadOnceId traceOnceId = EPICS_THREAD_ONCE_INIT;
+
+static void traceInit(void *)
+{
+    traceLock = epicsMutexMustCreate();
+}
+
+/** Starts tracing.
+  * \param[in] fileName Name of the JSON file to write when the trace is stopped.
+  * \param[in] numFrames Number of arrays to trace, starting with the next array that a plugin receives.
+  * \param[in] maxEvents Maximum number of events; recording stops when there are this many.
+  *            0 for DEFAULT_EVENTS_PER_FRAME per frame.
+  * \return 0 on success, -1 on error.
+  */
+int NDTraceSink::start(const char *fileName, int numFrames, int maxEvents)
+{
+    static const char *functionName = "start";
+
+    if (!fileName || !fileName[0] || (numFrames <= 0) || (maxEvents < 0)) {
+        printf("%s::%s: fileName must be given and numFrames must be greater than 0\n", driverName, functionName);
+        return -1;
+    }
+    epicsThreadOnce(&traceOnceId, traceInit, NULL);
+    epicsMutexLock(traceLock);
+    if (active() || !events_.empty()) {
+        epicsMutexUnlock(traceLock);
+        printf("%s::%s: a trace has already been started, call NDTraceStop first\n", driverName, functionName);
+        return -1;
+    }
+    fileName_ = fileName;
+    numFrames_ = numFrames;
+    maxEvents_ = maxEvents ? maxEvents : (size_t)numFrames * DEFAULT_EVENTS_PER_FRAME;
+    firstUniqueId_ = -1;
+    full_ = false;
+    events_.reserve(maxEvents_);
+    epicsAtomicSetIntT(&active_, 1);
+    epicsMutexUnlock(traceLock);
+    return 0;
+}
+
+/** Stops tracing and writes the file.
+  * \return 0 on success, -1 if there is no trace or the file could not be written.
+  */
+int NDTraceSink::stop()
+{
+    int status;
+    static const char *functionName = "stop";
+
+    epicsThreadOnce(&traceOnceId, traceInit, NULL);
+    epicsMutexLock(traceLock);
+    epicsAtomicSetIntT(&active_, 0);
+    if (fileName_.empty()) {
+        epicsMutexUnlock(traceLock);
+        printf("%s::%s: no trace has been started\n", driverName, functionName);
+        return -1;
+    }
+    status = writeFile();
+    if (status == 0) {
+        printf("%s::%s: wrote %d events to %s\n", driverName, functionName, (int)events_.size(), fileName_.c_str());
+    }
+    fileName_.clear();
+    std::vector<event>().swap(events_);
+    epicsMutexUnlock(traceLock);
+    return status;
+}
+
+/** Prints the state of the trace.
+  * \param[in] fp File pointer for the report. */
+void NDTraceSink::report(FILE *fp)
+{
+    epicsThreadOnce(&traceOnceId, traceInit, NULL);
+    epicsMutexLock(traceLock);
+    if (fileName_.empty()) {
+        fprintf(fp, "NDTraceSink: no trace\n");
+    } else {
+        fprintf(fp, "NDTraceSink: %s, file %s, %d frames from uniqueId %d, %d of %d events\n",
+                active() ? "recording" : (full_ ? "full" : "stopped"), fileName_.c_str(),
+                numFrames_, firstUniqueId_, (int)events_.size(), (int)maxEvents_);
+    }
+    epicsMutexUnlock(traceLock);
+}
+
+/** Returns the index of a port in portNames_, adding it if it is not there. Called with traceLock held. */
+int NDTraceSink::findPort(const char *portName)
+{
+    int i;
+
+    for (i=0; i<(int)portNames_.size(); i++) {
+        if (portNames_[i] == portName) return i;
+    }
+    portNames_.push_back(portName);
+    return i;
+}
+
+/** Returns the index of the calling thread in threadIds_, adding it if it is not there. Called with traceLock held. */
+int NDTraceSink::findThread()
+{
+    epicsThreadId id = epicsThreadGetIdSelf();
+    int i;
+
+    for (i=0; i<(int)threadIds_.size(); i++) {
+        if (threadIds_[i] == id) return i;
+    }
+    threadIds_.push_back(id);
+    threadNames_.push_back(epicsThreadGetNameSelf());
+    return i;
+}
+
+/** Records a trace event for an array if it is in the window of the active trace.
+  * \param[in] portName Name of the plugin.
+  * \param[in] stage The stage.
+  * \param[in] uniqueId uniqueId of the array.
+  * \param[in] pStart Time of the event, or the start of the stage.
+  * \param[in] pEnd End of the stage, NULL for an instant.
+  */
+void NDTraceSink::record(const char *portName, NDTraceStage_t stage, int uniqueId,
+                         const epicsTimeStamp *pStart, const epicsTimeStamp *pEnd)
+{
+    event ev;
+
+    if (!active()) return;
+    if ((pStart->secPastEpoch == 0) && (pStart->nsec == 0)) return;
+    epicsMutexLock(traceLock);
+    if (!active()) goto done;
+    if (firstUniqueId_ < 0) firstUniqueId_ = uniqueId;
+    if ((uniqueId < firstUniqueId_) || (uniqueId - firstUniqueId_ >= numFrames_)) goto done;
+    if (events_.size() >= maxEvents_) {
+        full_ = true;
+        epicsAtomicSetIntT(&active_, 0);
+        goto done;
+    }
+    ev.uniqueId = uniqueId;
+    ev.stage = stage;
+    ev.port = findPort(portName);
+    ev.thread = findThread();
+    ev.start = *pStart;
+    ev.end = pEnd ? *pEnd : *pStart;
+    events_.push_back(ev);
+    done:
+    epicsMutexUnlock(traceLock);
+}
+
+/* Writes a string with the JSON escapes */
+static void writeString(FILE *fp, const std::string& str)
+{
+    size_t i;
+
+    fputc('"', fp);
+    for (i=0; i<str.size(); i++) {
+        unsigned char c = (unsigned char)str[i];
+        if ((c == '"') || (c == '\\')) fprintf(fp, "\\%c", c);
+        else if (c < 0x20) fprintf(fp, "\\u%04x", c);
+        else fputc(c, fp);
+    }
+    fputc('"', fp);
+}
+
+/** Writes the events to fileName_.  The times are in microseconds from the earliest event.
+  * Called with traceLock held.  Returns 0 on success, -1 on error. */
+int NDTraceSink::writeFile()
+{
+    FILE *fp;
+    epicsTimeStamp origin;
+    std::vector<bool> portUsed(portNames_.size(), false);
+    std::vector<std::vector<bool> > threadUsed(portNames_.size(), std::vector<bool>(threadIds_.size(), false));
+    size_t i, j;
+    bool first = true;
+    static const char *functionName = "writeFile";
+
+    fp = fopen(fileName_.c_str(), "w");
+    if (!fp) {
+        printf("%s::%s: cannot open file %s\n", driverName, functionName, fileName_.c_str());
+        return -1;
+    }
+    for (i=0; i<events_.size(); i++) {
+        if ((i == 0) || epicsTimeLessThan(&events_[i].start, &origin)) origin = events_[i].start;
+        portUsed[events_[i].port] = true;
+        threadUsed[events_[i].port][events_[i].thread] = true;
+    }
+
+    fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    /* Names of the plugins and of their threads */
+    for (i=0; i<portNames_.size(); i++) {
+        if (!portUsed[i]) continue;
+        fprintf(fp, "%s{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":",
+                first ? "" : ",\n", (int)i+1);
+        writeString(fp, portNames_[i]);
+        fprintf(fp, "}}");
+        first = false;
+        for (j=0; j<threadIds_.size(); j++) {
+            if (!threadUsed[i][j]) continue;
+            fprintf(fp, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":",
+                    (int)i+1, (int)j+1);
+            writeString(fp, threadNames_[j]);
+            fprintf(fp, "}}");
+        }
+    }
+    for (i=0; i<events_.size(); i++) {
+        const event *pEv = &events_[i];
+        double ts = epicsTimeDiffInSeconds(&pEv->start, &origin) * 1e6;
+        double dur = epicsTimeDiffInSeconds(&pEv->end, &pEv->start) * 1e6;
+        int pid = pEv->port + 1;
+        int tid = pEv->thread + 1;
+        const char *name = stageNames[pEv->stage];
+
+        switch (pEv->stage) {
+            case NDTraceCallback:
+            case NDTraceDropped:
+                fprintf(fp, ",\n{\"name\":\"%s\",\"cat\":\"NDArray\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,"
+                            "\"pid\":%d,\"tid\":%d,\"args\":{\"uniqueId\":%d}}",
+                        name, ts, pid, tid, pEv->uniqueId);
+                break;
+            case NDTraceQueue:
+                /* The queue wait is not on a thread, so it is an async event for each array */
+                fprintf(fp, ",\n{\"name\":\"%s\",\"cat\":\"NDArray\",\"ph\":\"b\",\"id2\":{\"local\":%d},\"ts\":%.3f,"
+                            "\"pid\":%d,\"tid\":%d,\"args\":{\"uniqueId\":%d}}",
+                        name, pEv->uniqueId, ts, pid, tid, pEv->uniqueId);
+                fprintf(fp, ",\n{\"name\":\"%s\",\"cat\":\"NDArray\",\"ph\":\"e\",\"id2\":{\"local\":%d},\"ts\":%.3f,"
+                            "\"pid\":%d,\"tid\":%d}",
+                        name, pEv->uniqueId, ts+dur, pid, tid);
+                break;
+            default:
+                fprintf(fp, ",\n{\"name\":\"%s\",\"cat\":\"NDArray\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                            "\"pid\":%d,\"tid\":%d,\"args\":{\"uniqueId\":%d}}",
+                        name, ts, dur, pid, tid, pEv->uniqueId);
+                break;
+        }
+    }
+    fprintf(fp, "\n]}\n");
+    if (fclose(fp) != 0) {
+        printf("%s::%s: error writing file %s\n", driverName, functionName, fileName_.c_str());
+        return -1;
+    }
+    return 0;
+}
+
+/* EPICS iocsh shell commands */
+extern "C" int NDTraceStart(const char *fileName, int numFrames, int maxEvents)
+{
+    return NDTraceSink::start(fileName, numFrames, maxEvents);
+}
+
+extern "C" int NDTraceStop(void)
+{
+    return NDTraceSink::stop();
+}
+
+extern "C" int NDTraceReport(void)
+{
+    NDTraceSink::report(stdout);
+    return 0;
+}
+
+static const iocshArg startArg0 = { "fileName", iocshArgString};
+static const iocshArg startArg1 = { "numFrames", iocshArgInt};
+static const iocshArg startArg2 = { "maxEvents (0=64 per frame)", iocshArgInt};
+static const iocshArg * const startArgs[] = {&startArg0,
+                                             &startArg1,
+                                             &startArg2};
+static const iocshFuncDef startFuncDef = {"NDTraceStart", 3, startArgs};
+static void startCallFunc(const iocshArgBuf *args)
+{
+    NDTraceStart(args[0].sval, args[1].ival, args[2].ival);
+}
+
+static const iocshFuncDef stopFuncDef = {"NDTraceStop", 0, NULL};
+static void stopCallFunc(const iocshArgBuf *args)
+{
+    NDTraceStop();
+}
+
+static const iocshFuncDef reportFuncDef = {"NDTraceReport", 0, NULL};
+static void reportCallFunc(const iocshArgBuf *args)
+{
+    NDTraceReport();
+}
+
+extern "C" void NDTraceSinkRegister(void)
+{
+    iocshRegister(&startFuncDef, startCallFunc);
+    iocshRegister(&stopFuncDef, stopCallFunc);
+    iocshRegister(&reportFuncDef, reportCallFunc);
+}
+
+extern "C" {
+epicsExportRegistrar(NDTraceSinkRegister);
+}
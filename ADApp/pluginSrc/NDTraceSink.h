@@ -0,0 +1,66 @@
+#ifndef NDTraceSink_H
+#define NDTraceSink_H
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include <epicsTime.h>
+#include <epicsThread.h>
+#include <epicsAtomic.h>
+
+#include <NDPluginAPI.h>
+
+/** Points in a plugin at which NDPluginDriver records trace events for an NDArray */
+typedef enum {
+    NDTraceCallback,    /**< The driver callback was called with the array (an instant) */
+    NDTraceQueue,       /**< From putting the array on the input queue until a plugin thread took it */
+    NDTraceProcess,     /**< From the start to the end of processing the array */
+    NDTraceOutput,      /**< The callbacks to the downstream plugins for an output array */
+    NDTraceDropped,     /**< The array was dropped because the input queue was full (an instant) */
+    NDTraceNumStages
+} NDTraceStage_t;
+
+/** IOC-wide sink for trace events that follow NDArrays through the plugins, which it writes as a
+  * Chrome trace event JSON file that can be viewed with Perfetto or chrome://tracing.
+  * NDTraceStart() starts tracing a window of numFrames arrays, beginning with the first array that a plugin
+  * receives; the events of the arrays are identified by their uniqueId, which is kept when they are copied.
+  * Each plugin is shown as a process and each thread as a thread in it.  NDTraceStop() writes the file.
+  * When no trace is active recording an event only reads a flag.
+  */
+class NDPLUGIN_API NDTraceSink {
+public:
+    static int start(const char *fileName, int numFrames, int maxEvents);
+    static int stop();
+    static void report(FILE *fp);
+    /** Returns true while a trace is being recorded */
+    static bool active() {return epicsAtomicGetIntT(&active_) != 0;}
+    static void record(const char *portName, NDTraceStage_t stage, int uniqueId,
+                       const epicsTimeStamp *pStart, const epicsTimeStamp *pEnd=0);
+
+private:
+    struct event {
+        int uniqueId;
+        int stage;
+        int port;               /**< Index in portNames_ */
+        int thread;             /**< Index in threadIds_ and threadNames_ */
+        epicsTimeStamp start;
+        epicsTimeStamp end;
+    };
+    static int findPort(const char *portName);
+    static int findThread();
+    static int writeFile();
+
+    static int active_;
+    static std::string fileName_;
+    static int numFrames_;
+    static size_t maxEvents_;
+    static int firstUniqueId_;          /**< uniqueId of the first array in the window, -1 before the first array */
+    static bool full_;                  /**< Tracing stopped because maxEvents_ events were recorded */
+    static std::vector<event> events_;
+    static std::vector<std::string> portNames_;
+    static std::vector<epicsThreadId> threadIds_;
+    static std::vector<std::string> threadNames_;
+};
+
+#endif
@@ -0,0 +1,158 @@
+/*
+ * convert-benchmark.cpp
+ *
+ * Measures the throughput of the NDArrayPool::convert() data type conversion kernels
+ * for each type pair that has SIMD kernels, with each instruction set the CPU supports.
+ * If maxThreads is more than 1 it also measures some type pairs with 1, 2, 4, ... maxThreads threads,
+ * which is how NDArrayPool::convert() uses NDConvertNumThreads.
+ *
+ * Usage: convert-benchmark [megapixels] [repeats] [maxThreads]
+ *
+ * The throughput is (input bytes + output bytes) / time, in GB/s.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include <epicsTime.h>
+
+#include <NDArray.h>
+#include <NDConvert.h>
+
+static const char *dataTypeNames[] = {"Int8", "UInt8", "Int16", "UInt16", "Int32",
+                                      "UInt32", "Int64", "UInt64", "Float32", "Float64"};
+
+static size_t dataTypeSize(NDDataType_t dataType)
+{
+  NDArrayInfo_t arrayInfo;
+  size_t dims = 1;
+  NDArray::computeArrayInfo(1, &dims, dataType, &arrayInfo);
+  return arrayInfo.bytesPerElement;
+}
+
+/* Fills the input with values that every output type can represent, so the scalar and SIMD results can be compared */
+static void fillInput(NDDataType_t dataType, void *pData, size_t nElements)
+{
+  for (size_t i=0; i<nElements; i++) {
+    int value = (int)(i % 251);
+    switch (dataType) {
+      case NDInt8:    ((epicsInt8 *)pData)[i]    = (epicsInt8)(value/2); break;
+      case NDUInt8:   ((epicsUInt8 *)pData)[i]   = (epicsUInt8)value; break;
+      case NDInt16:   ((epicsInt16 *)pData)[i]   = (epicsInt16)value; break;
+      case NDUInt16:  ((epicsUInt16 *)pData)[i]  = (epicsUInt16)value; break;
+      case NDInt32:   ((epicsInt32 *)pData)[i]   = value; break;
+      case NDUInt32:  ((epicsUInt32 *)pData)[i]  = value; break;
+      case NDInt64:   ((epicsInt64 *)pData)[i]   = value; break;
+      case NDUInt64:  ((epicsUInt64 *)pData)[i]  = value; break;
+      case NDFloat32: ((epicsFloat32 *)pData)[i] = value + 0.25f; break;
+      case NDFloat64: ((epicsFloat64 *)pData)[i] = value + 0.25; break;
+    }
+  }
+}
+
+typedef struct {
+  NDConvertFunc_t convertFunc;
+  const char *pIn;
+  char *pOut;
+  size_t bytesIn;
+  size_t bytesOut;
+} bandArgs_t;
+
+static void convertBand(void *pvt, size_t first, size_t count)
+{
+  bandArgs_t *pArgs = (bandArgs_t *)pvt;
+  pArgs->convertFunc(pArgs->pIn + first*pArgs->bytesIn, pArgs->pOut + first*pArgs->bytesOut, count);
+}
+
+int main(int argc, char **argv)
+{
+  double megaPixels = (argc > 1) ? atof(argv[1]) : 16.;
+  int repeats = (argc > 2) ? atoi(argv[2]) : 10;
+  int maxThreads = (argc > 3) ? atoi(argv[3]) : 1;
+  size_t nElements = (size_t)(megaPixels * 1024 * 1024);
+  NDConvertSIMD_t supported = NDConvertGetSupportedSIMD();
+  std::vector<char> inBuffer(nElements * sizeof(epicsFloat64));
+  std::vector<char> outBuffer(nElements * sizeof(epicsFloat64));
+  std::vector<char> refBuffer(nElements * sizeof(epicsFloat64));
+  epicsTimeStamp tStart, tEnd;
+
+  if ((nElements == 0) || (repeats < 1)) {
+    printf("Usage: %s [megapixels] [repeats] [maxThreads]\n", argv[0]);
+    return 1;
+  }
+  printf("%.1f Mpixels, %d repeats, CPU supports %s\n", megaPixels, repeats, NDConvertGetSIMDName(supported));
+  printf("%-20s", "type pair");
+  for (int simd=NDConvertScalar; simd<=supported; simd++) {
+    printf("%12s", NDConvertGetSIMDName(simd));
+  }
+  printf("   (GB/s)\n");
+
+  for (int in=NDInt8; in<=NDFloat64; in++) {
+    for (int out=NDInt8; out<=NDFloat64; out++) {
+      NDDataType_t dataTypeIn = (NDDataType_t)in;
+      NDDataType_t dataTypeOut = (NDDataType_t)out;
+      if (NDConvertGetFunctionSIMD(dataTypeIn, dataTypeOut) == NDConvertScalar) continue;
+      size_t outBytes = nElements * dataTypeSize(dataTypeOut);
+      double bytes = (double)nElements * (dataTypeSize(dataTypeIn) + dataTypeSize(dataTypeOut));
+      char pairName[40];
+      bool ok = true;
+
+      fillInput(dataTypeIn, &inBuffer[0], nElements);
+      NDConvertGetFunction(dataTypeIn, dataTypeOut, NDConvertScalar)(&inBuffer[0], &refBuffer[0], nElements);
+      sprintf(pairName, "%s->%s", dataTypeNames[in], dataTypeNames[out]);
+      printf("%-20s", pairName);
+      for (int simd=NDConvertScalar; simd<=supported; simd++) {
+        if (NDConvertGetFunctionSIMD(dataTypeIn, dataTypeOut, simd) != simd) {
+          printf("%12s", "-");
+          continue;
+        }
+        NDConvertFunc_t convertFunc = NDConvertGetFunction(dataTypeIn, dataTypeOut, simd);
+        // The first pass faults in the output pages
+        convertFunc(&inBuffer[0], &outBuffer[0], nElements);
+        if (memcmp(&outBuffer[0], &refBuffer[0], outBytes) != 0) ok = false;
+        epicsTimeGetCurrent(&tStart);
+        for (int i=0; i<repeats; i++) {
+          convertFunc(&inBuffer[0], &outBuffer[0], nElements);
+        }
+        epicsTimeGetCurrent(&tEnd);
+        double elapsed = epicsTimeDiffInSeconds(&tEnd, &tStart);
+        printf("%12.2f", (elapsed > 0) ? bytes * repeats / elapsed / 1e9 : 0.);
+      }
+      printf("%s\n", ok ? "" : "   ERROR, results differ from scalar");
+    }
+  }
+
+  if (maxThreads > 1) {
+    NDDataType_t pairs[][2] = {{NDUInt32, NDFloat64}, {NDUInt32, NDUInt16}, {NDUInt16, NDFloat64}, {NDFloat64, NDUInt16}};
+    printf("\n%-20s", "threads");
+    for (int threads=1; threads<=maxThreads; threads*=2) printf("%12d", threads);
+    printf("   (GB/s)\n");
+    for (size_t p=0; p<sizeof(pairs)/sizeof(pairs[0]); p++) {
+      bandArgs_t args;
+      char pairName[40];
+      args.convertFunc = NDConvertGetFunction(pairs[p][0], pairs[p][1]);
+      args.pIn = &inBuffer[0];
+      args.pOut = &outBuffer[0];
+      args.bytesIn = dataTypeSize(pairs[p][0]);
+      args.bytesOut = dataTypeSize(pairs[p][1]);
+      double bytes = (double)nElements * (args.bytesIn + args.bytesOut);
+      fillInput(pairs[p][0], &inBuffer[0], nElements);
+      sprintf(pairName, "%s->%s", dataTypeNames[pairs[p][0]], dataTypeNames[pairs[p][1]]);
+      printf("%-20s", pairName);
+      for (int threads=1; threads<=maxThreads; threads*=2) {
+        NDConvertRunBands(convertBand, &args, nElements, threads);
+        epicsTimeGetCurrent(&tStart);
+        for (int i=0; i<repeats; i++) {
+          NDConvertRunBands(convertBand, &args, nElements, threads);
+        }
+        epicsTimeGetCurrent(&tEnd);
+        double elapsed = epicsTimeDiffInSeconds(&tEnd, &tStart);
+        printf("%12.2f", (elapsed > 0) ? bytes * repeats / elapsed / 1e9 : 0.);
+      }
+      printf("\n");
+    }
+  }
+  return 0;
+}
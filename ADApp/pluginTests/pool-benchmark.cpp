@@ -0,0 +1,127 @@
+/*
+ * pool-benchmark.cpp
+ *
+ * Measures NDArrayPool contention: several threads allocate, reserve and release arrays from the same pool,
+ * the way a driver and its plugins do.  Each thread keeps a few arrays in flight, like a plugin queue.
+ * The sorted and size class pool modes are measured without and with per-thread caches,
+ * with 1, 2, 4, ... maxThreads threads.
+ *
+ * Usage: pool-benchmark [numArrays] [maxThreads] [threadCacheSize]
+ *
+ * The result is the time in seconds for every thread to allocate and release numArrays arrays.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+#include <epicsTime.h>
+#include <epicsThread.h>
+#include <epicsEvent.h>
+
+#include <NDArray.h>
+#include <asynNDArrayDriver.h>
+
+struct poolWorker {
+  NDArrayPool *pPool;
+  int numArrays;
+  int numFailed;
+  epicsEventId done;
+};
+
+static void poolWorkerTask(void *drvPvt)
+{
+  poolWorker *pWorker = (poolWorker *)drvPvt;
+  std::vector<NDArray *> held;
+  size_t dims[2];
+
+  for (int i=0; i<pWorker->numArrays; i++) {
+    dims[0] = 100 + (i % 7) * 50;
+    dims[1] = 10;
+    NDArray *pArray = pWorker->pPool->alloc(2, dims, NDUInt16, 0, NULL);
+    if (!pArray) {
+      pWorker->numFailed++;
+      continue;
+    }
+    // Simulate a plugin taking and releasing a reference
+    pArray->reserve();
+    pArray->release();
+    held.push_back(pArray);
+    if (held.size() > 4) {
+      held.front()->release();
+      held.erase(held.begin());
+    }
+  }
+  for (size_t i=0; i<held.size(); i++) held[i]->release();
+  epicsEventSignal(pWorker->done);
+}
+
+/* Returns the elapsed time, or -1 if an allocation failed or an array was not returned to the pool */
+static double runPoolContention(asynNDArrayDriver *pDriver, NDArrayPoolMode_t mode, int threadCacheSize,
+                                int numThreads, int numArrays)
+{
+  NDArrayPool *pPool = new NDArrayPool(pDriver, 0, mode, 4, threadCacheSize);
+  std::vector<poolWorker> workers(numThreads);
+  epicsTimeStamp tStart, tEnd;
+  bool ok = true;
+  int i;
+
+  epicsTimeGetCurrent(&tStart);
+  for (i=0; i<numThreads; i++) {
+    workers[i].pPool = pPool;
+    workers[i].numArrays = numArrays;
+    workers[i].numFailed = 0;
+    workers[i].done = epicsEventMustCreate(epicsEventEmpty);
+    epicsThreadMustCreate("poolWorker", epicsThreadPriorityMedium,
+                          epicsThreadGetStackSize(epicsThreadStackMedium),
+                          poolWorkerTask, &workers[i]);
+  }
+  for (i=0; i<numThreads; i++) {
+    epicsEventWait(workers[i].done);
+    epicsEventDestroy(workers[i].done);
+    if (workers[i].numFailed) ok = false;
+  }
+  epicsTimeGetCurrent(&tEnd);
+
+  if (pPool->getNumFree() != pPool->getNumBuffers()) ok = false;
+  delete pPool;
+  return ok ? epicsTimeDiffInSeconds(&tEnd, &tStart) : -1.;
+}
+
+int main(int argc, char *argv[])
+{
+  int numArrays = (argc > 1) ? atoi(argv[1]) : 20000;
+  int maxThreads = (argc > 2) ? atoi(argv[2]) : 8;
+  int threadCacheSize = (argc > 3) ? atoi(argv[3]) : 8;
+  struct {
+    const char *name;
+    NDArrayPoolMode_t mode;
+    int threadCacheSize;
+  } configs[] = {{"sorted", NDArrayPoolModeSorted, 0},
+                 {"sizeClass", NDArrayPoolModeSizeClass, 0},
+                 {"sorted+cache", NDArrayPoolModeSorted, threadCacheSize},
+                 {"sizeClass+cache", NDArrayPoolModeSizeClass, threadCacheSize}};
+
+  if ((numArrays < 1) || (maxThreads < 1) || (threadCacheSize < 1)) {
+    printf("Usage: %s [numArrays] [maxThreads] [threadCacheSize]\n", argv[0]);
+    return 1;
+  }
+  asynNDArrayDriver *pDriver = new asynNDArrayDriver("poolBenchmark", 1, 0, 0, asynGenericPointerMask,
+                                                     asynGenericPointerMask, 0, 0, 0, 0);
+
+  printf("%d arrays per thread, thread cache size %d\n", numArrays, threadCacheSize);
+  printf("%-20s", "threads");
+  for (int threads=1; threads<=maxThreads; threads*=2) printf("%12d", threads);
+  printf("   (s)\n");
+  for (size_t c=0; c<sizeof(configs)/sizeof(configs[0]); c++) {
+    printf("%-20s", configs[c].name);
+    for (int threads=1; threads<=maxThreads; threads*=2) {
+      double elapsed = runPoolContention(pDriver, configs[c].mode, configs[c].threadCacheSize, threads, numArrays);
+      if (elapsed < 0) printf("%12s", "ERROR");
+      else printf("%12.3f", elapsed);
+    }
+    printf("\n");
+  }
+  delete pDriver;
+  return 0;
+}
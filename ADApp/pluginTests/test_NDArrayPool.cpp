@@ -7,9 +7,18 @@
 // AD and asyn dependencies
 #include <NDArray.h>
 #include <asynNDArrayDriver.h>
+#include <NDFrameMemory.h>
+#include <NDConvert.h>
 
 #include <string.h>
 #include <stdint.h>
+#include <vector>
+
+#include <epicsThread.h>
+#include <epicsEvent.h>
+#include <epicsTime.h>
+#include <epicsAtomic.h>
+#include <epicsStdio.h>
 
 #include "testingutilities.h"
 
@@ -129,4 +138,886 @@ BOOST_AUTO_TEST_CASE(test_Pool)
 
 }
 
+BOOST_AUTO_TEST_CASE(test_PoolSizeClass)
+{
+  size_t bufferSizes[MAX_ARRAYS] = {100, 150, 250, 1000, 50000};
+  // Sizes of the size classes these are rounded up to with 4 classes per octave
+  size_t classSizes[MAX_ARRAYS] = {112, 160, 256, 1024, 57344};
+  NDArray *pArrays[MAX_ARRAYS];
+  NDArray *pArrayTest;
+  size_t dims;
+  size_t totalMemory = 0;
+  int i;
+
+  NDArrayPool *pSizeClassPool = new NDArrayPool(dummy_driver, MAX_MEMORY, NDArrayPoolModeSizeClass, 4);
+  BOOST_CHECK_EQUAL(pSizeClassPool->getMode(), NDArrayPoolModeSizeClass);
+
+  for (i=0; i<MAX_ARRAYS; i++) {
+    dims = bufferSizes[i];
+    pArrays[i] = pSizeClassPool->alloc(1, &dims, NDUInt8, 0, NULL);
+    BOOST_REQUIRE(pArrays[i] != 0);
+    BOOST_CHECK_EQUAL(pArrays[i]->dataSize, classSizes[i]);
+    totalMemory += classSizes[i];
+  }
+  BOOST_CHECK_EQUAL(pSizeClassPool->getNumBuffers(), MAX_ARRAYS);
+  BOOST_CHECK_EQUAL(pSizeClassPool->getMemorySize(), totalMemory);
+  BOOST_CHECK_EQUAL(pSizeClassPool->getNumFree(), 0);
+
+  for (i=0; i<MAX_ARRAYS; i++) {
+    pArrays[i]->release();
+  }
+  pSizeClassPool->report(stdout, 6);
+  BOOST_CHECK_EQUAL(pSizeClassPool->getNumFree(), MAX_ARRAYS);
+
+  // Allocate an array of size of second array; should get pArrays[1] back
+  dims = bufferSizes[1];
+  pArrayTest = pSizeClassPool->alloc(1, &dims, NDUInt8, 0, NULL);
+  BOOST_CHECK_EQUAL(pArrayTest, pArrays[1]);
+  BOOST_CHECK_EQUAL(pSizeClassPool->getNumFree(), MAX_ARRAYS-1);
+  pArrayTest->release();
+
+  // Allocate an array of size 200; the 256 byte array is within the 1.5 threshold so should be reused
+  dims = 200;
+  pArrayTest = pSizeClassPool->alloc(1, &dims, NDUInt8, 0, NULL);
+  BOOST_CHECK_EQUAL(pArrayTest, pArrays[2]);
+  BOOST_CHECK_EQUAL(pArrayTest->dataSize, classSizes[2]);
+  pArrayTest->release();
+  BOOST_CHECK_EQUAL(pSizeClassPool->getNumFree(), MAX_ARRAYS);
+
+  // Allocate an array of size MAX_MEMORY; the size class would exceed MAX_MEMORY,
+  // so all free arrays are deleted and the exact size is allocated
+  dims = MAX_MEMORY;
+  pArrayTest = pSizeClassPool->alloc(1, &dims, NDUInt8, 0, NULL);
+  BOOST_REQUIRE(pArrayTest != 0);
+  BOOST_CHECK_EQUAL(pArrayTest->dataSize, MAX_MEMORY);
+  BOOST_CHECK_EQUAL(pSizeClassPool->getNumFree(), 0);
+  BOOST_CHECK_EQUAL(pSizeClassPool->getNumBuffers(), 1);
+  pArrayTest->release();
+
+  // Allocate an array of size MAX_MEMORY*2; this should fail
+  dims = MAX_MEMORY*2;
+  pArrayTest = pSizeClassPool->alloc(1, &dims, NDUInt8, 0, NULL);
+  BOOST_CHECK(pArrayTest == 0);
+  BOOST_CHECK_EQUAL(pSizeClassPool->getNumFree(), 0);
+  pSizeClassPool->report(stdout, 6);
+
+  delete pSizeClassPool;
+}
+
+BOOST_AUTO_TEST_CASE(test_ReferenceCount)
+{
+  size_t dims = 1000;
+  NDArray *pArray = pPool->alloc(1, &dims, NDUInt8, 0, NULL);
+  BOOST_REQUIRE(pArray != 0);
+  BOOST_CHECK_EQUAL(pArray->getReferenceCount(), 1);
+
+  pArray->reserve();
+  pArray->reserve();
+  BOOST_CHECK_EQUAL(pArray->getReferenceCount(), 3);
+
+  // Releases that don't take the count to 0 must not put the array on the free list
+  pArray->release();
+  pArray->release();
+  BOOST_CHECK_EQUAL(pArray->getReferenceCount(), 1);
+  BOOST_CHECK_EQUAL(pPool->getNumFree(), 0);
+
+  pArray->release();
+  BOOST_CHECK_EQUAL(pArray->getReferenceCount(), 0);
+  BOOST_CHECK_EQUAL(pPool->getNumFree(), 1);
+}
+
+BOOST_AUTO_TEST_CASE(test_PoolThreadCache)
+{
+  #define THREAD_CACHE_SIZE 4
+  size_t bufferSizes[MAX_ARRAYS] = {100, 150, 250, 1000, 50000};
+  NDArray *pArrays[MAX_ARRAYS];
+  NDArray *pArrayTest;
+  size_t dims;
+  int i;
+
+  NDArrayPool *pCachePool = new NDArrayPool(dummy_driver, MAX_MEMORY, NDArrayPoolModeSorted, 4, THREAD_CACHE_SIZE);
+  BOOST_CHECK_EQUAL(pCachePool->getThreadCacheSize(), THREAD_CACHE_SIZE);
+
+  for (i=0; i<MAX_ARRAYS; i++) {
+    dims = bufferSizes[i];
+    pArrays[i] = pCachePool->alloc(1, &dims, NDUInt8, 0, NULL);
+    BOOST_REQUIRE(pArrays[i] != 0);
+  }
+  BOOST_CHECK_EQUAL(pCachePool->getCacheHits(), 0);
+  BOOST_CHECK_EQUAL(pCachePool->getCacheMisses(), MAX_ARRAYS);
+
+  // Releasing 5 arrays overflows the cache of 4, so the oldest 3 are returned to the shared free list.
+  // Cached arrays are still counted as free.
+  for (i=0; i<MAX_ARRAYS; i++) {
+    pArrays[i]->release();
+  }
+  pCachePool->report(stdout, 6);
+  BOOST_CHECK_EQUAL(pCachePool->getNumFree(), MAX_ARRAYS);
+
+  // The last array released is in the cache
+  dims = bufferSizes[MAX_ARRAYS-1];
+  pArrayTest = pCachePool->alloc(1, &dims, NDUInt8, 0, NULL);
+  BOOST_CHECK_EQUAL(pArrayTest, pArrays[MAX_ARRAYS-1]);
+  BOOST_CHECK_EQUAL(pCachePool->getCacheHits(), 1);
+  pArrayTest->release();
+
+  // The first array released was spilled to the shared free list, which is used after a cache miss
+  dims = bufferSizes[0];
+  pArrayTest = pCachePool->alloc(1, &dims, NDUInt8, 0, NULL);
+  BOOST_CHECK_EQUAL(pArrayTest, pArrays[0]);
+  BOOST_CHECK_EQUAL(pCachePool->getCacheMisses(), MAX_ARRAYS+1);
+  pArrayTest->release();
+
+  // Allocating MAX_MEMORY must delete the cached arrays as well as the free list
+  dims = MAX_MEMORY;
+  pArrayTest = pCachePool->alloc(1, &dims, NDUInt8, 0, NULL);
+  BOOST_REQUIRE(pArrayTest != 0);
+  BOOST_CHECK_EQUAL(pCachePool->getNumBuffers(), 1);
+  BOOST_CHECK_EQUAL(pCachePool->getNumFree(), 0);
+  pArrayTest->release();
+
+  pCachePool->emptyFreeList();
+  BOOST_CHECK_EQUAL(pCachePool->getNumBuffers(), 0);
+  BOOST_CHECK_EQUAL(pCachePool->getNumFree(), 0);
+  BOOST_CHECK_EQUAL(pCachePool->getMemorySize(), 0);
+
+  delete pCachePool;
+}
+
+struct cacheThread {
+  NDArrayPool *pPool;
+  NDArray *pArray;
+  epicsEventId allocate;
+  epicsEventId done;
+};
+
+// Allocates an array each time it is signalled, until it is signalled with pPool=NULL
+static void cacheThreadTask(void *drvPvt)
+{
+  cacheThread *pThread = (cacheThread *)drvPvt;
+  size_t dims = 1000;
+
+  while (1) {
+    epicsEventWait(pThread->allocate);
+    if (!pThread->pPool) break;
+    pThread->pArray = pThread->pPool->alloc(1, &dims, NDUInt8, 0, NULL);
+    epicsEventSignal(pThread->done);
+  }
+  epicsEventSignal(pThread->done);
+}
+
+BOOST_AUTO_TEST_CASE(test_PoolThreadCacheProducer)
+{
+  NDArrayPool *pCachePool = new NDArrayPool(dummy_driver, MAX_MEMORY, NDArrayPoolModeSorted, 4, 4);
+  cacheThread producer;
+  NDArray *pFirst;
+  size_t dims = 1000;
+
+  producer.pPool = pCachePool;
+  producer.allocate = epicsEventMustCreate(epicsEventEmpty);
+  producer.done = epicsEventMustCreate(epicsEventEmpty);
+  epicsThreadMustCreate("cacheProducer", epicsThreadPriorityMedium,
+                        epicsThreadGetStackSize(epicsThreadStackMedium),
+                        cacheThreadTask, &producer);
+
+  // The array is released by this thread, it goes back to the cache of the producer thread
+  epicsEventSignal(producer.allocate);
+  epicsEventMustWait(producer.done);
+  pFirst = producer.pArray;
+  BOOST_REQUIRE(pFirst != 0);
+  pFirst->release();
+  epicsEventSignal(producer.allocate);
+  epicsEventMustWait(producer.done);
+  BOOST_CHECK_EQUAL(producer.pArray, pFirst);
+  BOOST_CHECK_EQUAL(pCachePool->getCacheHits(), 1);
+  BOOST_CHECK_EQUAL(pCachePool->getCacheMisses(), 1);
+  producer.pArray->release();
+
+  // When the producer exits the array in its cache goes back to the shared free list,
+  // where this thread finds it after a cache miss
+  producer.pPool = NULL;
+  epicsEventSignal(producer.allocate);
+  epicsEventMustWait(producer.done);
+  for (int i=0; (i<100) && epicsThreadGetId("cacheProducer"); i++) {
+    epicsThreadSleep(0.01);
+  }
+  epicsThreadSleep(0.1);
+  pFirst = pCachePool->alloc(1, &dims, NDUInt8, 0, NULL);
+  BOOST_CHECK_EQUAL(pFirst, producer.pArray);
+  BOOST_CHECK_EQUAL(pCachePool->getNumBuffers(), 1);
+  BOOST_CHECK_EQUAL(pCachePool->getCacheMisses(), 2);
+  pFirst->release();
+
+  epicsEventDestroy(producer.allocate);
+  epicsEventDestroy(producer.done);
+  delete pCachePool;
+}
+
+BOOST_AUTO_TEST_CASE(test_PoolTrim)
+{
+  #define TRIM_MAX_MEMORY 200000
+  NDArray *pArrays[7];
+  NDArray *pArrayTest;
+  size_t dims;
+  int i;
+
+  for (int mode=NDArrayPoolModeSorted; mode<=NDArrayPoolModeSizeClass; mode++) {
+    for (int cacheSize=0; cacheSize<=4; cacheSize+=4) {
+      NDArrayPool *pTrimPool = new NDArrayPool(dummy_driver, TRIM_MAX_MEMORY, (NDArrayPoolMode_t)mode, 4, cacheSize);
+      // High watermark 100000 bytes, low watermark 60000 bytes, free arrays expire after 0.2 seconds
+      pTrimPool->setTrimming(50, 30, 0.2);
+
+      for (i=0; i<4; i++) {
+        dims = 20000;
+        pArrays[i] = pTrimPool->alloc(1, &dims, NDUInt8, 0, NULL);
+        BOOST_REQUIRE(pArrays[i] != 0);
+      }
+      // 10000 bytes is the active size now
+      for (i=4; i<7; i++) {
+        dims = 10000;
+        pArrays[i] = pTrimPool->alloc(1, &dims, NDUInt8, 0, NULL);
+        BOOST_REQUIRE(pArrays[i] != 0);
+      }
+      for (i=0; i<7; i++) {
+        pArrays[i]->release();
+      }
+
+      // The "NDArrayPoolTrim" thread may already have trimmed the pool, so only check the result.
+      // The 20000 byte arrays are deleted first until the pool is below the low watermark.
+      pTrimPool->trim();
+      BOOST_CHECK_LE(pTrimPool->getMemorySize(), 60000);
+      BOOST_CHECK_EQUAL(pTrimPool->getNumBuffers(), 4);
+
+      // The last 20000 byte array expires, the arrays of the active size are kept
+      epicsThreadSleep(0.3);
+      pTrimPool->trim();
+      BOOST_CHECK_EQUAL(pTrimPool->getNumBuffers(), 3);
+      BOOST_CHECK_EQUAL(pTrimPool->getNumFree(), 3);
+
+      dims = 10000;
+      pArrayTest = pTrimPool->alloc(1, &dims, NDUInt8, 0, NULL);
+      BOOST_CHECK((pArrayTest == pArrays[4]) || (pArrayTest == pArrays[5]) || (pArrayTest == pArrays[6]));
+      BOOST_CHECK_EQUAL(pTrimPool->getNumBuffers(), 3);
+      pArrayTest->release();
+
+      delete pTrimPool;
+    }
+  }
+}
+
+BOOST_AUTO_TEST_CASE(test_PoolTrimKeepsOrder)
+{
+  NDArray *pArrays[3];
+  NDArray *pArraysTest[3];
+  size_t dims = 10000;
+  int i;
+
+  // Nothing expires and the pool is far below the high watermark, so trim() must not change the free list
+  NDArrayPool *pTrimPool = new NDArrayPool(dummy_driver, TRIM_MAX_MEMORY, NDArrayPoolModeSizeClass, 4, 0);
+  pTrimPool->setTrimming(90, 80, 100.);
+  for (i=0; i<3; i++) {
+    pArrays[i] = pTrimPool->alloc(1, &dims, NDUInt8, 0, NULL);
+    BOOST_REQUIRE(pArrays[i] != 0);
+  }
+  for (i=0; i<3; i++) {
+    pArrays[i]->release();
+  }
+  BOOST_CHECK_EQUAL(pTrimPool->trim(), 0);
+  BOOST_CHECK_EQUAL(pTrimPool->trim(), 0);
+
+  // The size class free list is still in the order the arrays were released
+  for (i=0; i<3; i++) {
+    pArraysTest[i] = pTrimPool->alloc(1, &dims, NDUInt8, 0, NULL);
+    BOOST_CHECK_EQUAL(pArraysTest[i], pArrays[i]);
+  }
+  for (i=0; i<3; i++) {
+    if (pArraysTest[i]) pArraysTest[i]->release();
+  }
+  delete pTrimPool;
+}
+
+BOOST_AUTO_TEST_CASE(test_PoolPreAllocate)
+{
+  NDArray *pArrays[4];
+  size_t dims = 10000;
+  int i;
+
+  // Pre-allocated buffers go to the shared free list, so another thread's cache does not hide them
+  NDArrayPool *pPreAllocPool = new NDArrayPool(dummy_driver, 0, NDArrayPoolModeSorted, 4, 8);
+  BOOST_CHECK_EQUAL(pPreAllocPool->preAllocate(4, dims, NDFrameMemoryPrefaultPopulate), ND_SUCCESS);
+  BOOST_CHECK_EQUAL(pPreAllocPool->getNumBuffers(), 4);
+  BOOST_CHECK_EQUAL(pPreAllocPool->getNumFree(), 4);
+  for (i=0; i<4; i++) {
+    pArrays[i] = pPreAllocPool->alloc(1, &dims, NDUInt8, 0, NULL);
+    BOOST_REQUIRE(pArrays[i] != 0);
+  }
+  BOOST_CHECK_EQUAL(pPreAllocPool->getNumBuffers(), 4);
+  BOOST_CHECK_EQUAL(pPreAllocPool->getNumFree(), 0);
+  for (i=0; i<4; i++) {
+    pArrays[i]->release();
+  }
+  // Free buffers count towards the number requested
+  BOOST_CHECK_EQUAL(pPreAllocPool->preAllocate(6, dims, NDFrameMemoryPrefaultNone), ND_SUCCESS);
+  BOOST_CHECK_EQUAL(pPreAllocPool->getNumBuffers(), 6);
+  delete pPreAllocPool;
+
+  // The driver pool is limited to MAX_MEMORY
+  dummy_driver->lock();
+  BOOST_CHECK_EQUAL(dummy_driver->preAllocateBuffers(5, 10000, NDFrameMemoryPrefaultNone), asynSuccess);
+  BOOST_CHECK_EQUAL(pPool->getNumFree(), 5);
+  BOOST_CHECK_EQUAL(dummy_driver->preAllocateBuffers(10, 10000, NDFrameMemoryPrefaultNone), asynError);
+  dummy_driver->unlock();
+  BOOST_CHECK_EQUAL(pPool->getNumBuffers(), 6);
+  pPool->emptyFreeList();
+}
+
+BOOST_AUTO_TEST_CASE(test_ConvertKernels)
+{
+  const size_t nElements = 1001;
+  std::vector<epicsFloat64> inBuffer(nElements), refBuffer(nElements), outBuffer(nElements);
+  size_t i;
+
+  // Values that every type can represent, an odd number of elements tests the scalar tail of each kernel
+  for (int in=NDInt8; in<=NDFloat64; in++) {
+    for (int out=NDInt8; out<=NDFloat64; out++) {
+      NDDataType_t dataTypeIn = (NDDataType_t)in;
+      NDDataType_t dataTypeOut = (NDDataType_t)out;
+      NDConvertFunc_t scalarFunc = NDConvertGetFunction(dataTypeIn, dataTypeOut, NDConvertScalar);
+      BOOST_REQUIRE(scalarFunc != 0);
+      for (i=0; i<nElements; i++) outBuffer[i] = (epicsFloat64)(i % 120) + 0.5;
+      NDConvertGetFunction(NDFloat64, dataTypeIn, NDConvertScalar)(&outBuffer[0], &inBuffer[0], nElements);
+      memset(&refBuffer[0], 0, nElements*sizeof(epicsFloat64));
+      scalarFunc(&inBuffer[0], &refBuffer[0], nElements);
+      for (int simd=NDConvertSSE41; simd<=NDConvertGetSupportedSIMD(); simd++) {
+        if (NDConvertGetFunctionSIMD(dataTypeIn, dataTypeOut, simd) != simd) continue;
+        memset(&outBuffer[0], 0, nElements*sizeof(epicsFloat64));
+        NDConvertGetFunction(dataTypeIn, dataTypeOut, simd)(&inBuffer[0], &outBuffer[0], nElements);
+        BOOST_CHECK_MESSAGE(memcmp(&outBuffer[0], &refBuffer[0], nElements*sizeof(epicsFloat64)) == 0,
+                            "convert " << in << " to " << out << " with " << NDConvertGetSIMDName(simd));
+      }
+    }
+  }
+
+  // NDArrayPool::convert() uses the kernels
+  size_t dims[2] = {37, 11};
+  NDArray *pIn = pPool->alloc(2, dims, NDUInt16, 0, NULL);
+  NDArray *pOut;
+  BOOST_REQUIRE(pIn != 0);
+  epicsUInt16 *pDataIn = (epicsUInt16 *)pIn->pData;
+  for (i=0; i<dims[0]*dims[1]; i++) pDataIn[i] = (epicsUInt16)(i*150);
+  BOOST_REQUIRE_EQUAL(pPool->convert(pIn, &pOut, NDFloat64), ND_SUCCESS);
+  epicsFloat64 *pDataOut = (epicsFloat64 *)pOut->pData;
+  for (i=0; i<dims[0]*dims[1]; i++) {
+    BOOST_REQUIRE_EQUAL(pDataOut[i], (epicsFloat64)pDataIn[i]);
+  }
+  pOut->release();
+  pIn->release();
+}
+
+BOOST_AUTO_TEST_CASE(test_ConvertRegion)
+{
+  // Input is 3-D with value x + 100*y + 1000*z, the output is compared with the sum over each bin
+  size_t dims[3] = {24, 20, 3};
+  NDArray *pIn = pPool->alloc(3, dims, NDUInt16, 0, NULL);
+  BOOST_REQUIRE(pIn != 0);
+  epicsUInt16 *pDataIn = (epicsUInt16 *)pIn->pData;
+  size_t x, y, z;
+  for (z=0; z<dims[2]; z++)
+    for (y=0; y<dims[1]; y++)
+      for (x=0; x<dims[0]; x++)
+        pDataIn[(z*dims[1] + y)*dims[0] + x] = (epicsUInt16)(x + 100*y + 1000*z);
+
+  // size, offset, binning and reverse in X and Y, Z is unchanged
+  struct {
+    size_t size[2], offset[2];
+    int binning[2], reverse[2];
+  } regions[] = {
+    {{24, 20}, {0, 0}, {1, 1}, {1, 0}},
+    {{10,  7}, {5, 3}, {1, 1}, {0, 0}},
+    {{24, 20}, {0, 0}, {2, 2}, {0, 0}},
+    {{20, 16}, {4, 4}, {4, 4}, {0, 1}},
+    {{21, 18}, {1, 2}, {3, 3}, {1, 1}},
+    {{ 9, 20}, {3, 0}, {3, 1}, {0, 0}},
+  };
+  NDDataType_t dataTypesOut[] = {NDUInt16, NDInt32, NDFloat64};
+
+  for (size_t r=0; r<sizeof(regions)/sizeof(regions[0]); r++) {
+    for (size_t t=0; t<sizeof(dataTypesOut)/sizeof(dataTypesOut[0]); t++) {
+      NDDimension_t dimsOut[3];
+      NDArray *pOut;
+      for (int d=0; d<3; d++) {
+        pIn->initDimension(&dimsOut[d], (d < 2) ? regions[r].size[d] : dims[2]);
+        if (d == 2) continue;
+        dimsOut[d].offset = regions[r].offset[d];
+        dimsOut[d].binning = regions[r].binning[d];
+        dimsOut[d].reverse = regions[r].reverse[d];
+      }
+      BOOST_REQUIRE_EQUAL(pPool->convert(pIn, &pOut, dataTypesOut[t], dimsOut), ND_SUCCESS);
+      size_t nx = regions[r].size[0]/regions[r].binning[0];
+      size_t ny = regions[r].size[1]/regions[r].binning[1];
+      BOOST_REQUIRE_EQUAL(pOut->dims[0].size, nx);
+      BOOST_REQUIRE_EQUAL(pOut->dims[1].size, ny);
+      for (z=0; z<dims[2]; z++) {
+        for (y=0; y<ny; y++) {
+          for (x=0; x<nx; x++) {
+            double expected = 0, value = 0;
+            for (int by=0; by<regions[r].binning[1]; by++) {
+              for (int bx=0; bx<regions[r].binning[0]; bx++) {
+                size_t ix = x*regions[r].binning[0] + bx;
+                size_t iy = y*regions[r].binning[1] + by;
+                if (regions[r].reverse[0]) ix = regions[r].size[0] - 1 - ix;
+                if (regions[r].reverse[1]) iy = regions[r].size[1] - 1 - iy;
+                ix += regions[r].offset[0];
+                iy += regions[r].offset[1];
+                expected += pDataIn[(z*dims[1] + iy)*dims[0] + ix];
+              }
+            }
+            size_t index = (z*ny + y)*nx + x;
+            switch (dataTypesOut[t]) {
+              case NDUInt16: value = ((epicsUInt16 *)pOut->pData)[index]; expected = (epicsUInt16)expected; break;
+              case NDInt32:  value = ((epicsInt32 *)pOut->pData)[index]; break;
+              default:       value = ((epicsFloat64 *)pOut->pData)[index]; break;
+            }
+            BOOST_REQUIRE_MESSAGE(value == expected, "region " << r << " type " << dataTypesOut[t]
+                                  << " x=" << x << " y=" << y << " z=" << z);
+          }
+        }
+      }
+      pOut->release();
+    }
+  }
+  pIn->release();
+}
+
+static void countBand(void *pvt, size_t first, size_t count)
+{
+  int *pCounts = (int *)pvt;
+  for (size_t i=first; i<first+count; i++) epicsAtomicIncrIntT(&pCounts[i]);
+}
+
+BOOST_AUTO_TEST_CASE(test_ConvertBands)
+{
+  // Arrays are converted in the calling thread by default
+  BOOST_CHECK_EQUAL(NDConvertGetNumThreads(1024*1024*1024), 1);
+
+  // Every item must be processed exactly once, whatever the number of threads
+  size_t numItems[] = {1, 3, 1000, 4097};
+  int numThreads[] = {1, 2, 4, 7};
+  for (size_t i=0; i<sizeof(numItems)/sizeof(numItems[0]); i++) {
+    for (size_t t=0; t<sizeof(numThreads)/sizeof(numThreads[0]); t++) {
+      std::vector<int> counts(numItems[i], 0);
+      NDConvertRunBands(countBand, &counts[0], numItems[i], numThreads[t]);
+      for (size_t j=0; j<numItems[i]; j++) {
+        BOOST_REQUIRE_MESSAGE(counts[j] == 1, "item " << j << " of " << numItems[i] << " with "
+                              << numThreads[t] << " threads");
+      }
+    }
+  }
+
+  // convert() records the time it took
+  size_t dims[2] = {64, 64};
+  NDArray *pIn = pPool->alloc(2, dims, NDUInt16, 0, NULL);
+  NDArray *pOut;
+  BOOST_REQUIRE(pIn != 0);
+  BOOST_REQUIRE_EQUAL(pPool->convert(pIn, &pOut, NDFloat32), ND_SUCCESS);
+  BOOST_CHECK_EQUAL(pPool->getConvertThreads(), 1);
+  BOOST_CHECK(pPool->getConvertTime() >= 0.);
+  pOut->release();
+  pIn->release();
+}
+
+BOOST_AUTO_TEST_CASE(test_ArrayView)
+{
+  // Input is 3-D with value x + 100*y + 1000*z
+  size_t dims[3] = {16, 12, 3};
+  NDArray *pIn = pPool->alloc(3, dims, NDInt32, 0, NULL);
+  BOOST_REQUIRE(pIn != 0);
+  epicsInt32 *pDataIn = (epicsInt32 *)pIn->pData;
+  size_t x, y, z;
+  for (z=0; z<dims[2]; z++)
+    for (y=0; y<dims[1]; y++)
+      for (x=0; x<dims[0]; x++)
+        pDataIn[(z*dims[1] + y)*dims[0] + x] = (epicsInt32)(x + 100*y + 1000*z);
+  pIn->uniqueId = 42;
+
+  // View of X=[3,12], Y=[2,8] reversed, Z unchanged
+  NDDimension_t dimsView[3];
+  for (int d=0; d<3; d++) pIn->initDimension(&dimsView[d], dims[d]);
+  dimsView[0].offset = 3; dimsView[0].size = 10;
+  dimsView[1].offset = 2; dimsView[1].size = 7; dimsView[1].reverse = 1;
+  NDArray *pView = pPool->createView(pIn, dimsView);
+  BOOST_REQUIRE(pView != 0);
+  BOOST_CHECK(pView->isView());
+  BOOST_CHECK(!pIn->isView());
+  BOOST_CHECK_EQUAL(pView->pViewParent, pIn);
+  BOOST_CHECK_EQUAL(pIn->getReferenceCount(), 2);
+  BOOST_CHECK_EQUAL(pView->uniqueId, 42);
+  BOOST_CHECK_EQUAL(pView->dims[0].size, 10);
+  BOOST_CHECK_EQUAL(pView->dims[1].size, 7);
+  BOOST_CHECK_EQUAL(pView->dims[2].size, 3);
+  BOOST_CHECK_EQUAL(pView->strides[0], 1);
+  BOOST_CHECK_EQUAL(pView->strides[1], -16);
+  BOOST_CHECK_EQUAL(pView->strides[2], 16*12);
+  for (z=0; z<3; z++)
+    for (y=0; y<7; y++)
+      for (x=0; x<10; x++) {
+        epicsInt32 *pElement = (epicsInt32 *)pView->pData + x*pView->strides[0] + y*pView->strides[1] + z*pView->strides[2];
+        BOOST_REQUIRE_EQUAL(*pElement, (epicsInt32)((x+3) + 100*(8-y) + 1000*z));
+      }
+
+  // A view of a view refers to the array that owns the data; Z=1 only, X reversed
+  NDDimension_t dimsView2[3];
+  for (int d=0; d<3; d++) pView->initDimension(&dimsView2[d], pView->dims[d].size);
+  dimsView2[0].reverse = 1;
+  dimsView2[2].offset = 1; dimsView2[2].size = 1;
+  NDArray *pView2 = pPool->createView(pView, dimsView2);
+  BOOST_REQUIRE(pView2 != 0);
+  BOOST_CHECK_EQUAL(pView2->pViewParent, pIn);
+  BOOST_CHECK_EQUAL(pIn->getReferenceCount(), 3);
+
+  // materialize() and copy() make contiguous arrays with the same values
+  NDArray *pCopy = pPool->materialize(pView2);
+  BOOST_REQUIRE(pCopy != 0);
+  BOOST_CHECK(!pCopy->isView());
+  epicsInt32 *pDataCopy = (epicsInt32 *)pCopy->pData;
+  for (y=0; y<7; y++)
+    for (x=0; x<10; x++)
+      BOOST_REQUIRE_EQUAL(pDataCopy[y*10 + x], (epicsInt32)((12-x) + 100*(8-y) + 1000));
+  pCopy->release();
+
+  // convert() of a view, with a data type change and binning
+  NDArray *pOut;
+  NDDimension_t dimsOut[3];
+  for (int d=0; d<3; d++) pView->initDimension(&dimsOut[d], pView->dims[d].size);
+  dimsOut[0].binning = 2;
+  BOOST_REQUIRE_EQUAL(pPool->convert(pView, &pOut, NDFloat64, dimsOut), ND_SUCCESS);
+  BOOST_CHECK(!pOut->isView());
+  BOOST_REQUIRE_EQUAL(pOut->dims[0].size, 5);
+  epicsFloat64 *pDataOut = (epicsFloat64 *)pOut->pData;
+  for (z=0; z<3; z++)
+    for (y=0; y<7; y++)
+      for (x=0; x<5; x++)
+        BOOST_REQUIRE_EQUAL(pDataOut[(z*7 + y)*5 + x], (double)(2*(2*x+3) + 1 + 2*(100*(8-y) + 1000*z)));
+  pOut->release();
+
+  // Releasing the views releases the parent
+  pView2->release();
+  pView->release();
+  BOOST_CHECK_EQUAL(pIn->getReferenceCount(), 1);
+
+  // Binned arrays cannot be views
+  dimsView[0].binning = 2;
+  BOOST_CHECK(pPool->createView(pIn, dimsView) == 0);
+  pIn->release();
+}
+
+BOOST_AUTO_TEST_CASE(test_ArrayShare)
+{
+  size_t dims[2] = {16, 12};
+  NDArray *pIn = pPool->alloc(2, dims, NDUInt16, 0, NULL);
+  BOOST_REQUIRE(pIn != 0);
+  pIn->uniqueId = 7;
+  int value = 1;
+  pIn->pAttributeList->add("Input", "", NDAttrInt32, &value);
+
+  // The shared array has the data of the input array and a copy of its attributes
+  NDArray *pShared = pPool->share(pIn);
+  BOOST_REQUIRE(pShared != 0);
+  BOOST_CHECK(!pShared->isView());
+  BOOST_CHECK(pShared->sharesData);
+  BOOST_CHECK_EQUAL(pShared->pData, pIn->pData);
+  BOOST_CHECK_EQUAL(pShared->pViewParent, pIn);
+  BOOST_CHECK_EQUAL(pIn->getReferenceCount(), 2);
+  BOOST_CHECK_EQUAL(pShared->uniqueId, 7);
+  BOOST_CHECK_EQUAL(pShared->dataType, NDUInt16);
+  BOOST_CHECK_EQUAL(pShared->dims[1].size, 12);
+  BOOST_CHECK(pShared->pAttributeList->find("Input") != 0);
+  pShared->pAttributeList->add("Shared", "", NDAttrInt32, &value);
+  BOOST_CHECK(pIn->pAttributeList->find("Shared") == 0);
+
+  // materialize() does not copy a shared array, and a shared array of a shared array refers to the input array
+  NDArray *pCopy = pPool->materialize(pShared);
+  BOOST_CHECK_EQUAL(pCopy, pShared);
+  pCopy->release();
+  NDArray *pShared2 = pPool->share(pShared);
+  BOOST_CHECK_EQUAL(pShared2->pViewParent, pIn);
+  BOOST_CHECK(pShared2->pAttributeList->find("Shared") != 0);
+  BOOST_CHECK_EQUAL(pIn->getReferenceCount(), 3);
+
+  // A view is reused as a shared array and back
+  pShared2->release();
+  pShared->release();
+  BOOST_CHECK_EQUAL(pIn->getReferenceCount(), 1);
+  NDDimension_t dimsView[2];
+  for (int d=0; d<2; d++) pIn->initDimension(&dimsView[d], dims[d]);
+  dimsView[0].size = 4;
+  NDArray *pView = pPool->createView(pIn, dimsView);
+  BOOST_REQUIRE(pView != 0);
+  BOOST_CHECK(pView->isView());
+  NDArray *pSharedView = pPool->share(pView);
+  BOOST_CHECK(pSharedView->isView());
+  BOOST_CHECK_EQUAL(pSharedView->strides[1], 16);
+  pSharedView->release();
+  pView->release();
+  BOOST_CHECK_EQUAL(pIn->getReferenceCount(), 1);
+  pIn->release();
+}
+
+BOOST_AUTO_TEST_CASE(test_AttributeListIndex)
+{
+  NDAttributeList listIn;
+  NDAttributeList listOut(true);
+  char name[32];
+  int i, value;
+
+  // Enough attributes for the index to grow several times
+  for (i=0; i<300; i++) {
+    epicsSnprintf(name, sizeof(name), "Attr%d", i);
+    listIn.add(name, "", NDAttrInt32, &i);
+  }
+  BOOST_CHECK_EQUAL(listIn.count(), 300);
+  for (i=0; i<300; i++) {
+    epicsSnprintf(name, sizeof(name), "Attr%d", i);
+    NDAttribute *pAttr = listIn.find(name);
+    BOOST_REQUIRE(pAttr != 0);
+    pAttr->getValue(NDAttrInt32, &value);
+    BOOST_REQUIRE_EQUAL(value, i);
+  }
+  BOOST_CHECK(listIn.find("Attr300") == 0);
+  BOOST_CHECK_EQUAL(listIn.remove("Attr10"), ND_SUCCESS);
+  BOOST_CHECK(listIn.find("Attr10") == 0);
+  BOOST_CHECK_EQUAL(listIn.remove("Attr10"), ND_ERROR);
+  BOOST_CHECK_EQUAL(listIn.count(), 299);
+
+  // Copy into an empty list, then clear it and copy again; the attributes are reused
+  BOOST_REQUIRE_EQUAL(listIn.copy(&listOut), ND_SUCCESS);
+  BOOST_CHECK_EQUAL(listOut.count(), 299);
+  NDAttribute *pFirst = listOut.find("Attr0");
+  value = 1000;
+  listIn.find("Attr0")->setValue(&value);
+  // A spare with another data type is not reused
+  listIn.remove("Attr20");
+  listIn.add("Attr20", "", NDAttrString, (void *)"text");
+  listOut.clear();
+  BOOST_CHECK_EQUAL(listOut.count(), 0);
+  BOOST_CHECK(listOut.find("Attr0") == 0);
+  listIn.copy(&listOut);
+  BOOST_CHECK_EQUAL(listOut.count(), 299);
+  BOOST_CHECK(listOut.find("Attr0") == pFirst);
+  listOut.find("Attr0")->getValue(NDAttrInt32, &value);
+  BOOST_CHECK_EQUAL(value, 1000);
+  BOOST_REQUIRE(listOut.find("Attr20") != 0);
+  BOOST_CHECK_EQUAL(listOut.find("Attr20")->getDataType(), NDAttrString);
+
+  // Copying into a list that is not empty updates the existing attributes and adds the others
+  listOut.remove("Attr5");
+  value = 2000;
+  listIn.find("Attr1")->setValue(&value);
+  listIn.copy(&listOut);
+  BOOST_CHECK_EQUAL(listOut.count(), 299);
+  BOOST_REQUIRE(listOut.find("Attr5") != 0);
+  listOut.find("Attr1")->getValue(NDAttrInt32, &value);
+  BOOST_CHECK_EQUAL(value, 2000);
+}
+
+BOOST_AUTO_TEST_CASE(test_AttributeSpareMetadata)
+{
+  NDAttributeList listIn;
+  NDAttributeList listOut(true);
+  NDAttrSource_t sourceType;
+  int value = 1;
+
+  listIn.add(new NDAttribute("Gain", "Gain of channel A", NDAttrSourceParam, "GAIN_A", NDAttrInt32, &value));
+  listIn.copy(&listOut);
+  listOut.clear();
+
+  // The spare for "Gain" is reused for an attribute with another description and source
+  listIn.remove("Gain");
+  value = 2;
+  listIn.add(new NDAttribute("Gain", "Gain of channel B", NDAttrSourceEPICSPV, "13SIM1:GainB", NDAttrInt32, &value));
+  listIn.copy(&listOut);
+  NDAttribute *pAttr = listOut.find("Gain");
+  BOOST_REQUIRE(pAttr != 0);
+  BOOST_CHECK_EQUAL(pAttr->getDescription(), "Gain of channel B");
+  BOOST_CHECK_EQUAL(pAttr->getSource(), "13SIM1:GainB");
+  BOOST_CHECK_EQUAL(pAttr->getSourceInfo(&sourceType), listIn.find("Gain")->getSourceInfo(&sourceType));
+  BOOST_CHECK_EQUAL(sourceType, NDAttrSourceEPICSPV);
+  pAttr->getValue(NDAttrInt32, &value);
+  BOOST_CHECK_EQUAL(value, 2);
+}
+
+struct attributeCopier {
+  NDAttributeList *pFrom;
+  NDAttributeList *pTo;
+  epicsEventId done;
+};
+
+static void attributeCopierTask(void *drvPvt)
+{
+  attributeCopier *pCopier = (attributeCopier *)drvPvt;
+
+  for (int i=0; i<10000; i++) {
+    pCopier->pFrom->copy(pCopier->pTo);
+  }
+  epicsEventSignal(pCopier->done);
+}
+
+BOOST_AUTO_TEST_CASE(test_AttributeCrossCopy)
+{
+  NDAttributeList listA(true), listB(true);
+  attributeCopier copiers[2] = {{&listA, &listB, 0}, {&listB, &listA, 0}};
+  int value = 0;
+
+  listA.add("A", "", NDAttrInt32, &value);
+  listB.add("B", "", NDAttrInt32, &value);
+  // Copying in both directions at once must not deadlock
+  for (int i=0; i<2; i++) {
+    copiers[i].done = epicsEventMustCreate(epicsEventEmpty);
+    epicsThreadMustCreate("attributeCopier", epicsThreadPriorityMedium,
+                          epicsThreadGetStackSize(epicsThreadStackMedium),
+                          attributeCopierTask, &copiers[i]);
+  }
+  for (int i=0; i<2; i++) {
+    BOOST_REQUIRE_EQUAL(epicsEventWaitWithTimeout(copiers[i].done, 30.0), epicsEventWaitOK);
+    epicsEventDestroy(copiers[i].done);
+  }
+  BOOST_CHECK(listA.find("B") != 0);
+  BOOST_CHECK(listB.find("A") != 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_FrameMemory)
+{
+  size_t bufferSizes[3] = {100, 100000, 5000000};
+  size_t dims;
+  NDArray *pArray;
+  int i;
+
+  BOOST_CHECK(NDFrameMemoryConfig("unknown", 0, 0, 0) != 0);
+  BOOST_CHECK(NDFrameMemoryConfig("aligned", 0, 0, 48) != 0);
+
+  // The aligned backend must return 64 byte aligned buffers
+  BOOST_REQUIRE_EQUAL(NDFrameMemoryConfig("aligned", 0, 0, 0), 0);
+  BOOST_CHECK_EQUAL(NDFrameMemoryGetBackend(), NDFrameMemoryAligned);
+  NDArrayPool *pAlignedPool = new NDArrayPool(dummy_driver, 0);
+  for (i=0; i<3; i++) {
+    dims = bufferSizes[i];
+    pArray = pAlignedPool->alloc(1, &dims, NDUInt8, 0, NULL);
+    BOOST_REQUIRE(pArray != 0);
+    BOOST_CHECK_EQUAL((size_t)pArray->pData % 64, 0);
+    memset(pArray->pData, 0, dims);
+    pArray->release();
+  }
+  pAlignedPool->emptyFreeList();
+  delete pAlignedPool;
+
+#ifdef __linux__
+  // The mmap backend must return page aligned buffers for large arrays, with pre-faulting and a NUMA node
+  BOOST_REQUIRE_EQUAL(NDFrameMemoryConfig("mmap", NDFrameMemoryHugePagesTHP, NDFrameMemoryPrefaultPopulate, 0), 0);
+  NDArrayPool *pMmapPool = new NDArrayPool(dummy_driver, 0);
+  pMmapPool->setNumaNode(0);
+  for (i=0; i<3; i++) {
+    dims = bufferSizes[i];
+    pArray = pMmapPool->alloc(1, &dims, NDUInt8, 0, NULL);
+    BOOST_REQUIRE(pArray != 0);
+    BOOST_CHECK_EQUAL((size_t)pArray->pData % 64, 0);
+    if (dims >= 65536) BOOST_CHECK_EQUAL((size_t)pArray->pData % 4096, 0);
+    memset(pArray->pData, 0, dims);
+    pArray->release();
+  }
+  pMmapPool->emptyFreeList();
+  BOOST_CHECK_EQUAL(pMmapPool->getMemorySize(), 0);
+  delete pMmapPool;
+#endif
+
+  // Restore the default so the other tests use malloc
+  BOOST_CHECK_EQUAL(NDFrameMemoryConfig("malloc", 0, 0, 0), 0);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
+
+// Several threads allocate, reserve and release arrays from the same pool, the way a driver and its
+// plugins do.  Every allocation must succeed, every array must be back on the free list at the end,
+// and the pool must reuse buffers rather than allocate one per array.
+// The timing of this is measured by pool-benchmark.
+struct poolWorker {
+  NDArrayPool *pPool;
+  int numArrays;
+  int numFailed;
+  epicsEventId done;
+};
+
+#define POOL_WORKER_HELD 4
+
+static void poolWorkerTask(void *drvPvt)
+{
+  poolWorker *pWorker = (poolWorker *)drvPvt;
+  std::vector<NDArray *> held;
+  size_t dims[2];
+
+  for (int i=0; i<pWorker->numArrays; i++) {
+    dims[0] = 100 + (i % 7) * 50;
+    dims[1] = 10;
+    NDArray *pArray = pWorker->pPool->alloc(2, dims, NDUInt16, 0, NULL);
+    if (!pArray) {
+      pWorker->numFailed++;
+      continue;
+    }
+    pArray->reserve();
+    pArray->release();
+    held.push_back(pArray);
+    if (held.size() > POOL_WORKER_HELD) {
+      held.front()->release();
+      held.erase(held.begin());
+    }
+  }
+  for (size_t i=0; i<held.size(); i++) held[i]->release();
+  epicsEventSignal(pWorker->done);
+}
+
+static void checkPoolThreads(asynNDArrayDriver *pDriver, NDArrayPoolMode_t mode, int threadCacheSize)
+{
+  const int numThreads = 4;
+  const int numArrays = 500;
+  NDArrayPool *pPool = new NDArrayPool(pDriver, 0, mode, 4, threadCacheSize);
+  std::vector<poolWorker> workers(numThreads);
+  int i;
+
+  for (i=0; i<numThreads; i++) {
+    workers[i].pPool = pPool;
+    workers[i].numArrays = numArrays;
+    workers[i].numFailed = 0;
+    workers[i].done = epicsEventMustCreate(epicsEventEmpty);
+    epicsThreadMustCreate("poolWorker", epicsThreadPriorityMedium,
+                          epicsThreadGetStackSize(epicsThreadStackMedium),
+                          poolWorkerTask, &workers[i]);
+  }
+  for (i=0; i<numThreads; i++) {
+    BOOST_REQUIRE_EQUAL(epicsEventWaitWithTimeout(workers[i].done, 30.0), epicsEventWaitOK);
+    epicsEventDestroy(workers[i].done);
+    BOOST_CHECK_EQUAL(workers[i].numFailed, 0);
+  }
+  // The thread caches are flushed when the threads exit
+  for (i=0; (i<100) && epicsThreadGetId("poolWorker"); i++) {
+    epicsThreadSleep(0.01);
+  }
+  epicsThreadSleep(0.1);
+
+  // Each thread holds at most POOL_WORKER_HELD+1 arrays at a time, and can leave up to
+  // threadCacheSize more in its cache where the other threads cannot reuse them
+  BOOST_CHECK_GT(pPool->getNumBuffers(), 0);
+  BOOST_CHECK_LE(pPool->getNumBuffers(), numThreads * (POOL_WORKER_HELD + 1 + threadCacheSize));
+  BOOST_CHECK_EQUAL(pPool->getNumFree(), pPool->getNumBuffers());
+  pPool->emptyFreeList();
+  BOOST_CHECK_EQUAL(pPool->getNumBuffers(), 0);
+  BOOST_CHECK_EQUAL(pPool->getMemorySize(), 0);
+  delete pPool;
+}
+
+BOOST_FIXTURE_TEST_CASE(test_PoolThreads, NDArrayPoolFixture)
+{
+  checkPoolThreads(dummy_driver, NDArrayPoolModeSorted, 0);
+  checkPoolThreads(dummy_driver, NDArrayPoolModeSizeClass, 0);
+  checkPoolThreads(dummy_driver, NDArrayPoolModeSorted, 8);
+  checkPoolThreads(dummy_driver, NDArrayPoolModeSizeClass, 8);
+}
+
@@ -0,0 +1,207 @@
+#include <stdio.h>
+
+#include "boost/test/unit_test.hpp"
+
+// AD dependencies
+#include <NDArray.h>
+#include <NDArrayQueue.h>
+
+#include <stdint.h>
+#include <vector>
+
+#include <epicsThread.h>
+#include <epicsEvent.h>
+#include <epicsTime.h>
+#include <epicsAtomic.h>
+
+using namespace std;
+
+static const NDArrayQueueMode_t queueModes[] = {NDArrayQueueMessageQueue, NDArrayQueueLockFree};
+static const char *queueModeNames[] = {"epicsMessageQueue", "lock-free"};
+
+// The queue never dereferences the arrays, so the tests send numbers as pointers
+#define TO_ARRAY(i) ((NDArray *)(uintptr_t)(i))
+#define FROM_ARRAY(p) ((size_t)(uintptr_t)(p))
+
+BOOST_AUTO_TEST_CASE(test_QueueBasics)
+{
+  for (int m=0; m<2; m++) {
+    NDArrayQueue queue(5, queueModes[m], 10);
+    NDArray *pArray;
+    size_t i;
+
+    BOOST_CHECK_EQUAL(queue.mode(), queueModes[m]);
+    BOOST_CHECK_EQUAL(queue.capacity(), 5);
+    BOOST_CHECK_EQUAL(queue.pending(), 0);
+    BOOST_CHECK(!queue.tryReceive(&pArray));
+
+    // The queue holds exactly capacity arrays, in order, several times round the ring
+    for (int pass=0; pass<3; pass++) {
+      for (i=1; i<=5; i++) BOOST_CHECK(queue.trySend(TO_ARRAY(i)));
+      BOOST_CHECK(!queue.trySend(TO_ARRAY(6)));
+      BOOST_CHECK_EQUAL(queue.pending(), 5);
+      for (i=1; i<=3; i++) BOOST_CHECK_EQUAL(FROM_ARRAY(queue.receive()), i);
+      BOOST_CHECK_EQUAL(queue.pending(), 2);
+      BOOST_CHECK(queue.tryReceive(&pArray));
+      BOOST_CHECK_EQUAL(FROM_ARRAY(pArray), 4u);
+      BOOST_CHECK_EQUAL(FROM_ARRAY(queue.receive()), 5u);
+      BOOST_CHECK_EQUAL(queue.pending(), 0);
+    }
+
+    // NULL is a valid message
+    queue.send(NULL);
+    BOOST_CHECK_EQUAL(queue.pending(), 1);
+    BOOST_CHECK(queue.tryReceive(&pArray));
+    BOOST_CHECK(pArray == NULL);
+
+    // Time stamps are received with their arrays
+    epicsTimeStamp sent, received;
+    sent.secPastEpoch = 1000;
+    for (i=1; i<=3; i++) {
+      sent.nsec = (epicsUInt32)i;
+      BOOST_CHECK(queue.trySend(TO_ARRAY(i), &sent));
+    }
+    BOOST_CHECK_EQUAL(FROM_ARRAY(queue.receive(&received)), 1u);
+    BOOST_CHECK_EQUAL(received.nsec, 1u);
+    BOOST_CHECK(queue.tryReceive(&pArray, &received));
+    BOOST_CHECK_EQUAL(received.secPastEpoch, 1000u);
+    BOOST_CHECK_EQUAL(received.nsec, 2u);
+    BOOST_CHECK_EQUAL(FROM_ARRAY(queue.receive()), 3u);
+  }
+}
+
+struct queueWorker {
+  NDArrayQueue *pQueue;
+  NDArrayQueue *pReplyQueue;
+  size_t first;
+  size_t count;
+  int *pReceived;
+  epicsEventId done;
+};
+
+// Sends arrays first..first+count-1 with trySend, retrying when the queue is full
+static void senderTask(void *drvPvt)
+{
+  queueWorker *pWorker = (queueWorker *)drvPvt;
+  for (size_t i=pWorker->first; i<pWorker->first+pWorker->count; i++) {
+    while (!pWorker->pQueue->trySend(TO_ARRAY(i))) {
+      epicsThreadSleep(0.);
+    }
+  }
+  epicsEventSignal(pWorker->done);
+}
+
+// Counts the arrays it receives until it receives NULL
+static void receiverTask(void *drvPvt)
+{
+  queueWorker *pWorker = (queueWorker *)drvPvt;
+  NDArray *pArray;
+  while ((pArray = pWorker->pQueue->receive()) != NULL) {
+    epicsAtomicIncrIntT(&pWorker->pReceived[FROM_ARRAY(pArray)]);
+  }
+  epicsEventSignal(pWorker->done);
+}
+
+// Sends every array that it receives back on the reply queue until it receives NULL
+static void echoTask(void *drvPvt)
+{
+  queueWorker *pWorker = (queueWorker *)drvPvt;
+  NDArray *pArray;
+  while ((pArray = pWorker->pQueue->receive()) != NULL) {
+    pWorker->pReplyQueue->send(pArray);
+  }
+  epicsEventSignal(pWorker->done);
+}
+
+static void startWorker(queueWorker *pWorker, EPICSTHREADFUNC func)
+{
+  pWorker->done = epicsEventMustCreate(epicsEventEmpty);
+  epicsThreadMustCreate("queueWorker", epicsThreadPriorityMedium,
+                        epicsThreadGetStackSize(epicsThreadStackMedium),
+                        func, pWorker);
+}
+
+static void waitWorker(queueWorker *pWorker)
+{
+  epicsEventWait(pWorker->done);
+  epicsEventDestroy(pWorker->done);
+}
+
+/* Sends numArrays arrays from numSenders threads to numReceivers threads and checks that each array
+ * is received once.  Returns the time in seconds. */
+static double runQueue(NDArrayQueueMode_t mode, int queueSize, int numSenders, int numReceivers, size_t numArrays)
+{
+  NDArrayQueue queue(queueSize, mode, 1000);
+  std::vector<queueWorker> senders(numSenders), receivers(numReceivers);
+  std::vector<int> received(numArrays + 1, 0);
+  epicsTimeStamp tStart, tEnd;
+  size_t perSender = numArrays / numSenders;
+  int i;
+
+  epicsTimeGetCurrent(&tStart);
+  for (i=0; i<numReceivers; i++) {
+    receivers[i].pQueue = &queue;
+    receivers[i].pReceived = &received[0];
+    startWorker(&receivers[i], receiverTask);
+  }
+  for (i=0; i<numSenders; i++) {
+    senders[i].pQueue = &queue;
+    senders[i].first = 1 + i*perSender;
+    senders[i].count = perSender;
+    startWorker(&senders[i], senderTask);
+  }
+  for (i=0; i<numSenders; i++) waitWorker(&senders[i]);
+  for (i=0; i<numReceivers; i++) queue.send(NULL);
+  for (i=0; i<numReceivers; i++) waitWorker(&receivers[i]);
+  epicsTimeGetCurrent(&tEnd);
+
+  for (size_t j=1; j<=perSender*numSenders; j++) {
+    BOOST_REQUIRE_MESSAGE(received[j] == 1, "array " << j << " received " << received[j] << " times, mode "
+                          << queueModeNames[mode] << ", " << numSenders << " senders, " << numReceivers << " receivers");
+  }
+  BOOST_CHECK_EQUAL(queue.pending(), 0);
+  return epicsTimeDiffInSeconds(&tEnd, &tStart);
+}
+
+BOOST_AUTO_TEST_CASE(test_QueueManyThreads)
+{
+  for (int m=0; m<2; m++) {
+    runQueue(queueModes[m], 4, 1, 1, 20000);
+    runQueue(queueModes[m], 4, 3, 2, 30000);
+    runQueue(queueModes[m], 100, 4, 4, 40000);
+  }
+}
+
+/* Compares the two implementations.  The latency is the mean round trip time of an array sent to a
+ * thread that sends it back, the throughput is the rate at which arrays pass through the queue. */
+BOOST_AUTO_TEST_CASE(test_QueueComparison)
+{
+  const size_t numArrays = 100000;
+  const int roundTrips = 10000;
+
+  for (int m=0; m<2; m++) {
+    NDArrayQueue queue(10, queueModes[m], 1000);
+    NDArrayQueue replyQueue(10, queueModes[m], 1000);
+    queueWorker echo;
+    epicsTimeStamp tStart, tEnd;
+
+    echo.pQueue = &queue;
+    echo.pReplyQueue = &replyQueue;
+    startWorker(&echo, echoTask);
+    epicsTimeGetCurrent(&tStart);
+    for (int i=1; i<=roundTrips; i++) {
+      queue.send(TO_ARRAY(i));
+      BOOST_REQUIRE_EQUAL(FROM_ARRAY(replyQueue.receive()), (size_t)i);
+    }
+    epicsTimeGetCurrent(&tEnd);
+    queue.send(NULL);
+    waitWorker(&echo);
+    double latency = epicsTimeDiffInSeconds(&tEnd, &tStart) / roundTrips;
+
+    double oneToOne = runQueue(queueModes[m], 10, 1, 1, numArrays);
+    double manyToMany = runQueue(queueModes[m], 10, 4, 4, numArrays);
+    BOOST_TEST_MESSAGE("NDArrayQueue " << queueModeNames[m] << ": round trip " << latency*1e6 << " us, "
+                       << "1 sender 1 receiver " << numArrays/oneToOne/1e6 << " M arrays/s, "
+                       << "4 senders 4 receivers " << numArrays/manyToMany/1e6 << " M arrays/s");
+  }
+}
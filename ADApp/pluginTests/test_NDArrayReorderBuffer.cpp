@@ -0,0 +1,95 @@
+#include <stdio.h>
+
+#include "boost/test/unit_test.hpp"
+
+// AD dependencies
+#include <NDArray.h>
+#include <NDArrayReorderBuffer.h>
+
+#include <vector>
+
+#include <epicsTime.h>
+
+using namespace std;
+
+// Arrays are only used for their uniqueId, so they are not allocated from a pool
+static void setIds(std::vector<NDArray> &arrays, const int *ids)
+{
+  for (size_t i=0; i<arrays.size(); i++) arrays[i].uniqueId = ids[i];
+}
+
+BOOST_AUTO_TEST_CASE(test_ReorderBufferOrder)
+{
+  NDArrayReorderBuffer buffer(8);
+  epicsTimeStamp now, t;
+  const int ids[] = {5, 3, 7, 4, 3, 9, 6};
+  std::vector<NDArray> arrays(7);
+  setIds(arrays, ids);
+  epicsTimeGetCurrent(&now);
+
+  BOOST_CHECK_EQUAL(buffer.capacity(), 8);
+  BOOST_CHECK(buffer.first() == NULL);
+  BOOST_CHECK(buffer.removeFirst() == NULL);
+  for (size_t i=0; i<arrays.size(); i++) {
+    t = now;
+    t.nsec = (epicsUInt32)i;
+    BOOST_REQUIRE(buffer.add(&arrays[i], &t));
+  }
+  BOOST_CHECK_EQUAL(buffer.size(), 7);
+
+  // Arrays come out by uniqueId, and arrays with the same uniqueId in the order they were added
+  const size_t expected[] = {1, 4, 3, 0, 6, 2, 5};
+  for (size_t i=0; i<arrays.size(); i++) {
+    NDArray *pArray = buffer.first(&t);
+    BOOST_REQUIRE(pArray == &arrays[expected[i]]);
+    BOOST_CHECK_EQUAL(t.nsec, (epicsUInt32)expected[i]);
+    BOOST_CHECK(buffer.removeFirst() == pArray);
+  }
+  BOOST_CHECK_EQUAL(buffer.size(), 0);
+  BOOST_CHECK(buffer.first() == NULL);
+}
+
+BOOST_AUTO_TEST_CASE(test_ReorderBufferLimits)
+{
+  NDArrayReorderBuffer buffer(4);
+  epicsTimeStamp now;
+  const int ids[] = {10, 13, 14, 9, 11, 12, 12, 100};
+  std::vector<NDArray> arrays(8);
+  setIds(arrays, ids);
+  epicsTimeGetCurrent(&now);
+
+  // uniqueIds must be less than capacity apart
+  BOOST_CHECK(buffer.add(&arrays[0], &now));
+  BOOST_CHECK(buffer.add(&arrays[1], &now));
+  BOOST_CHECK(!buffer.add(&arrays[2], &now));
+  BOOST_CHECK(!buffer.add(&arrays[3], &now));
+  BOOST_CHECK(buffer.add(&arrays[4], &now));
+  BOOST_CHECK(buffer.add(&arrays[5], &now));
+  // and there are at most capacity of them
+  BOOST_CHECK(!buffer.add(&arrays[6], &now));
+  BOOST_CHECK_EQUAL(buffer.size(), 4);
+
+  // A smaller capacity takes effect when the buffer is empty
+  buffer.setCapacity(2);
+  BOOST_CHECK_EQUAL(buffer.capacity(), 4);
+  BOOST_CHECK(buffer.removeFirst() == &arrays[0]);
+  BOOST_CHECK(buffer.removeFirst() == &arrays[4]);
+  BOOST_CHECK(buffer.add(&arrays[2], &now));
+  BOOST_CHECK(buffer.removeFirst() == &arrays[5]);
+  BOOST_CHECK(buffer.removeFirst() == &arrays[1]);
+  BOOST_CHECK(buffer.removeFirst() == &arrays[2]);
+  BOOST_CHECK_EQUAL(buffer.capacity(), 2);
+
+  // An empty buffer accepts any uniqueId, and the ring wraps round
+  for (int i=0; i<10; i++) {
+    arrays[7].uniqueId = 100 + i;
+    BOOST_CHECK(buffer.add(&arrays[7], &now));
+    BOOST_CHECK(buffer.first() == &arrays[7]);
+    BOOST_CHECK(buffer.removeFirst() == &arrays[7]);
+  }
+
+  // A buffer with no capacity accepts nothing
+  buffer.setCapacity(0);
+  BOOST_CHECK(!buffer.add(&arrays[0], &now));
+  BOOST_CHECK_EQUAL(buffer.size(), 0);
+}
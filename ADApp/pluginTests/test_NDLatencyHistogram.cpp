@@ -0,0 +1,81 @@
+#include <stdio.h>
+
+#include "boost/test/unit_test.hpp"
+
+// AD dependencies
+#include <NDLatencyHistogram.h>
+
+#include <math.h>
+
+using namespace std;
+
+BOOST_AUTO_TEST_CASE(test_LatencyHistogramBins)
+{
+  NDLatencyHistogram hist;
+  epicsInt32 counts[ND_LATENCY_NUM_BINS];
+
+  BOOST_CHECK_EQUAL(hist.count(), 0u);
+  BOOST_CHECK_EQUAL(hist.percentile(0.5), 0.);
+  BOOST_CHECK_EQUAL(hist.maximum(), 0.);
+
+  // Below 1 us, exactly on bin edges, between edges and above the last edge
+  hist.record(0.5e-6);
+  hist.record(1e-6);
+  hist.record(1.5e-6);
+  hist.record(2e-6);
+  hist.record(1e-3, 3);
+  hist.record(1e6);
+  BOOST_CHECK_EQUAL(hist.count(), 8u);
+  BOOST_CHECK_EQUAL(hist.maximum(), 1e6);
+
+  hist.getCounts(counts, ND_LATENCY_NUM_BINS);
+  BOOST_CHECK_EQUAL(counts[0], 1);
+  BOOST_CHECK_EQUAL(counts[1], 1);
+  BOOST_CHECK_EQUAL(counts[3], 1);
+  BOOST_CHECK_EQUAL(counts[5], 1);
+  BOOST_CHECK_EQUAL(counts[ND_LATENCY_NUM_BINS-1], 1);
+  // 1 ms is 2^9.97 us
+  int bin = 1 + (int)floor(log(1e3)/log(2.) * ND_LATENCY_BINS_PER_OCTAVE);
+  BOOST_CHECK_EQUAL(counts[bin], 3);
+  int total = 0;
+  for (int i=0; i<ND_LATENCY_NUM_BINS; i++) total += counts[i];
+  BOOST_CHECK_EQUAL(total, 8);
+
+  // The upper edges of the bins
+  BOOST_CHECK_CLOSE(NDLatencyHistogram::binUpperEdge(0), 1e-6, 1e-9);
+  BOOST_CHECK_CLOSE(NDLatencyHistogram::binUpperEdge(4), 2e-6, 1e-9);
+  BOOST_CHECK_CLOSE(NDLatencyHistogram::binUpperEdge(2), sqrt(2.)*1e-6, 1e-9);
+  BOOST_CHECK_EQUAL(NDLatencyHistogram::binUpperEdge(ND_LATENCY_NUM_BINS-1), 0.);
+
+  hist.reset();
+  BOOST_CHECK_EQUAL(hist.count(), 0u);
+  BOOST_CHECK_EQUAL(hist.maximum(), 0.);
+  hist.getCounts(counts, ND_LATENCY_NUM_BINS);
+  for (int i=0; i<ND_LATENCY_NUM_BINS; i++) BOOST_CHECK_EQUAL(counts[i], 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_LatencyHistogramPercentiles)
+{
+  NDLatencyHistogram hist;
+
+  // 1 to 1000 us
+  for (int i=1; i<=1000; i++) hist.record(i*1e-6);
+  BOOST_CHECK_EQUAL(hist.count(), 1000u);
+  BOOST_CHECK_CLOSE(hist.maximum(), 1e-3, 1e-9);
+
+  // Percentiles are the upper edge of their bin, so at most 19% above the true value
+  const double fractions[] = {0.5, 0.9, 0.99};
+  for (int i=0; i<3; i++) {
+    double p = hist.percentile(fractions[i]);
+    double expected = fractions[i] * 1e-3;
+    BOOST_CHECK(p >= expected);
+    BOOST_CHECK(p <= expected * 1.19);
+  }
+  // and not above the maximum
+  BOOST_CHECK_CLOSE(hist.percentile(1.0), 1e-3, 1e-9);
+
+  // Every time in the overflow bin
+  hist.reset();
+  hist.record(1e5, 10);
+  BOOST_CHECK_EQUAL(hist.percentile(0.5), 1e5);
+}
@@ -0,0 +1,95 @@
+#include <stdio.h>
+
+#include "boost/test/unit_test.hpp"
+
+// AD dependencies
+#include <NDPluginDriver.h>
+#include <NDArray.h>
+#include <asynDriver.h>
+
+#include <vector>
+#include <boost/shared_ptr.hpp>
+
+#include <epicsAtomic.h>
+
+#include "testingutilities.h"
+
+using namespace std;
+
+// Non-blocking plugin that records the batches of arrays it is given
+class BatchTestPlugin : public PassThroughPlugin {
+public:
+  BatchTestPlugin(const char *portName, const char *NDArrayPort, int queueSize)
+  : PassThroughPlugin(portName, NDArrayPort, queueSize, 0),
+    received(0) {}
+  void processCallbacks(NDArray *pArray)
+  {
+    uniqueIds.push_back(pArray->uniqueId);
+    epicsAtomicIncrIntT(&received);
+  }
+  void processCallbacksBatch(NDArray *pArrays[], int numArrays)
+  {
+    batchSizes.push_back(numArrays);
+    NDPluginDriver::processCallbacksBatch(pArrays, numArrays);
+  }
+  void setBatchSize(int batchSize) {setIntegerParam(NDPluginDriverBatchSize, batchSize);}
+  int droppedArrays()
+  {
+    int dropped;
+    lock();
+    getIntegerParam(NDPluginDriverDroppedArrays, &dropped);
+    unlock();
+    return dropped;
+  }
+  std::vector<int> uniqueIds;
+  std::vector<int> batchSizes;
+  int received;
+};
+
+BOOST_AUTO_TEST_CASE(test_BatchedCallbacks)
+{
+  const int numArrays = 50, batchSize = 10;
+  std::string simport("simBatch"), testport("Batch");
+  uniqueAsynPortName(simport);
+  uniqueAsynPortName(testport);
+  boost::shared_ptr<asynNDArrayDriver> driver(new asynNDArrayDriver(simport.c_str(), 1, 0, 0,
+                                                                    asynGenericPointerMask,
+                                                                    asynGenericPointerMask,
+                                                                    0, 0, 0, 0));
+  boost::shared_ptr<BatchTestPlugin> plugin(new BatchTestPlugin(testport.c_str(), simport.c_str(), 100));
+  plugin->start();
+
+  std::vector<size_t> dims(2, 8);
+  std::vector<NDArray *> arrays(numArrays);
+  fillNDArraysFromPool(dims, NDUInt8, arrays, driver->pNDArrayPool);
+  asynUser *pasynUser = pasynManager->createAsynUser(0, 0);
+
+  // Queue all of the arrays while holding the lock, so the plugin thread finds them waiting
+  plugin->lock();
+  plugin->setBatchSize(batchSize);
+  for (int i=0; i<numArrays; i++) {
+    arrays[i]->uniqueId = i + 1;
+    plugin->driverCallback(pasynUser, arrays[i]);
+    arrays[i]->release();
+  }
+  plugin->unlock();
+
+  BOOST_REQUIRE(waitFor(&plugin->received, numArrays));
+  plugin->lock();
+  BOOST_REQUIRE_EQUAL((int)plugin->uniqueIds.size(), numArrays);
+  for (int i=0; i<numArrays; i++) {
+    BOOST_CHECK_EQUAL(plugin->uniqueIds[i], i + 1);
+  }
+  // The thread may take the first array before the others are queued, the rest come in full batches
+  int total = 0;
+  for (size_t i=0; i<plugin->batchSizes.size(); i++) {
+    BOOST_CHECK(plugin->batchSizes[i] <= batchSize);
+    total += plugin->batchSizes[i];
+  }
+  BOOST_CHECK_EQUAL(total, numArrays);
+  BOOST_CHECK((int)plugin->batchSizes.size() <= numArrays/batchSize + 1);
+  plugin->unlock();
+  BOOST_CHECK_EQUAL(plugin->droppedArrays(), 0);
+  BOOST_CHECK_EQUAL(driver->getQueuedArrayCount(), 0);
+  pasynManager->freeAsynUser(pasynUser);
+}
@@ -0,0 +1,175 @@
+#include <stdio.h>
+
+#include "boost/test/unit_test.hpp"
+
+// AD dependencies
+#include <NDPluginDriver.h>
+#include <NDPluginExecutor.h>
+#include <NDArray.h>
+#include <asynDriver.h>
+
+#include <vector>
+#include <boost/shared_ptr.hpp>
+
+#include <epicsThread.h>
+#include <epicsEvent.h>
+#include <epicsAtomic.h>
+
+#include "testingutilities.h"
+#include "ROIPluginWrapper.h"
+
+using namespace std;
+
+extern volatile int NDPluginUseExecutor;
+
+struct executorTest {
+  NDPluginExecutor *pExecutor;
+  int *pRun;
+  int numChildren;
+  int outsidePool;
+  int remaining;
+  epicsEventId done;
+};
+
+// Counts a task that ran and signals when all have run
+static void runTestTask(executorTest *pTest, int index)
+{
+  if (!pTest->pExecutor->inWorkerThread()) epicsAtomicIncrIntT(&pTest->outsidePool);
+  epicsAtomicIncrIntT(&pTest->pRun[index]);
+  if (epicsAtomicDecrIntT(&pTest->remaining) == 0) epicsEventSignal(pTest->done);
+}
+
+struct executorChild {
+  executorTest *pTest;
+  int index;
+};
+
+static void executorChildTask(void *pvt)
+{
+  executorChild *pChild = (executorChild *)pvt;
+  runTestTask(pChild->pTest, pChild->index);
+}
+
+static std::vector<executorChild> children;
+
+// Submits the children of a task from the executor thread, half of them to run soon
+static void executorTestTask(void *pvt)
+{
+  executorChild *pParent = (executorChild *)pvt;
+  executorTest *pTest = pParent->pTest;
+  for (int i=0; i<pTest->numChildren; i++) {
+    executorChild *pChild = &children[pParent->index*pTest->numChildren + i];
+    pTest->pExecutor->submit(executorChildTask, pChild, (i % 2) == 0);
+  }
+  runTestTask(pTest, pParent->index);
+}
+
+BOOST_AUTO_TEST_CASE(test_ExecutorTasks)
+{
+  const int numParents = 1000, numChildren = 4;
+  const int numTasks = numParents * (1 + numChildren);
+  NDPluginExecutor *pExecutor = NDPluginExecutor::getInstance();
+  std::vector<executorChild> parents(numParents);
+  std::vector<int> run(numTasks, 0);
+  executorTest test;
+  int i;
+
+  BOOST_REQUIRE(pExecutor != NULL);
+  BOOST_CHECK(pExecutor == NDPluginExecutor::getInstance());
+  BOOST_CHECK(pExecutor->getNumThreads() >= 1);
+  BOOST_CHECK(!pExecutor->inWorkerThread());
+  // The executor already exists, so it cannot be configured again
+  BOOST_CHECK_EQUAL(NDPluginExecutor::configure(2, NULL), -1);
+
+  test.pExecutor = pExecutor;
+  test.pRun = &run[0];
+  test.numChildren = numChildren;
+  test.outsidePool = 0;
+  test.remaining = numTasks;
+  test.done = epicsEventMustCreate(epicsEventEmpty);
+  children.resize(numParents * numChildren);
+  for (i=0; i<numParents*numChildren; i++) {
+    children[i].pTest = &test;
+    children[i].index = numParents + i;
+  }
+
+  // Tasks submitted from outside the pool, each of which submits more tasks from inside it
+  for (i=0; i<numParents; i++) {
+    parents[i].pTest = &test;
+    parents[i].index = i;
+    pExecutor->submit(executorTestTask, &parents[i]);
+  }
+  BOOST_REQUIRE_EQUAL(epicsEventWaitWithTimeout(test.done, 10.0), epicsEventOK);
+  for (i=0; i<numTasks; i++) {
+    BOOST_REQUIRE_MESSAGE(run[i] == 1, "task " << i << " ran " << run[i] << " times");
+  }
+  BOOST_CHECK_EQUAL(test.outsidePool, 0);
+  epicsEventDestroy(test.done);
+  pExecutor->report(stdout, 1);
+}
+
+static int numReceived;
+static int outOfOrder;
+static int lastUniqueId;
+
+static void executorPluginCallback(void *userPvt, asynUser *pasynUser, void *pointer)
+{
+  NDArray *pArray = (NDArray *)pointer;
+  if (pArray->uniqueId <= lastUniqueId) outOfOrder++;
+  lastUniqueId = pArray->uniqueId;
+  numReceived++;
+}
+
+// A non-blocking plugin with one thread that runs on the executor must output its arrays in order
+BOOST_AUTO_TEST_CASE(test_ExecutorPlugin)
+{
+  const int numArrays = 500;
+  std::string simport("simExec"), testport("Exec");
+  uniqueAsynPortName(simport);
+  uniqueAsynPortName(testport);
+
+  boost::shared_ptr<asynNDArrayDriver> driver(new asynNDArrayDriver(simport.c_str(), 1, 0, 0,
+                                                                    asynGenericPointerMask,
+                                                                    asynGenericPointerMask,
+                                                                    0, 0, 0, 0));
+  NDPluginUseExecutor = 1;
+  boost::shared_ptr<ROIPluginWrapper> roi(new ROIPluginWrapper(testport.c_str(), 100, 0, simport.c_str(),
+                                                               0, 0, 0, 0, 1));
+  NDPluginUseExecutor = 0;
+  roi->start();
+  roi->write(NDPluginDriverEnableCallbacksString, 1);
+  roi->write(NDPluginDriverBlockingCallbacksString, 0);
+
+  boost::shared_ptr<asynGenericPointerClient> client(new asynGenericPointerClient(testport.c_str(), 0, NDArrayDataString));
+  client->registerInterruptUser(&executorPluginCallback);
+  numReceived = 0;
+  outOfOrder = 0;
+  lastUniqueId = 0;
+
+  std::vector<size_t> dims(2, 16);
+  std::vector<NDArray *> arrays(numArrays);
+  fillNDArraysFromPool(dims, NDUInt8, arrays, driver->pNDArrayPool);
+  asynUser *pasynUser = pasynManager->createAsynUser(0, 0);
+  for (int i=0; i<numArrays; i++) {
+    arrays[i]->uniqueId = i + 1;
+    roi->driverCallback(pasynUser, arrays[i]);
+    arrays[i]->release();
+    if ((i % 50) == 0) epicsThreadSleep(0.001);
+  }
+
+  int dropped = 0;
+  for (int i=0; i<1000; i++) {
+    roi->lock();
+    int done = numReceived;
+    roi->unlock();
+    dropped = roi->readInt(NDPluginDriverDroppedArraysString);
+    if (done + dropped == numArrays) break;
+    epicsThreadSleep(0.01);
+  }
+  roi->lock();
+  BOOST_CHECK_EQUAL(numReceived + dropped, numArrays);
+  BOOST_CHECK_EQUAL(outOfOrder, 0);
+  roi->unlock();
+  BOOST_CHECK(numReceived > 0);
+  pasynManager->freeAsynUser(pasynUser);
+}
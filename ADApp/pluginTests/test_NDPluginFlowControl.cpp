@@ -0,0 +1,110 @@
+#include <stdio.h>
+
+#include "boost/test/unit_test.hpp"
+
+// AD dependencies
+#include <NDPluginDriver.h>
+#include <NDArray.h>
+#include <asynDriver.h>
+#include <asynPortClient.h>
+
+#include <vector>
+#include <boost/shared_ptr.hpp>
+
+#include <epicsThread.h>
+#include <epicsAtomic.h>
+
+#include "testingutilities.h"
+
+using namespace std;
+
+// Non-blocking plugin whose processing waits until the test opens the gate
+class FlowControlTestPlugin : public PassThroughPlugin {
+public:
+  FlowControlTestPlugin(const char *portName, const char *NDArrayPort, int queueSize)
+  : PassThroughPlugin(portName, NDArrayPort, queueSize, 0),
+    numProcessed(0)
+  {
+    setGate(false);
+  }
+  void processCallbacks(NDArray *pArray)
+  {
+    waitAtGate();
+    epicsAtomicIncrIntT(&numProcessed);
+  }
+  int droppedArrays()
+  {
+    int dropped;
+    lock();
+    getIntegerParam(NDPluginDriverDroppedArrays, &dropped);
+    unlock();
+    return dropped;
+  }
+  int numProcessed;
+};
+
+static int backPressureParam(asynInt32Client *pClient)
+{
+  epicsInt32 value;
+  pClient->read(&value);
+  return value;
+}
+
+BOOST_AUTO_TEST_CASE(test_FlowControlCredits)
+{
+  const int queueSize = 4;
+  std::string simport("simFlowControl"), testport("FlowControl");
+  uniqueAsynPortName(simport);
+  uniqueAsynPortName(testport);
+  boost::shared_ptr<asynNDArrayDriver> driver(new asynNDArrayDriver(simport.c_str(), 1, 0, 0,
+                                                                    asynGenericPointerMask,
+                                                                    asynGenericPointerMask,
+                                                                    0, 0, 0, 0));
+  boost::shared_ptr<FlowControlTestPlugin> plugin(new FlowControlTestPlugin(testport.c_str(), simport.c_str(), queueSize));
+  plugin->start();
+
+  std::vector<size_t> dims(2, 8);
+  std::vector<NDArray *> arrays(queueSize + 2);
+  fillNDArraysFromPool(dims, NDUInt8, arrays, driver->pNDArrayPool);
+  asynUser *pasynUser = pasynManager->createAsynUser(0, 0);
+  asynInt32Client flowControl(testport.c_str(), 0, NDPluginDriverFlowControlString);
+  asynInt32Client backPressure(simport.c_str(), 0, NDBackPressureString);
+
+  // No plugin uses flow control yet
+  BOOST_CHECK_EQUAL(driver->getDownstreamCredits(), -1);
+  BOOST_CHECK(!driver->backPressure());
+  flowControl.write(1);
+
+  // The plugin thread takes the first array and waits in processCallbacks
+  plugin->driverCallback(pasynUser, arrays[0]);
+  BOOST_REQUIRE(waitFor(&plugin->numStarted, 1));
+  // The free queue slots are sent with each array that is queued
+  for (int i=1; i<=queueSize; i++) {
+    plugin->driverCallback(pasynUser, arrays[i]);
+    BOOST_CHECK_EQUAL(driver->getDownstreamCredits(), queueSize - i);
+  }
+  BOOST_CHECK(driver->backPressure());
+  for (int i=0; i<100 && !backPressureParam(&backPressure); i++) epicsThreadSleep(0.01);
+  BOOST_CHECK_EQUAL(backPressureParam(&backPressure), 1);
+
+  // A driver that ignores the back pressure loses the array
+  plugin->driverCallback(pasynUser, arrays[queueSize+1]);
+  BOOST_CHECK_EQUAL(plugin->droppedArrays(), 1);
+
+  // The credits come back as the plugin processes the queue
+  plugin->setGate(true);
+  BOOST_REQUIRE(waitFor(&plugin->numProcessed, queueSize + 1));
+  BOOST_CHECK_EQUAL(driver->getDownstreamCredits(), queueSize);
+  BOOST_CHECK(!driver->backPressure());
+  for (int i=0; i<100 && backPressureParam(&backPressure); i++) epicsThreadSleep(0.01);
+  BOOST_CHECK_EQUAL(backPressureParam(&backPressure), 0);
+
+  // Disabling flow control removes the plugin from the driver
+  flowControl.write(0);
+  BOOST_CHECK_EQUAL(driver->getDownstreamCredits(), -1);
+
+  for (size_t i=0; i<arrays.size(); i++) {
+    arrays[i]->release();
+  }
+  pasynManager->freeAsynUser(pasynUser);
+}
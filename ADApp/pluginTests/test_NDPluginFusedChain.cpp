@@ -0,0 +1,106 @@
+#include <stdio.h>
+
+#include "boost/test/unit_test.hpp"
+
+// AD dependencies
+#include <NDPluginDriver.h>
+#include <NDArray.h>
+#include <asynDriver.h>
+
+#include <vector>
+#include <boost/shared_ptr.hpp>
+
+#include <epicsThread.h>
+#include <epicsAtomic.h>
+
+#include "testingutilities.h"
+
+using namespace std;
+
+// Non-blocking plugin that outputs its input array and records which array it processed in which thread
+class FusedChainTestPlugin : public PassThroughPlugin {
+public:
+  FusedChainTestPlugin(const char *portName, const char *NDArrayPort)
+  : PassThroughPlugin(portName, NDArrayPort, 10, 0),
+    pLastArray(0), lastThread(0), numProcessed(0)
+  {
+    setIntegerParam(NDArrayCallbacks, 1);
+    setIntegerParam(NDPluginDriverEnableCallbacks, 1);
+    connectToArrayPort();
+  }
+  void processCallbacks(NDArray *pArray)
+  {
+    NDPluginDriver::beginProcessCallbacks(pArray);
+    pLastArray = pArray;
+    lastThread = epicsThreadGetIdSelf();
+    NDPluginDriver::endProcessCallbacks(pArray, true, true);
+    epicsAtomicIncrIntT(&numProcessed);
+  }
+  int fused()
+  {
+    int value;
+    lock();
+    getIntegerParam(NDPluginDriverFused, &value);
+    unlock();
+    return value;
+  }
+  NDArray *pLastArray;
+  epicsThreadId lastThread;
+  int numProcessed;
+};
+
+BOOST_AUTO_TEST_CASE(test_FusedChain)
+{
+  std::string simport("simFused"), port1("Fused1"), port2("Fused2"), port3("Fused3");
+  uniqueAsynPortName(simport);
+  uniqueAsynPortName(port1);
+  uniqueAsynPortName(port2);
+  uniqueAsynPortName(port3);
+  boost::shared_ptr<asynNDArrayDriver> driver(new asynNDArrayDriver(simport.c_str(), 1, 0, 0,
+                                                                    asynGenericPointerMask,
+                                                                    asynGenericPointerMask,
+                                                                    0, 0, 0, 0));
+  boost::shared_ptr<FusedChainTestPlugin> plugin1(new FusedChainTestPlugin(port1.c_str(), simport.c_str()));
+  boost::shared_ptr<FusedChainTestPlugin> plugin2(new FusedChainTestPlugin(port2.c_str(), port1.c_str()));
+  boost::shared_ptr<FusedChainTestPlugin> plugin3(new FusedChainTestPlugin(port3.c_str(), port2.c_str()));
+  plugin1->start();
+  plugin2->start();
+  plugin3->start();
+
+  std::vector<size_t> dims(2, 8);
+  std::vector<NDArray *> arrays(2);
+  fillNDArraysFromPool(dims, NDUInt8, arrays, driver->pNDArrayPool);
+  asynUser *pasynUser = pasynManager->createAsynUser(0, 0);
+
+  // Without fusing each plugin copies the array and processes it in its own thread
+  plugin1->driverCallback(pasynUser, arrays[0]);
+  BOOST_REQUIRE(waitFor(&plugin3->numProcessed, 1));
+  BOOST_CHECK(plugin2->pLastArray != plugin1->pLastArray);
+  BOOST_CHECK(plugin2->lastThread != plugin1->lastThread);
+  BOOST_CHECK(plugin3->lastThread != plugin2->lastThread);
+
+  // The plugins must be listed in the order of the chain
+  std::string chain = port1 + "," + port2 + ", " + port3;
+  BOOST_CHECK_EQUAL(NDPluginDriver::fuseChain((port2 + "," + port1).c_str()), -1);
+  BOOST_CHECK_EQUAL(NDPluginDriver::fuseChain((port1 + ",noSuchPort").c_str()), -1);
+  BOOST_CHECK_EQUAL(NDPluginDriver::fuseChain(port1.c_str()), -1);
+  BOOST_CHECK_EQUAL(plugin1->fused(), NDPluginFusedNone);
+  BOOST_REQUIRE_EQUAL(NDPluginDriver::fuseChain(chain.c_str()), 0);
+  BOOST_CHECK_EQUAL(plugin1->fused(), NDPluginFusedHead);
+  BOOST_CHECK_EQUAL(plugin2->fused(), NDPluginFusedMiddle);
+  BOOST_CHECK_EQUAL(plugin3->fused(), NDPluginFusedTail);
+
+  // The fused chain processes the same array in the thread of the first plugin
+  plugin1->driverCallback(pasynUser, arrays[1]);
+  BOOST_REQUIRE(waitFor(&plugin3->numProcessed, 2));
+  BOOST_CHECK(plugin1->pLastArray == arrays[1]);
+  BOOST_CHECK(plugin2->pLastArray == arrays[1]);
+  BOOST_CHECK(plugin3->pLastArray == arrays[1]);
+  BOOST_CHECK(plugin2->lastThread == plugin1->lastThread);
+  BOOST_CHECK(plugin3->lastThread == plugin1->lastThread);
+
+  for (size_t i=0; i<arrays.size(); i++) {
+    arrays[i]->release();
+  }
+  pasynManager->freeAsynUser(pasynUser);
+}
@@ -0,0 +1,191 @@
+#include <stdio.h>
+
+#include "boost/test/unit_test.hpp"
+
+// AD dependencies
+#include <NDPluginGather.h>
+#include <NDArray.h>
+#include <asynDriver.h>
+#include <asynPortClient.h>
+
+#include <vector>
+#include <string>
+#include <boost/shared_ptr.hpp>
+
+#include <epicsThread.h>
+#include <epicsAtomic.h>
+
+#include "testingutilities.h"
+
+using namespace std;
+
+// Blocking plugin that records the uniqueIds of the arrays output by the gather plugin
+class GatherTestPlugin : public PassThroughPlugin {
+public:
+  GatherTestPlugin(const char *portName, const char *NDArrayPort)
+  : PassThroughPlugin(portName, NDArrayPort, 1, 1),
+    numReceived(0)
+  {
+    setIntegerParam(NDPluginDriverEnableCallbacks, 1);
+    connectToArrayPort();
+  }
+  void processCallbacks(NDArray *pArray)
+  {
+    uniqueIds.push_back(pArray->uniqueId);
+    threadNames.push_back(epicsThreadGetNameSelf());
+    epicsAtomicIncrIntT(&numReceived);
+  }
+  std::vector<int> uniqueIds;
+  std::vector<std::string> threadNames;
+  int numReceived;
+};
+
+// Driver that outputs arrays to the gather plugin
+class GatherTestSource : public asynNDArrayDriver {
+public:
+  GatherTestSource(const char *portName)
+  : asynNDArrayDriver(portName, 1, 0, 0, asynGenericPointerMask, asynGenericPointerMask, 0, 0, 0, 0) {}
+  void output(NDArray *pArray)
+  {
+    doCallbacksGenericPointer(pArray, NDArrayData, 0);
+  }
+};
+
+struct GatherFixture
+{
+  boost::shared_ptr<GatherTestSource> sources[2];
+  boost::shared_ptr<NDPluginGather> gather;
+  boost::shared_ptr<GatherTestPlugin> capture;
+  std::string gatherPort;
+
+  GatherFixture()
+  {
+    gatherPort = "Gather";
+    uniqueAsynPortName(gatherPort);
+    // The gather plugin is blocking so that the arrays are ordered in the thread of the source
+    gather = boost::shared_ptr<NDPluginGather>(new NDPluginGather(gatherPort.c_str(), 10, 1, 2, 0, 0, 0, 0));
+    gather->start();
+    asynInt32Client(gatherPort.c_str(), 0, NDPluginDriverEnableCallbacksString).write(1);
+    asynInt32Client(gatherPort.c_str(), 0, NDArrayCallbacksString).write(1);
+    for (int i=0; i<2; i++) {
+      std::string simport("simGather");
+      uniqueAsynPortName(simport);
+      sources[i] = boost::shared_ptr<GatherTestSource>(new GatherTestSource(simport.c_str()));
+      asynOctetClient(gatherPort.c_str(), i, NDPluginDriverArrayPortString).write(simport.c_str());
+    }
+    std::string captureport("GatherCapture");
+    uniqueAsynPortName(captureport);
+    capture = boost::shared_ptr<GatherTestPlugin>(new GatherTestPlugin(captureport.c_str(), gatherPort.c_str()));
+    capture->start();
+    asynInt32Client(gatherPort.c_str(), 0, NDPluginGatherOrderString).write(1);
+  }
+  void setWindow(int window, double timeout)
+  {
+    asynInt32Client(gatherPort.c_str(), 0, NDPluginGatherWindowString).write(window);
+    asynFloat64Client(gatherPort.c_str(), 0, NDPluginGatherTimeoutString).write(timeout);
+  }
+  // Sends an array with the uniqueId from a source
+  void send(int source, int uniqueId)
+  {
+    std::vector<size_t> dims(2, 8);
+    std::vector<NDArray *> arrays(1);
+    fillNDArraysFromPool(dims, NDUInt8, arrays, sources[source]->pNDArrayPool);
+    arrays[0]->uniqueId = uniqueId;
+    sources[source]->output(arrays[0]);
+    arrays[0]->release();
+  }
+  int readParam(const char *param)
+  {
+    epicsInt32 value;
+    asynInt32Client(gatherPort.c_str(), 0, param).read(&value);
+    return value;
+  }
+  void checkOutput(const int *expected, size_t numExpected)
+  {
+    capture->lock();
+    BOOST_CHECK_EQUAL(capture->uniqueIds.size(), numExpected);
+    for (size_t i=0; i<numExpected && i<capture->uniqueIds.size(); i++) {
+      BOOST_CHECK_EQUAL(capture->uniqueIds[i], expected[i]);
+    }
+    capture->unlock();
+  }
+};
+
+BOOST_FIXTURE_TEST_SUITE(GatherTests, GatherFixture)
+
+BOOST_AUTO_TEST_CASE(test_GatherWatermarks)
+{
+  setWindow(10, 10.);
+  send(0, 1);
+  send(0, 3);
+  BOOST_CHECK_EQUAL(readParam(NDPluginGatherPendingString), 1);
+  send(1, 2);
+  // uniqueId 4 may still come from source 0
+  send(1, 5);
+  BOOST_CHECK_EQUAL(readParam(NDPluginGatherPendingString), 1);
+  // Both sources have passed uniqueId 4, so it is skipped without waiting
+  send(0, 6);
+  const int expected[] = {1, 2, 3, 5, 6};
+  checkOutput(expected, 5);
+  BOOST_CHECK_EQUAL(readParam(NDPluginGatherPendingString), 0);
+  BOOST_CHECK_EQUAL(readParam(NDPluginGatherSkippedString), 1);
+}
+
+BOOST_AUTO_TEST_CASE(test_GatherWindow)
+{
+  // Source 1 has not sent anything, so only the window and the timeout can skip uniqueIds
+  setWindow(4, 10.);
+  send(0, 1);
+  for (int id=3; id<=5; id++) send(0, id);
+  BOOST_CHECK_EQUAL(readParam(NDPluginGatherPendingString), 3);
+  send(0, 6);
+  const int expected[] = {1, 3, 4, 5, 6};
+  checkOutput(expected, 5);
+  BOOST_CHECK_EQUAL(readParam(NDPluginGatherSkippedString), 1);
+}
+
+BOOST_AUTO_TEST_CASE(test_GatherTimeout)
+{
+  setWindow(10, 0.1);
+  send(0, 1);
+  send(0, 3);
+  // The timer outputs the array after the timeout
+  BOOST_REQUIRE(waitFor(&capture->numReceived, 2));
+  const int expected[] = {1, 3};
+  checkOutput(expected, 2);
+  BOOST_CHECK_EQUAL(readParam(NDPluginGatherSkippedString), 1);
+}
+
+BOOST_AUTO_TEST_CASE(test_GatherTimeoutPluginThread)
+{
+  // Create the plugin thread, the arrays are still ordered in the thread of the source
+  asynInt32Client(gatherPort.c_str(), 0, NDPluginDriverBlockingCallbacksString).write(0);
+  asynInt32Client(gatherPort.c_str(), 0, NDPluginDriverBlockingCallbacksString).write(1);
+  setWindow(10, 0.1);
+  send(0, 1);
+  send(0, 3);
+  // The timer wakes up the plugin thread, which outputs the array
+  BOOST_REQUIRE(waitFor(&capture->numReceived, 2));
+  const int expected[] = {1, 3};
+  checkOutput(expected, 2);
+  capture->lock();
+  BOOST_CHECK(capture->threadNames[1].find("_Plugin_") != std::string::npos);
+  capture->unlock();
+}
+
+BOOST_AUTO_TEST_CASE(test_GatherLateAndRestart)
+{
+  setWindow(4, 10.);
+  send(0, 10);
+  send(0, 12);
+  send(1, 11);
+  // A late array is output at once
+  send(1, 9);
+  // A uniqueId far below the window starts a new sequence
+  send(0, 1);
+  const int expected[] = {10, 11, 12, 9, 1};
+  checkOutput(expected, 5);
+  BOOST_CHECK_EQUAL(readParam(NDPluginGatherSkippedString), 0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,297 @@
+#include <stdio.h>
+#include <math.h>
+
+#include "boost/test/unit_test.hpp"
+
+// AD dependencies
+#include <NDPluginDriver.h>
+#include <NDPluginStats.h>
+#include <NDPluginProcess.h>
+#include <NDPluginTransform.h>
+#include <NDArray.h>
+#include <asynDriver.h>
+
+#include <vector>
+#include <boost/shared_ptr.hpp>
+
+#include <epicsAtomic.h>
+
+#include "testingutilities.h"
+#include "AsynPortClientContainer.h"
+
+using namespace std;
+
+extern volatile int NDPluginParallelMinBytes;
+
+// Plugin that gives the tests access to the parallel processing methods of NDPluginDriver
+class ParallelTestPlugin : public PassThroughPlugin {
+public:
+  ParallelTestPlugin(const char *portName, const char *NDArrayPort)
+  : PassThroughPlugin(portName, NDArrayPort, 1, 1) {}
+  int numBands(NDArray *pArray, size_t numItems, int parallelThreads)
+  {
+    lock();
+    setIntegerParam(NDPluginDriverParallelThreads, parallelThreads);
+    int numBands = getNumBands(pArray, numItems);
+    unlock();
+    return numBands;
+  }
+  using NDPluginDriver::parallelFor;
+};
+
+struct bandTest {
+  std::vector<int> itemCount;
+  std::vector<int> bandCount;
+  std::vector<double> bandSum;
+};
+
+// Counts each item and each band, and sums the items of each band
+static void countBand(void *pvt, int band, size_t first, size_t count)
+{
+  bandTest *pTest = (bandTest *)pvt;
+  for (size_t i=first; i<first+count; i++) {
+    epicsAtomicIncrIntT(&pTest->itemCount[i]);
+    pTest->bandSum[band] += (double)i;
+  }
+  epicsAtomicIncrIntT(&pTest->bandCount[band]);
+}
+
+BOOST_AUTO_TEST_CASE(test_ParallelFor)
+{
+  std::string simport("simParallel"), testport("Parallel");
+  uniqueAsynPortName(simport);
+  uniqueAsynPortName(testport);
+  boost::shared_ptr<asynNDArrayDriver> driver(new asynNDArrayDriver(simport.c_str(), 1, 0, 0,
+                                                                    asynGenericPointerMask,
+                                                                    asynGenericPointerMask,
+                                                                    0, 0, 0, 0));
+  boost::shared_ptr<ParallelTestPlugin> plugin(new ParallelTestPlugin(testport.c_str(), simport.c_str()));
+
+  std::vector<size_t> dims(2, 256);
+  std::vector<NDArray *> arrays(1);
+  fillNDArraysFromPool(dims, NDUInt8, arrays, driver->pNDArrayPool);
+  NDArray *pArray = arrays[0];
+
+  // Arrays smaller than NDPluginParallelMinBytes and ParallelThreads=1 use one band
+  int saveMinBytes = NDPluginParallelMinBytes;
+  NDPluginParallelMinBytes = 1024*1024;
+  BOOST_CHECK_EQUAL(plugin->numBands(pArray, 256, 4), 1);
+  NDPluginParallelMinBytes = 0;
+  BOOST_CHECK_EQUAL(plugin->numBands(pArray, 256, 1), 1);
+  int numBands = plugin->numBands(pArray, 256, 4);
+  BOOST_CHECK(numBands > 1);
+  BOOST_CHECK(numBands <= 256);
+  BOOST_CHECK_EQUAL(plugin->numBands(pArray, 3, 4), 3);
+
+  // Every item is processed once, in bands that are the same each time
+  const size_t numItems = 100003;
+  std::vector<double> firstSums;
+  for (int pass=0; pass<5; pass++) {
+    bandTest test;
+    test.itemCount.assign(numItems, 0);
+    test.bandCount.assign(numBands, 0);
+    test.bandSum.assign(numBands, 0.);
+    plugin->parallelFor(countBand, &test, numItems, numBands);
+    for (size_t i=0; i<numItems; i++) {
+      BOOST_REQUIRE_MESSAGE(test.itemCount[i] == 1, "item " << i << " processed " << test.itemCount[i] << " times");
+    }
+    for (int band=0; band<numBands; band++) {
+      BOOST_REQUIRE_EQUAL(test.bandCount[band], 1);
+    }
+    if (pass == 0) firstSums = test.bandSum;
+    BOOST_CHECK(test.bandSum == firstSums);
+  }
+
+  // One band runs in the calling thread
+  bandTest test;
+  test.itemCount.assign(10, 0);
+  test.bandCount.assign(1, 0);
+  test.bandSum.assign(1, 0.);
+  plugin->parallelFor(countBand, &test, 10, 1);
+  BOOST_CHECK_EQUAL(test.bandCount[0], 1);
+  BOOST_CHECK_EQUAL(test.bandSum[0], 45.);
+
+  NDPluginParallelMinBytes = saveMinBytes;
+  pArray->release();
+}
+
+// Output of a plugin under test with one setting of ParallelThreads
+struct pluginOutput {
+  std::vector<size_t> dims;
+  std::vector<char> data;
+  std::vector<double> params;
+};
+
+static pluginOutput *pCapture;
+
+static void captureOutput(void *userPvt, asynUser *pasynUser, void *pointer)
+{
+  NDArray *pArray = (NDArray *)pointer;
+  NDArrayInfo_t arrayInfo;
+
+  if (!pCapture) return;
+  pArray->getInfo(&arrayInfo);
+  pCapture->dims.clear();
+  for (int dim=0; dim<pArray->ndims; dim++) pCapture->dims.push_back(pArray->dims[dim].size);
+  pCapture->data.assign((char *)pArray->pData, (char *)pArray->pData + arrayInfo.totalBytes);
+}
+
+// Sets the parameters of a plugin under test before each run
+typedef void (*pluginSetup_t)(AsynPortClientContainer *pParams);
+
+// Processes pArray numFrames times with the given ParallelThreads, and records the last output array
+// and the values of the named parameters
+static void runPlugin(NDPluginDriver *pPlugin, AsynPortClientContainer *pParams, pluginSetup_t setup,
+                      NDArray *pArray, int numFrames, int parallelThreads,
+                      const char **paramNames, int numParams, pluginOutput *pOut)
+{
+  pParams->write(NDPluginDriverParallelThreadsString, parallelThreads);
+  if (setup) setup(pParams);
+  asynUser *pasynUser = pasynManager->createAsynUser(0, 0);
+  pCapture = pOut;
+  // The plugins have BlockingCallbacks=1, so they process the array before driverCallback() returns
+  for (int frame=0; frame<numFrames; frame++) {
+    pPlugin->driverCallback(pasynUser, pArray);
+  }
+  pCapture = NULL;
+  pasynManager->freeAsynUser(pasynUser);
+  for (int i=0; i<numParams; i++) {
+    pOut->params.push_back(pParams->readDouble(paramNames[i]));
+  }
+}
+
+// Runs the plugin with 1 and with 4 threads, and checks that the outputs are the same
+static void checkParallelPlugin(NDPluginDriver *pPlugin, const std::string& port, pluginSetup_t setup,
+                                NDArray *pArray, int numFrames, const char **paramNames, int numParams)
+{
+  AsynPortClientContainer params(port);
+  asynGenericPointerClient client(port.c_str(), 0, NDArrayDataString);
+  pluginOutput serial, parallel;
+
+  params.write(NDArrayCallbacksString, 1);
+  client.registerInterruptUser(captureOutput);
+  runPlugin(pPlugin, &params, setup, pArray, numFrames, 1, paramNames, numParams, &serial);
+  runPlugin(pPlugin, &params, setup, pArray, numFrames, 4, paramNames, numParams, &parallel);
+
+  BOOST_REQUIRE(!serial.data.empty());
+  BOOST_CHECK(serial.dims == parallel.dims);
+  BOOST_CHECK(serial.data == parallel.data);
+  for (int i=0; i<numParams; i++) {
+    // Sums over the bands can differ in the last bits from the serial sums
+    double tolerance = 1e-9 * (fabs(serial.params[i]) + 1.);
+    BOOST_CHECK_MESSAGE(fabs(serial.params[i] - parallel.params[i]) <= tolerance,
+                        paramNames[i] << " is " << serial.params[i] << " with 1 thread and "
+                        << parallel.params[i] << " with 4 threads");
+  }
+}
+
+static void setupStats(AsynPortClientContainer *pParams)
+{
+  pParams->write(NDPluginStatsComputeStatisticsString, 1);
+  pParams->write(NDPluginStatsComputeCentroidString, 1);
+  pParams->write(NDPluginStatsComputeHistogramString, 1);
+  pParams->write(NDPluginStatsCentroidThresholdString, 100.);
+  pParams->write(NDPluginStatsHistSizeString, 64);
+  pParams->write(NDPluginStatsHistMinString, 10.);
+  pParams->write(NDPluginStatsHistMaxString, 900.);
+}
+
+static void setupProcess(AsynPortClientContainer *pParams)
+{
+  pParams->write(NDPluginProcessDataTypeString, (int)NDFloat64);
+  pParams->write(NDPluginProcessEnableOffsetScaleString, 1);
+  pParams->write(NDPluginProcessOffsetString, -100.);
+  pParams->write(NDPluginProcessScaleString, 0.5);
+  pParams->write(NDPluginProcessEnableLowClipString, 1);
+  pParams->write(NDPluginProcessLowClipThreshString, 10.);
+  pParams->write(NDPluginProcessLowClipValueString, 0.);
+  pParams->write(NDPluginProcessEnableHighClipString, 1);
+  pParams->write(NDPluginProcessHighClipThreshString, 400.);
+  pParams->write(NDPluginProcessHighClipValueString, 400.);
+  // The automatic offset and scale use the minimum and maximum of the bands
+  pParams->write(NDPluginProcessAutoOffsetScaleString, 1);
+  pParams->write(NDPluginProcessEnableFilterString, 1);
+  pParams->write(NDPluginProcessResetFilterString, 1);
+  pParams->write(NDPluginProcessNumFilterString, 3);
+  pParams->write(NDPluginProcessOScaleString, 1.);
+  pParams->write(NDPluginProcessOC1String, 1.);
+  pParams->write(NDPluginProcessFScaleString, 1.);
+  pParams->write(NDPluginProcessFC1String, 1.);
+  pParams->write(NDPluginProcessFC4String, 1.);
+  pParams->write(NDPluginProcessRC2String, 1.);
+}
+
+static int transformType;
+
+static void setupTransform(AsynPortClientContainer *pParams)
+{
+  pParams->write(NDPluginTransformTypeString, transformType);
+}
+
+// Stats, Process and Transform give the same results with ParallelThreads=4 as with ParallelThreads=1,
+// for an array whose size does not divide into the bands
+BOOST_AUTO_TEST_CASE(test_ParallelPlugins)
+{
+  std::string simport("simParallelPlugins");
+  uniqueAsynPortName(simport);
+  boost::shared_ptr<asynNDArrayDriver> driver(new asynNDArrayDriver(simport.c_str(), 1, 0, 0,
+                                                                    asynGenericPointerMask,
+                                                                    asynGenericPointerMask,
+                                                                    0, 0, 0, 0));
+  size_t dims[2] = {101, 37};
+  NDArray *pArray = driver->pNDArrayPool->alloc(2, dims, NDUInt16, 0, NULL);
+  BOOST_REQUIRE(pArray);
+  epicsUInt16 *pData = (epicsUInt16 *)pArray->pData;
+  for (size_t y=0; y<dims[1]; y++) {
+    for (size_t x=0; x<dims[0]; x++) {
+      pData[y*dims[0] + x] = (epicsUInt16)((x*31 + y*17) % 997);
+    }
+  }
+  // A single maximum in a band in the middle of the array
+  pData[23*dims[0] + 57] = 5000;
+
+  int saveMinBytes = NDPluginParallelMinBytes;
+  NDPluginParallelMinBytes = 0;
+
+  {
+    std::string port("ParallelStats");
+    uniqueAsynPortName(port);
+    boost::shared_ptr<NDPluginStats> stats(new NDPluginStats(port.c_str(), 10, 1, simport.c_str(), 0,
+                                                             0, 0, 0, 0, 1));
+    const char *paramNames[] = {NDPluginStatsMinValueString, NDPluginStatsMinXString, NDPluginStatsMinYString,
+                                NDPluginStatsMaxValueString, NDPluginStatsMaxXString, NDPluginStatsMaxYString,
+                                NDPluginStatsMeanValueString, NDPluginStatsSigmaValueString,
+                                NDPluginStatsTotalString, NDPluginStatsNetString,
+                                NDPluginStatsCentroidTotalString, NDPluginStatsCentroidXString,
+                                NDPluginStatsCentroidYString, NDPluginStatsSigmaXString,
+                                NDPluginStatsSigmaYString, NDPluginStatsSigmaXYString,
+                                NDPluginStatsHistEntropyString};
+    BOOST_TEST_MESSAGE("NDPluginStats");
+    checkParallelPlugin(stats.get(), port, setupStats, pArray, 1,
+                        paramNames, sizeof(paramNames)/sizeof(paramNames[0]));
+  }
+  {
+    std::string port("ParallelProcess");
+    uniqueAsynPortName(port);
+    boost::shared_ptr<NDPluginProcess> process(new NDPluginProcess(port.c_str(), 10, 1, simport.c_str(), 0,
+                                                                   0, 0, 0, 0));
+    const char *paramNames[] = {NDPluginProcessScaleString, NDPluginProcessOffsetString};
+    BOOST_TEST_MESSAGE("NDPluginProcess");
+    // The second frame applies the filter to the first
+    checkParallelPlugin(process.get(), port, setupProcess, pArray, 2,
+                        paramNames, sizeof(paramNames)/sizeof(paramNames[0]));
+  }
+  {
+    std::string port("ParallelTransform");
+    uniqueAsynPortName(port);
+    boost::shared_ptr<NDPluginTransform> transform(new NDPluginTransform(port.c_str(), 10, 1, simport.c_str(), 0,
+                                                                         0, 0, 0, 0, 1));
+    for (transformType=0; transformType<8; transformType++) {
+      BOOST_TEST_MESSAGE("NDPluginTransform type " << transformType);
+      checkParallelPlugin(transform.get(), port, setupTransform, pArray, 1, NULL, 0);
+    }
+  }
+
+  NDPluginParallelMinBytes = saveMinBytes;
+  pArray->release();
+}
@@ -0,0 +1,121 @@
+#include <stdio.h>
+
+#include "boost/test/unit_test.hpp"
+
+// AD dependencies
+#include <NDPluginDriver.h>
+#include <NDArray.h>
+#include <asynDriver.h>
+#include <asynPortClient.h>
+
+#include <vector>
+#include <boost/shared_ptr.hpp>
+
+#include <epicsThread.h>
+#include <epicsAtomic.h>
+
+#include "testingutilities.h"
+
+using namespace std;
+
+// Blocking plugin that updates ArrayCounter and does the parameter callbacks for every array
+class ParamRateTestPlugin : public PassThroughPlugin {
+public:
+  ParamRateTestPlugin(const char *portName, const char *NDArrayPort)
+  : PassThroughPlugin(portName, NDArrayPort, 1, 1) {}
+  void processCallbacks(NDArray *pArray)
+  {
+    beginProcessCallbacks(pArray);
+    callParamCallbacks();
+  }
+  void setMaxParamRate(double rate)
+  {
+    lock();
+    setDoubleParam(NDPluginDriverMaxParamRate, rate);
+    unlock();
+  }
+};
+
+static int numCounterCallbacks;
+static int lastCounter;
+
+static void counterCallback(void *userPvt, asynUser *pasynUser, epicsInt32 data)
+{
+  epicsAtomicIncrIntT(&numCounterCallbacks);
+  epicsAtomicSetIntT(&lastCounter, data);
+}
+
+BOOST_AUTO_TEST_CASE(test_MaxParamRate)
+{
+  const int numArrays = 100;
+  std::string simport("simParamRate"), testport("ParamRate");
+  uniqueAsynPortName(simport);
+  uniqueAsynPortName(testport);
+  boost::shared_ptr<asynNDArrayDriver> driver(new asynNDArrayDriver(simport.c_str(), 1, 0, 0,
+                                                                    asynGenericPointerMask,
+                                                                    asynGenericPointerMask,
+                                                                    0, 0, 0, 0));
+  boost::shared_ptr<ParamRateTestPlugin> plugin(new ParamRateTestPlugin(testport.c_str(), simport.c_str()));
+  asynInt32Client counter(testport.c_str(), 0, NDArrayCounterString);
+  counter.registerInterruptUser(counterCallback);
+
+  std::vector<size_t> dims(2, 8);
+  std::vector<NDArray *> arrays(numArrays);
+  fillNDArraysFromPool(dims, NDUInt8, arrays, driver->pNDArrayPool);
+  asynUser *pasynUser = pasynManager->createAsynUser(0, 0);
+
+  // Without a limit every array does the callbacks
+  numCounterCallbacks = 0;
+  for (int i=0; i<10; i++) {
+    plugin->driverCallback(pasynUser, arrays[i]);
+  }
+  BOOST_CHECK_EQUAL(epicsAtomicGetIntT(&numCounterCallbacks), 10);
+  BOOST_CHECK_EQUAL(epicsAtomicGetIntT(&lastCounter), 10);
+
+  // At 2 Hz the first array does the callbacks and the timer publishes the last value
+  plugin->setMaxParamRate(2.);
+  epicsThreadSleep(0.6);
+  numCounterCallbacks = 0;
+  for (int i=10; i<numArrays; i++) {
+    plugin->driverCallback(pasynUser, arrays[i]);
+  }
+  BOOST_CHECK(epicsAtomicGetIntT(&numCounterCallbacks) <= 2);
+  BOOST_CHECK(waitFor(&lastCounter, numArrays));
+  BOOST_CHECK(epicsAtomicGetIntT(&numCounterCallbacks) <= 3);
+
+  for (int i=0; i<numArrays; i++) {
+    arrays[i]->release();
+  }
+  pasynManager->freeAsynUser(pasynUser);
+}
+
+BOOST_AUTO_TEST_CASE(test_MaxParamRateDelete)
+{
+  std::string simport("simParamRateDelete"), testport("ParamRateDelete");
+  uniqueAsynPortName(simport);
+  uniqueAsynPortName(testport);
+  boost::shared_ptr<asynNDArrayDriver> driver(new asynNDArrayDriver(simport.c_str(), 1, 0, 0,
+                                                                    asynGenericPointerMask,
+                                                                    asynGenericPointerMask,
+                                                                    0, 0, 0, 0));
+  ParamRateTestPlugin *plugin = new ParamRateTestPlugin(testport.c_str(), simport.c_str());
+  plugin->setMaxParamRate(2.);
+
+  std::vector<size_t> dims(2, 8);
+  std::vector<NDArray *> arrays(5);
+  fillNDArraysFromPool(dims, NDUInt8, arrays, driver->pNDArrayPool);
+  asynUser *pasynUser = pasynManager->createAsynUser(0, 0);
+
+  // The callbacks for the arrays after the first wait for the timer
+  for (size_t i=0; i<arrays.size(); i++) {
+    plugin->driverCallback(pasynUser, arrays[i]);
+  }
+  // Deleting the blocking plugin must destroy the timer, so that it does not fire on the deleted object
+  BOOST_CHECK_NO_THROW(delete plugin);
+  epicsThreadSleep(1.);
+
+  for (size_t i=0; i<arrays.size(); i++) {
+    arrays[i]->release();
+  }
+  pasynManager->freeAsynUser(pasynUser);
+}
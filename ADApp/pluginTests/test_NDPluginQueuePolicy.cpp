@@ -0,0 +1,120 @@
+#include <stdio.h>
+
+#include "boost/test/unit_test.hpp"
+
+// AD dependencies
+#include <NDPluginDriver.h>
+#include <NDArray.h>
+#include <asynDriver.h>
+
+#include <vector>
+#include <boost/shared_ptr.hpp>
+
+#include <epicsThread.h>
+
+#include "testingutilities.h"
+
+using namespace std;
+
+// Non-blocking plugin that records the uniqueIds it processes, and waits until the test opens the gate
+class QueuePolicyTestPlugin : public PassThroughPlugin {
+public:
+  QueuePolicyTestPlugin(const char *portName, const char *NDArrayPort, int queueSize)
+  : PassThroughPlugin(portName, NDArrayPort, queueSize, 0)
+  {
+    setGate(false);
+  }
+  void processCallbacks(NDArray *pArray)
+  {
+    uniqueIds.push_back(pArray->uniqueId);
+    waitAtGate();
+  }
+  void setQueuePolicy(int policy)
+  {
+    lock();
+    setIntegerParam(NDPluginDriverQueuePolicy, policy);
+    unlock();
+  }
+  void getDropCounters(int *pNewest, int *pOldest, int *pStale)
+  {
+    lock();
+    getIntegerParam(NDPluginDriverDroppedArrays, pNewest);
+    getIntegerParam(NDPluginDriverDroppedOldest, pOldest);
+    getIntegerParam(NDPluginDriverDroppedStale, pStale);
+    unlock();
+  }
+  std::vector<int> uniqueIds;
+};
+
+/* Sends arrays 1 to numArrays to a plugin with the given policy while it is processing array 1,
+ * then checks which arrays it processed and the drop counters */
+static void runPolicy(int policy, const std::vector<int>& expected, int droppedNewest, int droppedOldest,
+                      int droppedStale)
+{
+  const int queueSize = 3, numArrays = 6;
+  std::string simport("simQueuePolicy"), testport("QueuePolicy");
+  uniqueAsynPortName(simport);
+  uniqueAsynPortName(testport);
+  boost::shared_ptr<asynNDArrayDriver> driver(new asynNDArrayDriver(simport.c_str(), 1, 0, 0,
+                                                                    asynGenericPointerMask,
+                                                                    asynGenericPointerMask,
+                                                                    0, 0, 0, 0));
+  boost::shared_ptr<QueuePolicyTestPlugin> plugin(new QueuePolicyTestPlugin(testport.c_str(), simport.c_str(), queueSize));
+  plugin->start();
+  plugin->setQueuePolicy(policy);
+
+  std::vector<size_t> dims(2, 8);
+  std::vector<NDArray *> arrays(numArrays);
+  fillNDArraysFromPool(dims, NDUInt8, arrays, driver->pNDArrayPool);
+  asynUser *pasynUser = pasynManager->createAsynUser(0, 0);
+
+  arrays[0]->uniqueId = 1;
+  plugin->driverCallback(pasynUser, arrays[0]);
+  BOOST_REQUIRE(waitFor(&plugin->numStarted, 1));
+  for (int i=1; i<numArrays; i++) {
+    arrays[i]->uniqueId = i + 1;
+    plugin->driverCallback(pasynUser, arrays[i]);
+  }
+  plugin->setGate(true);
+  BOOST_REQUIRE(waitFor(&plugin->numStarted, (int)expected.size()));
+  for (int i=0; i<100 && driver->getQueuedArrayCount() > 0; i++) epicsThreadSleep(0.01);
+
+  plugin->lock();
+  BOOST_CHECK_EQUAL(plugin->uniqueIds.size(), expected.size());
+  for (size_t i=0; i<expected.size() && i<plugin->uniqueIds.size(); i++) {
+    BOOST_CHECK_EQUAL(plugin->uniqueIds[i], expected[i]);
+  }
+  plugin->unlock();
+  int newest, oldest, stale;
+  plugin->getDropCounters(&newest, &oldest, &stale);
+  BOOST_CHECK_EQUAL(newest, droppedNewest);
+  BOOST_CHECK_EQUAL(oldest, droppedOldest);
+  BOOST_CHECK_EQUAL(stale, droppedStale);
+  BOOST_CHECK_EQUAL(driver->getQueuedArrayCount(), 0);
+
+  for (int i=0; i<numArrays; i++) {
+    arrays[i]->release();
+  }
+  pasynManager->freeAsynUser(pasynUser);
+}
+
+BOOST_AUTO_TEST_CASE(test_QueuePolicyDropNewest)
+{
+  // The queue keeps the first arrays that arrived
+  const int expected[] = {1, 2, 3, 4};
+  runPolicy(NDPluginQueueDropNewest, std::vector<int>(expected, expected+4), 2, 0, 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_QueuePolicyDropOldest)
+{
+  // The queue keeps the last arrays that arrived
+  const int expected[] = {1, 4, 5, 6};
+  runPolicy(NDPluginQueueDropOldest, std::vector<int>(expected, expected+4), 0, 2, 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_QueuePolicyKeepLatest)
+{
+  // Only the newest array waits
+  const int expected[] = {1, 6};
+  runPolicy(NDPluginQueueKeepLatest, std::vector<int>(expected, expected+2), 0, 0, 4);
+}
@@ -0,0 +1,211 @@
+#include <stdio.h>
+
+#include "boost/test/unit_test.hpp"
+
+// AD dependencies
+#include <NDPluginScatter.h>
+#include <NDArray.h>
+#include <asynDriver.h>
+#include <asynPortClient.h>
+
+#include <vector>
+#include <string>
+#include <stdexcept>
+#include <boost/shared_ptr.hpp>
+
+#include <epicsAtomic.h>
+
+#include "testingutilities.h"
+
+using namespace std;
+
+// Plugin that records the order in which the scatter clients receive arrays, and whose processing can
+// wait until the test opens the gate
+class ScatterTestPlugin : public PassThroughPlugin {
+public:
+  ScatterTestPlugin(const char *portName, const char *NDArrayPort, int queueSize, int blockingCallbacks,
+                    int id, std::vector<int> *pSequence)
+  : PassThroughPlugin(portName, NDArrayPort, queueSize, blockingCallbacks),
+    pLastArray(0), id_(id), pSequence_(pSequence)
+  {
+    setIntegerParam(NDPluginDriverEnableCallbacks, 1);
+    connectToArrayPort();
+  }
+  void processCallbacks(NDArray *pArray)
+  {
+    if (pSequence_) pSequence_->push_back(id_);
+    pLastArray = pArray;
+    waitAtGate();
+  }
+  NDArray *pLastArray;
+private:
+  int id_;
+  std::vector<int> *pSequence_;
+};
+
+struct ScatterFixture
+{
+  boost::shared_ptr<asynNDArrayDriver> driver;
+  boost::shared_ptr<NDPluginScatter> scatter;
+  std::vector<boost::shared_ptr<ScatterTestPlugin> > clients;
+  std::vector<std::string> clientPorts;
+  std::vector<NDArray *> arrays;
+  std::vector<int> sequence;
+  std::string scatterPort;
+
+  ScatterFixture()
+  {
+    std::string simport("simScatter");
+    scatterPort = "Scatter";
+    uniqueAsynPortName(simport);
+    uniqueAsynPortName(scatterPort);
+    driver = boost::shared_ptr<asynNDArrayDriver>(new asynNDArrayDriver(simport.c_str(), 1, 0, 0,
+                                                                        asynGenericPointerMask,
+                                                                        asynGenericPointerMask,
+                                                                        0, 0, 0, 0));
+    // The scatter plugin is blocking so that the arrays are dispatched in the test thread
+    scatter = boost::shared_ptr<NDPluginScatter>(new NDPluginScatter(scatterPort.c_str(), 10, 1, simport.c_str(), 0,
+                                                                     0, 0, 0, 0));
+    scatter->start();
+    asynInt32Client arrayCallbacks(scatterPort.c_str(), 0, NDArrayCallbacksString);
+    arrayCallbacks.write(1);
+
+    std::vector<size_t> dims(2, 8);
+    arrays.resize(10);
+    fillNDArraysFromPool(dims, NDUInt8, arrays, driver->pNDArrayPool);
+  }
+  ~ScatterFixture()
+  {
+    for (size_t i=0; i<arrays.size(); i++) {
+      arrays[i]->release();
+    }
+  }
+  void addClient(int queueSize, int blockingCallbacks)
+  {
+    std::string port("ScatterClient");
+    uniqueAsynPortName(port);
+    clientPorts.push_back(port);
+    clients.push_back(boost::shared_ptr<ScatterTestPlugin>(
+        new ScatterTestPlugin(port.c_str(), scatterPort.c_str(), queueSize, blockingCallbacks,
+                              (int)clients.size(), blockingCallbacks ? &sequence : NULL)));
+    clients.back()->start();
+  }
+  void setMethod(int method)
+  {
+    asynInt32Client client(scatterPort.c_str(), 0, NDPluginScatterMethodString);
+    client.write(method);
+  }
+  void send(int i)
+  {
+    asynUser *pasynUser = pasynManager->createAsynUser(0, 0);
+    scatter->driverCallback(pasynUser, arrays[i]);
+    pasynManager->freeAsynUser(pasynUser);
+  }
+};
+
+BOOST_FIXTURE_TEST_SUITE(ScatterTests, ScatterFixture)
+
+BOOST_AUTO_TEST_CASE(test_ScatterRoundRobin)
+{
+  for (int i=0; i<3; i++) addClient(10, 1);
+  setMethod(NDPluginScatterRoundRobin);
+  for (int i=0; i<6; i++) send(i);
+  const int expected[] = {0, 1, 2, 0, 1, 2};
+  BOOST_REQUIRE_EQUAL(sequence.size(), 6u);
+  for (size_t i=0; i<sequence.size(); i++) BOOST_CHECK_EQUAL(sequence[i], expected[i]);
+}
+
+BOOST_AUTO_TEST_CASE(test_ScatterWeighted)
+{
+  for (int i=0; i<3; i++) addClient(10, 1);
+  setMethod(NDPluginScatterWeighted);
+  // The third client is not in the list, so it has weight 1
+  asynOctetClient weights(scatterPort.c_str(), 0, NDPluginScatterWeightsString);
+  std::string weightList = clientPorts[0] + ":2, " + clientPorts[1] + ":1";
+  weights.write(weightList.c_str());
+  for (int i=0; i<8; i++) send(i);
+  // Smooth weighted round robin interleaves the clients
+  const int expected[] = {0, 1, 2, 0, 0, 1, 2, 0};
+  BOOST_REQUIRE_EQUAL(sequence.size(), 8u);
+  for (size_t i=0; i<sequence.size(); i++) BOOST_CHECK_EQUAL(sequence[i], expected[i]);
+}
+
+BOOST_AUTO_TEST_CASE(test_ScatterWeightsInvalid)
+{
+  for (int i=0; i<3; i++) addClient(10, 1);
+  setMethod(NDPluginScatterWeighted);
+  asynOctetClient weights(scatterPort.c_str(), 0, NDPluginScatterWeightsString);
+  std::string weightList = clientPorts[0] + ":2, " + clientPorts[1] + ":1";
+  weights.write(weightList.c_str());
+  // Invalid lists are rejected and leave the weights unchanged
+  const char *invalid[] = {":1", "none", ":", "x:-1", "x:", "x:2abc", "x:1.5", "x:1000001", "x:99999999999999999999"};
+  for (size_t i=0; i<sizeof(invalid)/sizeof(invalid[0]); i++) {
+    std::string list = clientPorts[0] + ":5, " + invalid[i];
+    BOOST_CHECK_THROW(weights.write(list.c_str()), std::runtime_error);
+  }
+  for (int i=0; i<8; i++) send(i);
+  const int expected[] = {0, 1, 2, 0, 0, 1, 2, 0};
+  BOOST_REQUIRE_EQUAL(sequence.size(), 8u);
+  for (size_t i=0; i<sequence.size(); i++) BOOST_CHECK_EQUAL(sequence[i], expected[i]);
+}
+
+BOOST_AUTO_TEST_CASE(test_ScatterWeightedLarge)
+{
+  for (int i=0; i<3; i++) addClient(10, 1);
+  setMethod(NDPluginScatterWeighted);
+  // The largest weights must not overflow the running totals
+  asynOctetClient weights(scatterPort.c_str(), 0, NDPluginScatterWeightsString);
+  std::string weightList = clientPorts[0] + ":1000000, " + clientPorts[1] + ":999999";
+  weights.write(weightList.c_str());
+  for (int i=0; i<8; i++) send(i);
+  const int expected[] = {0, 1, 0, 1, 0, 1, 0, 1};
+  BOOST_REQUIRE_EQUAL(sequence.size(), 8u);
+  for (size_t i=0; i<sequence.size(); i++) BOOST_CHECK_EQUAL(sequence[i], expected[i]);
+}
+
+BOOST_AUTO_TEST_CASE(test_ScatterLeastLoaded)
+{
+  addClient(6, 0);
+  addClient(2, 0);
+  setMethod(NDPluginScatterLeastLoaded);
+  clients[0]->setGate(false);
+  clients[1]->setGate(false);
+
+  // The first client has the larger queue, so it receives arrays until it has as few free slots as the second
+  send(0);
+  BOOST_REQUIRE(waitFor(&clients[0]->numStarted, 1));
+  for (int i=1; i<5; i++) send(i);
+  BOOST_CHECK_EQUAL(clients[0]->getQueueFree(), 2);
+  BOOST_CHECK_EQUAL(clients[1]->getQueueFree(), 2);
+  BOOST_CHECK_EQUAL(epicsAtomicGetIntT(&clients[1]->numStarted), 0);
+  // Then the clients take turns
+  send(5);
+  BOOST_REQUIRE(waitFor(&clients[1]->numStarted, 1));
+  send(6);
+  BOOST_CHECK_EQUAL(clients[0]->getQueueFree(), 1);
+  BOOST_CHECK_EQUAL(clients[1]->getQueueFree(), 2);
+  send(7);
+  BOOST_CHECK_EQUAL(clients[1]->getQueueFree(), 1);
+
+  clients[0]->setGate(true);
+  clients[1]->setGate(true);
+  BOOST_CHECK(waitFor(&clients[0]->numStarted, 6));
+  BOOST_CHECK(waitFor(&clients[1]->numStarted, 2));
+}
+
+BOOST_AUTO_TEST_CASE(test_ScatterZeroCopy)
+{
+  addClient(10, 1);
+  setMethod(NDPluginScatterRoundRobin);
+  // By default the client receives a copy
+  send(0);
+  BOOST_REQUIRE(clients[0]->pLastArray != 0);
+  BOOST_CHECK(clients[0]->pLastArray != arrays[0]);
+  // With ZeroCopy the client receives the input array
+  asynInt32Client zeroCopy(scatterPort.c_str(), 0, NDPluginDriverZeroCopyString);
+  zeroCopy.write(1);
+  send(1);
+  BOOST_CHECK(clients[0]->pLastArray == arrays[1]);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
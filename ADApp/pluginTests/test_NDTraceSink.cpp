@@ -0,0 +1,99 @@
+#include <stdio.h>
+
+#include "boost/test/unit_test.hpp"
+
+// AD dependencies
+#include <NDTraceSink.h>
+
+#include <string>
+#include <fstream>
+#include <sstream>
+
+#include <epicsTime.h>
+
+using namespace std;
+
+static const char *traceFile = "test_NDTraceSink.json";
+
+static std::string readTraceFile()
+{
+  std::ifstream in(traceFile);
+  std::stringstream contents;
+  contents << in.rdbuf();
+  return contents.str();
+}
+
+static size_t countOf(const std::string& str, const std::string& pattern)
+{
+  size_t n = 0;
+  for (size_t pos = str.find(pattern); pos != std::string::npos; pos = str.find(pattern, pos+1)) n++;
+  return n;
+}
+
+BOOST_AUTO_TEST_CASE(test_TraceWindow)
+{
+  epicsTimeStamp t0, t1;
+  epicsTimeGetCurrent(&t0);
+  t1 = t0;
+  epicsTimeAddSeconds(&t1, 0.001);
+
+  // Nothing is recorded without a trace
+  BOOST_CHECK(!NDTraceSink::active());
+  BOOST_CHECK_EQUAL(NDTraceSink::stop(), -1);
+  BOOST_CHECK_EQUAL(NDTraceSink::start("", 10, 0), -1);
+  BOOST_CHECK_EQUAL(NDTraceSink::start(traceFile, 0, 0), -1);
+
+  BOOST_REQUIRE_EQUAL(NDTraceSink::start(traceFile, 3, 0), 0);
+  BOOST_CHECK(NDTraceSink::active());
+  BOOST_CHECK_EQUAL(NDTraceSink::start(traceFile, 3, 0), -1);
+
+  // The window is uniqueIds 5 to 7, starting with the first array recorded
+  for (int id=5; id<=9; id++) {
+    NDTraceSink::record("TRACE1", NDTraceCallback, id, &t0);
+    NDTraceSink::record("TRACE1", NDTraceQueue, id, &t0, &t1);
+    NDTraceSink::record("TRACE1", NDTraceProcess, id, &t0, &t1);
+    NDTraceSink::record("TRACE2", NDTraceOutput, id, &t0, &t1);
+  }
+  NDTraceSink::record("TRACE1", NDTraceProcess, 4, &t0, &t1);
+  BOOST_REQUIRE_EQUAL(NDTraceSink::stop(), 0);
+  BOOST_CHECK(!NDTraceSink::active());
+
+  std::string trace = readTraceFile();
+  BOOST_CHECK_EQUAL(trace.compare(0, 17, "{\"displayTimeUnit"), 0);
+  BOOST_CHECK_EQUAL(countOf(trace, "\"process_name\""), 2u);
+  BOOST_CHECK_EQUAL(countOf(trace, "\"name\":\"TRACE1\""), 1u);
+  BOOST_CHECK_EQUAL(countOf(trace, "\"name\":\"TRACE2\""), 1u);
+  BOOST_CHECK_EQUAL(countOf(trace, "\"name\":\"callback\""), 3u);
+  BOOST_CHECK_EQUAL(countOf(trace, "\"ph\":\"b\""), 3u);
+  BOOST_CHECK_EQUAL(countOf(trace, "\"ph\":\"e\""), 3u);
+  BOOST_CHECK_EQUAL(countOf(trace, "\"ph\":\"X\""), 6u);
+  BOOST_CHECK_EQUAL(countOf(trace, "\"uniqueId\":7}"), 4u);
+  BOOST_CHECK_EQUAL(countOf(trace, "\"uniqueId\":8}"), 0u);
+  BOOST_CHECK_EQUAL(countOf(trace, "\"uniqueId\":4}"), 0u);
+  BOOST_CHECK_EQUAL(countOf(trace, "\"dur\":1000.000"), 6u);
+  BOOST_CHECK_EQUAL(trace.compare(trace.size()-3, 3, "]}\n"), 0);
+  remove(traceFile);
+}
+
+BOOST_AUTO_TEST_CASE(test_TraceMaxEvents)
+{
+  epicsTimeStamp t0;
+  epicsTimeGetCurrent(&t0);
+
+  // Recording stops when maxEvents events have been recorded
+  BOOST_REQUIRE_EQUAL(NDTraceSink::start(traceFile, 100, 5), 0);
+  for (int id=1; id<=10; id++) {
+    NDTraceSink::record("TRACE1", NDTraceProcess, id, &t0, &t0);
+  }
+  BOOST_CHECK(!NDTraceSink::active());
+  // and the file is written when the trace is stopped
+  BOOST_REQUIRE_EQUAL(NDTraceSink::stop(), 0);
+  std::string trace = readTraceFile();
+  BOOST_CHECK_EQUAL(countOf(trace, "\"ph\":\"X\""), 5u);
+  remove(traceFile);
+
+  // A new trace can be started after the file is written
+  BOOST_REQUIRE_EQUAL(NDTraceSink::start(traceFile, 1, 0), 0);
+  BOOST_REQUIRE_EQUAL(NDTraceSink::stop(), 0);
+  remove(traceFile);
+}
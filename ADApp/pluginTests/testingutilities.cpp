@@ -7,6 +7,8 @@
 #include <sstream>
 #include <iostream>
 #include <stdlib.h>
+#include <epicsThread.h>
+#include <epicsAtomic.h>
 #include <NDPluginDriver.h>
 #include "testingutilities.h"
 
@@ -78,6 +80,15 @@ void uniqueAsynPortName(std::string& name)
   counter++;
 }
 
+bool waitFor(int *pValue, int value)
+{
+  for (int i=0; i<1000; i++) {
+    if (epicsAtomicGetIntT(pValue) == value) return true;
+    epicsThreadSleep(0.01);
+  }
+  return false;
+}
+
 void TestingPluginCallback(void *drvPvt, asynUser *pasynUser, void *ptr)
 {
   TestingPlugin* self = (TestingPlugin*)drvPvt;
@@ -104,5 +115,31 @@ void TestingPlugin::callback(NDArray *pArray)
   arrays.push_back(pArray);
 }
 
+PassThroughPlugin::PassThroughPlugin(const char *portName, const char *NDArrayPort, int queueSize,
+                                     int blockingCallbacks)
+: NDPluginDriver(portName, queueSize, blockingCallbacks, NDArrayPort, 0, 1, 0, 0,
+                 asynGenericPointerMask, asynGenericPointerMask, 0, 1, 0, 0, 1),
+  numStarted(0), gateOpen_(1)
+{
+}
 
+void PassThroughPlugin::processCallbacks(NDArray *pArray)
+{
+  waitAtGate();
+}
+
+void PassThroughPlugin::setGate(bool open)
+{
+  epicsAtomicSetIntT(&gateOpen_, open ? 1 : 0);
+}
 
+// Called from processCallbacks() with the lock held. Counts the call and waits while the gate is closed,
+// without holding the lock so that the test can still access the plugin parameters.
+void PassThroughPlugin::waitAtGate()
+{
+  epicsAtomicIncrIntT(&numStarted);
+  if (epicsAtomicGetIntT(&gateOpen_)) return;
+  unlock();
+  while (!epicsAtomicGetIntT(&gateOpen_)) epicsThreadSleep(0.001);
+  lock();
+}
@@ -18,11 +18,14 @@
 #include <vector>
 
 #include <NDArray.h>
+#include <NDPluginDriver.h>
 #include <asynPortClient.h>
 
 void fillNDArrays(const std::vector<size_t>& dimensions, NDDataType_t dataType, std::vector<NDArray*>& arrays);
 void fillNDArraysFromPool(const std::vector<size_t>& dimensions, NDDataType_t dataType, std::vector<NDArray*>& arrays, NDArrayPool *pNDArrayPool);
 void uniqueAsynPortName(std::string& name);
+// Waits up to 10 seconds for a counter that another thread increments atomically to reach value
+bool waitFor(int *pValue, int value);
 
 // Mock simply stores all received NDArrays and provides them to a client on request.
 class TestingPlugin : public asynGenericPointerClient {
@@ -33,5 +36,20 @@ public:
   std::deque<NDArray *> arrays;
 };
 
+// Plugin that does nothing with the arrays it receives, for tests of the NDPluginDriver base class.
+// Tests derive from it and override processCallbacks() to record what they need.
+// processCallbacks() calls waitAtGate(), so a test can close the gate to hold the plugin in processCallbacks().
+class PassThroughPlugin : public NDPluginDriver {
+public:
+  PassThroughPlugin(const char *portName, const char *NDArrayPort, int queueSize, int blockingCallbacks);
+  virtual void processCallbacks(NDArray *pArray);
+  void setGate(bool open);
+  int numStarted;   // Number of calls to waitAtGate(), incremented atomically
+protected:
+  void waitAtGate();
+private:
+  int gateOpen_;
+};
+
 
 #endif /* ADAPP_PLUGINTESTS_TESTINGUTILITIES_H_ */